@@ -5,6 +5,7 @@ import os
 import time
 import socket
 import threading
+import urllib.parse
 
 try:
     import paho.mqtt.client as mqtt
@@ -17,7 +18,8 @@ PORT = 7777
 DATA_DIR = os.path.join(os.path.dirname(__file__), 'data')
 
 # MQTT Config
-MQTT_BROKER = "test.mosquitto.org"
+# Point at a local broker (MQTT_BROKER=localhost) to test replication between controllers
+MQTT_BROKER = os.environ.get("MQTT_BROKER", "test.mosquitto.org")
 MQTT_TOPIC_CMD = "antigravity_gate/cmd"
 MQTT_TOPIC_STATUS = "antigravity_gate/status"
 mqtt_client = None
@@ -25,7 +27,15 @@ mqtt_client = None
 # Mock Database
 # Mock Database
 users = []
+next_user_id = 1 << 8 # Stable ids: creation stamp above the slot
 logs = []
+gates = [
+    {'id': 0, 'name': 'Gate 1', 'gpio': 4, 'pulse_ms': 2000, 'active_high': False},
+    {'id': 1, 'name': 'Gate 2', 'gpio': 14, 'pulse_ms': 2000, 'active_high': False},
+    {'id': 2, 'name': '', 'gpio': -1, 'pulse_ms': 2000, 'active_high': False},
+    {'id': 3, 'name': '', 'gpio': -1, 'pulse_ms': 2000, 'active_high': False},
+]
+GATE_MASK_ALL = 0x0F
 
 # Security State
 failed_attempts = 0
@@ -51,10 +61,21 @@ class CustomHandler(http.server.SimpleHTTPRequestHandler):
 
     def do_GET(self):
         if self.path.startswith('/api/admin/users'):
+            # Same paging as the firmware: name order, prefix search, type filter
+            query = urllib.parse.parse_qs(urllib.parse.urlparse(self.path).query)
+            arg = lambda k, d: query.get(k, [d])[0]
+            q = arg('q', '').lower()
+            matches = sorted((u for u in users if u['name'].lower().startswith(q)),
+                             key=lambda u: u['name'].lower(), reverse=arg('sort', 'name') == '-name')
+            if 'type' in query:
+                matches = [u for u in matches if u['type'] == int(arg('type', 0))]
+            offset = int(arg('offset', 0))
+            page = matches[offset:offset + int(arg('limit', 50))]
             self.send_response(200)
             self.send_header('Content-type', 'application/json')
+            self.send_header('X-Total-Count', str(len(matches)))
             self.end_headers()
-            self.wfile.write(json.dumps(users).encode())
+            self.wfile.write(json.dumps(page).encode())
             return
         elif self.path.startswith('/api/admin/logs'):
             self.send_response(200)
@@ -62,6 +83,9 @@ class CustomHandler(http.server.SimpleHTTPRequestHandler):
             self.end_headers()
             self.wfile.write(json.dumps(logs).encode())
             return
+        elif self.path == '/api/admin/gates':
+            self.send_json(gates)
+            return
         elif self.path == '/api/admin/logs/download':
             self.send_response(200)
             self.send_header('Content-Type', 'text/csv')
@@ -118,6 +142,15 @@ class CustomHandler(http.server.SimpleHTTPRequestHandler):
             valid = (user is not None)
             u = user
 
+            # Gate permission: a right PIN for the wrong gate is not a failed attempt
+            gate = data.get('gate')
+            if valid and gate is not None and not ((user.get('gates') or GATE_MASK_ALL) >> gate) & 1:
+                self.send_response(401)
+                self.send_header('Content-Type', 'application/json')
+                self.end_headers()
+                self.wfile.write(b'{"status":"denied"}')
+                return
+
             # Global Security Checks (Lockout) & Brute Force Counting
             if valid:
                 failed_attempts = 0
@@ -195,7 +228,21 @@ class CustomHandler(http.server.SimpleHTTPRequestHandler):
 
         elif self.path == '/api/admin/open':
             # Mock gate opening
-            print("GATE OPENED via Admin Console")
+            gate = data.get('gate')
+            if gate is not None and not (0 <= gate < len(gates) and gates[gate]['gpio'] >= 0):
+                self.send_error(404, 'Unknown gate')
+                return
+            print(f"GATE {'ALL' if gate is None else gate} OPENED via Admin Console")
+            self.send_json({'status': 'ok'})
+
+        elif self.path == '/api/admin/gates':
+            gate_id = data.get('id')
+            if not isinstance(gate_id, int) or not 0 <= gate_id < len(gates):
+                self.send_error(400, 'Invalid gate')
+                return
+            for key in ('name', 'gpio', 'pulse_ms', 'active_high'):
+                if key in data:
+                    gates[gate_id][key] = data[key]
             self.send_json({'status': 'ok'})
 
         elif self.path == '/api/admin/users':
@@ -207,7 +254,9 @@ class CustomHandler(http.server.SimpleHTTPRequestHandler):
                     if not any(u['pin'] == p for u in users):
                         return p
             
+            global next_user_id
             new_user = {
+                'id': next_user_id,
                 'name': data.get('name'),
                 'pin': generate_pin(),
                 'type': data.get('type'),
@@ -215,10 +264,12 @@ class CustomHandler(http.server.SimpleHTTPRequestHandler):
                 'remaining': data.get('limit', 0),
                 'start': data.get('start', 0),
                 'end': data.get('end', 0),
-                'days': data.get('days', 0)
+                'days': data.get('days', 0),
+                'gates': data.get('gates', 0) or GATE_MASK_ALL
             }
+            next_user_id += 1 << 8
             users.append(new_user)
-            self.send_json({'status': 'ok', 'pin': new_user['pin']}) # Return PIN so UI can show it if needed
+            self.send_json({'status': 'ok', 'id': new_user['id'], 'pin': new_user['pin']}) # Return PIN so UI can show it if needed
 
         elif self.path == '/api/admin/mqtt':
             if self.command == 'GET':
@@ -245,16 +296,48 @@ class CustomHandler(http.server.SimpleHTTPRequestHandler):
         elif self.path == '/api/admin/users?delete=true': # Handle DELETE as POST if needed or check method
              pass # Logic below in DELETE
 
+    def user_by_id(self):
+        try:
+            user_id = int(self.path.split('?')[0][len('/api/admin/users/'):])
+        except ValueError:
+            return None
+        return next((u for u in users if u['id'] == user_id), None)
+
+    def do_PATCH(self):
+        print(f"PATCH Request: {self.path}")
+        if self.path.startswith('/api/admin/users/'):
+             user = self.user_by_id()
+             if not user:
+                 self.send_error(404, 'User not found')
+                 return
+             length = int(self.headers.get('content-length', 0))
+             data = json.loads(self.rfile.read(length).decode() or '{}')
+             for key in ('name', 'type', 'start', 'end', 'days'):
+                 if key in data:
+                     user[key] = data[key]
+             if 'limit' in data:
+                 user['remaining'] = data['limit']
+             if 'gates' in data:
+                 user['gates'] = data['gates'] or GATE_MASK_ALL
+             self.send_json({'status': 'ok'})
+
     def do_DELETE(self):
         print(f"DELETE Request: {self.path}")
-        if self.path.startswith('/api/admin/users'):
+        global users
+        if self.path.startswith('/api/admin/users/'):
+             user = self.user_by_id()
+             if user:
+                 users.remove(user)
+                 self.send_json({'status': 'ok'})
+             else:
+                 self.send_error(404, 'User not found')
+        elif self.path.startswith('/api/admin/users'):
              length = int(self.headers.get('content-length', 0))
              body = self.rfile.read(length).decode()
              data = json.loads(body)
              pin_to_del = data.get('pin')
              
              print(f"Deleting user pin: {pin_to_del}")
-             global users
              initial_len = len(users)
              users = [u for u in users if u['pin'] != pin_to_del]
              
@@ -282,6 +365,7 @@ class CustomHandler(http.server.SimpleHTTPRequestHandler):
                      u['start'] = data.get('start', u['start'])
                      u['end'] = data.get('end', u['end'])
                      u['days'] = data.get('days', u['days'])
+                     u['gates'] = data.get('gates', u.get('gates', 0)) or GATE_MASK_ALL
                      updated = True
                      break
              
@@ -312,8 +396,8 @@ def start_mqtt():
         if msg.topic == MQTT_TOPIC_CMD:
             payload = msg.payload.decode()
             print(f"MQTT Command received: {payload}")
-            if payload == "OPEN":
-                print("GATE OPENING via MQTT")
+            if payload == "OPEN" or payload.startswith("OPEN "):
+                print(f"GATE OPENING via MQTT ({payload[5:] or 'all'})")
                 client.publish(MQTT_TOPIC_STATUS, "OPENING")
                 # Log it
                 log_entry = {
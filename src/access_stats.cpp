@@ -0,0 +1,275 @@
+#include "access_stats.h"
+#include "data_manager.h"
+#include "json_reader.h"
+#include "logging_macros.h"
+#include "storage.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include "esp_log.h"
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static const char *TAG = "ACCESS_STATS";
+static const char *STATS_KEY = "stats.bin";
+
+#define STATS_MAGIC 0x54415453 // "STAT"
+#define HOURS_PER_WEEK (7 * 24)
+
+typedef struct {
+  uint16_t tag;   // Record the counts belong to
+  uint16_t month; // Months since 1970 counted in month_*
+  uint32_t granted;
+  uint32_t denied;
+  uint32_t last_seen;
+  uint16_t month_granted;
+  uint16_t month_denied;
+} stats_user_t;
+
+typedef struct {
+  uint16_t day; // Local days since 1970-01-01
+  uint16_t granted;
+  uint16_t denied;
+} stats_day_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t since; // First event counted
+  uint32_t granted;
+  uint32_t denied;
+  stats_user_t users[MAX_USERS];
+  uint16_t hours[HOURS_PER_WEEK];      // Grants, Sunday 00:00 first
+  stats_day_t days[ACCESS_STATS_DAYS]; // Slot day % ACCESS_STATS_DAYS
+} access_stats_t;
+
+static access_stats_t stats;
+static int unsaved = 0;
+
+static void stats_reset(void) {
+  memset(&stats, 0, sizeof(stats));
+  stats.magic = STATS_MAGIC;
+}
+
+// Local calendar time, or false while the clock is not set
+static bool local_time(uint32_t timestamp, struct tm *out) {
+  time_t t = timestamp;
+  localtime_r(&t, out);
+  return out->tm_year >= 120;
+}
+
+static uint16_t day_of(const struct tm *t) {
+  int y = t->tm_year + 1900;
+  return (y - 1970) * 365 + (y - 1969) / 4 - (y - 1901) / 100 +
+         (y - 1601) / 400 + t->tm_yday;
+}
+
+static uint16_t month_of(const struct tm *t) {
+  return (t->tm_year - 70) * 12 + t->tm_mon;
+}
+
+static void bump(uint16_t *v) {
+  if (*v < UINT16_MAX)
+    (*v)++;
+}
+
+void access_stats_init(void) {
+  if (storage_read(STORAGE_USERS, STATS_KEY, 0, &stats, sizeof(stats)) !=
+          sizeof(stats) ||
+      stats.magic != STATS_MAGIC) {
+    stats_reset();
+    ESP_LOGI(TAG, "Starting new statistics");
+  }
+}
+
+void access_stats_save(void) {
+  if (unsaved == 0)
+    return;
+  if (!storage_write(STORAGE_USERS, STATS_KEY, &stats, sizeof(stats))) {
+    ESP_LOGE(TAG, "Failed to save statistics");
+    return;
+  }
+  unsaved = 0;
+}
+
+void access_stats_record(uint32_t timestamp, uint8_t user, uint16_t tag,
+                         bool granted) {
+  if (stats.since == 0)
+    stats.since = timestamp;
+  if (granted)
+    stats.granted++;
+  else
+    stats.denied++;
+
+  struct tm t;
+  bool clock_set = local_time(timestamp, &t);
+  if (clock_set) {
+    uint16_t day = day_of(&t);
+    stats_day_t *d = &stats.days[day % ACCESS_STATS_DAYS];
+    if (d->day != day) {
+      memset(d, 0, sizeof(*d));
+      d->day = day;
+    }
+    bump(granted ? &d->granted : &d->denied);
+    if (granted)
+      bump(&stats.hours[t.tm_wday * 24 + t.tm_hour]);
+  }
+
+  if (user < MAX_USERS) {
+    stats_user_t *u = &stats.users[user];
+    if (u->tag != tag) {
+      memset(u, 0, sizeof(*u));
+      u->tag = tag;
+    }
+    if (granted)
+      u->granted++;
+    else
+      u->denied++;
+    u->last_seen = timestamp;
+    if (clock_set) {
+      if (u->month != month_of(&t)) {
+        u->month = month_of(&t);
+        u->month_granted = u->month_denied = 0;
+      }
+      bump(granted ? &u->month_granted : &u->month_denied);
+    }
+  }
+
+  if (++unsaved >= ACCESS_STATS_SAVE_EVERY)
+    access_stats_save();
+}
+
+// --- JSON rendering ---
+
+static bool user_shown(int slot) {
+  const user_snapshot_t *snap = data_manager_snapshot_acquire();
+  const user_t *u = &data_manager_snapshot_data(snap)->users[slot];
+  const stats_user_t *s = &stats.users[slot];
+  bool shown = u->active && s->tag == (uint16_t)u->created &&
+               (s->granted || s->denied);
+  data_manager_snapshot_release(snap);
+  return shown;
+}
+
+static uint16_t newest_day(void) {
+  uint16_t newest = 0;
+  for (int i = 0; i < ACCESS_STATS_DAYS; i++) {
+    if (stats.days[i].day > newest)
+      newest = stats.days[i].day;
+  }
+  return newest;
+}
+
+static const stats_day_t *day_at(int line) {
+  int day = newest_day() - ACCESS_STATS_DAYS + line;
+  if (day < 0)
+    return NULL;
+  const stats_day_t *d = &stats.days[day % ACCESS_STATS_DAYS];
+  return d->day == day && (d->granted || d->denied) ? d : NULL;
+}
+
+static size_t render_user(int slot, bool first, char *out, size_t cap) {
+  const stats_user_t *s = &stats.users[slot];
+  // Month counts are only current while their month is
+  struct tm t;
+  bool stale =
+      local_time((uint32_t)time(NULL), &t) && s->month != month_of(&t);
+
+  char name[2 * NAME_LENGTH + 2];
+  const user_snapshot_t *snap = data_manager_snapshot_acquire();
+  const user_t *u = &data_manager_snapshot_data(snap)->users[slot];
+  json_quote(name, sizeof(name), data_manager_snapshot_name(snap, u));
+  data_manager_snapshot_release(snap);
+  return snprintf(out, cap,
+                  "%s{\"name\":%s,\"granted\":%u,\"denied\":%u,"
+                  "\"month_granted\":%u,\"month_denied\":%u,"
+                  "\"last_seen\":%u}",
+                  first ? "" : ",", name, (unsigned)s->granted,
+                  (unsigned)s->denied, stale ? 0u : s->month_granted,
+                  stale ? 0u : s->month_denied, (unsigned)s->last_seen);
+}
+
+static size_t render_day(const stats_day_t *d, bool first, char *out,
+                         size_t cap) {
+  // Day numbers count calendar days, so the UTC date of the day is it
+  time_t t = (time_t)d->day * 86400;
+  struct tm date;
+  gmtime_r(&t, &date);
+  return snprintf(out, cap,
+                  "%s{\"date\":\"%04d-%02d-%02d\",\"granted\":%u,"
+                  "\"denied\":%u}",
+                  first ? "" : ",", date.tm_year + 1900, date.tm_mon + 1,
+                  date.tm_mday, d->granted, d->denied);
+}
+
+// One piece of the document: its length, 0 to skip the line, or -1 once
+// the item is complete
+static int render_piece(uint32_t item, uint32_t line, char *out, size_t cap) {
+  switch (item) {
+  case 0:
+    if (line > 0)
+      return -1;
+    return snprintf(out, cap,
+                    "{\"since\":%u,\"granted\":%u,\"denied\":%u,"
+                    "\"users\":[",
+                    (unsigned)stats.since, (unsigned)stats.granted,
+                    (unsigned)stats.denied);
+  case 1: {
+    if (line >= MAX_USERS)
+      return -1;
+    if (!user_shown(line))
+      return 0;
+    bool first = true;
+    for (uint32_t i = 0; i < line && first; i++)
+      first = !user_shown(i);
+    return render_user(line, first, out, cap);
+  }
+  case 2:
+    if (line == 0)
+      return snprintf(out, cap, "],\"hour_of_week\":[");
+    if (line > HOURS_PER_WEEK)
+      return -1;
+    return snprintf(out, cap, "%s%u", line > 1 ? "," : "",
+                    stats.hours[line - 1]);
+  case 3: {
+    if (line == 0)
+      return snprintf(out, cap, "],\"days\":[");
+    if (line > ACCESS_STATS_DAYS)
+      return -1;
+    const stats_day_t *d = day_at(line);
+    if (!d)
+      return 0;
+    bool first = true;
+    for (uint32_t i = 1; i < line && first; i++)
+      first = day_at(i) == NULL;
+    return render_day(d, first, out, cap);
+  }
+  case 4:
+    return line == 0 ? snprintf(out, cap, "]}") : -1;
+  }
+  return -1;
+}
+
+size_t access_stats_render(uint32_t *item, uint32_t *line, char *buf,
+                           size_t cap) {
+  size_t n = 0;
+  char tmp[256];
+  while (*item <= 4) {
+    int len = render_piece(*item, *line, tmp, sizeof(tmp));
+    if (len < 0) {
+      (*item)++;
+      *line = 0;
+      continue;
+    }
+    if (len >= (int)sizeof(tmp))
+      len = sizeof(tmp) - 1;
+    if (n + len > cap)
+      break; // Resume with this piece on the next call
+    memcpy(buf + n, tmp, len);
+    n += len;
+    (*line)++;
+  }
+  return n;
+}
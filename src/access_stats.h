@@ -0,0 +1,33 @@
+#ifndef ACCESS_STATS_H
+#define ACCESS_STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Access analytics.
+// Aggregates are updated as each event is logged, so reading them never
+// scans the history: per-user counts and last-seen time, grants by local
+// hour of the week, and daily totals for the last ACCESS_STATS_DAYS days.
+// They are saved with the user table snapshot and every
+// ACCESS_STATS_SAVE_EVERY events in between.
+
+#define ACCESS_STATS_DAYS 35
+#ifndef ACCESS_STATS_SAVE_EVERY
+#define ACCESS_STATS_SAVE_EVERY 16
+#endif
+
+void access_stats_init(void);
+
+// user is a slot or one of LOG_USER_*; tag identifies the record in the
+// slot, so counts restart when the slot is reused
+void access_stats_record(uint32_t timestamp, uint8_t user, uint16_t tag,
+                         bool granted);
+void access_stats_save(void); // No-op when nothing changed
+
+// Renders the aggregates as JSON, as much as fits in cap. item and line
+// start at 0 and carry the position between calls; returns 0 when done.
+size_t access_stats_render(uint32_t *item, uint32_t *line, char *buf,
+                           size_t cap);
+
+#endif // ACCESS_STATS_H
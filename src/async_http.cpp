@@ -0,0 +1,1013 @@
+#include "async_http.h"
+
+#ifdef ARDUINO
+#include "logging_macros.h"
+#include <ESPAsyncTCP.h>
+#include <bearssl/bearssl.h>
+#include <strings.h>
+
+static const char *TAG = "ASYNC_HTTP";
+
+#define HTTP_MAX_ROUTES 24
+
+// Chunk framing reserved around streamed data: "xxx\r\n" + data + "\r\n"
+#define CHUNK_HEAD_RESERVE 8
+#define CHUNK_TAIL_RESERVE 2
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_MAX_CONTROL 125
+
+#define WS_OP_CONT 0x0
+#define WS_OP_TEXT 0x1
+#define WS_OP_BINARY 0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+#define WS_OP_PONG 0xA
+
+typedef enum {
+  CONN_FREE = 0,
+  CONN_READ_HEAD,
+  CONN_READ_BODY,
+  CONN_READY, // Request complete, waiting for dispatch from the loop
+  CONN_SENDING,
+  CONN_CLOSING,
+  CONN_WEBSOCKET // Upgraded; frames are parsed in the TCP callback
+} conn_state_t;
+
+struct http_conn {
+  AsyncClient *client;
+  conn_state_t state;
+  bool in_handler;
+  bool keep_alive;
+  bool http10;
+  uint16_t requests;
+  uint32_t last_activity;
+
+  // Request
+  http_method_t method;
+  char uri[HTTP_MAX_URI];
+  const char *query;
+  char line[HTTP_MAX_LINE];
+  size_t line_len;
+  bool line_overflow;
+  bool request_line_seen;
+  size_t content_len;
+  char body[HTTP_MAX_BODY + 1];
+  size_t body_len;
+  int error_code; // Parse error reported at dispatch time
+  bool ws_upgrade;
+  char ws_key[32];
+  char range[40];
+  char if_range[24];
+  char if_none_match[40];
+  bool accept_gzip;
+  bool accept_cbor;
+  bool body_cbor;
+
+  // Response
+  bool responded;
+  bool chunked;
+  bool body_done;
+  char extra[HTTP_MAX_EXTRA_HEADERS];
+  size_t extra_len;
+  char tx[HTTP_TX_BUF];
+  size_t tx_len;
+  size_t tx_off;
+  http_fill_t fill;
+  long fill_left; // Bytes a fill of known length still owes, else -1
+  File file;
+  bool has_file;
+  http_cursor_t cursor;
+  void *user_ctx; // From the matched route
+
+  // WebSocket framing state. Message payloads land in body[].
+  const struct http_route *ws_route;
+  uint8_t ws_hdr[14];
+  uint8_t ws_hdr_len;
+  uint8_t ws_hdr_need;
+  uint8_t ws_opcode;
+  bool ws_fin;
+  size_t ws_payload_len;
+  size_t ws_payload_got;
+  char ws_control[WS_MAX_CONTROL + 1];
+  bool ws_msg_ready;
+  uint32_t ws_last_ping;
+};
+
+typedef struct http_route {
+  const char *uri;
+  http_method_t method;
+  http_handler_t handler;
+  http_ws_handler_t ws_handler;
+  void *user_ctx;
+} http_route_t;
+
+static AsyncServer *tcp_server = NULL;
+static http_conn_t conns[HTTP_MAX_CONNECTIONS];
+static http_route_t routes[HTTP_MAX_ROUTES];
+static int route_count = 0;
+static http_handler_t not_found_handler = NULL;
+static int dispatch_next = 0; // Round-robin start for fair dispatch
+
+static const char BUSY_RESPONSE[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Connection: close\r\n"
+    "Retry-After: 1\r\n"
+    "Content-Length: 0\r\n\r\n";
+
+static const char *status_text(int code) {
+  switch (code) {
+  case 101:
+    return "Switching Protocols";
+  case 200:
+    return "OK";
+  case 204:
+    return "No Content";
+  case 206:
+    return "Partial Content";
+  case 304:
+    return "Not Modified";
+  case 400:
+    return "Bad Request";
+  case 401:
+    return "Unauthorized";
+  case 403:
+    return "Forbidden";
+  case 404:
+    return "Not Found";
+  case 405:
+    return "Method Not Allowed";
+  case 408:
+    return "Request Timeout";
+  case 413:
+    return "Payload Too Large";
+  case 414:
+    return "URI Too Long";
+  case 416:
+    return "Range Not Satisfiable";
+  case 500:
+    return "Internal Server Error";
+  case 501:
+    return "Not Implemented";
+  case 503:
+    return "Service Unavailable";
+  default:
+    return "";
+  }
+}
+
+static http_method_t parse_method(const char *m) {
+  if (strcmp(m, "GET") == 0)
+    return HTTP_GET;
+  if (strcmp(m, "POST") == 0)
+    return HTTP_POST;
+  if (strcmp(m, "DELETE") == 0)
+    return HTTP_DELETE;
+  if (strcmp(m, "PUT") == 0)
+    return HTTP_PUT;
+  if (strcmp(m, "PATCH") == 0)
+    return HTTP_PATCH;
+  if (strcmp(m, "HEAD") == 0)
+    return HTTP_HEAD;
+  if (strcmp(m, "OPTIONS") == 0)
+    return HTTP_OPTIONS;
+  return HTTP_ANY; // Unknown, answered with 501
+}
+
+// Prepares the connection for the next request on the same socket
+static void conn_reset_request(http_conn_t *c) {
+  c->state = CONN_READ_HEAD;
+  c->method = HTTP_ANY;
+  c->uri[0] = 0;
+  c->query = "";
+  c->line_len = 0;
+  c->line_overflow = false;
+  c->request_line_seen = false;
+  c->content_len = 0;
+  c->body[0] = 0;
+  c->body_len = 0;
+  c->error_code = 0;
+  c->ws_upgrade = false;
+  c->ws_key[0] = 0;
+  c->range[0] = 0;
+  c->if_range[0] = 0;
+  c->if_none_match[0] = 0;
+  c->accept_gzip = false;
+  c->accept_cbor = false;
+  c->body_cbor = false;
+
+  c->responded = false;
+  c->chunked = false;
+  c->body_done = false;
+  c->extra_len = 0;
+  c->extra[0] = 0;
+  c->tx_len = 0;
+  c->tx_off = 0;
+  c->fill = NULL;
+  if (c->has_file) {
+    c->file.close();
+    c->has_file = false;
+  }
+  memset(&c->cursor, 0, sizeof(c->cursor));
+}
+
+static void conn_free(http_conn_t *c) {
+  conn_reset_request(c);
+  c->ws_route = NULL;
+  c->ws_msg_ready = false;
+  c->client = NULL;
+  c->state = CONN_FREE;
+}
+
+static void conn_close(http_conn_t *c) {
+  c->state = CONN_CLOSING;
+  if (c->client)
+    c->client->close();
+}
+
+// --- Request parsing (runs in the TCP callback) ---
+
+static void conn_request_ready(http_conn_t *c) {
+  c->body[c->body_len] = 0;
+  c->state = CONN_READY;
+}
+
+static void conn_fail(http_conn_t *c, int code) {
+  c->error_code = code;
+  c->keep_alive = false;
+  conn_request_ready(c);
+}
+
+static void parse_request_line(http_conn_t *c) {
+  char *method = c->line;
+  char *target = strchr(method, ' ');
+  if (!target) {
+    conn_fail(c, 400);
+    return;
+  }
+  *target++ = 0;
+  char *version = strchr(target, ' ');
+  if (!version) {
+    conn_fail(c, 400);
+    return;
+  }
+  *version++ = 0;
+
+  c->method = parse_method(method);
+  c->http10 = strcmp(version, "HTTP/1.0") == 0;
+  c->keep_alive = !c->http10;
+
+  if (strlen(target) >= HTTP_MAX_URI) {
+    conn_fail(c, 414);
+    return;
+  }
+  strcpy(c->uri, target);
+  char *q = strchr(c->uri, '?');
+  if (q) {
+    *q = 0;
+    c->query = q + 1;
+  }
+  c->request_line_seen = true;
+  if (c->method == HTTP_ANY)
+    conn_fail(c, 501);
+}
+
+static void parse_header_line(http_conn_t *c) {
+  char *value = strchr(c->line, ':');
+  if (!value)
+    return;
+  *value++ = 0;
+  while (*value == ' ' || *value == '\t')
+    value++;
+
+  if (strcasecmp(c->line, "Content-Length") == 0) {
+    char *end;
+    unsigned long len = strtoul(value, &end, 10);
+    if (end == value) {
+      conn_fail(c, 400);
+      return;
+    }
+    c->content_len = len;
+  } else if (strcasecmp(c->line, "Connection") == 0) {
+    if (strcasecmp(value, "close") == 0)
+      c->keep_alive = false;
+    else if (strcasecmp(value, "keep-alive") == 0)
+      c->keep_alive = true;
+  } else if (strcasecmp(c->line, "Upgrade") == 0) {
+    c->ws_upgrade = strcasecmp(value, "websocket") == 0;
+  } else if (strcasecmp(c->line, "Sec-WebSocket-Key") == 0) {
+    strncpy(c->ws_key, value, sizeof(c->ws_key) - 1);
+    c->ws_key[sizeof(c->ws_key) - 1] = 0;
+  } else if (strcasecmp(c->line, "Range") == 0) {
+    strncpy(c->range, value, sizeof(c->range) - 1);
+    c->range[sizeof(c->range) - 1] = 0;
+  } else if (strcasecmp(c->line, "If-Range") == 0) {
+    strncpy(c->if_range, value, sizeof(c->if_range) - 1);
+    c->if_range[sizeof(c->if_range) - 1] = 0;
+  } else if (strcasecmp(c->line, "If-None-Match") == 0) {
+    strncpy(c->if_none_match, value, sizeof(c->if_none_match) - 1);
+    c->if_none_match[sizeof(c->if_none_match) - 1] = 0;
+  } else if (strcasecmp(c->line, "Accept-Encoding") == 0) {
+    c->accept_gzip = strstr(value, "gzip") != NULL;
+  } else if (strcasecmp(c->line, "Accept") == 0) {
+    c->accept_cbor = strstr(value, "application/cbor") != NULL;
+  } else if (strcasecmp(c->line, "Content-Type") == 0) {
+    c->body_cbor = strncasecmp(value, "application/cbor", 16) == 0;
+  }
+}
+
+static void parse_line(http_conn_t *c) {
+  if (c->line_len > 0 && c->line[c->line_len - 1] == '\r')
+    c->line_len--;
+  c->line[c->line_len] = 0;
+
+  if (!c->request_line_seen) {
+    if (c->line_overflow)
+      conn_fail(c, 414);
+    else if (c->line_len > 0) // Tolerate leading blank lines
+      parse_request_line(c);
+  } else if (c->line_len == 0) {
+    // End of headers
+    if (c->content_len > HTTP_MAX_BODY)
+      conn_fail(c, 413);
+    else if (c->content_len > 0)
+      c->state = CONN_READ_BODY;
+    else
+      conn_request_ready(c);
+  } else if (!c->line_overflow) {
+    // Overlong headers (cookies, user agents) are none we care about
+    parse_header_line(c);
+  }
+  c->line_len = 0;
+  c->line_overflow = false;
+}
+
+// --- WebSocket framing (RFC 6455, unfragmented frames only) ---
+
+static bool ws_write_frame(http_conn_t *c, uint8_t opcode, const char *data,
+                           size_t len) {
+  if (!c->client)
+    return false;
+  uint8_t head[4];
+  size_t h = 0;
+  head[h++] = 0x80 | opcode; // FIN, never masked from the server side
+  if (len < 126) {
+    head[h++] = len;
+  } else {
+    head[h++] = 126;
+    head[h++] = len >> 8;
+    head[h++] = len & 0xFF;
+  }
+  if (c->client->space() < h + len)
+    return false;
+  c->client->add((const char *)head, h);
+  if (len)
+    c->client->add(data, len);
+  return c->client->send();
+}
+
+static void ws_close(http_conn_t *c, uint16_t status) {
+  char payload[2] = {(char)(status >> 8), (char)(status & 0xFF)};
+  ws_write_frame(c, WS_OP_CLOSE, payload, sizeof(payload));
+  conn_close(c);
+}
+
+static void ws_frame_complete(http_conn_t *c) {
+  switch (c->ws_opcode) {
+  case WS_OP_TEXT:
+  case WS_OP_BINARY:
+    if (!c->ws_fin) {
+      ws_close(c, 1009); // Fragmented messages are not supported
+      return;
+    }
+    if (c->ws_msg_ready) {
+      // The loop has not consumed the previous message yet
+      ESP_LOGW(TAG, "WebSocket message dropped (busy)");
+      return;
+    }
+    c->body_len = c->ws_payload_len;
+    c->body[c->body_len] = 0;
+    c->ws_msg_ready = true;
+    break;
+  case WS_OP_PING:
+    ws_write_frame(c, WS_OP_PONG, c->ws_control, c->ws_payload_len);
+    break;
+  case WS_OP_CLOSE:
+    ws_write_frame(c, WS_OP_CLOSE, c->ws_control,
+                   c->ws_payload_len >= 2 ? 2 : 0);
+    conn_close(c);
+    break;
+  case WS_OP_PONG:
+    break;
+  default:
+    ws_close(c, 1003);
+    break;
+  }
+}
+
+// Parses the frame header collected in ws_hdr once it is complete
+static bool ws_parse_header(http_conn_t *c) {
+  uint8_t b0 = c->ws_hdr[0], b1 = c->ws_hdr[1];
+  if (c->ws_hdr_len == 2) {
+    uint8_t len7 = b1 & 0x7F;
+    c->ws_hdr_need = 2 + (len7 == 126 ? 2 : len7 == 127 ? 8 : 0) +
+                     ((b1 & 0x80) ? 4 : 0);
+    if (c->ws_hdr_len < c->ws_hdr_need)
+      return false;
+  }
+
+  if (!(b1 & 0x80)) {
+    ws_close(c, 1002); // Client frames must be masked
+    return false;
+  }
+  uint8_t len7 = b1 & 0x7F;
+  uint64_t len = len7;
+  size_t off = 2;
+  if (len7 == 126) {
+    len = ((uint16_t)c->ws_hdr[2] << 8) | c->ws_hdr[3];
+    off = 4;
+  } else if (len7 == 127) {
+    len = 0;
+    for (int i = 0; i < 8; i++)
+      len = (len << 8) | c->ws_hdr[2 + i];
+    off = 10;
+  }
+
+  c->ws_fin = (b0 & 0x80) != 0;
+  c->ws_opcode = b0 & 0x0F;
+  bool control = c->ws_opcode & 0x08;
+  if ((control && len > WS_MAX_CONTROL) || len > HTTP_MAX_BODY) {
+    ws_close(c, 1009);
+    return false;
+  }
+  c->ws_payload_len = len;
+  c->ws_payload_got = 0;
+  memmove(c->ws_hdr + 10, c->ws_hdr + off, 4); // Mask key kept at [10..13]
+  return true;
+}
+
+static void ws_on_data(http_conn_t *c, const uint8_t *data, size_t len) {
+  size_t i = 0;
+  while (i < len && c->state == CONN_WEBSOCKET) {
+    if (c->ws_hdr_len < c->ws_hdr_need) {
+      c->ws_hdr[c->ws_hdr_len++] = data[i++];
+      if (c->ws_hdr_len < c->ws_hdr_need || !ws_parse_header(c))
+        continue;
+      if (c->ws_payload_len > 0)
+        continue;
+    } else {
+      bool control = c->ws_opcode & 0x08;
+      char *dst = control ? c->ws_control : c->body;
+      bool drop = !control && c->ws_msg_ready;
+      while (i < len && c->ws_payload_got < c->ws_payload_len) {
+        uint8_t b = data[i++] ^ c->ws_hdr[10 + (c->ws_payload_got & 3)];
+        if (!drop)
+          dst[c->ws_payload_got] = b;
+        c->ws_payload_got++;
+      }
+      if (c->ws_payload_got < c->ws_payload_len)
+        continue;
+    }
+    ws_frame_complete(c);
+    c->ws_hdr_len = 0;
+    c->ws_hdr_need = 2;
+  }
+}
+
+static void ws_accept_key(const char *key, char out[29]) {
+  static const char b64[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  uint8_t hash[20];
+  br_sha1_context ctx;
+  br_sha1_init(&ctx);
+  br_sha1_update(&ctx, key, strlen(key));
+  br_sha1_update(&ctx, WS_GUID, strlen(WS_GUID));
+  br_sha1_out(&ctx, hash);
+
+  size_t o = 0;
+  for (int i = 0; i < 20; i += 3) {
+    uint32_t v = (uint32_t)hash[i] << 16;
+    if (i + 1 < 20)
+      v |= (uint32_t)hash[i + 1] << 8;
+    if (i + 2 < 20)
+      v |= hash[i + 2];
+    out[o++] = b64[(v >> 18) & 0x3F];
+    out[o++] = b64[(v >> 12) & 0x3F];
+    out[o++] = i + 1 < 20 ? b64[(v >> 6) & 0x3F] : '=';
+    out[o++] = i + 2 < 20 ? b64[v & 0x3F] : '=';
+  }
+  out[o] = 0;
+}
+
+static int ws_connection_count(void) {
+  int n = 0;
+  for (int i = 0; i < HTTP_MAX_CONNECTIONS; i++) {
+    if (conns[i].state == CONN_WEBSOCKET)
+      n++;
+  }
+  return n;
+}
+
+// Answers the upgrade request and switches the connection to framing mode
+static void ws_upgrade(http_conn_t *c, const http_route_t *r) {
+  if (c->ws_key[0] == 0) {
+    async_http_send(c, 400, "text/plain", "Missing Sec-WebSocket-Key");
+    return;
+  }
+  if (ws_connection_count() >= HTTP_MAX_WS_CONNECTIONS) {
+    c->keep_alive = false;
+    async_http_send(c, 503, "text/plain", "Too many WebSocket clients");
+    return;
+  }
+
+  char accept[29];
+  ws_accept_key(c->ws_key, accept);
+  char resp[160];
+  snprintf(resp, sizeof(resp),
+           "HTTP/1.1 101 %s\r\n"
+           "Upgrade: websocket\r\n"
+           "Connection: Upgrade\r\n"
+           "Sec-WebSocket-Accept: %s\r\n\r\n",
+           status_text(101), accept);
+  c->client->write(resp);
+
+  c->responded = true;
+  c->state = CONN_WEBSOCKET;
+  c->ws_route = r;
+  c->ws_hdr_len = 0;
+  c->ws_hdr_need = 2;
+  c->ws_msg_ready = false;
+  c->ws_last_ping = millis();
+  c->body_len = 0;
+  r->ws_handler(c, HTTP_WS_OPEN, NULL, 0);
+}
+
+static void conn_on_data(http_conn_t *c, const char *data, size_t len) {
+  c->last_activity = millis();
+  if (c->state == CONN_WEBSOCKET) {
+    ws_on_data(c, (const uint8_t *)data, len);
+    return;
+  }
+  size_t i = 0;
+  while (i < len) {
+    if (c->state == CONN_READ_HEAD) {
+      char ch = data[i++];
+      if (ch == '\n') {
+        parse_line(c);
+      } else if (c->line_len < HTTP_MAX_LINE - 1) {
+        c->line[c->line_len++] = ch;
+      } else {
+        c->line_overflow = true;
+      }
+    } else if (c->state == CONN_READ_BODY) {
+      size_t n = len - i;
+      if (n > c->content_len - c->body_len)
+        n = c->content_len - c->body_len;
+      memcpy(c->body + c->body_len, data + i, n);
+      c->body_len += n;
+      i += n;
+      if (c->body_len == c->content_len)
+        conn_request_ready(c);
+    } else {
+      // Pipelined request while the previous one is still pending. Not
+      // supported: finish the current response and let the client retry.
+      c->keep_alive = false;
+      break;
+    }
+  }
+}
+
+// --- Connection lifecycle (TCP callbacks) ---
+
+static http_conn_t *conn_alloc(void) {
+  for (int i = 0; i < HTTP_MAX_CONNECTIONS; i++) {
+    if (conns[i].state == CONN_FREE && !conns[i].in_handler)
+      return &conns[i];
+  }
+  return NULL;
+}
+
+static void on_client_disconnect(void *arg, AsyncClient *client) {
+  http_conn_t *c = (http_conn_t *)arg;
+  delete client;
+  c->client = NULL;
+  // A handler that yields (delay, flash I/O) may lose its client; the slot
+  // is then released once the handler returns.
+  if (!c->in_handler)
+    conn_free(c);
+}
+
+static void on_client(void *arg, AsyncClient *client) {
+  http_conn_t *c = conn_alloc();
+  if (!c) {
+    ESP_LOGW(TAG, "Connection limit reached, rejecting client");
+    client->onDisconnect([](void *, AsyncClient *cl) { delete cl; }, NULL);
+    client->write(BUSY_RESPONSE);
+    client->close();
+    return;
+  }
+
+  conn_reset_request(c);
+  c->client = client;
+  c->requests = 0;
+  c->keep_alive = true;
+  c->http10 = false;
+  c->last_activity = millis();
+
+  client->setNoDelay(true);
+  client->onData(
+      [](void *arg, AsyncClient *, void *data, size_t len) {
+        conn_on_data((http_conn_t *)arg, (const char *)data, len);
+      },
+      c);
+  client->onDisconnect(on_client_disconnect, c);
+  client->onError(
+      [](void *arg, AsyncClient *, int8_t error) {
+        ESP_LOGW(TAG, "Client error %d", error);
+      },
+      c);
+  client->onTimeout(
+      [](void *arg, AsyncClient *cl, uint32_t) { cl->close(); }, c);
+}
+
+// --- Response path (runs from async_http_loop) ---
+
+static void begin_response(http_conn_t *c, int code, const char *type,
+                           long content_len) {
+  c->responded = true;
+  c->state = CONN_SENDING;
+  c->tx_off = 0;
+
+  // Bodies of unknown length are chunked; HTTP/1.0 clients get a close
+  // delimited body instead.
+  c->chunked = content_len < 0 && !c->http10;
+  if (content_len < 0 && c->http10)
+    c->keep_alive = false;
+  if (c->requests + 1 >= HTTP_MAX_REQUESTS_PER_CONN)
+    c->keep_alive = false;
+
+  int n = snprintf(c->tx, HTTP_TX_BUF, "HTTP/1.1 %d %s\r\n", code,
+                   status_text(code));
+  if (type)
+    n += snprintf(c->tx + n, HTTP_TX_BUF - n, "Content-Type: %s\r\n", type);
+  if (content_len >= 0 && code != 304) // 304 has no body to measure
+    n += snprintf(c->tx + n, HTTP_TX_BUF - n, "Content-Length: %ld\r\n",
+                  content_len);
+  else if (c->chunked)
+    n += snprintf(c->tx + n, HTTP_TX_BUF - n,
+                  "Transfer-Encoding: chunked\r\n");
+  n += snprintf(c->tx + n, HTTP_TX_BUF - n, "Connection: %s\r\n%s\r\n",
+                c->keep_alive ? "keep-alive" : "close", c->extra);
+  c->tx_len = n < HTTP_TX_BUF ? n : HTTP_TX_BUF - 1;
+}
+
+void async_http_add_header(http_conn_t *c, const char *name,
+                           const char *value) {
+  int n = snprintf(c->extra + c->extra_len,
+                   HTTP_MAX_EXTRA_HEADERS - c->extra_len, "%s: %s\r\n", name,
+                   value);
+  if (n < 0 || c->extra_len + n >= HTTP_MAX_EXTRA_HEADERS) {
+    ESP_LOGW(TAG, "Header %s dropped (buffer full)", name);
+    c->extra[c->extra_len] = 0;
+    return;
+  }
+  c->extra_len += n;
+}
+
+void async_http_send(http_conn_t *c, int code, const char *type,
+                     const char *body) {
+  async_http_send_data(c, code, type, body, body ? strlen(body) : 0);
+}
+
+void async_http_send_data(http_conn_t *c, int code, const char *type,
+                          const void *body, size_t len) {
+  begin_response(c, code, type, len);
+  if (c->method != HTTP_HEAD) {
+    if (c->tx_len + len > HTTP_TX_BUF) {
+      // Larger bodies must be streamed; never truncate silently
+      ESP_LOGE(TAG, "Response for %s exceeds tx buffer", c->uri);
+      c->responded = false;
+      c->extra_len = 0;
+      c->extra[0] = 0;
+      async_http_send(c, 500, "text/plain", "Response too large");
+      return;
+    }
+    memcpy(c->tx + c->tx_len, body, len);
+    c->tx_len += len;
+  }
+  c->body_done = true;
+}
+
+void async_http_send_file(http_conn_t *c, File file, const char *type) {
+  begin_response(c, 200, type, file.size());
+  if (c->method == HTTP_HEAD) {
+    file.close();
+    c->body_done = true;
+    return;
+  }
+  c->file = file;
+  c->has_file = true;
+}
+
+void async_http_send_stream(http_conn_t *c, int code, const char *type,
+                            http_fill_t fill) {
+  async_http_send_stream_len(c, code, type, -1, fill);
+}
+
+void async_http_send_stream_len(http_conn_t *c, int code, const char *type,
+                                long len, http_fill_t fill) {
+  begin_response(c, code, type, len);
+  memset(&c->cursor, 0, sizeof(c->cursor));
+  c->fill_left = len;
+  if (c->method == HTTP_HEAD)
+    c->body_done = true;
+  else
+    c->fill = fill;
+}
+
+bool async_http_streaming(http_conn_t *c, http_fill_t fill) {
+  return c->state != CONN_FREE && c->state != CONN_CLOSING && c->fill == fill;
+}
+
+// Loads the next block of body data into the (drained) tx buffer
+static void conn_refill(http_conn_t *c) {
+  c->tx_off = 0;
+  c->tx_len = 0;
+
+  if (c->has_file) {
+    int n = c->file.read((uint8_t *)c->tx, HTTP_TX_BUF);
+    if (n <= 0) {
+      c->file.close();
+      c->has_file = false;
+      c->body_done = true;
+    } else {
+      c->tx_len = n;
+    }
+    return;
+  }
+
+  if (c->fill) {
+    if (!c->chunked) {
+      size_t n = c->fill(c, c->tx, HTTP_TX_BUF);
+      c->tx_len = n;
+      c->fill_left -= n;
+      if (n == 0) {
+        // A body cut short breaks the framing; only closing tells the client
+        if (c->fill_left > 0)
+          c->keep_alive = false;
+        c->body_done = true;
+      }
+      return;
+    }
+    size_t n = c->fill(c, c->tx + CHUNK_HEAD_RESERVE,
+                       HTTP_TX_BUF - CHUNK_HEAD_RESERVE - CHUNK_TAIL_RESERVE);
+    if (n == 0) {
+      memcpy(c->tx, "0\r\n\r\n", 5);
+      c->tx_len = 5;
+      c->body_done = true;
+      return;
+    }
+    char head[CHUNK_HEAD_RESERVE + 1];
+    int h = snprintf(head, sizeof(head), "%x\r\n", (unsigned)n);
+    c->tx_off = CHUNK_HEAD_RESERVE - h;
+    memcpy(c->tx + c->tx_off, head, h);
+    memcpy(c->tx + CHUNK_HEAD_RESERVE + n, "\r\n", 2);
+    c->tx_len = CHUNK_HEAD_RESERVE + n + CHUNK_TAIL_RESERVE;
+    return;
+  }
+
+  c->body_done = true;
+}
+
+static void conn_finish_response(http_conn_t *c) {
+  c->requests++;
+  if (c->keep_alive && c->requests < HTTP_MAX_REQUESTS_PER_CONN) {
+    conn_reset_request(c);
+    c->last_activity = millis();
+  } else {
+    conn_close(c);
+  }
+}
+
+static void conn_pump(http_conn_t *c) {
+  bool added = false;
+  while (c->client && c->client->space() > 0) {
+    if (c->tx_off < c->tx_len) {
+      size_t n = c->tx_len - c->tx_off;
+      size_t space = c->client->space();
+      if (n > space)
+        n = space;
+      size_t sent = c->client->add(c->tx + c->tx_off, n);
+      if (sent == 0)
+        break;
+      c->tx_off += sent;
+      added = true;
+      continue;
+    }
+    if (c->body_done)
+      break;
+    conn_refill(c);
+  }
+  if (!c->client)
+    return;
+  if (added)
+    c->client->send();
+  if (c->tx_off >= c->tx_len && c->body_done) {
+    c->last_activity = millis();
+    conn_finish_response(c);
+  }
+}
+
+// A route ending in "/*" matches everything below its prefix
+static bool uri_matches(const char *route, const char *uri) {
+  size_t len = strlen(route);
+  if (len >= 2 && strcmp(route + len - 2, "/*") == 0)
+    return strncmp(route, uri, len - 1) == 0;
+  return strcmp(route, uri) == 0;
+}
+
+static const http_route_t *find_route(http_conn_t *c) {
+  for (int i = 0; i < route_count; i++) {
+    const http_route_t *r = &routes[i];
+    if ((r->ws_handler != NULL) != c->ws_upgrade)
+      continue;
+    if ((r->method == HTTP_ANY || r->method == c->method) &&
+        uri_matches(r->uri, c->uri))
+      return r;
+  }
+  return NULL;
+}
+
+static void conn_dispatch(http_conn_t *c) {
+  if (c->error_code) {
+    async_http_send(c, c->error_code, "text/plain",
+                    status_text(c->error_code));
+    return;
+  }
+
+  const http_route_t *r = find_route(c);
+  http_handler_t handler = r ? r->handler : not_found_handler;
+
+  c->user_ctx = r ? r->user_ctx : NULL;
+  c->in_handler = true;
+  if (r && r->ws_handler)
+    ws_upgrade(c, r);
+  else if (handler)
+    handler(c);
+  c->in_handler = false;
+
+  if (!c->client) {
+    conn_free(c); // Client went away while the handler yielded
+    return;
+  }
+  if (!c->responded)
+    async_http_send(c, handler ? 500 : 404, "text/plain",
+                    handler ? "No response" : "404: Not Found");
+}
+
+// --- Public API ---
+
+void async_http_on(const char *uri, http_method_t method,
+                   http_handler_t handler) {
+  async_http_on_ctx(uri, method, handler, NULL);
+}
+
+void async_http_on_ctx(const char *uri, http_method_t method,
+                       http_handler_t handler, void *user_ctx) {
+  if (route_count >= HTTP_MAX_ROUTES) {
+    ESP_LOGE(TAG, "Route table full, %s not registered", uri);
+    return;
+  }
+  routes[route_count].uri = uri;
+  routes[route_count].method = method;
+  routes[route_count].handler = handler;
+  routes[route_count].ws_handler = NULL;
+  routes[route_count].user_ctx = user_ctx;
+  route_count++;
+}
+
+void async_http_on_ws(const char *uri, http_ws_handler_t handler) {
+  if (route_count >= HTTP_MAX_ROUTES) {
+    ESP_LOGE(TAG, "Route table full, %s not registered", uri);
+    return;
+  }
+  routes[route_count].uri = uri;
+  routes[route_count].method = HTTP_GET;
+  routes[route_count].handler = NULL;
+  routes[route_count].ws_handler = handler;
+  routes[route_count].user_ctx = NULL;
+  route_count++;
+}
+
+void async_http_on_not_found(http_handler_t handler) {
+  not_found_handler = handler;
+}
+
+void async_http_begin(uint16_t port) {
+  if (tcp_server)
+    return;
+  for (int i = 0; i < HTTP_MAX_CONNECTIONS; i++)
+    conn_free(&conns[i]);
+  tcp_server = new AsyncServer(port);
+  tcp_server->setNoDelay(true);
+  tcp_server->onClient(on_client, NULL);
+  tcp_server->begin();
+}
+
+void async_http_end(void) {
+  if (!tcp_server)
+    return;
+  tcp_server->end();
+  for (int i = 0; i < HTTP_MAX_CONNECTIONS; i++) {
+    if (conns[i].client)
+      conns[i].client->close(true);
+  }
+  delete tcp_server;
+  tcp_server = NULL;
+}
+
+void async_http_loop(void) {
+  uint32_t now = millis();
+
+  // Dispatch at most one request per connection per pass, round-robin so a
+  // busy client cannot starve the others.
+  for (int k = 0; k < HTTP_MAX_CONNECTIONS; k++) {
+    http_conn_t *c = &conns[(dispatch_next + k) % HTTP_MAX_CONNECTIONS];
+    if (c->state == CONN_READY && c->client)
+      conn_dispatch(c);
+    else if (c->state == CONN_WEBSOCKET && c->ws_msg_ready) {
+      c->in_handler = true;
+      c->ws_route->ws_handler(c, HTTP_WS_MESSAGE, c->body, c->body_len);
+      c->in_handler = false;
+      c->ws_msg_ready = false;
+      if (!c->client)
+        conn_free(c);
+    }
+  }
+  dispatch_next = (dispatch_next + 1) % HTTP_MAX_CONNECTIONS;
+
+  for (int i = 0; i < HTTP_MAX_CONNECTIONS; i++) {
+    http_conn_t *c = &conns[i];
+    if (!c->client)
+      continue;
+    if (c->state == CONN_SENDING) {
+      conn_pump(c);
+    } else if ((c->state == CONN_READ_HEAD || c->state == CONN_READ_BODY) &&
+               now - c->last_activity > HTTP_KEEPALIVE_MS) {
+      conn_close(c); // Idle keep-alive or stalled request
+    } else if (c->state == CONN_WEBSOCKET) {
+      // Keypads sit idle for long periods; ping to detect dead peers
+      if (now - c->last_activity > 2 * HTTP_WS_PING_MS)
+        conn_close(c);
+      else if (now - c->ws_last_ping > HTTP_WS_PING_MS) {
+        c->ws_last_ping = now;
+        ws_write_frame(c, WS_OP_PING, NULL, 0);
+      }
+    }
+  }
+}
+
+http_method_t async_http_method(http_conn_t *c) { return c->method; }
+
+const char *async_http_uri(http_conn_t *c) { return c->uri; }
+
+const char *async_http_query(http_conn_t *c) { return c->query; }
+
+const char *async_http_body(http_conn_t *c) { return c->body; }
+
+size_t async_http_body_len(http_conn_t *c) { return c->body_len; }
+
+http_cursor_t *async_http_cursor(http_conn_t *c) { return &c->cursor; }
+
+const char *async_http_range(http_conn_t *c) { return c->range; }
+
+const char *async_http_if_range(http_conn_t *c) { return c->if_range; }
+
+const char *async_http_if_none_match(http_conn_t *c) {
+  return c->if_none_match;
+}
+
+bool async_http_accepts_gzip(http_conn_t *c) { return c->accept_gzip; }
+
+bool async_http_accepts_cbor(http_conn_t *c) { return c->accept_cbor; }
+
+bool async_http_body_is_cbor(http_conn_t *c) { return c->body_cbor; }
+
+void *async_http_user_ctx(http_conn_t *c) { return c->user_ctx; }
+
+bool async_http_ws_send(http_conn_t *c, const char *text) {
+  if (c->state != CONN_WEBSOCKET)
+    return false;
+  return ws_write_frame(c, WS_OP_TEXT, text, strlen(text));
+}
+
+void async_http_ws_broadcast(const char *uri, const char *text) {
+  for (int i = 0; i < HTTP_MAX_CONNECTIONS; i++) {
+    http_conn_t *c = &conns[i];
+    if (c->state == CONN_WEBSOCKET && c->client &&
+        strcmp(c->ws_route->uri, uri) == 0)
+      ws_write_frame(c, WS_OP_TEXT, text, strlen(text));
+  }
+}
+
+#endif // ARDUINO
@@ -0,0 +1,110 @@
+#ifndef ASYNC_HTTP_H
+#define ASYNC_HTTP_H
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#include <FS.h>
+
+// Event-driven HTTP/1.1 engine on top of ESPAsyncTCP.
+// Sockets are accepted and parsed from the TCP callbacks; complete requests
+// are dispatched from async_http_loop() so handlers may touch the filesystem.
+// All buffers are static and bounded per connection.
+
+#define HTTP_MAX_CONNECTIONS 6
+#define HTTP_MAX_WS_CONNECTIONS 3 // Leaves slots for plain requests
+#define HTTP_MAX_URI 96
+#define HTTP_MAX_LINE 192
+#define HTTP_MAX_BODY 384
+#define HTTP_MAX_EXTRA_HEADERS 224
+#define HTTP_TX_BUF 768
+#define HTTP_KEEPALIVE_MS 5000
+#define HTTP_MAX_REQUESTS_PER_CONN 32
+#define HTTP_WS_PING_MS 20000
+
+typedef enum {
+  HTTP_ANY = 0,
+  HTTP_GET,
+  HTTP_HEAD,
+  HTTP_POST,
+  HTTP_PUT,
+  HTTP_PATCH,
+  HTTP_DELETE,
+  HTTP_OPTIONS
+} http_method_t;
+
+typedef struct http_conn http_conn_t;
+
+// Scratch state for streamed responses, reset before every response
+typedef struct {
+  uint32_t pos;
+  uint32_t end; // Optional stop position
+  uint32_t count;
+  bool started;
+  bool done;
+} http_cursor_t;
+
+typedef enum { HTTP_WS_OPEN, HTTP_WS_MESSAGE } http_ws_event_t;
+
+typedef void (*http_handler_t)(http_conn_t *c);
+// WebSocket events are dispatched from async_http_loop() like requests.
+// data/len carry the text or binary payload of a HTTP_WS_MESSAGE.
+typedef void (*http_ws_handler_t)(http_conn_t *c, http_ws_event_t event,
+                                  const char *data, size_t len);
+// Writes the next part of a streamed body into buf (at most cap bytes).
+// Returns 0 once the body is complete.
+typedef size_t (*http_fill_t)(http_conn_t *c, char *buf, size_t cap);
+
+// A uri ending in "/*" also matches every path below it; the handler reads
+// the rest from async_http_uri()
+void async_http_on(const char *uri, http_method_t method,
+                   http_handler_t handler);
+// Like async_http_on; user_ctx is returned by async_http_user_ctx()
+void async_http_on_ctx(const char *uri, http_method_t method,
+                       http_handler_t handler, void *user_ctx);
+void async_http_on_not_found(http_handler_t handler);
+void async_http_on_ws(const char *uri, http_ws_handler_t handler);
+void async_http_begin(uint16_t port);
+void async_http_end(void);
+void async_http_loop(void);
+
+// Request accessors, valid while the handler runs
+http_method_t async_http_method(http_conn_t *c);
+const char *async_http_uri(http_conn_t *c);
+const char *async_http_query(http_conn_t *c); // "" when absent
+const char *async_http_body(http_conn_t *c);  // NUL-terminated
+size_t async_http_body_len(http_conn_t *c);
+http_cursor_t *async_http_cursor(http_conn_t *c);
+const char *async_http_range(http_conn_t *c);    // Range header, "" if absent
+const char *async_http_if_range(http_conn_t *c); // "" when absent
+const char *async_http_if_none_match(http_conn_t *c); // "" when absent
+bool async_http_accepts_gzip(http_conn_t *c);
+bool async_http_accepts_cbor(http_conn_t *c); // Accept names application/cbor
+bool async_http_body_is_cbor(http_conn_t *c); // Content-Type is CBOR
+void *async_http_user_ctx(http_conn_t *c);
+
+// Responses. Extra headers must be added before the send call.
+void async_http_add_header(http_conn_t *c, const char *name,
+                           const char *value);
+void async_http_send(http_conn_t *c, int code, const char *type,
+                     const char *body);
+// Like async_http_send, for a body that may hold NUL bytes
+void async_http_send_data(http_conn_t *c, int code, const char *type,
+                          const void *body, size_t len);
+void async_http_send_file(http_conn_t *c, File file, const char *type);
+void async_http_send_stream(http_conn_t *c, int code, const char *type,
+                            http_fill_t fill);
+// Streamed body of known length, sent without chunk framing. The cursor is
+// reset by the call, so set it up afterwards.
+void async_http_send_stream_len(http_conn_t *c, int code, const char *type,
+                                long len, http_fill_t fill);
+// True while c is still sending a body from fill, false once the response
+// is over or the client went away
+bool async_http_streaming(http_conn_t *c, http_fill_t fill);
+
+// WebSocket text frames (payloads up to HTTP_MAX_BODY bytes)
+bool async_http_ws_send(http_conn_t *c, const char *text);
+void async_http_ws_broadcast(const char *uri, const char *text);
+
+#endif // ARDUINO
+
+#endif // ASYNC_HTTP_H
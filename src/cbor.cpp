@@ -0,0 +1,323 @@
+#include "cbor.h"
+
+#include <string.h>
+
+// Major types
+enum {
+  CBOR_UINT = 0,
+  CBOR_NEGINT = 1,
+  CBOR_BYTES = 2,
+  CBOR_TEXT = 3,
+  CBOR_ARRAY = 4,
+  CBOR_MAP = 5,
+  CBOR_TAG = 6,
+  CBOR_SIMPLE = 7
+};
+
+#define CBOR_FALSE 20
+#define CBOR_TRUE 21
+#define CBOR_NULL 22
+#define CBOR_UNDEFINED 23
+#define AI_INDEFINITE 31
+
+// --- Writer ---
+
+void cbor_writer_init(cbor_writer_t *w, void *buf, size_t cap) {
+  w->buf = (uint8_t *)buf;
+  w->cap = cap;
+  w->len = 0;
+}
+
+static void put_bytes(cbor_writer_t *w, const void *data, size_t n) {
+  if (w->len + n <= w->cap)
+    memcpy(w->buf + w->len, data, n);
+  w->len += n;
+}
+
+// Initial byte and argument, in the shortest form
+static void put_head(cbor_writer_t *w, uint8_t major, uint64_t v) {
+  uint8_t h[9];
+  size_t n;
+  if (v < 24) {
+    h[0] = major << 5 | v;
+    n = 1;
+  } else if (v <= UINT8_MAX) {
+    h[0] = major << 5 | 24;
+    n = 2;
+  } else if (v <= UINT16_MAX) {
+    h[0] = major << 5 | 25;
+    n = 3;
+  } else if (v <= UINT32_MAX) {
+    h[0] = major << 5 | 26;
+    n = 5;
+  } else {
+    h[0] = major << 5 | 27;
+    n = 9;
+  }
+  for (size_t i = n - 1; i > 0; i--, v >>= 8)
+    h[i] = (uint8_t)v; // Big-endian
+  put_bytes(w, h, n);
+}
+
+void cbor_put_uint(cbor_writer_t *w, uint64_t v) { put_head(w, CBOR_UINT, v); }
+
+void cbor_put_int(cbor_writer_t *w, int64_t v) {
+  if (v >= 0)
+    put_head(w, CBOR_UINT, (uint64_t)v);
+  else
+    put_head(w, CBOR_NEGINT, (uint64_t)(-1 - v));
+}
+
+void cbor_put_bool(cbor_writer_t *w, bool v) {
+  uint8_t b = CBOR_SIMPLE << 5 | (v ? CBOR_TRUE : CBOR_FALSE);
+  put_bytes(w, &b, 1);
+}
+
+void cbor_put_text(cbor_writer_t *w, const char *s) {
+  size_t n = strlen(s);
+  put_head(w, CBOR_TEXT, n);
+  put_bytes(w, s, n);
+}
+
+void cbor_put_array(cbor_writer_t *w, size_t count) {
+  put_head(w, CBOR_ARRAY, count);
+}
+
+void cbor_put_map(cbor_writer_t *w, size_t pairs) {
+  put_head(w, CBOR_MAP, pairs);
+}
+
+// --- Reader ---
+
+typedef struct {
+  const uint8_t *p;
+  const uint8_t *end;
+  json_status_t status; // JSON_INCOMPLETE while all is well
+} cbor_in_t;
+
+static bool in_fail(cbor_in_t *in, json_status_t status) {
+  if (in->status == JSON_INCOMPLETE)
+    in->status = status;
+  return false;
+}
+
+// Reads an initial byte and its argument. Running out of input leaves the
+// status at JSON_INCOMPLETE, like a truncated JSON document.
+static bool read_head(cbor_in_t *in, uint8_t *major, uint8_t *ai,
+                      uint64_t *v) {
+  if (in->p >= in->end)
+    return false;
+  *major = *in->p >> 5;
+  *ai = *in->p & 0x1F;
+  in->p++;
+  *v = *ai;
+  if (*ai < 24 || *ai == AI_INDEFINITE)
+    return true;
+  if (*ai > 27)
+    return in_fail(in, JSON_ERR_SYNTAX);
+  size_t n = (size_t)1 << (*ai - 24);
+  if ((size_t)(in->end - in->p) < n)
+    return false;
+  *v = 0;
+  while (n--)
+    *v = *v << 8 | *in->p++;
+  return true;
+}
+
+static bool at_break(cbor_in_t *in) {
+  if (in->p < in->end && *in->p == 0xFF) {
+    in->p++;
+    return true;
+  }
+  return false;
+}
+
+// Copies a text string, definite or chunked, into out (cap bytes with the
+// NUL), or skips it when out is NULL. Sets *too_long when it did not fit.
+static bool read_text(cbor_in_t *in, uint8_t ai, uint64_t v, char *out,
+                      size_t cap, bool *too_long) {
+  size_t n = 0;
+  bool chunked = ai == AI_INDEFINITE;
+  for (;;) {
+    if (chunked) {
+      if (at_break(in))
+        break;
+      uint8_t major;
+      if (!read_head(in, &major, &ai, &v))
+        return false;
+      if (major != CBOR_TEXT || ai == AI_INDEFINITE)
+        return in_fail(in, JSON_ERR_SYNTAX);
+    }
+    if ((uint64_t)(in->end - in->p) < v)
+      return false;
+    if (out && n + v < cap)
+      memcpy(out + n, in->p, v);
+    else if (out)
+      *too_long = true;
+    n += v;
+    in->p += v;
+    if (!chunked)
+      break;
+  }
+  if (out && !*too_long)
+    out[n] = 0;
+  return true;
+}
+
+static bool skip_item(cbor_in_t *in, int depth);
+
+// Skips the content of an item whose head has been read
+static bool skip_body(cbor_in_t *in, uint8_t major, uint8_t ai, uint64_t v,
+                      int depth) {
+  if (depth >= JSON_MAX_DEPTH)
+    return in_fail(in, JSON_ERR_DEPTH);
+  switch (major) {
+  case CBOR_UINT:
+  case CBOR_NEGINT:
+    return true;
+  case CBOR_BYTES:
+  case CBOR_TEXT: {
+    bool unused = false;
+    if (ai != AI_INDEFINITE)
+      return read_text(in, ai, v, NULL, 0, &unused);
+    // Chunks of a byte string have the byte string type
+    while (!at_break(in)) {
+      uint8_t m;
+      if (!read_head(in, &m, &ai, &v))
+        return false;
+      if (m != major || ai == AI_INDEFINITE)
+        return in_fail(in, JSON_ERR_SYNTAX);
+      if ((uint64_t)(in->end - in->p) < v)
+        return false;
+      in->p += v;
+    }
+    return true;
+  }
+  case CBOR_ARRAY:
+  case CBOR_MAP: {
+    uint64_t items = major == CBOR_MAP ? 2 * v : v;
+    for (uint64_t i = 0; ai == AI_INDEFINITE || i < items; i++) {
+      if (ai == AI_INDEFINITE && at_break(in))
+        return true;
+      if (!skip_item(in, depth + 1))
+        return false;
+    }
+    return true;
+  }
+  case CBOR_TAG:
+    return skip_item(in, depth + 1);
+  default: // CBOR_SIMPLE: the head holds the whole value
+    return ai != AI_INDEFINITE || in_fail(in, JSON_ERR_SYNTAX);
+  }
+}
+
+static bool skip_item(cbor_in_t *in, int depth) {
+  uint8_t major, ai;
+  uint64_t v;
+  return read_head(in, &major, &ai, &v) && skip_body(in, major, ai, v, depth);
+}
+
+// Index of the field a key names, -1 when none
+static int bind_key(json_reader_t *r, const char *const *names,
+                    size_t name_count, cbor_in_t *in) {
+  uint8_t major, ai;
+  uint64_t v;
+  if (!read_head(in, &major, &ai, &v))
+    return -2;
+  char key[JSON_MAX_KEY];
+  const char *name = NULL;
+  if (major == CBOR_TEXT) {
+    bool too_long = false;
+    if (!read_text(in, ai, v, key, sizeof(key), &too_long))
+      return -2;
+    name = too_long ? NULL : key;
+  } else if (major == CBOR_UINT) {
+    name = names && v < name_count ? names[v] : NULL;
+  } else if (!skip_body(in, major, ai, v, 1)) {
+    return -2;
+  }
+  for (size_t i = 0; name && i < r->field_count; i++) {
+    if (strcmp(r->fields[i].key, name) == 0)
+      return (int)i;
+  }
+  return -1;
+}
+
+// Stores a member's value in its field
+static bool bind_value(json_reader_t *r, int field, cbor_in_t *in) {
+  const json_field_t *f = &r->fields[field];
+  void *dst = (char *)r->out + f->offset;
+  uint8_t major, ai;
+  uint64_t v;
+  do {
+    if (!read_head(in, &major, &ai, &v))
+      return false;
+  } while (major == CBOR_TAG); // Tags (an epoch time, say) change nothing
+  if (major == CBOR_SIMPLE && (v == CBOR_NULL || v == CBOR_UNDEFINED))
+    return true; // Leaves the member unset, as null does in JSON
+
+  bool ok;
+  if (f->type == JSON_FIELD_INT) {
+    ok = (major == CBOR_UINT || major == CBOR_NEGINT) && ai != AI_INDEFINITE;
+    // -1 - v for a negative integer, so both signs stop at v == INT32_MAX
+    if (ok && v > INT32_MAX)
+      return in_fail(in, JSON_ERR_RANGE);
+    if (ok)
+      *(int32_t *)dst =
+          major == CBOR_UINT ? (int32_t)v : (int32_t)(-1 - (int64_t)v);
+  } else if (f->type == JSON_FIELD_BOOL) {
+    ok = major == CBOR_SIMPLE && (v == CBOR_TRUE || v == CBOR_FALSE);
+    if (ok)
+      *(bool *)dst = v == CBOR_TRUE;
+  } else {
+    ok = major == CBOR_TEXT;
+    bool too_long = false;
+    if (ok && !read_text(in, ai, v, (char *)dst, f->size, &too_long))
+      return false;
+    if (too_long)
+      return in_fail(in, JSON_ERR_TOO_LONG);
+  }
+  if (!ok)
+    return in_fail(in, JSON_ERR_TYPE);
+  r->seen |= 1UL << field;
+  return true;
+}
+
+json_status_t cbor_parse_buffer(json_reader_t *r, const json_field_t *fields,
+                                size_t field_count, void *out,
+                                const char *const *names, size_t name_count,
+                                const uint8_t *data, size_t len) {
+  json_reader_init(r, fields, field_count, out);
+  cbor_in_t in = {data, data + len, JSON_INCOMPLETE};
+  uint8_t major, ai;
+  uint64_t pairs;
+  bool done = false;
+  if (read_head(&in, &major, &ai, &pairs)) {
+    if (major != CBOR_MAP)
+      in_fail(&in, JSON_ERR_TYPE); // Only a map has members
+    for (uint64_t i = 0; in.status == JSON_INCOMPLETE; i++) {
+      if (ai == AI_INDEFINITE ? at_break(&in) : i == pairs) {
+        done = true;
+        break;
+      }
+      int field = bind_key(r, names, name_count, &in);
+      if (field == -2 ||
+          !(field < 0 ? skip_item(&in, 1) : bind_value(r, field, &in)))
+        break;
+    }
+  }
+  if (done && in.p != in.end)
+    in_fail(&in, JSON_ERR_SYNTAX); // Trailing bytes
+  if (in.status != JSON_INCOMPLETE || !done) {
+    r->status = in.status;
+    return r->status;
+  }
+  for (size_t i = 0; i < field_count; i++) {
+    if ((fields[i].flags & JSON_REQUIRED) && !json_reader_has(r, i)) {
+      r->status = JSON_ERR_MISSING;
+      return r->status;
+    }
+  }
+  r->status = JSON_OK;
+  return r->status;
+}
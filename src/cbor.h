@@ -0,0 +1,46 @@
+#ifndef CBOR_H
+#define CBOR_H
+
+#include "json_reader.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// CBOR (RFC 8949) for the API, as an alternative to JSON text.
+// The writer encodes items straight into a caller buffer, with no document
+// tree; lists of unknown length are streamed as indefinite-length arrays.
+// The reader binds the members of a top-level map into the same field
+// tables json_reader uses, so handlers treat both encodings alike.
+
+#define CBOR_CONTENT_TYPE "application/cbor"
+
+typedef struct {
+  uint8_t *buf;
+  size_t cap;
+  size_t len; // Bytes the items need; past cap when they did not fit
+} cbor_writer_t;
+
+void cbor_writer_init(cbor_writer_t *w, void *buf, size_t cap);
+void cbor_put_uint(cbor_writer_t *w, uint64_t v);
+void cbor_put_int(cbor_writer_t *w, int64_t v);
+void cbor_put_bool(cbor_writer_t *w, bool v);
+void cbor_put_text(cbor_writer_t *w, const char *s);
+void cbor_put_array(cbor_writer_t *w, size_t count);
+void cbor_put_map(cbor_writer_t *w, size_t pairs);
+
+// An indefinite-length array and its end, for lists streamed from items
+// encoded one at a time
+#define CBOR_LIST_OPEN "\x9F"
+#define CBOR_LIST_END "\xFF"
+
+// Binds a top-level map into out. Keys are text strings matched against
+// fields, or unsigned integers k standing for names[k] when names is given.
+// Members that are absent or null keep their previous value; unknown
+// members are skipped.
+json_status_t cbor_parse_buffer(json_reader_t *r, const json_field_t *fields,
+                                size_t field_count, void *out,
+                                const char *const *names, size_t name_count,
+                                const uint8_t *data, size_t len);
+
+#endif // CBOR_H
@@ -1,341 +1,1568 @@
 #include "data_manager.h"
+#include "access_stats.h"
+#include "gates.h"
+#include "history.h"
 #include "logging_macros.h"
+#include "metrics.h"
+#include "pin_alloc.h"
+#include "profiler.h"
+#include "replication.h"
+#include "storage.h"
 
 #ifdef ARDUINO
-#include <LittleFS.h>
+#include <Arduino.h>
 #else
+#include "esp_attr.h"
 #include "esp_log.h"
 #include "esp_random.h"
-#include "esp_spiffs.h"
-
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
 #endif
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/stat.h>
+#include <strings.h>
 #include <sys/time.h>
 #include <time.h>
-#include <unistd.h>
 
 static const char *TAG = "DATA_MANAGER";
 static system_data_t sys_data;
-static const char *DATA_FILE = "/spiffs/data.bin";
+static const char *DATA_KEY = "data.bin";
 
-void data_manager_init(void) {
-  ESP_LOGI(TAG, "Initializing Data Manager...");
+// Recent access events for the UI. Kept apart from data.bin so an event
+// never rewrites the user table. Retained memory survives resets but not
+// a power cut; define ACCESS_RING_FILE to keep it in flash instead.
+#define RING_MAGIC 0x474E4952 // "RING"
+typedef struct {
+  uint32_t magic;
+  uint8_t head; // Next slot to write
+  uint8_t count;
+  uint16_t size; // sizeof(access_ring_t), catches a layout change
+  access_log_t entries[MAX_LOGS];
+} access_ring_t;
 
-  // Set defaults
-  memset(&sys_data, 0, sizeof(system_data_t));
+#if defined(ACCESS_RING_FILE)
+static access_ring_t recent;
+#elif defined(ESP8266)
+#define RING_RTC_USER_MEMORY
+static access_ring_t recent; // Mirrored to the 512-byte RTC user memory
+static_assert(sizeof(access_ring_t) <= 512, "ring exceeds RTC user memory");
+#elif !defined(ARDUINO)
+#define RING_RTC_NOINIT
+RTC_NOINIT_ATTR static access_ring_t recent;
+#else
+#define ACCESS_RING_FILE
+static access_ring_t recent;
+#endif
+
+// PIN -> slot lookup over every record that holds a PIN
+#define PIN_INDEX_SIZE 128 // Power of two, at least twice MAX_USERS
+#define PIN_INDEX_EMPTY 0xFF
+static uint8_t pin_index[PIN_INDEX_SIZE];
+
+#if MAX_USERS * 2 > PIN_INDEX_SIZE
+#error "PIN_INDEX_SIZE must be at least twice MAX_USERS"
+#endif
+
+// Slots that can expire, as a min-heap on expiry_date: the sweeper only
+// looks at the top. Rebuilt with the PIN index.
+static uint8_t expiry_heap[MAX_USERS];
+static int expiry_count = 0;
+
+// Active slots in case-insensitive name order, for paged listings and
+// prefix search. Kept sorted as records change. Rebuilt with the PIN index.
+static uint8_t name_order[MAX_USERS];
+static uint8_t name_count = 0;
+
+#define EXPIRY_SWEEP_INTERVAL_SEC 60
+#define EXPIRY_SWEEP_BATCH 4 // Records freed per sweep, one save
+#define CLOCK_VALID_AFTER 1577836800 // 2020-01-01; before that it is unset
+
+// Published copy of the table and index for readers. On the ESP32 the web
+// server, MQTT and the keypad run in different tasks, so readers get one of
+// two copies that writers fill in turn (read-copy-update): a writer copies
+// into the idle buffer once its last reader has left, then swaps the
+// pointer. Readers never block and never see a half-written record. The
+// ESP8266 runs everything in loop(), so its snapshot is the live table.
+struct user_snapshot {
+  const system_data_t *data;
+  const uint8_t *index;
+  const uint8_t *order; // Slots in name order
+  uint8_t order_len;
+  uint32_t version;
+  uint32_t readers;
+};
 
-  // Try logs loading from file
 #ifdef ARDUINO
-  File f = LittleFS.open(DATA_FILE, "r");
-  if (!f) {
-    ESP_LOGW(TAG, "No data file found, creating new one");
-    data_manager_save();
-  } else {
-    f.read((uint8_t *)&sys_data, sizeof(system_data_t));
-    f.close();
-    ESP_LOGI(TAG, "Data loaded. Users: %d", sys_data.user_count);
-  }
+static user_snapshot_t live_view = {&sys_data, pin_index, name_order,
+                                    0, 0, 0};
+#define WRITE_LOCK()
+#define WRITE_UNLOCK()
+#define SPIN_LOCK()
+#define SPIN_UNLOCK()
 #else
-  FILE *f = fopen(DATA_FILE, "rb");
-  if (f == NULL) {
-    ESP_LOGW(TAG, "No data file found, creating new one");
-    data_manager_save();
-  } else {
-    fread(&sys_data, sizeof(system_data_t), 1, f);
-    fclose(f);
-    ESP_LOGI(TAG, "Data loaded. Users: %d", sys_data.user_count);
+static system_data_t snap_data[2];
+static uint8_t snap_index[2][PIN_INDEX_SIZE];
+static uint8_t snap_order[2][MAX_USERS];
+static user_snapshot_t snaps[2];
+static user_snapshot_t *current = NULL;
+// Serialises writers; recursive because mutators call one another
+static SemaphoreHandle_t write_lock = NULL;
+static int write_depth = 0;          // Nesting of the holder
+static bool publish_pending = false; // The idle copy still had readers
+static void write_lock_take(void);
+static void write_lock_give(void);
+#define WRITE_LOCK() write_lock_take()
+#define WRITE_UNLOCK() write_lock_give()
+// Guards what the PIN check changes without the writer lock: spent uses on
+// the live table, the brute force counters and the event queue
+static portMUX_TYPE spin = portMUX_INITIALIZER_UNLOCKED;
+#define SPIN_LOCK() portENTER_CRITICAL(&spin)
+#define SPIN_UNLOCK() portEXIT_CRITICAL(&spin)
+#endif
+
+// Earlier data.bin layouts, only used for migration: version 1 held 4-digit
+// PINs, version 2 widened them. Both stored names and log text inline.
+#define LEGACY_USER_T(pin_len)                                                 \
+  struct {                                                                     \
+    char name[NAME_LENGTH];                                                    \
+    char pin[pin_len];                                                         \
+    user_type_t type;                                                          \
+    uint32_t version;                                                          \
+    int64_t expiry_date;                                                       \
+    int access_count_remaining;                                                \
+    bool active;                                                               \
+    uint8_t gate_mask;                                                         \
+    uint16_t start_time;                                                       \
+    uint16_t end_time;                                                         \
+    uint8_t allowed_days;                                                      \
+    uint32_t created;                                                          \
+  }
+typedef LEGACY_USER_T(5) user_v1_t;
+typedef LEGACY_USER_T(PIN_LENGTH) user_v2_t;
+
+typedef struct {
+  int64_t timestamp;
+  char user_name[NAME_LENGTH];
+  bool granted;
+  char details[32];
+} access_log_v2_t;
+
+typedef struct {
+  user_v1_t users[MAX_USERS];
+  access_log_v2_t logs[MAX_LOGS];
+  int log_head;
+  int user_count;
+} system_data_v1_t;
+
+typedef struct {
+  user_v2_t users[MAX_USERS];
+  access_log_v2_t logs[MAX_LOGS];
+  int log_head;
+  int user_count;
+} system_data_v2_t;
+
+// Versions 3 and 4 kept only what remained of a count; version 3 also kept
+// the recent events inside data.bin
+typedef struct {
+  char pin[PIN_LENGTH];
+  uint8_t type;
+  bool active;
+  uint8_t gate_mask;
+  int16_t access_count_remaining;
+  uint16_t start_time;
+  uint16_t end_time;
+  uint8_t allowed_days;
+  uint16_t name_off;
+  uint32_t expiry_date;
+  uint32_t version;
+  uint32_t created;
+} user_v4_t;
+
+typedef struct {
+  uint32_t magic;
+  user_v4_t users[MAX_USERS];
+  access_log_t logs[MAX_LOGS];
+  uint16_t names_used;
+  uint8_t log_head;
+  uint8_t user_count;
+  char names[NAME_POOL_SIZE];
+} system_data_v3_t;
+#define DATA_MAGIC_V3 0x33424447
+
+typedef struct {
+  uint32_t magic;
+  user_v4_t users[MAX_USERS];
+  uint16_t names_used;
+  uint8_t user_count;
+  char names[NAME_POOL_SIZE];
+} system_data_v4_t;
+#define DATA_MAGIC_V4 0x34424447
+
+static const struct {
+  const char *text;
+  bool granted;
+} log_reasons[LOG_REASON_COUNT] = {
+    // In log_reason_t order
+    {"Access Granted", true},
+    {"Remote Open", true},
+    {"Invalid PIN", false},
+    {"Security Lockout", false},
+    {"Expired (Time)", false},
+    {"Expired (Count)", false},
+    {"Denied (Schedule Day)", false},
+    {"Denied (Schedule Time)", false},
+    {"Denied (Gate)", false},
+    {"Granted", true},
+    {"Denied", false},
+    {"Removed (Expired)", false},
+};
+
+static void log_event(uint8_t user, log_reason_t reason);
+static void log_event_as(uint8_t user, uint16_t tag, const char *name,
+                         log_reason_t reason, const user_t *spent_on);
+
+// --- Recent events ring ---
+
+static void ring_reset(void) {
+  memset(&recent, 0, sizeof(recent));
+  recent.magic = RING_MAGIC;
+  recent.size = sizeof(recent);
+}
+
+static bool ring_valid(void) {
+  if (recent.magic != RING_MAGIC || recent.size != sizeof(recent) ||
+      recent.head >= MAX_LOGS || recent.count > MAX_LOGS)
+    return false;
+  for (int i = 0; i < MAX_LOGS; i++) {
+    if (recent.entries[i].reason >= LOG_REASON_COUNT)
+      return false;
   }
+  return true;
+}
+
+#if defined(ACCESS_RING_FILE)
+static const char *RECENT_KEY = "recent.bin";
+#endif
+
+// Persists the header and entry idx, or the whole ring when idx < 0
+static void ring_persist(int idx) {
+#if defined(RING_RTC_USER_MEMORY)
+  // RTC user memory is addressed in 4-byte blocks
+  size_t head_len = offsetof(access_ring_t, entries);
+  if (idx < 0) {
+    ESP.rtcUserMemoryWrite(0, (uint32_t *)&recent, sizeof(recent));
+    return;
+  }
+  ESP.rtcUserMemoryWrite(0, (uint32_t *)&recent, head_len);
+  ESP.rtcUserMemoryWrite((head_len + idx * sizeof(access_log_t)) / 4,
+                         (uint32_t *)&recent.entries[idx],
+                         sizeof(access_log_t));
+#elif defined(ACCESS_RING_FILE)
+  (void)idx;
+  if (!storage_write(STORAGE_LOGS, RECENT_KEY, &recent, sizeof(recent)))
+    ESP_LOGE(TAG, "Failed to write %s", RECENT_KEY);
+#else
+  (void)idx; // The ring itself lives in retained memory
 #endif
 }
 
-void data_manager_save(void) {
-#ifdef ARDUINO
-  File f = LittleFS.open(DATA_FILE, "w");
-  if (!f) {
-    ESP_LOGE(TAG, "Failed to open data file for writing");
+static void ring_load(void) {
+#if defined(RING_RTC_USER_MEMORY)
+  ESP.rtcUserMemoryRead(0, (uint32_t *)&recent, sizeof(recent));
+#elif defined(ACCESS_RING_FILE)
+  if (storage_read(STORAGE_LOGS, RECENT_KEY, 0, &recent, sizeof(recent)) !=
+      sizeof(recent))
+    recent.magic = 0;
+#endif
+  if (ring_valid()) {
+    ESP_LOGI(TAG, "Recent events restored: %d", recent.count);
     return;
   }
-  f.write((uint8_t *)&sys_data, sizeof(system_data_t));
-  f.close();
-  ESP_LOGI(TAG, "Data saved");
+  ring_reset();
+  ring_persist(-1);
+}
+
+// Fills in head and count for entries that were stored by slot, with
+// unused slots zeroed
+static void ring_from_slots(int head) {
+  recent.head = head;
+  recent.count = 0;
+  while (recent.count < MAX_LOGS &&
+         recent.entries[(head + MAX_LOGS - 1 - recent.count) % MAX_LOGS]
+             .timestamp)
+    recent.count++;
+}
+
+static metric_t *save_count = NULL;
+static metric_t *save_bytes = NULL;
+static metric_t *save_duration = NULL;
+static metric_t *log_write_duration = NULL;
+static metric_t *expired_removed = NULL;
+
+static uint32_t pin_hash(const char *pin) {
+  uint32_t h = 2166136261u;
+  for (; *pin; pin++)
+    h = (h ^ (uint8_t)*pin) * 16777619u;
+  return h;
+}
+
+// Makes the working table visible to readers. Called with the writer lock.
+static void snapshot_publish(void) {
+#ifdef ARDUINO
+  live_view.order_len = name_count;
+  live_view.version++;
 #else
-  FILE *f = fopen(DATA_FILE, "wb");
-  if (f == NULL) {
-    ESP_LOGE(TAG, "Failed to open data file for writing");
+  user_snapshot_t *next = current == &snaps[0] ? &snaps[1] : &snaps[0];
+  // Readers of the previous version are still in the idle copy: the
+  // outermost unlock waits for them, without holding the lock
+  if (__atomic_load_n(&next->readers, __ATOMIC_SEQ_CST)) {
+    publish_pending = true;
     return;
   }
-  fwrite(&sys_data, sizeof(system_data_t), 1, f);
-  fclose(f);
-  ESP_LOGI(TAG, "Data saved");
+  int n = next - snaps;
+  memcpy(&snap_data[n], &sys_data, sizeof(sys_data));
+  memcpy(snap_index[n], pin_index, sizeof(pin_index));
+  memcpy(snap_order[n], name_order, name_count);
+  next->data = &snap_data[n];
+  next->index = snap_index[n];
+  next->order = snap_order[n];
+  next->order_len = name_count;
+  next->version = current ? current->version + 1 : 1;
+  __atomic_store_n(&current, next, __ATOMIC_SEQ_CST);
+  publish_pending = false;
 #endif
 }
 
-char *data_manager_generate_pin(void) {
-  static char pin_buf[PIN_LENGTH];
-  bool unique = false;
+#ifndef ARDUINO
+static void write_lock_take(void) {
+  xSemaphoreTakeRecursive(write_lock, portMAX_DELAY);
+  write_depth++;
+}
+
+static void write_lock_give(void) {
+  // Finish a deferred publish: the grace period runs unlocked, so neither
+  // other writers nor the PIN check wait on a slow reader
+  while (write_depth == 1 && publish_pending) {
+    const user_snapshot_t *idle = current == &snaps[0] ? &snaps[1] : &snaps[0];
+    write_depth = 0;
+    xSemaphoreGiveRecursive(write_lock);
+    while (__atomic_load_n(&idle->readers, __ATOMIC_SEQ_CST))
+      vTaskDelay(1);
+    write_lock_take();
+    if (publish_pending)
+      snapshot_publish();
+  }
+  write_depth--;
+  xSemaphoreGiveRecursive(write_lock);
+}
+#endif
+
+const user_snapshot_t *data_manager_snapshot_acquire(void) {
+#ifdef ARDUINO
+  return &live_view;
+#else
+  for (;;) {
+    user_snapshot_t *s = __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&s->readers, 1, __ATOMIC_SEQ_CST);
+    // A writer may have swapped and started refilling s meanwhile
+    if (s == __atomic_load_n(&current, __ATOMIC_SEQ_CST))
+      return s;
+    __atomic_fetch_sub(&s->readers, 1, __ATOMIC_SEQ_CST);
+  }
+#endif
+}
 
-  while (!unique) {
+void data_manager_snapshot_release(const user_snapshot_t *s) {
 #ifdef ARDUINO
-    uint32_t num = random(10000);
+  (void)s;
 #else
-    uint32_t num = esp_random() % 10000;
+  __atomic_fetch_sub(&((user_snapshot_t *)s)->readers, 1, __ATOMIC_SEQ_CST);
 #endif
-    snprintf(pin_buf, PIN_LENGTH, "%04u", num);
+}
+
+const system_data_t *data_manager_snapshot_data(const user_snapshot_t *s) {
+  return s->data;
+}
+
+const char *data_manager_snapshot_name(const user_snapshot_t *s,
+                                       const user_t *u) {
+  return &s->data->names[u->name_off];
+}
+
+uint32_t data_manager_snapshot_version(const user_snapshot_t *s) {
+  return s->version;
+}
+
+uint32_t data_manager_generation(void) {
+  const user_snapshot_t *s = data_manager_snapshot_acquire();
+  uint32_t version = s->version;
+  data_manager_snapshot_release(s);
+  return version;
+}
 
-    unique = true;
+int data_manager_snapshot_user_count(const user_snapshot_t *s) {
+  return s->order_len;
+}
+
+int data_manager_snapshot_ordered(const user_snapshot_t *s, int pos) {
+  return s->order[pos];
+}
+
+// First position whose name, cut to len characters, is not below prefix,
+// or above it when after is true
+static int prefix_bound(const user_snapshot_t *s, const char *prefix,
+                        size_t len, bool after) {
+  int lo = 0, hi = s->order_len;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    const user_t *u = &s->data->users[s->order[mid]];
+    int cmp = strncasecmp(data_manager_snapshot_name(s, u), prefix, len);
+    if (cmp < 0 || (after && cmp == 0))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+void data_manager_snapshot_prefix(const user_snapshot_t *s, const char *prefix,
+                                  int *lo, int *hi) {
+  size_t len = strlen(prefix);
+  *lo = prefix_bound(s, prefix, len, false);
+  *hi = prefix_bound(s, prefix, len, true);
+}
+
+void data_manager_lock(void) { WRITE_LOCK(); }
+
+void data_manager_unlock(void) { WRITE_UNLOCK(); }
+
+static bool expirable(const user_t *u) {
+  if (!u->active)
+    return false;
+  // Count records exhausted before the stamp existed have 0: due at once
+  return u->type == USER_TYPE_DATE_LIMIT ||
+         (u->type == USER_TYPE_COUNT_LIMIT && u->access_count_remaining <= 0);
+}
+
+static bool expiry_before(int a, int b) {
+  return sys_data.users[expiry_heap[a]].expiry_date <
+         sys_data.users[expiry_heap[b]].expiry_date;
+}
+
+static void expiry_sift_down(int i) {
+  for (;;) {
+    int first = i, l = 2 * i + 1;
+    if (l < expiry_count && expiry_before(l, first))
+      first = l;
+    if (l + 1 < expiry_count && expiry_before(l + 1, first))
+      first = l + 1;
+    if (first == i)
+      return;
+    uint8_t t = expiry_heap[i];
+    expiry_heap[i] = expiry_heap[first];
+    expiry_heap[first] = t;
+    i = first;
+  }
+}
+
+static void expiry_rebuild(void) {
+  expiry_count = 0;
+  for (int i = 0; i < MAX_USERS; i++) {
+    if (expirable(&sys_data.users[i]))
+      expiry_heap[expiry_count++] = i;
+  }
+  for (int i = expiry_count / 2 - 1; i >= 0; i--)
+    expiry_sift_down(i);
+}
+
+static void expiry_pop(void) {
+  expiry_heap[0] = expiry_heap[--expiry_count];
+  expiry_sift_down(0);
+}
+
+static bool name_before(int a, int b) {
+  int cmp = strcasecmp(data_manager_user_name(&sys_data.users[a]),
+                       data_manager_user_name(&sys_data.users[b]));
+  return cmp < 0 || (cmp == 0 && a < b);
+}
+
+// Drops inactive slots from the previous order, appends new ones and
+// insertion-sorts. A change moves one or two records, so this is linear.
+static void name_order_update(void) {
+  uint8_t listed[(MAX_USERS + 7) / 8] = {0};
+  int n = 0;
+  for (int i = 0; i < name_count; i++) {
+    int slot = name_order[i];
+    if (sys_data.users[slot].active) {
+      name_order[n++] = slot;
+      listed[slot / 8] |= 1 << (slot % 8);
+    }
+  }
+  for (int i = 0; i < MAX_USERS; i++) {
+    if (sys_data.users[i].active && !(listed[i / 8] & (1 << (i % 8))))
+      name_order[n++] = i;
+  }
+  name_count = n;
+
+  for (int i = 1; i < n; i++) {
+    uint8_t slot = name_order[i];
+    int j = i;
+    for (; j > 0 && name_before(slot, name_order[j - 1]); j--)
+      name_order[j] = name_order[j - 1];
+    name_order[j] = slot;
+  }
+}
+
+void data_manager_reindex(void) {
+  WRITE_LOCK();
+  memset(pin_index, PIN_INDEX_EMPTY, sizeof(pin_index));
+  for (int i = 0; i < MAX_USERS; i++) {
+    const user_t *u = &sys_data.users[i];
+    if (!u->active && !u->created)
+      continue;
+    uint32_t h = pin_hash(u->pin);
+    while (pin_index[h & (PIN_INDEX_SIZE - 1)] != PIN_INDEX_EMPTY)
+      h++;
+    pin_index[h & (PIN_INDEX_SIZE - 1)] = i;
+  }
+  expiry_rebuild();
+  name_order_update();
+  snapshot_publish();
+  WRITE_UNLOCK();
+}
+
+// Slot holding pin (active or deleted), or -1
+static int index_lookup(const uint8_t *index, const system_data_t *data,
+                        const char *pin) {
+  for (uint32_t h = pin_hash(pin);; h++) {
+    uint8_t slot = index[h & (PIN_INDEX_SIZE - 1)];
+    if (slot == PIN_INDEX_EMPTY)
+      return -1;
+    if (strcmp(data->users[slot].pin, pin) == 0)
+      return slot;
+  }
+}
+
+static int pin_lookup(const char *pin) {
+  return index_lookup(pin_index, &sys_data, pin);
+}
+
+// Deleted records keep their PIN until the slot is reused so a replica
+// cannot confuse a new user with the old one
+static bool pin_in_use(const char *pin) { return pin_lookup(pin) >= 0; }
+
+static bool user_live(const user_t *u) { return u->active || u->created; }
+
+// Rewrites the pool in offset order, dropping names no record uses
+static void names_compact(void) {
+  uint16_t w = 0;
+  for (;;) {
+    user_t *next = NULL;
     for (int i = 0; i < MAX_USERS; i++) {
-      if (sys_data.users[i].active &&
-          strcmp(sys_data.users[i].pin, pin_buf) == 0) {
-        unique = false;
-        break;
-      }
+      user_t *u = &sys_data.users[i];
+      if (user_live(u) && u->name_off >= w &&
+          (!next || u->name_off < next->name_off))
+        next = u;
     }
+    if (!next)
+      break;
+    size_t len = strlen(&sys_data.names[next->name_off]) + 1;
+    memmove(&sys_data.names[w], &sys_data.names[next->name_off], len);
+    next->name_off = w;
+    w += len;
   }
-  return pin_buf;
+  sys_data.names_used = w;
 }
 
-bool data_manager_add_user(const char *name, user_type_t type, int limit) {
-  // Find empty slot
+const char *data_manager_user_name(const user_t *u) {
+  return &sys_data.names[u->name_off];
+}
+
+bool data_manager_set_user_name(user_t *u, const char *name) {
+  size_t len = strnlen(name, NAME_LENGTH - 1);
+  if (sys_data.names_used + len + 1 > NAME_POOL_SIZE)
+    names_compact();
+  if (sys_data.names_used + len + 1 > NAME_POOL_SIZE) {
+    ESP_LOGE(TAG, "Name pool full");
+    return false;
+  }
+  u->name_off = sys_data.names_used;
+  memcpy(&sys_data.names[u->name_off], name, len);
+  sys_data.names[u->name_off + len] = 0;
+  sys_data.names_used += len + 1;
+  return true;
+}
+
+static uint8_t log_reason_of(bool granted, const char *details) {
+  for (int i = 0; i < LOG_REASON_COUNT; i++) {
+    if (log_reasons[i].granted == granted &&
+        strcmp(log_reasons[i].text, details) == 0)
+      return i;
+  }
+  return granted ? LOG_OTHER_GRANTED : LOG_OTHER_DENIED;
+}
+
+// Log reference for a name: the active user holding it, else the newest
+// record with it, else a fixed sender
+static uint8_t log_user_of(const char *name) {
+  int found = -1;
+  for (int i = 0; i < MAX_USERS; i++) {
+    const user_t *u = &sys_data.users[i];
+    if (!user_live(u) || strcmp(data_manager_user_name(u), name) != 0)
+      continue;
+    if (u->active)
+      return i;
+    if (found < 0 || u->version > sys_data.users[found].version)
+      found = i;
+  }
+  if (found >= 0)
+    return found;
+  if (strcmp(name, "System") == 0)
+    return LOG_USER_SYSTEM;
+  if (strcmp(name, "MQTT") == 0)
+    return LOG_USER_MQTT;
+  return LOG_USER_UNKNOWN;
+}
+
+static void data_reset(void) {
+  memset(&sys_data, 0, sizeof(system_data_t));
+  sys_data.magic = DATA_MAGIC;
+}
+
+static void read_legacy_user(int version, int i, user_v2_t *out) {
+  memset(out, 0, sizeof(*out));
+  if (version == 2) {
+    storage_read(STORAGE_USERS, DATA_KEY, i * sizeof(*out), out, sizeof(*out));
+    return;
+  }
+  user_v1_t old;
+  if (storage_read(STORAGE_USERS, DATA_KEY, i * sizeof(old), &old,
+                   sizeof(old)) != sizeof(old))
+    return;
+  memcpy(out->name, old.name, NAME_LENGTH);
+  memcpy(out->pin, old.pin, sizeof(old.pin));
+  out->type = old.type;
+  out->version = old.version;
+  out->expiry_date = old.expiry_date;
+  out->access_count_remaining = old.access_count_remaining;
+  out->active = old.active;
+  out->gate_mask = old.gate_mask;
+  out->start_time = old.start_time;
+  out->end_time = old.end_time;
+  out->allowed_days = old.allowed_days;
+  out->created = old.created;
+}
+
+static bool migrate_legacy(int version) {
+  data_reset();
+  ring_reset();
+  for (int i = 0; i < MAX_USERS; i++) {
+    user_v2_t old;
+    read_legacy_user(version, i, &old);
+    old.name[NAME_LENGTH - 1] = 0;
+    old.pin[PIN_LENGTH - 1] = 0;
+    user_t *u = &sys_data.users[i];
+    if (!old.active && !old.created)
+      continue;
+    // Name first, while the record does not count as holding one
+    if (!data_manager_set_user_name(u, old.name)) {
+      ESP_LOGE(TAG, "Dropping user %s in migration", old.name);
+      continue;
+    }
+    memcpy(u->pin, old.pin, PIN_LENGTH);
+    u->type = old.type;
+    u->active = old.active;
+    u->gate_mask = old.gate_mask;
+    u->use_limit = old.access_count_remaining < 0 ? 0
+                   : old.access_count_remaining > USER_MAX_COUNT
+                       ? USER_MAX_COUNT
+                       : old.access_count_remaining;
+    data_manager_count_uses(u);
+    u->start_time = old.start_time;
+    u->end_time = old.end_time;
+    u->allowed_days = old.allowed_days;
+    u->expiry_date = old.expiry_date < 0 ? 0 : (uint32_t)old.expiry_date;
+    u->version = old.version;
+    u->created = old.created;
+    sys_data.user_count += u->active;
+  }
+
+  size_t logs_off = version == 1 ? offsetof(system_data_v1_t, logs)
+                                 : offsetof(system_data_v2_t, logs);
+  size_t head_off = version == 1 ? offsetof(system_data_v1_t, log_head)
+                                 : offsetof(system_data_v2_t, log_head);
+  for (int i = 0; i < MAX_LOGS; i++) {
+    access_log_v2_t old;
+    if (storage_read(STORAGE_USERS, DATA_KEY, logs_off + i * sizeof(old), &old,
+                     sizeof(old)) != sizeof(old) ||
+        old.timestamp == 0)
+      continue;
+    old.user_name[NAME_LENGTH - 1] = 0;
+    old.details[sizeof(old.details) - 1] = 0;
+    access_log_t *l = &recent.entries[i];
+    l->timestamp = (uint32_t)old.timestamp;
+    l->reason = log_reason_of(old.granted, old.details);
+    l->user = log_user_of(old.user_name);
+    if (l->user < MAX_USERS)
+      l->user_tag = (uint16_t)sys_data.users[l->user].created;
+  }
+  int head = 0;
+  storage_read(STORAGE_USERS, DATA_KEY, head_off, &head, sizeof(head));
+  ring_from_slots(head >= 0 && head < MAX_LOGS ? head : 0);
+  return true;
+}
+
+// Version 3 or 4: the same records, less the per-node use counts
+static bool migrate_v4(int version) {
+  data_reset();
+  ring_reset();
+  uint32_t magic = 0;
+  storage_read(STORAGE_USERS, DATA_KEY, 0, &magic, sizeof(magic));
+  if (magic != (version == 3 ? DATA_MAGIC_V3 : DATA_MAGIC_V4))
+    return false;
+  const struct {
+    size_t off;
+    void *dst;
+    size_t len;
+  } parts[] = {
+      {version == 3 ? offsetof(system_data_v3_t, names_used)
+                    : offsetof(system_data_v4_t, names_used),
+       &sys_data.names_used, sizeof(sys_data.names_used)},
+      {version == 3 ? offsetof(system_data_v3_t, user_count)
+                    : offsetof(system_data_v4_t, user_count),
+       &sys_data.user_count, sizeof(sys_data.user_count)},
+      {version == 3 ? offsetof(system_data_v3_t, names)
+                    : offsetof(system_data_v4_t, names),
+       sys_data.names, sizeof(sys_data.names)},
+      {offsetof(system_data_v3_t, logs), recent.entries, sizeof(recent.entries)},
+      {offsetof(system_data_v3_t, log_head), &recent.head, sizeof(recent.head)},
+  };
+  size_t part_count = sizeof(parts) / sizeof(parts[0]) - (version == 3 ? 0 : 2);
+  for (size_t i = 0; i < part_count; i++) {
+    if (storage_read(STORAGE_USERS, DATA_KEY, parts[i].off, parts[i].dst,
+                     parts[i].len) != (int)parts[i].len)
+      return false;
+  }
+  for (int i = 0; i < MAX_USERS; i++) {
+    user_v4_t old;
+    if (storage_read(STORAGE_USERS, DATA_KEY,
+                     offsetof(system_data_v4_t, users) + i * sizeof(old), &old,
+                     sizeof(old)) != sizeof(old))
+      return false;
+    user_t *u = &sys_data.users[i];
+    memcpy(u->pin, old.pin, PIN_LENGTH);
+    u->type = old.type;
+    u->active = old.active;
+    u->gate_mask = old.gate_mask;
+    u->start_time = old.start_time;
+    u->end_time = old.end_time;
+    u->allowed_days = old.allowed_days;
+    u->name_off = old.name_off;
+    u->expiry_date = old.expiry_date;
+    u->version = old.version;
+    u->created = old.created;
+    // What remained becomes the whole limit, with nothing spent yet
+    u->use_limit = old.access_count_remaining > 0 ? old.access_count_remaining
+                                                  : 0;
+    data_manager_count_uses(u);
+  }
+  if (version == 3)
+    ring_from_slots(recent.head < MAX_LOGS ? recent.head : 0);
+  return sys_data.names_used <= NAME_POOL_SIZE;
+}
+
+#ifndef ARDUINO
+// Queued events and the sweep write to flash, too slow for the PIN check and
+// for the esp_timer task that also ends gate pulses: both only wake this task
+static TaskHandle_t writer_task = NULL;
+
+static void writer_task_fn(void *arg) {
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    PROFILE("event flush", data_manager_flush_events());
+    PROFILE("user sweep", data_manager_sweep());
+  }
+}
+
+static void sweep_timer_cb(void *arg) { xTaskNotifyGive(writer_task); }
+#endif
+
+void data_manager_init(void) {
+  ESP_LOGI(TAG, "Initializing Data Manager...");
+#ifndef ARDUINO
+  write_lock = xSemaphoreCreateRecursiveMutex();
+#endif
+
+  save_count = metrics_counter("data_save_total", "User table saves", NULL);
+  save_bytes = metrics_counter("data_save_bytes_total",
+                               "Bytes written by user table saves", NULL);
+  save_duration = metrics_histogram("data_save_duration_seconds",
+                                    "User table save latency", NULL);
+  log_write_duration = metrics_histogram("access_log_write_duration_seconds",
+                                         "Access history append latency",
+                                         NULL);
+  expired_removed = metrics_counter("users_expired_removed_total",
+                                    "Expired users freed by the sweeper",
+                                    NULL);
+
+  history_init();
+  access_stats_init();
+
+  // Set defaults
+  data_reset();
+  ring_load();
+
+  // Try loading the last snapshot
+  int size = storage_size(STORAGE_USERS, DATA_KEY);
+  int legacy = size == sizeof(system_data_v1_t)   ? 1
+               : size == sizeof(system_data_v2_t) ? 2
+               : size == sizeof(system_data_v3_t) ? 3
+               : size == sizeof(system_data_v4_t) ? 4
+                                                  : 0;
+  if (size < 0) {
+    ESP_LOGW(TAG, "No data file found, creating new one");
+    data_manager_save();
+  } else if (legacy) {
+    if (legacy >= 3 ? migrate_v4(legacy) : migrate_legacy(legacy)) {
+      ESP_LOGI(TAG, "Data migrated from layout %d (%d -> %d bytes)", legacy,
+               size, (int)sizeof(system_data_t));
+    } else {
+      ESP_LOGE(TAG, "Data migration failed. Starting empty");
+      data_reset();
+      ring_reset();
+    }
+    ring_persist(-1);
+    data_manager_save();
+  } else if (size != sizeof(system_data_t) ||
+             storage_read(STORAGE_USERS, DATA_KEY, 0, &sys_data,
+                          sizeof(system_data_t)) != size ||
+             sys_data.magic != DATA_MAGIC ||
+             sys_data.names_used > NAME_POOL_SIZE) {
+    ESP_LOGE(TAG, "Data file has %d bytes, expected %d. Starting empty", size,
+             (int)sizeof(system_data_t));
+    data_reset();
+  } else {
+    sys_data.names[NAME_POOL_SIZE - 1] = 0;
+    ESP_LOGI(TAG, "Data loaded. Users: %d", sys_data.user_count);
+  }
+  data_manager_reindex();
+  pin_alloc_init(PIN_DIGITS);
+
+#ifndef ARDUINO
+  xTaskCreate(writer_task_fn, "data_writer", 4096, NULL, tskIDLE_PRIORITY + 1,
+              &writer_task);
+  static esp_timer_handle_t sweep_timer = NULL;
+  esp_timer_create_args_t args = {.callback = sweep_timer_cb,
+                                  .name = "user_sweep"};
+  esp_timer_create(&args, &sweep_timer);
+  esp_timer_start_periodic(sweep_timer,
+                           EXPIRY_SWEEP_INTERVAL_SEC * 1000000ULL);
+#endif
+}
+
+void data_manager_save(void) {
+  WRITE_LOCK();
+  profiler_enter("data save");
+  uint32_t start = metrics_now_us();
+  bool ok = storage_write(STORAGE_USERS, DATA_KEY, &sys_data,
+                          sizeof(system_data_t));
+  metrics_observe_us(save_duration, metrics_now_us() - start);
+  metrics_inc(save_count);
+  if (ok) {
+    metrics_add(save_bytes, sizeof(system_data_t));
+    access_stats_save();
+    ESP_LOGI(TAG, "Data saved");
+  } else {
+    ESP_LOGE(TAG, "Failed to write data file");
+  }
+  profiler_exit();
+  WRITE_UNLOCK();
+}
+
+char *data_manager_generate_pin(void) {
+  static char pin_buf[PIN_LENGTH];
+  return pin_alloc_next(pin_buf, sizeof(pin_buf), pin_in_use) ? pin_buf : NULL;
+}
+
+int data_manager_free_slot(void) {
   int slot = -1;
   for (int i = 0; i < MAX_USERS; i++) {
-    if (!sys_data.users[i].active) {
+    const user_t *u = &sys_data.users[i];
+    if (u->active)
+      continue;
+    if (u->created == 0)
+      return i;
+    if (slot < 0 || u->version < sys_data.users[slot].version)
       slot = i;
-      break;
+  }
+  return slot;
+}
+
+static uint64_t uses_spent(const user_t *u) {
+  uint64_t spent = 0;
+  for (int i = 0; i < USER_USE_NODES; i++)
+    spent += u->uses[i].count;
+  return spent;
+}
+
+void data_manager_count_uses(user_t *u) {
+  int64_t left = u->uses_lost ? 0 : (int64_t)u->use_limit - uses_spent(u);
+  u->access_count_remaining = left < 0               ? 0
+                              : left > USER_MAX_COUNT ? USER_MAX_COUNT
+                                                      : left;
+}
+
+// Takes the larger of each node's spent uses. A node that does not fit loses
+// the record every remaining use, rather than letting its uses go uncounted.
+void data_manager_merge_uses(user_t *dst, const user_t *src) {
+  for (int i = 0; i < USER_USE_NODES; i++) {
+    const user_uses_t *e = &src->uses[i];
+    if (!e->count)
+      continue;
+    user_uses_t *slot = NULL;
+    for (int j = 0; j < USER_USE_NODES; j++) {
+      if (dst->uses[j].node == e->node) {
+        slot = &dst->uses[j];
+        break;
+      }
+      if (!slot && !dst->uses[j].count)
+        slot = &dst->uses[j];
+    }
+    if (!slot) {
+      dst->uses_lost = true;
+      continue;
     }
+    if (!slot->count || slot->count < e->count)
+      *slot = *e;
   }
+  dst->uses_lost = dst->uses_lost || src->uses_lost;
+  data_manager_count_uses(dst);
+}
 
-  if (slot == -1) {
-    ESP_LOGE(TAG, "User list full");
-    return false;
+void data_manager_store_user(user_t *slot, const user_t *u) {
+  SPIN_LOCK();
+  user_t next = *u;
+  if (slot->created == u->created)
+    data_manager_merge_uses(&next, slot);
+  *slot = next;
+  SPIN_UNLOCK();
+}
+
+// Adds a use to this node's count. False when every entry belongs to
+// another node, and the use cannot be accounted for.
+static bool spend_use(user_t *u) {
+  uint32_t node = repl_node_id();
+  user_uses_t *entry = NULL;
+  for (int i = 0; i < USER_USE_NODES; i++) {
+    if (u->uses[i].node == node) {
+      entry = &u->uses[i];
+      break;
+    }
+    if (!entry && !u->uses[i].count)
+      entry = &u->uses[i];
   }
+  if (!entry)
+    return false;
+  entry->node = node;
+  entry->count++;
+  data_manager_count_uses(u);
+  return true;
+}
 
-  user_t *u = &sys_data.users[slot];
-  strncpy(u->name, name, NAME_LENGTH - 1);
-  strcpy(u->pin, data_manager_generate_pin());
-  u->type = type;
-  u->active = true;
+void data_manager_user_changed(user_t *u) {
+  WRITE_LOCK();
+  repl_user_changed(u);
+  data_manager_reindex();
+  data_manager_save();
+  WRITE_UNLOCK();
+}
 
-  // Set limits
+// Arms the record's limit for type. Left alone when neither the type nor
+// the limit is new.
+static void apply_limit(user_t *u, user_type_t type, int limit,
+                        uint32_t expiry, bool has_limit) {
+  bool changed = u->type != type;
+  u->type = type;
   if (type == USER_TYPE_DATE_LIMIT) {
-    // limit is days from now
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    u->expiry_date = tv.tv_sec + (limit * 24 * 3600);
+    if (expiry) {
+      u->expiry_date = expiry;
+    } else if (has_limit || changed) {
+      // limit is days from now
+      struct timeval tv;
+      gettimeofday(&tv, NULL);
+      u->expiry_date = tv.tv_sec + (limit * 24 * 3600);
+    }
   } else if (type == USER_TYPE_COUNT_LIMIT || type == USER_TYPE_ONE_TIME) {
-    u->access_count_remaining = (type == USER_TYPE_ONE_TIME) ? 1 : limit;
+    if (!has_limit && !changed)
+      return;
+    if (limit > USER_MAX_COUNT)
+      limit = USER_MAX_COUNT;
+    if (limit < 0)
+      limit = 0;
+    // Spent uses only ever grow, so the limit moves past them
+    SPIN_LOCK();
+    u->use_limit = uses_spent(u) + (type == USER_TYPE_ONE_TIME ? 1 : limit);
+    data_manager_count_uses(u);
+    SPIN_UNLOCK();
+    u->expiry_date = 0; // Stamped again when the last use is spent
   }
+}
+
+static void apply_fields(user_t *u, const user_fields_t *f, uint32_t fields) {
+  if (fields & (USER_FIELD_TYPE | USER_FIELD_LIMIT))
+    apply_limit(u, fields & USER_FIELD_TYPE ? f->type : (user_type_t)u->type,
+                f->limit, f->expiry, fields & USER_FIELD_LIMIT);
+  if (fields & USER_FIELD_START)
+    u->start_time = f->start_time;
+  if (fields & USER_FIELD_END)
+    u->end_time = f->end_time;
+  if (fields & USER_FIELD_DAYS)
+    u->allowed_days = f->allowed_days;
+  if (fields & USER_FIELD_GATES)
+    u->gate_mask = f->gate_mask;
+}
 
+// Writes a whole new record and saves once; returns its slot or -1
+static int create_user(const user_fields_t *f) {
+  int slot = data_manager_free_slot();
+  if (slot == -1) {
+    ESP_LOGE(TAG, "User list full");
+    return -1;
+  }
+
+  const char *pin = data_manager_generate_pin();
+  if (!pin)
+    return -1;
+
+  // Built aside so a full name pool leaves the slot's old record intact
+  user_t rec = {};
+  if (!data_manager_set_user_name(&rec, f->name))
+    return -1;
+  strcpy(rec.pin, pin);
+  rec.active = true;
+  apply_limit(&rec, f->type, f->limit, f->expiry, true);
+  apply_fields(&rec, f, USER_FIELD_ALL & ~(USER_FIELD_TYPE | USER_FIELD_LIMIT));
+
+  user_t *u = &sys_data.users[slot];
+  if (u->created)
+    repl_tombstone_dropped(u);
+  *u = rec;
   sys_data.user_count++;
-  data_manager_save();
-  ESP_LOGI(TAG, "User added: %s (PIN: %s)", u->name, u->pin);
-  return true;
+  data_manager_user_changed(u);
+  ESP_LOGI(TAG, "User added: %s (PIN: %s)", f->name, u->pin);
+  return slot;
 }
 
-bool data_manager_delete_user(const char *pin) {
-  for (int i = 0; i < MAX_USERS; i++) {
-    if (sys_data.users[i].active && strcmp(sys_data.users[i].pin, pin) == 0) {
-      sys_data.users[i].active = false;
-      sys_data.user_count--;
-      data_manager_save();
-      return true;
+bool data_manager_add_user(const char *name, user_type_t type, int limit) {
+  user_fields_t f = {};
+  f.name = name;
+  f.type = type;
+  f.limit = limit;
+  WRITE_LOCK();
+  bool ok = create_user(&f) >= 0;
+  WRITE_UNLOCK();
+  return ok;
+}
+
+user_id_t data_manager_user_id(int slot, const user_t *u) {
+  return ((user_id_t)u->created << 8) | (uint8_t)slot;
+}
+
+// Slot of the live record with this id, or -1
+static int id_lookup(user_id_t id) {
+  uint32_t slot = id & 0xFF;
+  if (slot >= MAX_USERS || (id >> 8) > UINT32_MAX)
+    return -1;
+  const user_t *u = &sys_data.users[slot];
+  return u->active && u->created == (uint32_t)(id >> 8) ? (int)slot : -1;
+}
+
+bool data_manager_create_user(const user_fields_t *f, user_id_t *id_out,
+                              char *pin_out) {
+  WRITE_LOCK();
+  int slot = create_user(f);
+  if (slot >= 0) {
+    if (id_out)
+      *id_out = data_manager_user_id(slot, &sys_data.users[slot]);
+    if (pin_out)
+      strcpy(pin_out, sys_data.users[slot].pin);
+  }
+  WRITE_UNLOCK();
+  return slot >= 0;
+}
+
+bool data_manager_update_user(user_id_t id, const user_fields_t *f,
+                              uint32_t fields) {
+  WRITE_LOCK();
+  int slot = id_lookup(id);
+  bool ok = slot >= 0;
+  if (ok) {
+    user_t *u = &sys_data.users[slot];
+    // The name is the only part that can fail; set it before the rest
+    if (fields & USER_FIELD_NAME)
+      ok = data_manager_set_user_name(u, f->name);
+    if (ok) {
+      apply_fields(u, f, fields);
+      data_manager_user_changed(u);
     }
   }
-  return false;
+  WRITE_UNLOCK();
+  return ok;
 }
 
-// Brute Force Protection
+static void delete_slot(int slot) {
+  sys_data.users[slot].active = false;
+  sys_data.user_count--;
+  data_manager_user_changed(&sys_data.users[slot]);
+}
+
+bool data_manager_delete_user_id(user_id_t id) {
+  WRITE_LOCK();
+  int slot = id_lookup(id);
+  if (slot >= 0)
+    delete_slot(slot);
+  WRITE_UNLOCK();
+  return slot >= 0;
+}
+
+void data_manager_sweep(void) {
+  static uint32_t last_sweep = 0;
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  // Expiry times mean nothing until the clock is set
+  if (tv.tv_sec < CLOCK_VALID_AFTER ||
+      (last_sweep && tv.tv_sec - last_sweep < EXPIRY_SWEEP_INTERVAL_SEC))
+    return;
+  last_sweep = tv.tv_sec;
+
+  WRITE_LOCK();
+  int freed = 0;
+  while (expiry_count > 0 && freed < EXPIRY_SWEEP_BATCH) {
+    int slot = expiry_heap[0];
+    user_t *u = &sys_data.users[slot];
+    if ((int64_t)u->expiry_date + USER_EXPIRY_RETAIN_DAYS * 86400LL >=
+        tv.tv_sec)
+      break;
+    // The history keeps the record's name after the slot is reused
+    ESP_LOGI(TAG, "Removing expired user %s", data_manager_user_name(u));
+    log_event(slot, LOG_EXPIRED_REMOVED);
+    u->active = false;
+    sys_data.user_count--;
+    repl_user_changed(u);
+    expiry_pop();
+    freed++;
+  }
+  if (freed) {
+    metrics_add(expired_removed, freed);
+    data_manager_reindex();
+    data_manager_save();
+  }
+  WRITE_UNLOCK();
+}
+
+bool data_manager_delete_user(const char *pin) {
+  WRITE_LOCK();
+  int slot = pin_lookup(pin);
+  bool ok = slot >= 0 && sys_data.users[slot].active;
+  if (ok)
+    delete_slot(slot);
+  WRITE_UNLOCK();
+  return ok;
+}
+
+// Brute Force Protection. Changed under the spin lock and read without it,
+// hence 32-bit.
 static int failed_attempts = 0;
-static int64_t lockout_timestamp = 0;
+static volatile uint32_t lockout_timestamp = 0;
 #define MAX_FAILED_ATTEMPTS 5
 #define LOCKOUT_DURATION_SEC 300 // 5 minutes
 
-bool data_manager_validate_pin(const char *pin, char *user_name_out) {
+// Takes one use from the live record in slot if it is still the one rec was
+// copied from and has one left. Check and spend happen under the spin lock,
+// so two keypads cannot both spend the last use; the rest is left to the
+// writer through the granted event.
+static bool consume_use(int slot, const user_t *rec) {
+  SPIN_LOCK();
+  user_t *u = &sys_data.users[slot];
+  bool ok = u->active && u->created == rec->created &&
+            strcmp(u->pin, rec->pin) == 0 && u->access_count_remaining > 0 &&
+            spend_use(u);
+  SPIN_UNLOCK();
+  return ok;
+}
+
+// The writer's half of a use spent by the PIN check. Called with the lock;
+// true when the record changed.
+static bool finish_use(int slot, uint32_t created, uint32_t now) {
+  user_t *u = &sys_data.users[slot];
+  if (u->created != created)
+    return false; // Replaced since; the use went with the old record
+  if (u->access_count_remaining == 0) {
+    if (u->type == USER_TYPE_COUNT_LIMIT)
+      u->expiry_date = now; // Unused by count limits; starts the sweep delay
+
+    // If One-Time and used, deactivate immediately (user request:
+    // "Auto-delete")
+    if (u->type == USER_TYPE_ONE_TIME && u->active) {
+      ESP_LOGI(TAG, "OTP User %s used. Deactivating.",
+               data_manager_user_name(u));
+      u->active = false;
+      sys_data.user_count--;
+    }
+  }
+  repl_user_changed(u); // Replicas must see the use too
+  return true;
+}
+
+bool data_manager_validate_pin(const char *pin, int gate, char *user_name_out,
+                               uint8_t *gates_out) {
   struct timeval tv;
   gettimeofday(&tv, NULL);
 
   // Check if locked out
-  if (lockout_timestamp > 0) {
-    if (tv.tv_sec < lockout_timestamp) {
+  uint32_t until = lockout_timestamp;
+  if (until > 0) {
+    if (tv.tv_sec < until) {
       ESP_LOGW(TAG, "System Locked Out. Wait %lld seconds.",
-               lockout_timestamp - tv.tv_sec);
+               (long long)(until - tv.tv_sec));
       return false;
-    } else {
+    }
+    SPIN_LOCK();
+    bool expired = lockout_timestamp == until;
+    if (expired) {
       // Lockout expired
       lockout_timestamp = 0;
       failed_attempts = 0;
-      ESP_LOGI(TAG, "Lockout expired. System unlocked.");
     }
+    SPIN_UNLOCK();
+    if (expired)
+      ESP_LOGI(TAG, "Lockout expired. System unlocked.");
   }
 
-  for (int i = 0; i < MAX_USERS; i++) {
-    user_t *u = &sys_data.users[i];
-    if (u->active && strcmp(u->pin, pin) == 0) {
-      // Check limits
-      if (u->type == USER_TYPE_DATE_LIMIT) {
-        if (tv.tv_sec > u->expiry_date) {
-          ESP_LOGW(TAG, "User %s expired", u->name);
-          data_manager_log_access(u->name, false, "Expired (Time)");
-          return false;
-        }
-      } else if (u->type == USER_TYPE_COUNT_LIMIT ||
-                 u->type == USER_TYPE_ONE_TIME) {
-        if (u->access_count_remaining <= 0) {
-          ESP_LOGW(TAG, "User %s expired (count)", u->name);
-          data_manager_log_access(u->name, false, "Expired (Count)");
-          return false;
-        }
-        // Decrement count
-        u->access_count_remaining--;
-
-        // If One-Time and used, deactivate immediately (user request:
-        // "Auto-delete")
-        if (u->type == USER_TYPE_ONE_TIME && u->access_count_remaining == 0) {
-          ESP_LOGI(TAG, "OTP User %s used. Deactivating.", u->name);
-          u->active = false;
-          sys_data.user_count--;
-        }
-        data_manager_save(); // Update state
+  // Copy the record out of the published table; the checks below run on
+  // the copy without holding anything
+  user_t rec;
+  char name[NAME_LENGTH];
+  const user_snapshot_t *snap = data_manager_snapshot_acquire();
+  int slot = index_lookup(snap->index, snap->data, pin);
+  bool found = slot >= 0 && snap->data->users[slot].active;
+  if (found) {
+    rec = snap->data->users[slot];
+    snprintf(name, sizeof(name), "%s", data_manager_snapshot_name(snap, &rec));
+  }
+  data_manager_snapshot_release(snap);
+
+  if (found) {
+    const user_t *u = &rec;
+    // Check the gate first so a denied gate does not use up a count. The
+    // PIN itself was right, so this is not a failed attempt.
+    uint8_t allowed = u->gate_mask ? u->gate_mask : GATE_MASK_ALL;
+    if (gate != GATE_ANY && (gate < 0 || gate >= MAX_GATES ||
+                             !((allowed >> gate) & 1))) {
+      ESP_LOGW(TAG, "User %s denied (Gate %d)", name, gate);
+      log_event_as(slot, u->created, name, LOG_DENIED_GATE, NULL);
+      return false;
+    }
+
+    // Check limits
+    bool counted = u->type == USER_TYPE_COUNT_LIMIT ||
+                   u->type == USER_TYPE_ONE_TIME;
+    if (u->type == USER_TYPE_DATE_LIMIT) {
+      if (tv.tv_sec > u->expiry_date) {
+        ESP_LOGW(TAG, "User %s expired", name);
+        log_event_as(slot, u->created, name, LOG_EXPIRED_TIME, NULL);
+        return false;
       }
+    } else if (counted && u->access_count_remaining <= 0) {
+      ESP_LOGW(TAG, "User %s expired (count)", name);
+      log_event_as(slot, u->created, name, LOG_EXPIRED_COUNT, NULL);
+      return false;
+    }
+
+    // Check Schedule
+    // Convert struct timeval to tm; localtime_r as other tasks call in too
+    time_t now = tv.tv_sec;
+    struct tm local;
+    struct tm *timeinfo = localtime_r(&now, &local);
 
-      // Check Schedule
-      // Convert struct timeval to tm
-      time_t now = tv.tv_sec;
-      struct tm *timeinfo = localtime(&now);
-
-      // Check Days (Bit 0 = Sun)
-      // allowed_days: 0 means no restriction? Or 0 means NO access?
-      // Let's assume default (from invalid init) might be 0.
-      // If we want 0 to mean "All Days" we need to handle it.
-      // But if we initialize to 0xFF or 0x7F it's better.
-      // Let's assume if it is NOT 0, we check. If 0, maybe we block or assume
-      // all? Strict security: 0 = NO access. But legacy users have 0. Since we
-      // use memset 0, logic should probably treat 0 as "All Access" for
-      // backward compatibility OR we must migrate data. Let's treat 0 as
-      // "Access All Days" for now to avoid breaking existing users.
-      if (u->allowed_days != 0) {
-        if (!((u->allowed_days >> timeinfo->tm_wday) & 1)) {
-          ESP_LOGW(TAG, "User %s denied (Day Restriction)", u->name);
-          data_manager_log_access(u->name, false, "Denied (Schedule Day)");
-          return false;
-        }
+    // Check Days (Bit 0 = Sun)
+    // allowed_days: 0 means no restriction? Or 0 means NO access?
+    // Let's assume default (from invalid init) might be 0.
+    // If we want 0 to mean "All Days" we need to handle it.
+    // But if we initialize to 0xFF or 0x7F it's better.
+    // Let's assume if it is NOT 0, we check. If 0, maybe we block or assume
+    // all? Strict security: 0 = NO access. But legacy users have 0. Since we
+    // use memset 0, logic should probably treat 0 as "All Access" for
+    // backward compatibility OR we must migrate data. Let's treat 0 as
+    // "Access All Days" for now to avoid breaking existing users.
+    if (u->allowed_days != 0) {
+      if (!((u->allowed_days >> timeinfo->tm_wday) & 1)) {
+        ESP_LOGW(TAG, "User %s denied (Day Restriction)", name);
+        log_event_as(slot, u->created, name, LOG_DENIED_DAY, NULL);
+        return false;
       }
+    }
 
-      // Check Time Window
-      if (u->start_time != u->end_time) { // If equal, assume no restriction
-        uint16_t current_mins = timeinfo->tm_hour * 60 + timeinfo->tm_min;
-        bool in_window = false;
-        if (u->start_time < u->end_time) {
-          if (current_mins >= u->start_time && current_mins < u->end_time)
-            in_window = true;
-        } else {
-          // Crossover 24h (e.g. 23:00 to 02:00)
-          if (current_mins >= u->start_time || current_mins < u->end_time)
-            in_window = true;
-        }
-
-        if (!in_window) {
-          ESP_LOGW(TAG, "User %s denied (Time Restriction)", u->name);
-          data_manager_log_access(u->name, false, "Denied (Schedule Time)");
-          return false;
-        }
+    // Check Time Window
+    if (u->start_time != u->end_time) { // If equal, assume no restriction
+      uint16_t current_mins = timeinfo->tm_hour * 60 + timeinfo->tm_min;
+      bool in_window = false;
+      if (u->start_time < u->end_time) {
+        if (current_mins >= u->start_time && current_mins < u->end_time)
+          in_window = true;
+      } else {
+        // Crossover 24h (e.g. 23:00 to 02:00)
+        if (current_mins >= u->start_time || current_mins < u->end_time)
+          in_window = true;
       }
 
-      if (user_name_out)
-        strcpy(user_name_out, u->name);
-      data_manager_log_access(u->name, true, "Access Granted");
+      if (!in_window) {
+        ESP_LOGW(TAG, "User %s denied (Time Restriction)", name);
+        log_event_as(slot, u->created, name, LOG_DENIED_TIME, NULL);
+        return false;
+      }
+    }
 
-      // Reset failed attempts on success
-      failed_attempts = 0;
-      return true;
+    // Spend a use only once every other check has passed
+    if (counted && !consume_use(slot, u)) {
+      ESP_LOGW(TAG, "User %s expired (count)", name);
+      log_event_as(slot, u->created, name, LOG_EXPIRED_COUNT, NULL);
+      return false;
     }
+
+    if (user_name_out)
+      strcpy(user_name_out, name);
+    if (gates_out)
+      *gates_out = gate == GATE_ANY ? allowed : (uint8_t)(1 << gate);
+    // Reset failed attempts on success
+    SPIN_LOCK();
+    failed_attempts = 0;
+    SPIN_UNLOCK();
+    log_event_as(slot, u->created, name, LOG_GRANTED, counted ? u : NULL);
+    return true;
   }
 
   // Increment failed attempts
-  failed_attempts++;
-  ESP_LOGW(TAG, "Invalid PIN. Attempt %d/%d", failed_attempts,
-           MAX_FAILED_ATTEMPTS);
-
-  if (failed_attempts >= MAX_FAILED_ATTEMPTS) {
+  SPIN_LOCK();
+  int attempts = ++failed_attempts;
+  bool locked = attempts >= MAX_FAILED_ATTEMPTS;
+  if (locked)
     lockout_timestamp = tv.tv_sec + LOCKOUT_DURATION_SEC;
+  SPIN_UNLOCK();
+  ESP_LOGW(TAG, "Invalid PIN. Attempt %d/%d", attempts, MAX_FAILED_ATTEMPTS);
+
+  if (locked) {
     ESP_LOGE(TAG, "Multiple failures. System LOCKED for 5 minutes.");
-    data_manager_log_access("System", false, "Security Lockout");
+    log_event_as(LOG_USER_SYSTEM, 0, "System", LOG_LOCKOUT, NULL);
   } else {
-    data_manager_log_access("Unknown", false, "Invalid PIN");
+    log_event_as(LOG_USER_UNKNOWN, 0, "Unknown", LOG_INVALID_PIN, NULL);
   }
 
   return false;
 }
 
+int64_t data_manager_lockout_remaining(void) {
+  uint32_t until = lockout_timestamp;
+  if (until == 0)
+    return 0;
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec < until ? until - tv.tv_sec : 0;
+}
+
 // File Logging Helper
 void log_to_file(long timestamp, const char *user, bool granted,
                  const char *details) {
-#ifdef ARDUINO
-  // Check file size and rotate if needed
-  if (LittleFS.exists("/access.log")) {
-    File f_check = LittleFS.open("/access.log", "r");
-    if (f_check && f_check.size() > 50 * 1024) { // 50KB limit
-      f_check.close();
-      ESP_LOGI(TAG, "Log file full, rotating...");
-      LittleFS.remove("/access.log.bak");
-      LittleFS.rename("/access.log", "/access.log.bak");
-    } else {
-      if (f_check)
-        f_check.close();
-    }
+  uint32_t start = metrics_now_us();
+
+  // CSV Format: Timestamp,User,Granted,Details
+  char line[32 + NAME_LENGTH + 32];
+  int len = snprintf(line, sizeof(line), "%ld,%s,%d,%s\n", timestamp, user,
+                     granted, details);
+  if (len >= (int)sizeof(line))
+    len = sizeof(line) - 1;
+  if (!history_append(line, len))
+    ESP_LOGE(TAG, "Failed to write to access history");
+  metrics_observe_us(log_write_duration, metrics_now_us() - start);
+}
+
+static uint16_t log_user_tag(uint8_t user) {
+  return user < MAX_USERS ? (uint16_t)sys_data.users[user].created : 0;
+}
+
+static const char *log_user_name(uint8_t user, uint16_t tag) {
+  switch (user) {
+  case LOG_USER_UNKNOWN:
+    return "Unknown";
+  case LOG_USER_SYSTEM:
+    return "System";
+  case LOG_USER_MQTT:
+    return "MQTT";
   }
+  const user_t *u = user < MAX_USERS ? &sys_data.users[user] : NULL;
+  // The slot may have been reused since
+  if (!u || !user_live(u) || (uint16_t)u->created != tag)
+    return "(deleted)";
+  return data_manager_user_name(u);
+}
 
-  File f = LittleFS.open("/access.log", "a");
-  if (f) {
-    // CSV Format: Timestamp,User,Granted,Details
-    f.printf("%ld,%s,%d,%s\n", timestamp, user, granted, details);
-    f.close();
-  } else {
-    ESP_LOGE(TAG, "Failed to write to access.log");
+bool data_manager_log_entry(int n, access_log_view_t *out) {
+  WRITE_LOCK(); // The ring moves under events from other tasks
+  bool ok = n >= 0 && n < recent.count;
+  if (ok) {
+    const access_log_t *l =
+        &recent.entries[(recent.head + MAX_LOGS - 1 - n) % MAX_LOGS];
+    out->timestamp = l->timestamp;
+    out->user_name = log_user_name(l->user, l->user_tag);
+    out->granted = log_reasons[l->reason].granted;
+    out->details = log_reasons[l->reason].text;
   }
+  WRITE_UNLOCK();
+  return ok;
+}
 
-#else
-  // Check file size and rotate if needed
-  struct stat st;
-  if (stat("/spiffs/access.log", &st) == 0) {
-    if (st.st_size > 50 * 1024) { // 50KB limit
-      ESP_LOGI(TAG, "Log file full, rotating...");
-      unlink("/spiffs/access.log.bak");
-      rename("/spiffs/access.log", "/spiffs/access.log.bak");
+// Access events waiting for the writer. The PIN check and MQTT only queue
+// them, so the ring, statistics, history and the save after a spent use
+// never run on their path.
+#define EVENT_QUEUE_LEN 8
+#define EVENT_USER_BY_NAME 0xFC // Resolved from the name by the writer
+typedef struct {
+  uint32_t timestamp;
+  uint32_t created; // Of the record the use was spent on
+  bool spent;
+  uint16_t user_tag;
+  uint8_t user; // Slot, one of LOG_USER_*, or EVENT_USER_BY_NAME
+  uint8_t reason;
+  bool granted;
+  char name[NAME_LENGTH];
+  char details[32];
+} queued_event_t;
+
+static queued_event_t event_queue[EVENT_QUEUE_LEN];
+static uint8_t event_head = 0; // Oldest queued event
+static uint8_t event_count = 0;
+
+// Adds the event to the ring, statistics and history. True when it finished
+// a spent use, which leaves the table to save.
+static bool event_apply(const queued_event_t *e) {
+  WRITE_LOCK(); // Ring, statistics and records are shared by all tasks
+  bool changed = e->spent && finish_use(e->user, e->created, e->timestamp);
+  uint8_t user = e->user;
+  uint16_t tag = e->user_tag;
+  if (user == EVENT_USER_BY_NAME) {
+    user = log_user_of(e->name);
+    tag = log_user_tag(user);
+  }
+  int idx = recent.head;
+  access_log_t *l = &recent.entries[idx];
+
+  // Update RAM Buffer (for UI)
+  l->timestamp = e->timestamp;
+  l->reason = e->reason;
+  l->user = user;
+  l->user_tag = tag;
+
+  recent.head = (recent.head + 1) % MAX_LOGS;
+  if (recent.count < MAX_LOGS)
+    recent.count++;
+  ring_persist(idx);
+  access_stats_record(e->timestamp, user, tag, e->granted);
+  WRITE_UNLOCK();
+
+  // Persist to File (History), which has its own lock
+  log_to_file(e->timestamp, e->name, e->granted, e->details);
+  return changed;
+}
+
+void data_manager_flush_events(void) {
+  bool changed = false;
+  for (;;) {
+    queued_event_t e;
+    SPIN_LOCK();
+    bool any = event_count > 0;
+    if (any) {
+      e = event_queue[event_head];
+      event_head = (event_head + 1) % EVENT_QUEUE_LEN;
+      event_count--;
     }
+    SPIN_UNLOCK();
+    if (!any)
+      break;
+    changed |= event_apply(&e);
+  }
+  if (changed) {
+    WRITE_LOCK();
+    data_manager_reindex();
+    data_manager_save();
+    WRITE_UNLOCK();
   }
+}
 
-  FILE *f = fopen("/spiffs/access.log", "a");
-  if (f) {
-    // CSV Format: Timestamp,User,Granted,Details
-    fprintf(f, "%ld,%s,%d,%s\n", timestamp, user, granted, details);
-    fclose(f);
-  } else {
-    ESP_LOGE(TAG, "Failed to write to access.log");
+static void event_push(const queued_event_t *e) {
+  for (;;) {
+    SPIN_LOCK();
+    bool queued = event_count < EVENT_QUEUE_LEN;
+    if (queued) {
+      event_queue[(event_head + event_count) % EVENT_QUEUE_LEN] = *e;
+      event_count++;
+    }
+    SPIN_UNLOCK();
+    if (queued)
+      break;
+    // The writer has fallen behind: catch up here rather than drop events
+    data_manager_flush_events();
   }
+#ifndef ARDUINO
+  if (writer_task)
+    xTaskNotifyGive(writer_task);
 #endif
 }
 
-void data_manager_log_access(const char *name, bool granted,
-                             const char *details) {
-  int idx = sys_data.log_head;
+// Queues an event for a user whose name the caller already has. spent_on is
+// the record a use was just spent on, for the writer to finish.
+static void log_event_as(uint8_t user, uint16_t tag, const char *name,
+                         log_reason_t reason, const user_t *spent_on) {
   struct timeval tv;
   gettimeofday(&tv, NULL);
+  queued_event_t e;
+  e.timestamp = tv.tv_sec;
+  e.created = spent_on ? spent_on->created : 0;
+  e.spent = spent_on != NULL;
+  e.user_tag = tag;
+  e.user = user;
+  e.reason = reason;
+  e.granted = log_reasons[reason].granted;
+  snprintf(e.name, sizeof(e.name), "%s", name);
+  snprintf(e.details, sizeof(e.details), "%s", log_reasons[reason].text);
+  event_push(&e);
+}
 
-  // Update RAM Buffer (for UI)
-  sys_data.logs[idx].timestamp = tv.tv_sec;
-  strncpy(sys_data.logs[idx].user_name, name, NAME_LENGTH - 1);
-  sys_data.logs[idx].granted = granted;
-  strncpy(sys_data.logs[idx].details, details, 31);
-
-  sys_data.log_head = (sys_data.log_head + 1) % MAX_LOGS;
-
-  // Save RAM state (Users + Recent Logs)
-  data_manager_save();
+static void log_event(uint8_t user, log_reason_t reason) {
+  WRITE_LOCK(); // The name lives in the pool writers compact
+  uint16_t tag = log_user_tag(user);
+  log_event_as(user, tag, log_user_name(user, tag), reason, NULL);
+  WRITE_UNLOCK();
+}
 
-  // Persist to File (History)
-  log_to_file(tv.tv_sec, name, granted, details);
+void data_manager_log_access(const char *name, bool granted,
+                             const char *details) {
+  // History keeps the caller's wording; the ring stores a reason code
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  queued_event_t e;
+  e.timestamp = tv.tv_sec;
+  e.created = 0;
+  e.spent = false;
+  e.user_tag = 0;
+  e.user = EVENT_USER_BY_NAME;
+  e.reason = log_reason_of(granted, details);
+  e.granted = granted;
+  snprintf(e.name, sizeof(e.name), "%s", name);
+  snprintf(e.details, sizeof(e.details), "%s", details);
+  event_push(&e);
 }
 
 system_data_t *data_manager_get_data(void) { return &sys_data; }
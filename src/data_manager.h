@@ -6,7 +6,11 @@
 
 #define MAX_USERS 50
 #define MAX_LOGS 50
-#define PIN_LENGTH 5
+#ifndef PIN_DIGITS
+#define PIN_DIGITS 4 // Length of newly issued PINs, 4..8
+#endif
+#define PIN_MAX_DIGITS 8
+#define PIN_LENGTH (PIN_MAX_DIGITS + 1) // Older shorter PINs stay valid
 #define NAME_LENGTH 32
 
 typedef enum {
@@ -16,39 +20,195 @@ typedef enum {
     USER_TYPE_ONE_TIME = 3
 } user_type_t;
 
+// Uses of a count-limited record spent by one node. Replicas keep every
+// node's count and take the larger of two, so uses spent on nodes that could
+// not reach each other all add up once they do.
+#define USER_USE_NODES 4 // Nodes that can spend a record's uses
+typedef struct {
+    uint32_t node;  // repl_node_id() of the spender
+    uint32_t count; // 0 = free entry
+} user_uses_t;
+
+// Hot fields first: a PIN check touches only the first 24 bytes
 typedef struct {
-    char name[NAME_LENGTH];
     char pin[PIN_LENGTH];
-    user_type_t type;
-    int64_t expiry_date; // Unix timestamp
-    int access_count_remaining;
+    uint8_t type;         // user_type_t
     bool active;
-    uint16_t start_time; // Minutes from midnight
-    uint16_t end_time;   // Minutes from midnight
+    uint8_t gate_mask;    // Bitmask of gate ids, 0 = all gates
+    int16_t access_count_remaining; // use_limit less the spent uses
+    uint16_t start_time;  // Minutes from midnight
+    uint16_t end_time;    // Minutes from midnight
     uint8_t allowed_days; // Bitmask: 0=Sun, 6=Sat
+    uint16_t name_off;    // Into system_data_t.names
+    uint32_t expiry_date; // Unix timestamp
+    uint32_t version;     // Replication stamp of the last change, 0 = never
+    uint32_t created;     // Replication stamp of creation; kept on delete
+    uint32_t use_limit;   // Uses granted over every arming of the limit
+    user_uses_t uses[USER_USE_NODES];
+    bool uses_lost;       // More nodes spent uses than fit: none are left
 } user_t;
 
+#define USER_MAX_COUNT INT16_MAX // Largest count limit a record can hold
+
+// Date-limited users past expiry_date and count-limited users with no uses
+// left are freed by the sweeper this many days later. A count-limited
+// record's expiry_date holds the time its last use was spent.
+#ifndef USER_EXPIRY_RETAIN_DAYS
+#define USER_EXPIRY_RETAIN_DAYS 0
+#endif
+
+typedef enum {
+    LOG_GRANTED = 0,
+    LOG_REMOTE_OPEN,
+    LOG_INVALID_PIN,
+    LOG_LOCKOUT,
+    LOG_EXPIRED_TIME,
+    LOG_EXPIRED_COUNT,
+    LOG_DENIED_DAY,
+    LOG_DENIED_TIME,
+    LOG_DENIED_GATE,
+    LOG_OTHER_GRANTED,
+    LOG_OTHER_DENIED,
+    LOG_EXPIRED_REMOVED, // The sweeper freed the record's slot
+    LOG_REASON_COUNT
+} log_reason_t;
+
+// Log entries that are not a user's
+#define LOG_USER_UNKNOWN 0xFF
+#define LOG_USER_SYSTEM 0xFE
+#define LOG_USER_MQTT 0xFD
+
+typedef struct {
+    uint32_t timestamp;
+    uint8_t reason;    // log_reason_t
+    uint8_t user;      // Slot, or one of LOG_USER_*
+    uint16_t user_tag; // Low bits of the user's created stamp
+} access_log_t;
+
+// One log entry with its text resolved
 typedef struct {
     int64_t timestamp;
-    char user_name[NAME_LENGTH];
+    const char *user_name;
     bool granted;
-    char details[32]; // e.g., "Invalid PIN" or "Access Granted"
-} access_log_t;
+    const char *details; // e.g., "Invalid PIN" or "Access Granted"
+} access_log_view_t;
+
+#define DATA_MAGIC 0x35424447 // "GDB5"
+#define NAME_POOL_SIZE (MAX_USERS * 24) // Fits MAX_USERS names of 23 characters
 
 typedef struct {
+    uint32_t magic;
     user_t users[MAX_USERS];
-    access_log_t logs[MAX_LOGS];
-    int log_head; // Circular buffer index
-    int user_count;
+    uint16_t names_used;
+    uint8_t user_count;
+    char names[NAME_POOL_SIZE]; // NUL-terminated user names
 } system_data_t;
 
 void data_manager_init(void);
 void data_manager_save(void);
-bool data_manager_validate_pin(const char *pin, char *user_name_out);
+// gate is a gate id or GATE_ANY. On success gates_out receives the gates to
+// open: just that gate, or every gate the user may open.
+bool data_manager_validate_pin(const char *pin, int gate, char *user_name_out,
+                               uint8_t *gates_out);
+int64_t data_manager_lockout_remaining(void); // Seconds, 0 when not locked
 bool data_manager_add_user(const char *name, user_type_t type, int limit); // limit is either count or days
 bool data_manager_delete_user(const char *pin);
+
+// Stable user id: the record's creation stamp above its slot. It survives
+// edits, is never reused, finds the slot without a search and fits the
+// 53 bits a JSON number holds exactly.
+typedef uint64_t user_id_t;
+#define USER_ID_NONE 0
+
+// Full user record for create and update
+typedef struct {
+    const char *name;
+    user_type_t type;
+    int limit;       // Count, or days from now for USER_TYPE_DATE_LIMIT
+    uint32_t expiry; // Exact expiry for USER_TYPE_DATE_LIMIT, 0 = use limit
+    uint16_t start_time;
+    uint16_t end_time;
+    uint8_t allowed_days;
+    uint8_t gate_mask;
+} user_fields_t;
+
+// Members of user_fields_t an update applies. A new type or a limit re-arms
+// the record's limit from limit/expiry; send both when changing the type.
+enum {
+    USER_FIELD_NAME = 1 << 0,
+    USER_FIELD_TYPE = 1 << 1,
+    USER_FIELD_LIMIT = 1 << 2,
+    USER_FIELD_START = 1 << 3,
+    USER_FIELD_END = 1 << 4,
+    USER_FIELD_DAYS = 1 << 5,
+    USER_FIELD_GATES = 1 << 6,
+    USER_FIELD_ALL = 0x7F
+};
+
+// Each call applies the whole change and saves once. Create issues a new
+// PIN; id_out and pin_out (PIN_LENGTH bytes) may be NULL. Update keeps the
+// PIN. Both fail, changing nothing, when the table or name pool is full.
+bool data_manager_create_user(const user_fields_t *f, user_id_t *id_out,
+                              char *pin_out);
+bool data_manager_update_user(user_id_t id, const user_fields_t *f,
+                              uint32_t fields);
+bool data_manager_delete_user_id(user_id_t id);
+user_id_t data_manager_user_id(int slot, const user_t *u);
+// Writer lock. The calls above take it themselves; hold it while reading or
+// changing records through data_manager_get_data(). It nests.
+void data_manager_lock(void);
+void data_manager_unlock(void);
+// Call after changing a user record in place: stamps it for replication,
+// publishes the table to readers and saves
+void data_manager_user_changed(user_t *u);
+// Sets access_count_remaining from use_limit and the spent uses
+void data_manager_count_uses(user_t *u);
+// Adds src's spent uses to dst's, per node, and recounts dst
+void data_manager_merge_uses(user_t *dst, const user_t *src);
+// Writes u over a live record, keeping uses the PIN check spent on it since
+// u was copied out. Call with the writer lock.
+void data_manager_store_user(user_t *slot, const user_t *u);
+// Frees expired records, a few per call and at most once a minute. Call
+// from loop(); the ESP32 runs it from a timer.
+void data_manager_sweep(void);
+// Applies queued access events: ring, statistics, history and the save after
+// a spent use. Call from loop(); the ESP32 runs it from a writer task.
+void data_manager_flush_events(void);
+// Slot for a new record: never used first, then the oldest deleted one.
+// Call repl_tombstone_dropped() before overwriting a deleted one.
+int data_manager_free_slot(void);
+// Rebuilds the PIN lookup after records were written directly
+void data_manager_reindex(void);
 void data_manager_log_access(const char *name, bool granted, const char *details);
+// Recent access events, n = 0 is the newest; false past the oldest. The
+// strings stay valid until the table changes.
+bool data_manager_log_entry(int n, access_log_view_t *out);
+const char *data_manager_user_name(const user_t *u);
+// False when the name pool is full
+bool data_manager_set_user_name(user_t *u, const char *name);
+// Working table, for writers holding the lock
 system_data_t *data_manager_get_data(void);
+
+// Read-only view of the table as last published. Acquiring never blocks and
+// the view stays consistent until released, whatever writers do meanwhile.
+// Release promptly: a writer waits for the readers of the older copy.
+typedef struct user_snapshot user_snapshot_t;
+const user_snapshot_t *data_manager_snapshot_acquire(void);
+void data_manager_snapshot_release(const user_snapshot_t *s);
+const system_data_t *data_manager_snapshot_data(const user_snapshot_t *s);
+const char *data_manager_snapshot_name(const user_snapshot_t *s,
+                                       const user_t *u);
+uint32_t data_manager_snapshot_version(const user_snapshot_t *s);
+// Version of the table as last published; every change bumps it
+uint32_t data_manager_generation(void);
+// Active users in case-insensitive name order: the slot at position pos,
+// 0 <= pos < data_manager_snapshot_user_count()
+int data_manager_snapshot_user_count(const user_snapshot_t *s);
+int data_manager_snapshot_ordered(const user_snapshot_t *s, int pos);
+// Positions [*lo, *hi) of the names starting with prefix, ignoring case.
+// Binary search; an empty prefix gives every user.
+void data_manager_snapshot_prefix(const user_snapshot_t *s, const char *prefix,
+                                  int *lo, int *hi);
 char* data_manager_generate_pin(void);
 
 #endif // DATA_MANAGER_H
@@ -1,6 +0,0 @@
-#ifndef GATE_CONTROL_MAIN_H
-#define GATE_CONTROL_MAIN_H
-
-void trigger_relay(void);
-
-#endif // GATE_CONTROL_MAIN_H
@@ -0,0 +1,192 @@
+#include "gates.h"
+#include "logging_macros.h"
+#include "metrics.h"
+#include "storage.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include "driver/gpio.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#endif
+#include <string.h>
+
+static const char *TAG = "GATES";
+static const char *CONFIG_KEY = "gates";
+
+#if defined(ESP8266)
+#define GPIO_RELAY_1 4  // D2 (GPIO 4)
+#define GPIO_RELAY_2 14 // D5
+#else
+#define GPIO_RELAY_1 2  // D2 (GPIO 2)
+#define GPIO_RELAY_2 18 // D5 (GPIO 18)
+#endif
+
+#define DEFAULT_PULSE_MS 2000
+
+static gate_t gates[MAX_GATES];
+static metric_t *actuations[MAX_GATES];
+static const char *gate_labels[MAX_GATES] = {"gate=\"0\"", "gate=\"1\"",
+                                             "gate=\"2\"", "gate=\"3\""};
+
+#ifdef ARDUINO
+static uint32_t pulse_start[MAX_GATES];
+static bool pulse_active[MAX_GATES];
+#else
+static esp_timer_handle_t pulse_timers[MAX_GATES];
+#endif
+
+static void gate_write(int id, bool active) {
+  const gate_t *g = &gates[id];
+  if (g->gpio < 0)
+    return;
+  bool level = active == g->active_high;
+#ifdef ARDUINO
+  digitalWrite(g->gpio, level ? HIGH : LOW);
+#else
+  gpio_set_level((gpio_num_t)g->gpio, level ? 1 : 0);
+#endif
+}
+
+static void gate_setup_pin(int id) {
+  const gate_t *g = &gates[id];
+  if (g->gpio < 0)
+    return;
+#ifdef ARDUINO
+  pinMode(g->gpio, OUTPUT);
+#else
+  gpio_reset_pin((gpio_num_t)g->gpio);
+  gpio_set_direction((gpio_num_t)g->gpio, GPIO_MODE_OUTPUT);
+#endif
+  gate_write(id, false);
+}
+
+#ifndef ARDUINO
+static void pulse_end_cb(void *arg) { gate_write((int)(intptr_t)arg, false); }
+#endif
+
+static void gates_defaults(void) {
+  memset(gates, 0, sizeof(gates));
+  for (int i = 0; i < MAX_GATES; i++) {
+    gates[i].gpio = -1;
+    gates[i].pulse_ms = DEFAULT_PULSE_MS;
+  }
+  // Both relays used to pulse together as one gate. Opening "any gate"
+  // still drives both, so a fresh install behaves the same.
+  strcpy(gates[0].name, "Gate 1");
+  gates[0].gpio = GPIO_RELAY_1;
+  strcpy(gates[1].name, "Gate 2");
+  gates[1].gpio = GPIO_RELAY_2;
+}
+
+// Pins a relay may drive. GPIO 6-11 carry the SPI flash on both chips and
+// driving one crashes it; a saved table naming one would do so every boot.
+static bool gpio_valid(int gpio) {
+  if (gpio == -1)
+    return true; // Not fitted
+#ifdef ARDUINO
+  return (gpio >= 0 && gpio <= 5) || (gpio >= 12 && gpio <= 16);
+#else
+  // Also rules out the input-only pins, 34-39 on the ESP32
+  return (gpio < 6 || gpio > 11) && GPIO_IS_VALID_OUTPUT_GPIO(gpio);
+#endif
+}
+
+static bool gate_valid(const gate_t *g) {
+  return gpio_valid(g->gpio) && g->pulse_ms >= GATE_MIN_PULSE_MS &&
+         g->pulse_ms <= GATE_MAX_PULSE_MS && memchr(g->name, 0, sizeof(g->name));
+}
+
+void gates_init(void) {
+  int n = storage_read(STORAGE_CONFIG, CONFIG_KEY, 0, gates, sizeof(gates));
+  bool ok = n == sizeof(gates);
+  for (int i = 0; ok && i < MAX_GATES; i++)
+    ok = gate_valid(&gates[i]);
+  if (ok) {
+    ESP_LOGI(TAG, "Gate table loaded");
+  } else {
+    gates_defaults();
+    ESP_LOGW(TAG, "Gate table not found, using defaults");
+  }
+
+  for (int i = 0; i < MAX_GATES; i++) {
+    gate_setup_pin(i);
+#ifndef ARDUINO
+    esp_timer_create_args_t args = {.callback = pulse_end_cb,
+                                    .arg = (void *)(intptr_t)i,
+                                    .name = "gate_pulse"};
+    esp_timer_create(&args, &pulse_timers[i]);
+#endif
+    actuations[i] = metrics_counter("relay_actuations_total",
+                                    "Gate relay pulses", gate_labels[i]);
+    if (gates[i].gpio >= 0)
+      ESP_LOGI(TAG, "Gate %d '%s': GPIO %d, %u ms, active %s", i,
+               gates[i].name, gates[i].gpio, gates[i].pulse_ms,
+               gates[i].active_high ? "high" : "low");
+  }
+}
+
+void gates_loop(void) {
+#ifdef ARDUINO
+  uint32_t now = millis();
+  for (int i = 0; i < MAX_GATES; i++) {
+    if (pulse_active[i] && now - pulse_start[i] >= gates[i].pulse_ms) {
+      pulse_active[i] = false;
+      gate_write(i, false);
+    }
+  }
+#endif
+}
+
+const gate_t *gates_get(int id) {
+  return id >= 0 && id < MAX_GATES ? &gates[id] : NULL;
+}
+
+bool gates_configure(int id, const gate_t *gate) {
+  if (id < 0 || id >= MAX_GATES || !gate_valid(gate))
+    return false;
+  // Release the old pin before switching
+  gate_write(id, false);
+  gates[id] = *gate;
+  gate_setup_pin(id);
+  if (!storage_write(STORAGE_CONFIG, CONFIG_KEY, gates, sizeof(gates)))
+    ESP_LOGE(TAG, "Failed to save gate table");
+  ESP_LOGI(TAG, "Gate %d reconfigured", id);
+  return true;
+}
+
+uint8_t gates_fitted_mask(void) {
+  uint8_t mask = 0;
+  for (int i = 0; i < MAX_GATES; i++) {
+    if (gates[i].gpio >= 0)
+      mask |= 1 << i;
+  }
+  return mask;
+}
+
+bool gates_open(int id) {
+  if (id < 0 || id >= MAX_GATES || gates[id].gpio < 0)
+    return false;
+  ESP_LOGI(TAG, "Opening gate %d (%s) on GPIO %d", id, gates[id].name,
+           gates[id].gpio);
+  metrics_inc(actuations[id]);
+  gate_write(id, true);
+#ifdef ARDUINO
+  pulse_start[id] = millis();
+  pulse_active[id] = true;
+#else
+  esp_timer_stop(pulse_timers[id]); // Re-trigger extends the pulse
+  esp_timer_start_once(pulse_timers[id], (uint64_t)gates[id].pulse_ms * 1000);
+#endif
+  return true;
+}
+
+uint8_t gates_open_mask(uint8_t mask) {
+  uint8_t opened = 0;
+  for (int i = 0; i < MAX_GATES; i++) {
+    if ((mask >> i) & 1 && gates_open(i))
+      opened |= 1 << i;
+  }
+  return opened;
+}
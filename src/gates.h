@@ -0,0 +1,38 @@
+#ifndef GATES_H
+#define GATES_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Gate table. Each gate drives one relay channel with its own GPIO, pulse
+// length and active level; pulses run independently and never block.
+// The table is persisted in the STORAGE_CONFIG class.
+
+#define MAX_GATES 4 // Must fit user_t.gate_mask
+#define GATE_NAME_LENGTH 16
+#define GATE_ANY -1 // No gate given: every gate the user may open
+#define GATE_MASK_ALL ((uint8_t)((1 << MAX_GATES) - 1))
+
+#define GATE_MIN_PULSE_MS 50
+#define GATE_MAX_PULSE_MS 30000
+
+typedef struct {
+  char name[GATE_NAME_LENGTH];
+  int8_t gpio; // -1 when the gate is not fitted
+  bool active_high;
+  uint16_t pulse_ms;
+} gate_t;
+
+void gates_init(void);
+void gates_loop(void); // Ends pulses on the Arduino build
+
+const gate_t *gates_get(int id); // NULL when out of range
+bool gates_configure(int id, const gate_t *gate);
+uint8_t gates_fitted_mask(void);
+
+// Starts (or extends) a pulse. Returns false for an unfitted gate.
+bool gates_open(int id);
+// Opens every fitted gate in mask; returns the mask actually opened
+uint8_t gates_open_mask(uint8_t mask);
+
+#endif // GATES_H
@@ -0,0 +1,389 @@
+#include "gzip_stream.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define GZ_HASH_SIZE (1 << GZ_HASH_BITS)
+#define GZ_MIN_MATCH 3
+#define GZ_MAX_MATCH 258
+#define GZ_MIN_LOOKAHEAD (GZ_MAX_MATCH + GZ_MIN_MATCH + 1)
+#define GZ_MAX_CHAIN 8 // Candidates tried per position
+#define GZ_NIL 0xFFFF
+
+#if GZ_WINDOW & (GZ_WINDOW - 1) || GZ_WINDOW < GZ_MIN_LOOKAHEAD ||                \
+    GZ_WINDOW * 2 >= GZ_NIL
+#error "GZ_WINDOW must be a power of two from 512 to 16K"
+#endif
+
+typedef enum { GZ_HEADER, GZ_DATA, GZ_TRAILER, GZ_DONE } gz_state_t;
+
+struct gz_stream {
+  gz_read_fn read;
+  void *ctx;
+  gz_state_t state;
+  bool eof;
+  uint32_t pos; // Next byte to encode in win
+  uint32_t end; // Bytes of input in win
+  uint32_t crc;
+  uint32_t isize;
+  uint32_t bits; // Pending output bits, LSB first
+  int nbits;
+  uint8_t *out; // Output of the current gz_stream_read call
+  size_t n;
+  uint16_t head[GZ_HASH_SIZE]; // Latest position per hash
+  uint16_t prev[GZ_WINDOW];    // Earlier position with the same hash
+  uint8_t win[2 * GZ_WINDOW];
+};
+
+// Base values and extra bits of the length and distance codes
+static const uint16_t len_base[29] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t len_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                      1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                      4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t dist_base[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t dist_extra[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                       4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                       9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *p, size_t len) {
+  // Nibble table keeps this at 64 bytes of flash
+  static const uint32_t t[16] = {
+      0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4,
+      0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+      0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+  crc = ~crc;
+  while (len--) {
+    crc ^= *p++;
+    crc = (crc >> 4) ^ t[crc & 15];
+    crc = (crc >> 4) ^ t[crc & 15];
+  }
+  return ~crc;
+}
+
+static void put_bits(gz_stream_t *z, uint32_t value, int count) {
+  z->bits |= value << z->nbits;
+  z->nbits += count;
+  while (z->nbits >= 8) {
+    z->out[z->n++] = (uint8_t)z->bits;
+    z->bits >>= 8;
+    z->nbits -= 8;
+  }
+}
+
+// Huffman codes go out most significant bit first
+static void put_code(gz_stream_t *z, uint32_t code, int len) {
+  uint32_t rev = 0;
+  for (int i = 0; i < len; i++, code >>= 1)
+    rev = (rev << 1) | (code & 1);
+  put_bits(z, rev, len);
+}
+
+// Fixed literal/length code from RFC 1951 3.2.6
+static void put_symbol(gz_stream_t *z, int sym) {
+  if (sym < 144)
+    put_code(z, 0x30 + sym, 8);
+  else if (sym < 256)
+    put_code(z, 0x190 + sym - 144, 9);
+  else if (sym < 280)
+    put_code(z, sym - 256, 7);
+  else
+    put_code(z, 0xC0 + sym - 280, 8);
+}
+
+static void put_match(gz_stream_t *z, int len, int dist) {
+  int i = 28;
+  while (len_base[i] > len)
+    i--;
+  put_symbol(z, 257 + i);
+  put_bits(z, len - len_base[i], len_extra[i]);
+  i = 29;
+  while (dist_base[i] > dist)
+    i--;
+  put_code(z, i, 5);
+  put_bits(z, dist - dist_base[i], dist_extra[i]);
+}
+
+static uint32_t hash_at(const gz_stream_t *z, uint32_t p) {
+  return ((z->win[p] << 10) ^ (z->win[p + 1] << 5) ^ z->win[p + 2]) &
+         (GZ_HASH_SIZE - 1);
+}
+
+static void insert(gz_stream_t *z, uint32_t p) {
+  if (p + GZ_MIN_MATCH > z->end)
+    return;
+  uint32_t h = hash_at(z, p);
+  z->prev[p & (GZ_WINDOW - 1)] = z->head[h];
+  z->head[h] = p;
+}
+
+// Keeps at least GZ_MIN_LOOKAHEAD bytes ahead of pos until the input ends
+static void refill(gz_stream_t *z) {
+  while (!z->eof && z->end - z->pos < GZ_MIN_LOOKAHEAD) {
+    if (z->end == sizeof(z->win)) {
+      // Drop the older half; positions move down by one window
+      memmove(z->win, z->win + GZ_WINDOW, GZ_WINDOW);
+      z->pos -= GZ_WINDOW;
+      z->end -= GZ_WINDOW;
+      for (int i = 0; i < GZ_HASH_SIZE; i++)
+        z->head[i] = z->head[i] >= GZ_WINDOW && z->head[i] != GZ_NIL
+                         ? z->head[i] - GZ_WINDOW
+                         : GZ_NIL;
+      for (int i = 0; i < GZ_WINDOW; i++)
+        z->prev[i] = z->prev[i] >= GZ_WINDOW && z->prev[i] != GZ_NIL
+                         ? z->prev[i] - GZ_WINDOW
+                         : GZ_NIL;
+    }
+    size_t n = z->read(z->ctx, z->win + z->end, sizeof(z->win) - z->end);
+    if (n == 0) {
+      z->eof = true;
+      break;
+    }
+    z->crc = crc32_update(z->crc, z->win + z->end, n);
+    z->isize += n;
+    z->end += n;
+  }
+}
+
+static int longest_match(const gz_stream_t *z, uint32_t *dist) {
+  uint32_t avail = z->end - z->pos;
+  if (avail < GZ_MIN_MATCH)
+    return 0;
+  int max = avail < GZ_MAX_MATCH ? avail : GZ_MAX_MATCH;
+  int best = 0;
+  uint32_t cand = z->head[hash_at(z, z->pos)];
+  for (int chain = 0; chain < GZ_MAX_CHAIN && cand != GZ_NIL; chain++) {
+    if (cand >= z->pos || z->pos - cand >= GZ_WINDOW)
+      break;
+    const uint8_t *a = z->win + cand, *b = z->win + z->pos;
+    int len = 0;
+    while (len < max && a[len] == b[len])
+      len++;
+    if (len > best) {
+      best = len;
+      *dist = z->pos - cand;
+      if (len == max)
+        break;
+    }
+    cand = z->prev[cand & (GZ_WINDOW - 1)];
+  }
+  return best >= GZ_MIN_MATCH ? best : 0;
+}
+
+static void put_u32_le(gz_stream_t *z, uint32_t v) {
+  for (int i = 0; i < 4; i++)
+    z->out[z->n++] = (uint8_t)(v >> (8 * i));
+}
+
+gz_stream_t *gz_stream_new(gz_read_fn read, void *ctx) {
+  gz_stream_t *z = (gz_stream_t *)malloc(sizeof(gz_stream_t));
+  if (!z)
+    return NULL;
+  memset(z, 0, sizeof(*z));
+  memset(z->head, 0xFF, sizeof(z->head));
+  memset(z->prev, 0xFF, sizeof(z->prev));
+  z->read = read;
+  z->ctx = ctx;
+  return z;
+}
+
+void gz_stream_free(gz_stream_t *z) { free(z); }
+
+size_t gz_stream_read(gz_stream_t *z, uint8_t *out, size_t cap) {
+  static const uint8_t header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff};
+  if (cap < GZ_MIN_OUT)
+    return 0;
+  z->out = out;
+  z->n = 0;
+
+  // A token is at most 31 bits, so 8 bytes of room always fit the next one
+  while (z->n + 8 <= cap) {
+    if (z->state == GZ_HEADER) {
+      memcpy(out, header, sizeof(header));
+      z->n = sizeof(header);
+      put_bits(z, 1, 1); // Last block
+      put_bits(z, 1, 2); // Fixed Huffman codes
+      z->state = GZ_DATA;
+    } else if (z->state == GZ_DATA) {
+      refill(z);
+      if (z->pos < z->end) {
+        uint32_t dist = 0;
+        int len = longest_match(z, &dist);
+        if (len) {
+          put_match(z, len, dist);
+          for (int i = 0; i < len; i++)
+            insert(z, z->pos++);
+        } else {
+          put_symbol(z, z->win[z->pos]);
+          insert(z, z->pos++);
+        }
+      } else {
+        put_symbol(z, 256); // End of block
+        if (z->nbits)
+          put_bits(z, 0, 8 - z->nbits);
+        z->state = GZ_TRAILER;
+      }
+    } else if (z->state == GZ_TRAILER) {
+      put_u32_le(z, z->crc);
+      put_u32_le(z, z->isize);
+      z->state = GZ_DONE;
+    } else {
+      break;
+    }
+  }
+  return z->n;
+}
+
+// --- Decoder ---
+
+typedef enum {
+  GZI_HEADER,
+  GZI_BLOCK,
+  GZI_DATA,
+  GZI_DONE,
+  GZI_ERROR
+} gz_inflate_state_t;
+
+struct gz_inflate {
+  gz_read_fn read;
+  void *ctx;
+  gz_inflate_state_t state;
+  bool last_block;
+  uint8_t in[64];
+  uint8_t in_len;
+  uint8_t in_pos;
+  uint32_t bits;
+  int nbits;
+  uint16_t copy_len; // Left of the current match
+  uint16_t copy_dist;
+  uint32_t total; // Bytes produced
+  uint8_t win[GZ_WINDOW];
+};
+
+static bool need_bits(gz_inflate_t *z, int count) {
+  while (z->nbits < count) {
+    if (z->in_pos == z->in_len) {
+      z->in_len = (uint8_t)z->read(z->ctx, z->in, sizeof(z->in));
+      z->in_pos = 0;
+      if (z->in_len == 0) {
+        z->state = GZI_ERROR;
+        return false;
+      }
+    }
+    z->bits |= (uint32_t)z->in[z->in_pos++] << z->nbits;
+    z->nbits += 8;
+  }
+  return true;
+}
+
+static uint32_t get_bits(gz_inflate_t *z, int count) {
+  if (count == 0 || !need_bits(z, count))
+    return 0;
+  uint32_t v = z->bits & ((1u << count) - 1);
+  z->bits >>= count;
+  z->nbits -= count;
+  return v;
+}
+
+// Reads a Huffman code, most significant bit first
+static uint32_t get_code(gz_inflate_t *z, uint32_t code, int count) {
+  while (count--)
+    code = (code << 1) | get_bits(z, 1);
+  return code;
+}
+
+// Inverse of put_symbol; -1 on an invalid code
+static int get_symbol(gz_inflate_t *z) {
+  uint32_t code = get_code(z, 0, 7);
+  if (code <= 0x17)
+    return 256 + code;
+  code = get_code(z, code, 1);
+  if (code >= 0x30 && code <= 0xBF)
+    return code - 0x30;
+  if (code >= 0xC0 && code <= 0xC7)
+    return 280 + code - 0xC0;
+  code = get_code(z, code, 1);
+  return code >= 0x190 ? (int)(144 + code - 0x190) : -1;
+}
+
+static void emit(gz_inflate_t *z, uint8_t b, uint8_t *out, size_t *n) {
+  z->win[z->total++ & (GZ_WINDOW - 1)] = b;
+  out[(*n)++] = b;
+}
+
+gz_inflate_t *gz_inflate_new(gz_read_fn read, void *ctx) {
+  gz_inflate_t *z = (gz_inflate_t *)malloc(sizeof(gz_inflate_t));
+  if (!z)
+    return NULL;
+  memset(z, 0, sizeof(*z));
+  z->read = read;
+  z->ctx = ctx;
+  return z;
+}
+
+void gz_inflate_free(gz_inflate_t *z) { free(z); }
+
+bool gz_inflate_failed(const gz_inflate_t *z) {
+  return z->state == GZI_ERROR;
+}
+
+size_t gz_inflate_read(gz_inflate_t *z, uint8_t *out, size_t cap) {
+  size_t n = 0;
+  while (n < cap) {
+    if (z->copy_len) {
+      emit(z, z->win[(z->total - z->copy_dist) & (GZ_WINDOW - 1)], out, &n);
+      z->copy_len--;
+      continue;
+    }
+    if (z->state == GZI_HEADER) {
+      // Flags and the rest of the header are always zero here
+      if (get_bits(z, 16) != 0x8b1f || get_bits(z, 8) != 8 ||
+          get_bits(z, 8) != 0) {
+        z->state = GZI_ERROR;
+        break;
+      }
+      for (int i = 0; i < 6; i++)
+        get_bits(z, 8);
+      if (z->state != GZI_ERROR)
+        z->state = GZI_BLOCK;
+    } else if (z->state == GZI_BLOCK) {
+      z->last_block = get_bits(z, 1);
+      if (get_bits(z, 2) != 1 && z->state != GZI_ERROR)
+        z->state = GZI_ERROR; // Only fixed Huffman blocks are written
+      if (z->state != GZI_ERROR)
+        z->state = GZI_DATA;
+    } else if (z->state == GZI_DATA) {
+      int sym = get_symbol(z);
+      if (z->state == GZI_ERROR || sym < 0 || sym > 285) {
+        z->state = GZI_ERROR;
+      } else if (sym < 256) {
+        emit(z, (uint8_t)sym, out, &n);
+      } else if (sym == 256) {
+        // The trailer is not checked; storage has its own integrity
+        z->state = z->last_block ? GZI_DONE : GZI_BLOCK;
+      } else {
+        int i = sym - 257;
+        uint32_t len = len_base[i] + get_bits(z, len_extra[i]);
+        uint32_t d = get_code(z, 0, 5);
+        if (d >= 30) {
+          z->state = GZI_ERROR;
+          break;
+        }
+        uint32_t dist = dist_base[d] + get_bits(z, dist_extra[d]);
+        if (dist > z->total || dist > GZ_WINDOW) {
+          z->state = GZI_ERROR;
+          break;
+        }
+        z->copy_len = len;
+        z->copy_dist = dist;
+      }
+    } else {
+      break;
+    }
+  }
+  return n;
+}
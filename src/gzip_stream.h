@@ -0,0 +1,44 @@
+#ifndef GZIP_STREAM_H
+#define GZIP_STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming gzip encoder and decoder.
+// Deflate with fixed Huffman codes and greedy LZ77 matching over a small
+// sliding window, so the state is a few KB and needs no output buffering.
+// Input is pulled through a callback; output is produced in whatever
+// pieces the caller asks for. The decoder only reads what the encoder
+// writes: one member, fixed Huffman blocks, distances within GZ_WINDOW.
+
+#ifndef GZ_WINDOW
+#define GZ_WINDOW 1024 // Match distance limit, power of two
+#endif
+#define GZ_HASH_BITS 9
+#define GZ_MIN_OUT 16 // Smallest cap gz_stream_read accepts
+
+// Reads up to cap bytes of input; returns 0 at the end of the input
+typedef size_t (*gz_read_fn)(void *ctx, uint8_t *buf, size_t cap);
+
+typedef struct gz_stream gz_stream_t;
+
+// NULL when out of memory
+gz_stream_t *gz_stream_new(gz_read_fn read, void *ctx);
+void gz_stream_free(gz_stream_t *z);
+
+// Writes the next compressed bytes to out. Returns 0 once the stream,
+// trailer included, is complete.
+size_t gz_stream_read(gz_stream_t *z, uint8_t *out, size_t cap);
+
+typedef struct gz_inflate gz_inflate_t;
+
+gz_inflate_t *gz_inflate_new(gz_read_fn read, void *ctx);
+void gz_inflate_free(gz_inflate_t *z);
+
+// Writes the next decompressed bytes to out. Returns 0 at the end of the
+// member, and also on malformed input (see gz_inflate_failed).
+size_t gz_inflate_read(gz_inflate_t *z, uint8_t *out, size_t cap);
+bool gz_inflate_failed(const gz_inflate_t *z);
+
+#endif // GZIP_STREAM_H
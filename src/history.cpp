@@ -0,0 +1,413 @@
+#include "history.h"
+#include "gzip_stream.h"
+#include "logging_macros.h"
+#include "storage.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "HISTORY";
+static const char *ACTIVE_KEY = "access.log";
+static const char *LEGACY_KEY = "access.log.bak"; // Before segmenting
+static const char *INDEX_KEY = "hist.idx";
+
+#if HISTORY_BUDGET_BYTES < 2 * HISTORY_SEGMENT_BYTES + HISTORY_BLOCK_BYTES
+#error "HISTORY_BUDGET_BYTES must hold two segments and a sealed one"
+#endif
+
+// Sealed segments, oldest first. Segment i is stored under "hist.<seq>"
+// with seq = first_seq + i; the active segment is next in sequence.
+#define INDEX_MAGIC 0x58444948 // "HIDX"
+typedef struct {
+  uint32_t magic;
+  uint32_t first_seq;
+  uint32_t count;
+  uint32_t plain; // Bit per segment stored uncompressed
+  uint32_t raw[HISTORY_MAX_SEGMENTS];    // CSV bytes
+  uint32_t stored[HISTORY_MAX_SEGMENTS]; // Bytes on flash
+} history_index_t;
+
+static history_index_t idx;
+static int32_t active_size = -1; // -1 until the first line is written
+
+#ifdef ARDUINO
+#define LOCK()
+#define UNLOCK()
+#else
+// Appends come from whichever task logs an event and may evict the segment
+// a download is reading, so every entry point holds this. Recursive because
+// history_tag reads through history_read.
+static SemaphoreHandle_t lock = NULL;
+#define LOCK() xSemaphoreTakeRecursive(lock, portMAX_DELAY)
+#define UNLOCK() xSemaphoreGiveRecursive(lock)
+#endif
+
+// Decoder kept open between reads, so a download walking through a
+// sealed segment decompresses it once
+static struct {
+  gz_inflate_t *z;
+  uint32_t seq;
+  uint32_t raw_pos;
+  uint32_t comp_pos;
+} cursor;
+
+static void segment_key(char *out, uint32_t seq) {
+  snprintf(out, STORAGE_MAX_KEY, "hist.%u", (unsigned)seq);
+}
+
+static uint32_t blocks(uint32_t bytes) {
+  return (bytes + HISTORY_BLOCK_BYTES - 1) / HISTORY_BLOCK_BYTES *
+         HISTORY_BLOCK_BYTES;
+}
+
+static uint32_t active_seq(void) { return idx.first_seq + idx.count; }
+
+static void save_index(void) {
+  if (!storage_write(STORAGE_LOGS, INDEX_KEY, &idx, sizeof(idx)))
+    ESP_LOGE(TAG, "Failed to save history index");
+}
+
+static void cursor_close(void) {
+  gz_inflate_free(cursor.z);
+  cursor.z = NULL;
+}
+
+static void evict_oldest(void) {
+  char key[STORAGE_MAX_KEY];
+  segment_key(key, idx.first_seq);
+  if (cursor.z && cursor.seq == idx.first_seq)
+    cursor_close();
+  idx.first_seq++;
+  idx.count--;
+  idx.plain >>= 1;
+  memmove(idx.raw, idx.raw + 1, idx.count * sizeof(idx.raw[0]));
+  memmove(idx.stored, idx.stored + 1, idx.count * sizeof(idx.stored[0]));
+  // Index first: a crash in between leaves an orphan, not a hole
+  save_index();
+  storage_remove(STORAGE_LOGS, key);
+}
+
+// Reading an uncompressed file from the start
+typedef struct {
+  const char *key;
+  uint32_t pos;
+} file_src_t;
+
+static size_t file_src_read(void *ctx, uint8_t *buf, size_t cap) {
+  file_src_t *src = (file_src_t *)ctx;
+  int n = storage_read(STORAGE_LOGS, src->key, src->pos, buf, cap);
+  if (n <= 0)
+    return 0;
+  src->pos += n;
+  return n;
+}
+
+// Turns the file at src_key into the next sealed segment and removes it
+static bool seal(const char *src_key, uint32_t raw) {
+  // Room for the CSV and its compressed copy while sealing, which is
+  // room for the copy and the next active segment afterwards
+  uint32_t used = 0;
+  for (uint32_t i = 0; i < idx.count; i++)
+    used += blocks(idx.stored[i]);
+  while (idx.count > 0 &&
+         (idx.count == HISTORY_MAX_SEGMENTS ||
+          used + blocks(raw) + blocks(HISTORY_SEGMENT_BYTES) +
+                  HISTORY_BLOCK_BYTES >
+              HISTORY_BUDGET_BYTES)) {
+    used -= blocks(idx.stored[0]);
+    evict_oldest();
+  }
+
+  char key[STORAGE_MAX_KEY];
+  segment_key(key, active_seq());
+  storage_remove(STORAGE_LOGS, key); // Left over from an interrupted seal
+
+  file_src_t src = {src_key, 0};
+  gz_stream_t *z = gz_stream_new(file_src_read, &src);
+  uint32_t stored = 0;
+  bool ok = z != NULL;
+  uint8_t buf[512];
+  size_t n;
+  while (ok && (n = gz_stream_read(z, buf, sizeof(buf))) > 0) {
+    ok = storage_append(STORAGE_LOGS, key, buf, n);
+    stored += n;
+  }
+  gz_stream_free(z);
+
+  uint32_t i = idx.count;
+  if (ok && src.pos == raw) {
+    idx.plain &= ~(1u << i);
+  } else {
+    // Out of memory or flash: keep the segment as it is
+    ESP_LOGW(TAG, "Compression failed, sealing %s uncompressed", src_key);
+    storage_remove(STORAGE_LOGS, key);
+    if (!storage_rename(STORAGE_LOGS, src_key, key)) {
+      ESP_LOGE(TAG, "Failed to seal %s", src_key);
+      return false;
+    }
+    idx.plain |= 1u << i;
+    stored = raw;
+  }
+  idx.raw[i] = raw;
+  idx.stored[i] = stored;
+  idx.count++;
+  // Index before removing the source: a crash in between repeats a
+  // segment rather than losing one
+  save_index();
+  storage_remove(STORAGE_LOGS, src_key);
+  ESP_LOGI(TAG, "Sealed segment %u: %u -> %u bytes",
+           (unsigned)(active_seq() - 1), (unsigned)raw, (unsigned)stored);
+  return true;
+}
+
+void history_init(void) {
+#ifndef ARDUINO
+  lock = xSemaphoreCreateRecursiveMutex();
+#endif
+  if (storage_read(STORAGE_LOGS, INDEX_KEY, 0, &idx, sizeof(idx)) !=
+          sizeof(idx) ||
+      idx.magic != INDEX_MAGIC || idx.count > HISTORY_MAX_SEGMENTS) {
+    memset(&idx, 0, sizeof(idx));
+    idx.magic = INDEX_MAGIC;
+  }
+  // The only size check: appends keep count from here on
+  active_size = storage_size(STORAGE_LOGS, ACTIVE_KEY);
+
+  int32_t legacy = storage_size(STORAGE_LOGS, LEGACY_KEY);
+  if (legacy > 0 && idx.count == 0)
+    seal(LEGACY_KEY, legacy);
+  else if (legacy >= 0)
+    storage_remove(STORAGE_LOGS, LEGACY_KEY);
+
+  ESP_LOGI(TAG, "%u sealed segments, active %d bytes", (unsigned)idx.count,
+           (int)active_size);
+}
+
+bool history_append(const char *line, size_t len) {
+  LOCK();
+  if (active_size > 0 && active_size + len > HISTORY_SEGMENT_BYTES &&
+      seal(ACTIVE_KEY, active_size))
+    active_size = 0;
+  bool ok = storage_append(STORAGE_LOGS, ACTIVE_KEY, line, len);
+  if (ok)
+    active_size = (active_size < 0 ? 0 : active_size) + len;
+  UNLOCK();
+  return ok;
+}
+
+int32_t history_size(void) {
+  LOCK();
+  int32_t total = active_size < 0 ? 0 : active_size;
+  for (uint32_t i = 0; i < idx.count; i++)
+    total += idx.raw[i];
+  if (idx.count == 0 && active_size < 0)
+    total = -1;
+  UNLOCK();
+  return total;
+}
+
+static size_t cursor_src_read(void *ctx, uint8_t *buf, size_t cap) {
+  (void)ctx;
+  char key[STORAGE_MAX_KEY];
+  segment_key(key, cursor.seq);
+  int n = storage_read(STORAGE_LOGS, key, cursor.comp_pos, buf, cap);
+  if (n <= 0)
+    return 0;
+  cursor.comp_pos += n;
+  return n;
+}
+
+// Reads CSV bytes from one segment. Returns bytes read, 0 at its end and
+// -1 once the segment has been evicted.
+static int segment_read(uint32_t seq, uint32_t offset, uint8_t *buf,
+                        size_t cap) {
+  if (seq < idx.first_seq)
+    return -1;
+  uint32_t i = seq - idx.first_seq;
+  if (i >= idx.count || (idx.plain & (1u << i))) {
+    char key[STORAGE_MAX_KEY];
+    if (i >= idx.count)
+      strcpy(key, ACTIVE_KEY);
+    else
+      segment_key(key, seq);
+    int n = storage_read(STORAGE_LOGS, key, offset, buf, cap);
+    return n < 0 ? 0 : n;
+  }
+
+  if (offset >= idx.raw[i])
+    return 0;
+  if (!cursor.z || cursor.seq != seq || cursor.raw_pos > offset) {
+    cursor_close();
+    cursor.seq = seq;
+    cursor.raw_pos = 0;
+    cursor.comp_pos = 0;
+    cursor.z = gz_inflate_new(cursor_src_read, NULL);
+    if (!cursor.z)
+      return 0;
+  }
+  uint8_t skip[64];
+  while (cursor.raw_pos < offset) {
+    size_t want = offset - cursor.raw_pos;
+    size_t n = gz_inflate_read(cursor.z, skip,
+                               want < sizeof(skip) ? want : sizeof(skip));
+    if (n == 0)
+      break;
+    cursor.raw_pos += n;
+  }
+  size_t n = cursor.raw_pos == offset ? gz_inflate_read(cursor.z, buf, cap) : 0;
+  cursor.raw_pos += n;
+  if (n == 0 || cursor.raw_pos >= idx.raw[i]) {
+    if (gz_inflate_failed(cursor.z))
+      ESP_LOGE(TAG, "Segment %u is corrupt", (unsigned)seq);
+    cursor_close();
+  }
+  return n;
+}
+
+static int read_locked(uint32_t offset, void *buf, size_t cap) {
+  size_t got = 0;
+  for (uint32_t seq = idx.first_seq; seq <= active_seq() && got < cap;
+       seq++) {
+    uint32_t i = seq - idx.first_seq;
+    uint32_t n = i < idx.count ? idx.raw[i]
+                               : (uint32_t)(active_size < 0 ? 0 : active_size);
+    if (offset >= n) {
+      offset -= n;
+      continue;
+    }
+    // Never run into the next segment before this one is used up
+    while (offset < n && got < cap) {
+      size_t want = cap - got;
+      if (want > n - offset)
+        want = n - offset;
+      int r = segment_read(seq, offset, (uint8_t *)buf + got, want);
+      if (r <= 0)
+        return got;
+      got += r;
+      offset += r;
+    }
+    offset = 0;
+  }
+  return got;
+}
+
+int history_read(uint32_t offset, void *buf, size_t cap) {
+  LOCK();
+  int n = read_locked(offset, buf, cap);
+  UNLOCK();
+  return n;
+}
+
+uint32_t history_tag(void) {
+  // Every line starts with its timestamp, so the first one identifies
+  // where the history begins
+  char line[16] = {0};
+  history_read(0, line, sizeof(line) - 1);
+  return (uint32_t)strtoul(line, NULL, 10);
+}
+
+struct history_gz {
+  uint32_t seq;  // Segment being sent
+  uint32_t last; // The active segment when the download started
+  uint32_t pos;  // Stored bytes copied, or CSV bytes compressed
+  uint32_t end;  // CSV bytes in the segment being compressed
+  uint32_t last_size; // Of the active segment when the download started
+  gz_stream_t *z;
+};
+
+static size_t gz_segment_read(void *ctx, uint8_t *buf, size_t cap) {
+  history_gz_t *h = (history_gz_t *)ctx;
+  if (cap > h->end - h->pos)
+    cap = h->end - h->pos;
+  int n = cap ? segment_read(h->seq, h->pos, buf, cap) : 0;
+  if (n <= 0)
+    return 0;
+  h->pos += n;
+  return n;
+}
+
+history_gz_t *history_gz_open(void) {
+  history_gz_t *h = (history_gz_t *)malloc(sizeof(history_gz_t));
+  if (!h)
+    return NULL;
+  memset(h, 0, sizeof(*h));
+  LOCK();
+  h->seq = idx.first_seq;
+  h->last = active_seq();
+  h->last_size = active_size < 0 ? 0 : active_size;
+  UNLOCK();
+  return h;
+}
+
+static size_t gz_read_locked(history_gz_t *h, uint8_t *out, size_t cap) {
+  size_t n = 0;
+  while (h->seq <= h->last) {
+    uint32_t i = h->seq - idx.first_seq;
+    if (h->seq < idx.first_seq) {
+      // Evicted mid-download; the client sees a truncated file
+      h->seq = h->last + 1;
+      break;
+    }
+    if (h->z || i >= idx.count || (idx.plain & (1u << i))) {
+      // CSV data gets a member of its own
+      if (cap - n < GZ_MIN_OUT)
+        break;
+      if (!h->z) {
+        h->end = i < idx.count ? idx.raw[i] : h->last_size;
+        h->z = gz_stream_new(gz_segment_read, h);
+        if (!h->z) {
+          h->seq = h->last + 1;
+          break;
+        }
+      }
+      size_t r = gz_stream_read(h->z, out + n, cap - n);
+      if (r == 0) {
+        gz_stream_free(h->z);
+        h->z = NULL;
+        h->seq++;
+        h->pos = 0;
+      }
+      n += r;
+    } else {
+      if (n == cap)
+        break;
+      char key[STORAGE_MAX_KEY];
+      segment_key(key, h->seq);
+      size_t want = cap - n;
+      if (want > idx.stored[i] - h->pos)
+        want = idx.stored[i] - h->pos;
+      int r = want ? storage_read(STORAGE_LOGS, key, h->pos, out + n, want)
+                   : 0;
+      if (r <= 0) {
+        h->seq++;
+        h->pos = 0;
+      } else {
+        h->pos += r;
+        n += r;
+      }
+    }
+  }
+  return n;
+}
+
+size_t history_gz_read(history_gz_t *h, uint8_t *out, size_t cap) {
+  LOCK();
+  size_t n = gz_read_locked(h, out, cap);
+  UNLOCK();
+  return n;
+}
+
+void history_gz_close(history_gz_t *h) {
+  if (!h)
+    return;
+  gz_stream_free(h->z);
+  free(h);
+}
@@ -0,0 +1,44 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Access history, kept in the STORAGE_LOGS class.
+// Lines are appended to an active segment whose size is tracked in RAM.
+// A full segment is sealed: compressed into a gzip member and listed in a
+// small index. Sealed segments are evicted oldest first to keep the whole
+// history inside a flash budget. Readers see one CSV file, oldest first,
+// so a download can be resumed by byte offset.
+
+#ifndef HISTORY_BUDGET_BYTES
+#define HISTORY_BUDGET_BYTES (100 * 1024) // Flash for the whole history
+#endif
+#ifndef HISTORY_SEGMENT_BYTES
+#define HISTORY_SEGMENT_BYTES (16 * 1024) // Active segment seal size
+#endif
+#define HISTORY_BLOCK_BYTES 4096 // Files occupy whole flash blocks
+#define HISTORY_MAX_SEGMENTS 32  // Sealed segments in the index
+
+void history_init(void);
+
+// Appends one line (newline included) to the active segment
+bool history_append(const char *line, size_t len);
+
+int32_t history_size(void); // -1 when nothing has been logged yet
+int history_read(uint32_t offset, void *buf, size_t cap);
+// Changes whenever eviction drops data from the front, which shifts every
+// offset. Usable as an ETag.
+uint32_t history_tag(void);
+
+// Whole history as gzip. Sealed segments are sent as stored, so the result
+// is a multi-member gzip file. NULL when out of memory.
+typedef struct history_gz history_gz_t;
+
+history_gz_t *history_gz_open(void);
+// Returns 0 when done; cap must be at least GZ_MIN_OUT
+size_t history_gz_read(history_gz_t *h, uint8_t *out, size_t cap);
+void history_gz_close(history_gz_t *h);
+
+#endif // HISTORY_H
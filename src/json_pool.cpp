@@ -0,0 +1,184 @@
+#include "json_pool.h"
+#include "logging_macros.h"
+#include "metrics.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <cJSON.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "JSON_POOL";
+
+#ifdef ARDUINO
+JsonPoolAllocator json_pool_allocator;
+#endif
+
+// First-fit blocks laid end to end; size excludes the header. Free
+// neighbours are merged as allocation walks past them.
+typedef struct {
+  uint32_t size;
+  uint32_t used;
+} block_t;
+
+#define ALIGN(n) (((n) + 7) & ~(size_t)7)
+#define MIN_SPLIT (sizeof(block_t) + 16)
+
+static uint8_t arena[JSON_POOL_BYTES] __attribute__((aligned(8)));
+static bool active = false;
+static size_t in_use = 0; // Bytes taken, headers included
+static uint32_t live = 0; // Blocks not yet freed
+#ifndef ARDUINO
+// The hooks are global; only the task serving the request uses the arena
+static TaskHandle_t owner = NULL;
+#endif
+
+static uint32_t high_water = 0; // Most in_use seen
+static metric_t *fallbacks = NULL;
+
+static block_t *first_block(void) { return (block_t *)arena; }
+
+static block_t *next_block(block_t *b) {
+  uint8_t *n = (uint8_t *)(b + 1) + b->size;
+  return n < arena + sizeof(arena) ? (block_t *)n : NULL;
+}
+
+static bool in_arena(const void *ptr) {
+  return (const uint8_t *)ptr >= arena &&
+         (const uint8_t *)ptr < arena + sizeof(arena);
+}
+
+static bool arena_usable(void) {
+#ifdef ARDUINO
+  return active;
+#else
+  return active && xTaskGetCurrentTaskHandle() == owner;
+#endif
+}
+
+static void merge_free(block_t *b) {
+  block_t *n;
+  while ((n = next_block(b)) && !n->used)
+    b->size += sizeof(block_t) + n->size;
+}
+
+static void take(block_t *b, size_t size) {
+  if (b->size >= size + MIN_SPLIT) {
+    block_t *rest = (block_t *)((uint8_t *)(b + 1) + size);
+    rest->size = b->size - size - sizeof(block_t);
+    rest->used = 0;
+    b->size = size;
+  }
+  b->used = 1;
+  live++;
+  in_use += sizeof(block_t) + b->size;
+  if (in_use > high_water)
+    high_water = in_use;
+}
+
+static void *arena_alloc(size_t size) {
+  size = ALIGN(size ? size : 1);
+  for (block_t *b = first_block(); b; b = next_block(b)) {
+    if (b->used)
+      continue;
+    merge_free(b);
+    if (b->size >= size) {
+      take(b, size);
+      return b + 1;
+    }
+  }
+  return NULL;
+}
+
+void json_pool_begin(void) {
+  first_block()->size = sizeof(arena) - sizeof(block_t);
+  first_block()->used = 0;
+  in_use = 0;
+  live = 0;
+#ifndef ARDUINO
+  owner = xTaskGetCurrentTaskHandle();
+#endif
+  active = true;
+}
+
+void json_pool_end(void) {
+  if (live)
+    ESP_LOGW(TAG, "%u blocks still allocated at request end",
+             (unsigned)live);
+  active = false;
+}
+
+void *json_pool_alloc(size_t size) {
+  if (arena_usable()) {
+    void *p = arena_alloc(size);
+    if (p)
+      return p;
+  }
+  if (active)
+    metrics_inc(fallbacks);
+  return malloc(size);
+}
+
+void json_pool_free(void *ptr) {
+  if (!ptr)
+    return;
+  if (!in_arena(ptr)) {
+    free(ptr);
+    return;
+  }
+  block_t *b = (block_t *)ptr - 1;
+  if (!active || !b->used)
+    return; // Already released by json_pool_end
+  b->used = 0;
+  live--;
+  in_use -= sizeof(block_t) + b->size;
+}
+
+void *json_pool_realloc(void *ptr, size_t size) {
+  if (!ptr)
+    return json_pool_alloc(size);
+  if (!in_arena(ptr))
+    return realloc(ptr, size);
+
+  block_t *b = (block_t *)ptr - 1;
+  size_t want = ALIGN(size ? size : 1);
+  if (active) {
+    // Grow or shrink in place when the following space allows. Free
+    // blocks are only merged in when that works, since in_use counts the
+    // block at its old size.
+    size_t room = b->size;
+    for (block_t *n = next_block(b); n && !n->used; n = next_block(n))
+      room += sizeof(block_t) + n->size;
+    if (room >= want) {
+      in_use -= sizeof(block_t) + b->size;
+      live--;
+      merge_free(b);
+      take(b, want);
+      return ptr;
+    }
+  }
+  void *p = json_pool_alloc(size);
+  if (p) {
+    memcpy(p, ptr, b->size < size ? b->size : size);
+    json_pool_free(ptr);
+  }
+  return p;
+}
+
+void json_pool_init(void) {
+  metrics_gauge_fn("json_pool_high_water_bytes",
+                   "Most JSON pool memory in use at once", NULL,
+                   metrics_read_u32, &high_water);
+  fallbacks = metrics_counter("json_pool_fallback_total",
+                              "JSON allocations served by the heap", NULL);
+#ifndef ARDUINO
+  cJSON_Hooks hooks = {json_pool_alloc, json_pool_free};
+  cJSON_InitHooks(&hooks);
+#endif
+  ESP_LOGI(TAG, "JSON pool: %u bytes", (unsigned)sizeof(arena));
+}
@@ -0,0 +1,47 @@
+#ifndef JSON_POOL_H
+#define JSON_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Per-request JSON memory.
+// JSON trees built while handling an API request come from a static arena
+// that is reset when the request ends, so they never fragment the general
+// heap. cJSON is routed here through its hooks; ArduinoJson documents take
+// a JsonPoolAllocator. Outside a request, or once the arena is full,
+// allocations fall back to the heap and are counted.
+
+#ifndef JSON_POOL_BYTES
+#ifdef ARDUINO
+#define JSON_POOL_BYTES 3072
+#else
+#define JSON_POOL_BYTES (24 * 1024)
+#endif
+#endif
+
+void json_pool_init(void); // Installs the cJSON hooks on the IDF
+
+void json_pool_begin(void);
+void json_pool_end(void); // Releases everything allocated since begin
+
+void *json_pool_alloc(size_t size);
+void json_pool_free(void *ptr);
+void *json_pool_realloc(void *ptr, size_t size);
+
+#if defined(__cplusplus) && defined(ARDUINO)
+#include <ArduinoJson.h>
+
+class JsonPoolAllocator : public ArduinoJson::Allocator {
+public:
+  void *allocate(size_t size) override { return json_pool_alloc(size); }
+  void deallocate(void *ptr) override { json_pool_free(ptr); }
+  void *reallocate(void *ptr, size_t size) override {
+    return json_pool_realloc(ptr, size);
+  }
+};
+
+extern JsonPoolAllocator json_pool_allocator;
+#endif
+
+#endif // JSON_POOL_H
@@ -0,0 +1,532 @@
+#include "json_reader.h"
+#include <stdio.h>
+#include <string.h>
+
+typedef enum {
+  JS_VALUE,
+  JS_KEY_OR_END, // After '{'
+  JS_KEY,        // After ',' inside an object
+  JS_COLON,
+  JS_COMMA_OR_END,
+  JS_STRING,
+  JS_STRING_ESC,
+  JS_STRING_HEX,
+  JS_NUMBER,
+  JS_LITERAL,
+  JS_DONE
+} json_state_t;
+
+#define STREAM_CHUNK 32
+
+static bool is_ws(char ch) {
+  return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
+}
+
+static bool top_is_object(const json_reader_t *r) {
+  return r->depth > 0 && ((r->stack >> (r->depth - 1)) & 1);
+}
+
+static void *field_ptr(const json_reader_t *r) {
+  return (char *)r->out + r->fields[r->field].offset;
+}
+
+static const json_field_t *bound_field(const json_reader_t *r) {
+  return r->field >= 0 ? &r->fields[r->field] : NULL;
+}
+
+static void fail(json_reader_t *r, json_status_t status) {
+  if (r->status == JSON_INCOMPLETE)
+    r->status = status;
+}
+
+// Called after any complete value at the current depth
+static void value_done(json_reader_t *r) {
+  r->field = -1;
+  r->state = r->depth == 0 ? JS_DONE : JS_COMMA_OR_END;
+}
+
+static void bind_key(json_reader_t *r) {
+  r->field = -1;
+  if (r->depth != 1 || r->overflow)
+    return;
+  for (size_t i = 0; i < r->field_count; i++) {
+    if (strcmp(r->fields[i].key, r->key) == 0) {
+      r->field = (int8_t)i;
+      return;
+    }
+  }
+}
+
+static void mark_seen(json_reader_t *r) { r->seen |= 1UL << r->field; }
+
+static void push(json_reader_t *r, bool object) {
+  if (r->depth == 0 && !object) {
+    fail(r, JSON_ERR_TYPE); // Requests are always objects
+    return;
+  }
+  if (r->depth == 1 && bound_field(r)) {
+    fail(r, JSON_ERR_TYPE); // Known members are scalars
+    return;
+  }
+  if (r->depth >= JSON_MAX_DEPTH) {
+    fail(r, JSON_ERR_DEPTH);
+    return;
+  }
+  if (object)
+    r->stack |= 1U << r->depth;
+  else
+    r->stack &= ~(1U << r->depth);
+  r->depth++;
+  r->field = -1;
+  r->array_open = !object;
+  r->state = object ? JS_KEY_OR_END : JS_VALUE;
+}
+
+static void pop(json_reader_t *r, char closer) {
+  if ((closer == '}') != top_is_object(r)) {
+    fail(r, JSON_ERR_SYNTAX);
+    return;
+  }
+  r->depth--;
+  value_done(r);
+}
+
+// Appends one decoded byte to the key or the bound string member
+static void string_put(json_reader_t *r, char ch) {
+  if (r->in_key) {
+    if (r->len + 1 < JSON_MAX_KEY)
+      r->key[r->len++] = ch;
+    else
+      r->overflow = true;
+    return;
+  }
+  const json_field_t *f = bound_field(r);
+  if (!f || f->type != JSON_FIELD_STRING)
+    return;
+  if (r->len + 1 < f->size)
+    ((char *)field_ptr(r))[r->len++] = ch;
+  else
+    r->overflow = true;
+}
+
+static void string_put_utf8(json_reader_t *r, uint32_t cp) {
+  if (cp < 0x80) {
+    string_put(r, (char)cp);
+  } else if (cp < 0x800) {
+    string_put(r, (char)(0xC0 | (cp >> 6)));
+    string_put(r, (char)(0x80 | (cp & 0x3F)));
+  } else if (cp < 0x10000) {
+    string_put(r, (char)(0xE0 | (cp >> 12)));
+    string_put(r, (char)(0x80 | ((cp >> 6) & 0x3F)));
+    string_put(r, (char)(0x80 | (cp & 0x3F)));
+  } else {
+    string_put(r, (char)(0xF0 | (cp >> 18)));
+    string_put(r, (char)(0x80 | ((cp >> 12) & 0x3F)));
+    string_put(r, (char)(0x80 | ((cp >> 6) & 0x3F)));
+    string_put(r, (char)(0x80 | (cp & 0x3F)));
+  }
+}
+
+static void string_begin(json_reader_t *r, bool key) {
+  const json_field_t *f = key ? NULL : bound_field(r);
+  if (f && f->type != JSON_FIELD_STRING) {
+    fail(r, JSON_ERR_TYPE);
+    return;
+  }
+  r->in_key = key;
+  r->len = 0;
+  r->overflow = false;
+  r->high_surrogate = 0;
+  r->state = JS_STRING;
+}
+
+static void string_end(json_reader_t *r) {
+  if (r->in_key) {
+    r->key[r->len] = 0;
+    bind_key(r);
+    r->state = JS_COLON;
+    return;
+  }
+  if (bound_field(r)) {
+    if (r->overflow) {
+      fail(r, JSON_ERR_TOO_LONG);
+      return;
+    }
+    ((char *)field_ptr(r))[r->len] = 0;
+    mark_seen(r);
+  }
+  value_done(r);
+}
+
+static void number_end(json_reader_t *r) {
+  if (r->len == 0) {
+    fail(r, JSON_ERR_SYNTAX); // '-' with no digits
+    return;
+  }
+  const json_field_t *f = bound_field(r);
+  if (f) {
+    if (f->type != JSON_FIELD_INT) {
+      fail(r, JSON_ERR_TYPE);
+      return;
+    }
+    int64_t v = r->negative ? -r->number : r->number;
+    if (r->overflow || v < INT32_MIN || v > INT32_MAX) {
+      fail(r, JSON_ERR_RANGE);
+      return;
+    }
+    *(int32_t *)field_ptr(r) = (int32_t)v;
+    mark_seen(r);
+  }
+  value_done(r);
+}
+
+static void literal_end(json_reader_t *r) {
+  r->literal[r->len] = 0;
+  bool is_true = strcmp(r->literal, "true") == 0;
+  bool is_false = strcmp(r->literal, "false") == 0;
+  if (!is_true && !is_false && strcmp(r->literal, "null") != 0) {
+    fail(r, JSON_ERR_SYNTAX);
+    return;
+  }
+  const json_field_t *f = bound_field(r);
+  if (f && (is_true || is_false)) { // null leaves the member unset
+    if (f->type != JSON_FIELD_BOOL) {
+      fail(r, JSON_ERR_TYPE);
+      return;
+    }
+    *(bool *)field_ptr(r) = is_true;
+    mark_seen(r);
+  }
+  value_done(r);
+}
+
+static void value_begin(json_reader_t *r, char ch) {
+  bool array_open = r->array_open;
+  r->array_open = false;
+  if (ch == '{') {
+    push(r, true);
+  } else if (ch == '[') {
+    push(r, false);
+  } else if (ch == ']' && array_open) {
+    pop(r, ch);
+  } else if (ch == '"') {
+    string_begin(r, false);
+  } else if (ch == '-' || (ch >= '0' && ch <= '9')) {
+    r->negative = ch == '-';
+    r->number = ch == '-' ? 0 : ch - '0';
+    r->len = ch == '-' ? 0 : 1; // Integer digits
+    r->fraction = false;
+    r->overflow = false;
+    r->state = JS_NUMBER;
+  } else if (ch == 't' || ch == 'f' || ch == 'n') {
+    r->literal[0] = ch;
+    r->len = 1;
+    r->state = JS_LITERAL;
+  } else {
+    fail(r, JSON_ERR_SYNTAX);
+  }
+}
+
+static int hex_value(char ch) {
+  if (ch >= '0' && ch <= '9')
+    return ch - '0';
+  if (ch >= 'a' && ch <= 'f')
+    return ch - 'a' + 10;
+  if (ch >= 'A' && ch <= 'F')
+    return ch - 'A' + 10;
+  return -1;
+}
+
+static void string_escape(json_reader_t *r, char ch) {
+  r->state = JS_STRING;
+  switch (ch) {
+  case '"':
+  case '\\':
+  case '/':
+    string_put(r, ch);
+    break;
+  case 'b':
+    string_put(r, '\b');
+    break;
+  case 'f':
+    string_put(r, '\f');
+    break;
+  case 'n':
+    string_put(r, '\n');
+    break;
+  case 'r':
+    string_put(r, '\r');
+    break;
+  case 't':
+    string_put(r, '\t');
+    break;
+  case 'u':
+    r->unicode = 0;
+    r->hex_digits = 0;
+    r->state = JS_STRING_HEX;
+    break;
+  default:
+    fail(r, JSON_ERR_SYNTAX);
+  }
+}
+
+static void string_hex(json_reader_t *r, char ch) {
+  int v = hex_value(ch);
+  if (v < 0) {
+    fail(r, JSON_ERR_SYNTAX);
+    return;
+  }
+  r->unicode = (r->unicode << 4) | v;
+  if (++r->hex_digits < 4)
+    return;
+
+  r->state = JS_STRING;
+  uint32_t cp = r->unicode;
+  if (cp >= 0xD800 && cp < 0xDC00) {
+    r->high_surrogate = (uint16_t)cp; // Wait for the low half
+    return;
+  }
+  if (cp >= 0xDC00 && cp < 0xE000 && r->high_surrogate) {
+    cp = 0x10000 + (((uint32_t)r->high_surrogate - 0xD800) << 10) +
+         (cp - 0xDC00);
+  }
+  r->high_surrogate = 0;
+  string_put_utf8(r, cp);
+}
+
+// Processes one character. Returns false if the character terminated a
+// number or literal and must be processed again in the new state.
+static bool step(json_reader_t *r, char ch) {
+  switch (r->state) {
+  case JS_STRING:
+    if (ch == '"')
+      string_end(r);
+    else if (ch == '\\')
+      r->state = JS_STRING_ESC;
+    else if ((unsigned char)ch < 0x20)
+      fail(r, JSON_ERR_SYNTAX);
+    else
+      string_put(r, ch);
+    return true;
+  case JS_STRING_ESC:
+    string_escape(r, ch);
+    return true;
+  case JS_STRING_HEX:
+    string_hex(r, ch);
+    return true;
+  case JS_NUMBER:
+    if (ch >= '0' && ch <= '9') {
+      if (!r->fraction) {
+        if (r->len > 0 && r->number == 0) {
+          fail(r, JSON_ERR_SYNTAX); // Leading zero
+          return true;
+        }
+        r->len++;
+        if (r->number > (INT64_MAX - 9) / 10)
+          r->overflow = true;
+        else
+          r->number = r->number * 10 + (ch - '0');
+      }
+      return true;
+    }
+    if (ch == '.' || ch == 'e' || ch == 'E' || ch == '+' ||
+        (ch == '-' && r->fraction)) {
+      if (r->len == 0) {
+        fail(r, JSON_ERR_SYNTAX); // '-' with no digits
+        return true;
+      }
+      // Fractions are truncated; exponents would change the integer part
+      if (ch != '.' && bound_field(r))
+        fail(r, JSON_ERR_TYPE);
+      r->fraction = true;
+      return true;
+    }
+    number_end(r);
+    return false;
+  case JS_LITERAL:
+    if (ch >= 'a' && ch <= 'z') {
+      if (r->len + 1 < sizeof(r->literal))
+        r->literal[r->len++] = ch;
+      else
+        fail(r, JSON_ERR_SYNTAX);
+      return true;
+    }
+    literal_end(r);
+    return false;
+  default:
+    break;
+  }
+
+  if (is_ws(ch))
+    return true;
+
+  switch (r->state) {
+  case JS_VALUE:
+    value_begin(r, ch);
+    break;
+  case JS_KEY_OR_END:
+    if (ch == '}')
+      pop(r, ch);
+    else if (ch == '"')
+      string_begin(r, true);
+    else
+      fail(r, JSON_ERR_SYNTAX);
+    break;
+  case JS_KEY:
+    if (ch == '"')
+      string_begin(r, true);
+    else
+      fail(r, JSON_ERR_SYNTAX);
+    break;
+  case JS_COLON:
+    if (ch == ':')
+      r->state = JS_VALUE;
+    else
+      fail(r, JSON_ERR_SYNTAX);
+    break;
+  case JS_COMMA_OR_END:
+    if (ch == ',')
+      r->state = top_is_object(r) ? JS_KEY : JS_VALUE;
+    else if (ch == '}' || ch == ']')
+      pop(r, ch);
+    else
+      fail(r, JSON_ERR_SYNTAX);
+    break;
+  case JS_DONE:
+    fail(r, JSON_ERR_SYNTAX); // Trailing garbage
+    break;
+  default:
+    fail(r, JSON_ERR_SYNTAX);
+  }
+  return true;
+}
+
+void json_reader_init(json_reader_t *r, const json_field_t *fields,
+                      size_t field_count, void *out) {
+  memset(r, 0, sizeof(*r));
+  r->fields = fields;
+  r->field_count = field_count < JSON_MAX_FIELDS ? field_count : JSON_MAX_FIELDS;
+  r->out = out;
+  r->status = JSON_INCOMPLETE;
+  r->state = JS_VALUE;
+  r->field = -1;
+}
+
+json_status_t json_reader_feed(json_reader_t *r, const char *data,
+                               size_t len) {
+  size_t i = 0;
+  while (i < len && r->status == JSON_INCOMPLETE) {
+    if (step(r, data[i]))
+      i++;
+  }
+  return r->status;
+}
+
+json_status_t json_reader_finish(json_reader_t *r) {
+  if (r->status != JSON_INCOMPLETE)
+    return r->status;
+
+  // A bare number or literal at the end of input has no terminator
+  if (r->state == JS_NUMBER || r->state == JS_LITERAL)
+    step(r, ' ');
+  if (r->status != JSON_INCOMPLETE)
+    return r->status;
+  if (r->state != JS_DONE)
+    return r->status; // Still JSON_INCOMPLETE
+
+  for (size_t i = 0; i < r->field_count; i++) {
+    if ((r->fields[i].flags & JSON_REQUIRED) && !json_reader_has(r, i)) {
+      r->status = JSON_ERR_MISSING;
+      return r->status;
+    }
+  }
+  r->status = JSON_OK;
+  return r->status;
+}
+
+bool json_reader_has(const json_reader_t *r, size_t field_index) {
+  return (r->seen >> field_index) & 1;
+}
+
+json_status_t json_parse_buffer(json_reader_t *r, const json_field_t *fields,
+                                size_t field_count, void *out,
+                                const char *data, size_t len) {
+  json_reader_init(r, fields, field_count, out);
+  json_reader_feed(r, data, len);
+  return json_reader_finish(r);
+}
+
+json_status_t json_parse_stream(json_reader_t *r, const json_field_t *fields,
+                                size_t field_count, void *out,
+                                json_read_fn read, void *ctx,
+                                size_t max_body) {
+  char chunk[STREAM_CHUNK];
+  size_t total = 0;
+  json_reader_init(r, fields, field_count, out);
+  for (;;) {
+    int n = read(ctx, chunk, sizeof(chunk));
+    if (n < 0) {
+      r->status = JSON_ERR_READ;
+      return r->status;
+    }
+    if (n == 0)
+      break;
+    total += n;
+    if (total > max_body) {
+      r->status = JSON_ERR_BODY_SIZE;
+      return r->status;
+    }
+    if (json_reader_feed(r, chunk, n) != JSON_INCOMPLETE)
+      break;
+  }
+  return json_reader_finish(r);
+}
+
+const char *json_status_str(json_status_t status) {
+  switch (status) {
+  case JSON_OK:
+    return "ok";
+  case JSON_INCOMPLETE:
+    return "Truncated JSON";
+  case JSON_ERR_SYNTAX:
+    return "Invalid JSON";
+  case JSON_ERR_TYPE:
+    return "Wrong field type";
+  case JSON_ERR_TOO_LONG:
+    return "Field too long";
+  case JSON_ERR_RANGE:
+    return "Number out of range";
+  case JSON_ERR_DEPTH:
+    return "JSON nested too deeply";
+  case JSON_ERR_MISSING:
+    return "Missing required field";
+  case JSON_ERR_READ:
+    return "Failed to read body";
+  case JSON_ERR_BODY_SIZE:
+    return "Body too large";
+  }
+  return "Invalid JSON";
+}
+
+size_t json_quote(char *out, size_t cap, const char *s) {
+  size_t n = 0;
+  if (cap < 3)
+    return cap;
+  out[n++] = '"';
+  for (; *s; s++) {
+    unsigned char ch = (unsigned char)*s;
+    if (n + 7 >= cap)
+      return cap;
+    if (ch == '"' || ch == '\\') {
+      out[n++] = '\\';
+      out[n++] = ch;
+    } else if (ch < 0x20) {
+      n += snprintf(out + n, cap - n, "\\u%04x", ch);
+    } else {
+      out[n++] = ch;
+    }
+  }
+  out[n++] = '"';
+  out[n] = 0;
+  return n;
+}
@@ -0,0 +1,109 @@
+#ifndef JSON_READER_H
+#define JSON_READER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming JSON request reader.
+// Pulls the request body from a read callback in small chunks and binds the
+// members of the top-level object straight into a caller struct described by
+// a field table. Unknown members and nested values are skipped. No heap use;
+// the whole state lives in json_reader_t.
+
+#define JSON_MAX_KEY 24
+#define JSON_MAX_DEPTH 16
+#define JSON_MAX_FIELDS 32
+
+typedef enum {
+  JSON_FIELD_STRING, // char[] member, NUL-terminated
+  JSON_FIELD_INT,    // int32_t member
+  JSON_FIELD_BOOL    // bool member
+} json_field_type_t;
+
+#define JSON_REQUIRED 0x01
+
+typedef struct {
+  const char *key;
+  json_field_type_t type;
+  size_t offset;
+  size_t size;
+  uint8_t flags;
+} json_field_t;
+
+#define JSON_MEMBER_SIZE(type, member) sizeof(((type *)0)->member)
+#define JSON_STR(key, type, member, flags)                                     \
+  {key, JSON_FIELD_STRING, offsetof(type, member),                             \
+   JSON_MEMBER_SIZE(type, member), flags}
+#define JSON_INT(key, type, member, flags)                                     \
+  {key, JSON_FIELD_INT, offsetof(type, member),                                \
+   JSON_MEMBER_SIZE(type, member), flags}
+#define JSON_BOOL(key, type, member, flags)                                    \
+  {key, JSON_FIELD_BOOL, offsetof(type, member),                               \
+   JSON_MEMBER_SIZE(type, member), flags}
+#define JSON_FIELD_COUNT(table) (sizeof(table) / sizeof((table)[0]))
+
+typedef enum {
+  JSON_OK = 0,
+  JSON_INCOMPLETE,    // Input ended inside the document
+  JSON_ERR_SYNTAX,
+  JSON_ERR_TYPE,      // Member has the wrong JSON type
+  JSON_ERR_TOO_LONG,  // String does not fit its member
+  JSON_ERR_RANGE,     // Number does not fit int32_t
+  JSON_ERR_DEPTH,
+  JSON_ERR_MISSING,   // A JSON_REQUIRED member is absent
+  JSON_ERR_READ,      // The read callback failed
+  JSON_ERR_BODY_SIZE  // More input than the caller allows
+} json_status_t;
+
+typedef struct {
+  const json_field_t *fields;
+  size_t field_count;
+  void *out;
+  uint32_t seen; // Bit i set when fields[i] was present (not null)
+  json_status_t status;
+
+  // Tokenizer state
+  uint8_t state;
+  uint8_t depth;
+  uint16_t stack; // Bit per level: 1 = object, 0 = array
+  bool in_key;
+  bool overflow;
+  bool array_open; // '[' just seen, ']' allowed
+  int8_t field;    // Field bound to the pending value, -1 if none
+  char key[JSON_MAX_KEY];
+  size_t len;
+  uint32_t unicode;
+  uint16_t high_surrogate;
+  uint8_t hex_digits;
+  bool negative;
+  bool fraction;
+  int64_t number;
+  char literal[6];
+} json_reader_t;
+
+// Returns bytes read, 0 at end of input, < 0 on error
+typedef int (*json_read_fn)(void *ctx, char *buf, size_t cap);
+
+void json_reader_init(json_reader_t *r, const json_field_t *fields,
+                      size_t field_count, void *out);
+json_status_t json_reader_feed(json_reader_t *r, const char *data, size_t len);
+json_status_t json_reader_finish(json_reader_t *r);
+bool json_reader_has(const json_reader_t *r, size_t field_index);
+
+// One-shot helpers. Members that are absent keep their previous value, so
+// zero or default-fill out first.
+json_status_t json_parse_buffer(json_reader_t *r, const json_field_t *fields,
+                                size_t field_count, void *out,
+                                const char *data, size_t len);
+json_status_t json_parse_stream(json_reader_t *r, const json_field_t *fields,
+                                size_t field_count, void *out,
+                                json_read_fn read, void *ctx,
+                                size_t max_body);
+
+const char *json_status_str(json_status_t status);
+
+// Writes s as a quoted JSON string. Returns the length, or cap if truncated.
+size_t json_quote(char *out, size_t cap, const char *s);
+
+#endif // JSON_READER_H
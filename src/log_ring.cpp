@@ -0,0 +1,334 @@
+#include "log_ring.h"
+
+#ifdef ARDUINO
+#include "metrics.h"
+#include "storage.h"
+#include <Arduino.h>
+#include <interrupts.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+
+// --- Formatting, shared with tools/logdecode ---
+
+// Copies the conversion spec at fmt[0] == '%' into spec with the length
+// modifier replaced by what the packed argument needs. Returns the spec's
+// length in fmt, or 0 when it is malformed.
+static size_t spec_parse(const char *fmt, char *spec, size_t cap, char *conv,
+                         bool *wide, int *stars) {
+  size_t i = 1, n = 0;
+  *wide = false;
+  *stars = 0;
+  spec[n++] = '%';
+  while (fmt[i] && strchr("-+ #0", fmt[i]) && n < cap - 8)
+    spec[n++] = fmt[i++];
+  for (int part = 0; part < 2; part++) {
+    if (part == 1) {
+      if (fmt[i] != '.')
+        break;
+      spec[n++] = fmt[i++];
+    }
+    if (fmt[i] == '*') {
+      spec[n++] = fmt[i++];
+      (*stars)++;
+    }
+    while (fmt[i] >= '0' && fmt[i] <= '9' && n < cap - 6)
+      spec[n++] = fmt[i++];
+  }
+  // Length modifiers: h and hh are kept, the rest become the packed width
+  while (fmt[i] && strchr("hlLjzt", fmt[i])) {
+    if (fmt[i] == 'h')
+      spec[n++] = 'h';
+    else if (fmt[i] == 'j' || (fmt[i] == 'l' && fmt[i + 1] == 'l'))
+      *wide = true;
+    i += fmt[i] == 'l' && fmt[i + 1] == 'l' ? 2 : 1;
+  }
+  if (!fmt[i] || !strchr("diouxXcspfFeEgGaA", fmt[i]) || n >= cap - 4)
+    return 0;
+  *conv = fmt[i];
+  if (*wide && strchr("diouxX", *conv)) {
+    spec[n++] = 'l';
+    spec[n++] = 'l';
+  }
+  spec[n++] = fmt[i];
+  spec[n] = 0;
+  return i + 1;
+}
+
+// Next packed argument of size bytes, NULL past the end
+static const uint8_t *arg_take(const uint8_t **p, const uint8_t *end,
+                               size_t size) {
+  if ((size_t)(end - *p) < size)
+    return NULL;
+  const uint8_t *a = *p;
+  *p += size;
+  return a;
+}
+
+size_t log_ring_format(const char *fmt, const uint8_t *args, size_t len,
+                       char *out, size_t cap) {
+  const uint8_t *end = args + len;
+  size_t n = 0;
+  if (cap == 0)
+    return 0;
+  while (*fmt && n + 1 < cap) {
+    if (*fmt != '%' || fmt[1] == '%') {
+      out[n++] = *fmt;
+      fmt += *fmt == '%' ? 2 : 1;
+      continue;
+    }
+    char spec[24], conv;
+    bool wide;
+    int stars;
+    size_t used = spec_parse(fmt, spec, sizeof(spec), &conv, &wide, &stars);
+    if (!used)
+      break;
+    fmt += used;
+
+    // Star width and precision come first, as ints
+    int star[2] = {0, 0};
+    const uint8_t *a = NULL;
+    bool ok = true;
+    for (int i = 0; i < stars && ok; i++) {
+      ok = (a = arg_take(&args, end, 4)) != NULL;
+      if (ok)
+        memcpy(&star[i], a, 4);
+    }
+    int w = -1;
+    size_t room = cap - n;
+    if (ok && conv == 's') {
+      const char *s = (const char *)args;
+      const char *nul = (const char *)memchr(args, 0, end - args);
+      if (nul) {
+        args = (const uint8_t *)nul + 1;
+        w = stars == 2   ? snprintf(out + n, room, spec, star[0], star[1], s)
+            : stars == 1 ? snprintf(out + n, room, spec, star[0], s)
+                         : snprintf(out + n, room, spec, s);
+      }
+    } else if (ok && conv == 'p') {
+      if ((a = arg_take(&args, end, 4))) {
+        uint32_t v;
+        memcpy(&v, a, 4);
+        w = snprintf(out + n, room, "0x%x", (unsigned)v);
+      }
+    } else if (ok && strchr("fFeEgGaA", conv)) {
+      if ((a = arg_take(&args, end, 8))) {
+        double v;
+        memcpy(&v, a, 8);
+        w = stars == 2   ? snprintf(out + n, room, spec, star[0], star[1], v)
+            : stars == 1 ? snprintf(out + n, room, spec, star[0], v)
+                         : snprintf(out + n, room, spec, v);
+      }
+    } else if (ok && wide) {
+      if ((a = arg_take(&args, end, 8))) {
+        long long v;
+        memcpy(&v, a, 8);
+        w = stars == 2   ? snprintf(out + n, room, spec, star[0], star[1], v)
+            : stars == 1 ? snprintf(out + n, room, spec, star[0], v)
+                         : snprintf(out + n, room, spec, v);
+      }
+    } else if (ok) {
+      if ((a = arg_take(&args, end, 4))) {
+        int v;
+        memcpy(&v, a, 4);
+        w = stars == 2   ? snprintf(out + n, room, spec, star[0], star[1], v)
+            : stars == 1 ? snprintf(out + n, room, spec, star[0], v)
+                         : snprintf(out + n, room, spec, v);
+      }
+    }
+    if (w < 0)
+      break; // Arguments ran out: the record does not match its format
+    n += (size_t)w < room ? (size_t)w : room - 1;
+  }
+  out[n] = 0;
+  return n;
+}
+
+#ifdef ARDUINO
+// --- Ring (ESP8266) ---
+
+// Records are contiguous; one that would straddle the end is preceded by
+// a pad record. head and tail count bytes and only ever grow. Producers
+// reserve space with interrupts masked for a few instructions, so an ISR
+// may log too; the drain in loop() is the only consumer.
+static uint8_t ring[LOG_RING_BYTES] __attribute__((aligned(4)));
+static volatile uint32_t head = 0;
+static volatile uint32_t tail = 0;
+static uint32_t dropped = 0;
+static uint32_t reported = 0; // dropped as of the last notice
+static uint32_t high_water = 0;
+
+#if LOG_RING_BYTES & (LOG_RING_BYTES - 1)
+#error "LOG_RING_BYTES must be a power of two"
+#endif
+#define RING_MASK (LOG_RING_BYTES - 1)
+
+static inline void barrier(void) { __asm__ __volatile__("" ::: "memory"); }
+
+void log_ring_init(void) {
+  metrics_counter_fn("log_ring_dropped_total",
+                     "Log records lost to a full ring", NULL, metrics_read_u32,
+                     &dropped);
+  metrics_gauge_fn("log_ring_high_water_bytes", "Most log ring bytes in use",
+                   NULL, metrics_read_u32, &high_water);
+}
+
+uint8_t *log_ring_reserve(uint8_t level, const char *tag, const char *fmt,
+                          size_t arg_bytes) {
+  uint32_t need = (sizeof(log_rec_t) + arg_bytes + 3) & ~3u;
+  if (need > LOG_RING_BYTES / 4) {
+    dropped++; // A few of these would starve everything else
+    return NULL;
+  }
+  log_rec_t *r;
+  {
+    esp8266::InterruptLock lock;
+    uint32_t at = head & RING_MASK;
+    uint32_t pad = at + need > LOG_RING_BYTES ? LOG_RING_BYTES - at : 0;
+    uint32_t used = head + pad + need - tail;
+    if (used > LOG_RING_BYTES) {
+      dropped++;
+      return NULL;
+    }
+    if (used > high_water)
+      high_water = used;
+    if (pad) {
+      // Only the first word is sure to fit before the end
+      log_rec_t *p = (log_rec_t *)&ring[at];
+      p->len = pad;
+      p->state = LOG_REC_PAD;
+      at = 0;
+    }
+    r = (log_rec_t *)&ring[at];
+    r->state = LOG_REC_FREE;
+    r->len = need;
+    head = head + pad + need;
+  }
+  r->level = level;
+  r->ms = millis();
+  r->tag = (uint32_t)(uintptr_t)tag;
+  r->fmt = (uint32_t)(uintptr_t)fmt;
+  return (uint8_t *)(r + 1);
+}
+
+void log_ring_commit(uint8_t *args) {
+  log_rec_t *r = (log_rec_t *)args - 1;
+  barrier();
+  ((volatile log_rec_t *)r)->state = LOG_REC_READY;
+}
+
+// Oldest committed record, skipping padding; NULL when none is ready
+static const log_rec_t *ring_peek(void) {
+  while (tail != head) {
+    log_rec_t *r = (log_rec_t *)&ring[tail & RING_MASK];
+    uint8_t state = ((volatile log_rec_t *)r)->state;
+    if (state != LOG_REC_PAD)
+      return state == LOG_REC_READY ? r : NULL;
+    r->state = LOG_REC_FREE;
+    barrier();
+    tail = tail + r->len;
+  }
+  return NULL;
+}
+
+static void ring_release(const log_rec_t *r) {
+  ((log_rec_t *)r)->state = LOG_REC_FREE;
+  barrier();
+  tail = tail + r->len;
+}
+
+#if LOG_RING_FLASH
+#define FLASH_BATCH 512
+#define FLASH_IDLE_MS 1000 // A partial batch is written after this long
+
+static void flash_drain(bool force) {
+  static uint32_t last_write = 0;
+  uint32_t now = millis();
+  if (!force && head - tail < FLASH_BATCH && now - last_write < FLASH_IDLE_MS)
+    return;
+  last_write = now;
+
+  static uint8_t batch[FLASH_BATCH];
+  size_t n = 0;
+  const log_rec_t *r;
+  while ((r = ring_peek()) && n + r->len <= sizeof(batch)) {
+    memcpy(batch + n, r, r->len);
+    n += r->len;
+    ring_release(r);
+  }
+  if (n == 0)
+    return;
+  if (storage_size(STORAGE_LOGS, LOG_RING_FLASH_KEY) + (int32_t)n >
+      LOG_RING_FLASH_BYTES) {
+    storage_remove(STORAGE_LOGS, LOG_RING_FLASH_OLD);
+    storage_rename(STORAGE_LOGS, LOG_RING_FLASH_KEY, LOG_RING_FLASH_OLD);
+  }
+  storage_append(STORAGE_LOGS, LOG_RING_FLASH_KEY, batch, n);
+}
+
+void log_ring_drain(void) { flash_drain(false); }
+
+void log_ring_flush(void) {
+  while (ring_peek())
+    flash_drain(true);
+}
+#else
+// Line in progress; the UART takes it as its FIFO frees up
+static char line[192];
+static size_t line_len = 0, line_off = 0;
+static const log_rec_t *line_rec = NULL; // Released once the line is out
+
+static size_t record_line(const log_rec_t *r, char *out, size_t cap) {
+  static const char *const prefix[] = {"", "ERROR: ", "WARN: ", ""};
+  int n = snprintf(out, cap, "[%s] %s", (const char *)(uintptr_t)r->tag,
+                   prefix[r->level & 3]);
+  if (n < 0 || (size_t)n >= cap - 2)
+    n = 0;
+  n += log_ring_format((const char *)(uintptr_t)r->fmt,
+                       (const uint8_t *)(r + 1), r->len - sizeof(*r), out + n,
+                       cap - n - 2);
+  out[n++] = '\r';
+  out[n++] = '\n';
+  return n;
+}
+
+void log_ring_drain(void) {
+  for (;;) {
+    if (line_off < line_len) {
+      size_t room = Serial.availableForWrite();
+      size_t n = line_len - line_off < room ? line_len - line_off : room;
+      if (n)
+        Serial.write((const uint8_t *)line + line_off, n);
+      line_off += n;
+      if (line_off < line_len)
+        return;
+      if (line_rec)
+        ring_release(line_rec);
+      line_rec = NULL;
+    }
+    line_len = line_off = 0;
+
+    const log_rec_t *r = ring_peek();
+    if (r) {
+      line_len = record_line(r, line, sizeof(line));
+      line_rec = r;
+      continue;
+    }
+    // Drops are newer than anything that was queued
+    uint32_t lost = dropped;
+    if (lost == reported)
+      return;
+    line_len = snprintf(line, sizeof(line), "[LOG] %u records dropped\r\n",
+                        (unsigned)(lost - reported));
+    reported = lost;
+  }
+}
+
+void log_ring_flush(void) {
+  while (ring_peek() || line_off < line_len) {
+    log_ring_drain();
+    yield();
+  }
+}
+#endif // LOG_RING_FLASH
+#endif // ARDUINO
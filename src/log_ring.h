@@ -0,0 +1,151 @@
+#ifndef LOG_RING_H
+#define LOG_RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Deferred, tokenized logging for the Arduino build.
+// ESP_LOGx stores the tag and format addresses and the raw arguments in a
+// ring; nothing is formatted or written on the caller's path. loop() drains
+// the ring in idle time, as text to Serial (no more than the UART FIFO
+// takes) or, with LOG_RING_FLASH, as binary records to flash, which
+// tools/logdecode expands against the firmware ELF. String arguments are
+// copied at capture time, since they often live on the caller's stack.
+// Calls above LOG_RING_LEVEL compile to nothing.
+
+#define LOG_RING_ERROR 1
+#define LOG_RING_WARN 2
+#define LOG_RING_INFO 3
+
+#ifndef LOG_RING_LEVEL
+#define LOG_RING_LEVEL LOG_RING_INFO
+#endif
+#ifndef LOG_RING_BYTES
+#define LOG_RING_BYTES 2048 // Power of two
+#endif
+#define LOG_RING_MAX_STR 48 // Longer string arguments are cut
+#ifndef LOG_RING_FLASH
+#define LOG_RING_FLASH 0 // 1: drain binary records to flash, not Serial
+#endif
+#define LOG_RING_FLASH_KEY "trace.bin"
+#define LOG_RING_FLASH_OLD "trace.old"
+#define LOG_RING_FLASH_BYTES (32 * 1024) // Rotated to LOG_RING_FLASH_OLD
+
+// Record layout, the same in the ring and in LOG_RING_FLASH_KEY. Arguments
+// follow the header in format order: 4 bytes each, 8 for %ll, %j and
+// floating point, strings NUL-terminated; all little-endian.
+enum { LOG_REC_FREE = 0, LOG_REC_READY = 0xA5, LOG_REC_PAD = 0x5A };
+
+typedef struct {
+  uint8_t state; // LOG_REC_*, written last
+  uint8_t level; // LOG_RING_*
+  uint16_t len;  // Whole record, header included, multiple of 4
+  uint32_t ms;   // millis() at capture
+  uint32_t tag;  // Address of the tag string
+  uint32_t fmt;  // Address of the format string
+} log_rec_t;
+
+// Expands fmt with the packed arguments of a record. Returns the length
+// written, excluding the NUL; output is cut at cap. Used by the drain and
+// by the host decoder.
+size_t log_ring_format(const char *fmt, const uint8_t *args, size_t len,
+                       char *out, size_t cap);
+
+#ifdef ARDUINO
+#include <string.h>
+
+void log_ring_init(void);  // Registers the drop counter
+void log_ring_drain(void); // Call from loop(); never blocks on the UART
+void log_ring_flush(void); // Drains everything, waiting as needed
+
+// Capture path: reserve, fill, commit. reserve returns NULL and counts a
+// drop when the ring is full.
+uint8_t *log_ring_reserve(uint8_t level, const char *tag, const char *fmt,
+                          size_t arg_bytes);
+void log_ring_commit(uint8_t *args);
+
+static inline size_t log_arg_strlen(const char *s) {
+  size_t n = 0;
+  while (n < LOG_RING_MAX_STR - 1 && s[n])
+    n++;
+  return n;
+}
+
+static inline size_t log_arg_size(const char *s) {
+  return (s ? log_arg_strlen(s) : 6) + 1;
+}
+static inline size_t log_arg_size(char *s) {
+  return log_arg_size((const char *)s);
+}
+static inline size_t log_arg_size(double) { return 8; }
+static inline size_t log_arg_size(float) { return 8; } // Promoted, as printf
+template <typename T> static inline size_t log_arg_size(T *) { return 4; }
+template <typename T> static inline size_t log_arg_size(T) {
+  return sizeof(T) > 4 ? 8 : 4;
+}
+
+static inline uint8_t *log_arg_put(uint8_t *p, const char *s) {
+  if (!s)
+    s = "(null)";
+  size_t n = log_arg_strlen(s);
+  memcpy(p, s, n);
+  p[n] = 0;
+  return p + n + 1;
+}
+static inline uint8_t *log_arg_put(uint8_t *p, char *s) {
+  return log_arg_put(p, (const char *)s);
+}
+static inline uint8_t *log_arg_put(uint8_t *p, double v) {
+  memcpy(p, &v, 8);
+  return p + 8;
+}
+static inline uint8_t *log_arg_put(uint8_t *p, float v) {
+  return log_arg_put(p, (double)v);
+}
+template <typename T> static inline uint8_t *log_arg_put(uint8_t *p, T *v) {
+  uint32_t w = (uint32_t)(uintptr_t)v;
+  memcpy(p, &w, 4);
+  return p + 4;
+}
+template <typename T> static inline uint8_t *log_arg_put(uint8_t *p, T v) {
+  if (sizeof(T) > 4) {
+    uint64_t w = (uint64_t)v;
+    memcpy(p, &w, 8);
+    return p + 8;
+  }
+  uint32_t w = (uint32_t)v;
+  memcpy(p, &w, 4);
+  return p + 4;
+}
+
+template <typename... Args>
+static inline void log_ring_write(uint8_t level, const char *tag,
+                                  const char *fmt, Args... args) {
+  size_t sizes[] = {0, log_arg_size(args)...};
+  size_t bytes = 0;
+  for (size_t n : sizes)
+    bytes += n;
+  uint8_t *start = log_ring_reserve(level, tag, fmt, bytes);
+  if (!start)
+    return;
+  uint8_t *p = start;
+  int order[] = {0, (p = log_arg_put(p, args), 0)...};
+  (void)order;
+  (void)p;
+  log_ring_commit(start);
+}
+
+// Never called; keeps -Wformat checking the arguments
+static inline void __attribute__((format(printf, 1, 2)))
+log_ring_check(const char *, ...) {}
+
+#define LOG_RING_WRITE(level, tag, fmt, ...)                                   \
+  do {                                                                         \
+    if (0)                                                                     \
+      log_ring_check(fmt, ##__VA_ARGS__);                                      \
+    log_ring_write(level, tag, fmt, ##__VA_ARGS__);                            \
+  } while (0)
+#endif // ARDUINO
+
+#endif // LOG_RING_H
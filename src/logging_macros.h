@@ -4,25 +4,42 @@
 #ifdef ARDUINO
 #include <Arduino.h>
 // Macros to mimic ESP-IDF logging in Arduino
-// Uses TAG and adds newline to match IDF behavior
-#define ESP_LOGI(tag, ...)                                                     \
-  do {                                                                         \
-    Serial.printf("[%s] ", tag);                                               \
-    Serial.printf(__VA_ARGS__);                                                \
-    Serial.println();                                                          \
-  } while (0)
-#define ESP_LOGE(tag, ...)                                                     \
-  do {                                                                         \
-    Serial.printf("[%s] ERROR: ", tag);                                        \
-    Serial.printf(__VA_ARGS__);                                                \
-    Serial.println();                                                          \
-  } while (0)
-#define ESP_LOGW(tag, ...)                                                     \
+// Uses TAG and adds newline to match IDF behavior. By default calls are
+// queued in log_ring and printed from loop(); LOG_RING=0 prints in place.
+#include "log_ring.h"
+#ifndef LOG_RING
+#define LOG_RING 1
+#endif
+
+#if LOG_RING
+#define LOG_AT(level, tag, ...) LOG_RING_WRITE(level, tag, __VA_ARGS__)
+#else
+#define LOG_AT(level, tag, ...)                                                \
   do {                                                                         \
-    Serial.printf("[%s] WARN: ", tag);                                         \
+    Serial.printf("[%s] %s", tag,                                              \
+                  level == LOG_RING_ERROR  ? "ERROR: "                         \
+                  : level == LOG_RING_WARN ? "WARN: "                          \
+                                           : "");                              \
     Serial.printf(__VA_ARGS__);                                                \
     Serial.println();                                                          \
   } while (0)
+#endif
+
+#if LOG_RING_LEVEL >= LOG_RING_INFO
+#define ESP_LOGI(tag, ...) LOG_AT(LOG_RING_INFO, tag, __VA_ARGS__)
+#else
+#define ESP_LOGI(tag, ...) ((void)0)
+#endif
+#if LOG_RING_LEVEL >= LOG_RING_WARN
+#define ESP_LOGW(tag, ...) LOG_AT(LOG_RING_WARN, tag, __VA_ARGS__)
+#else
+#define ESP_LOGW(tag, ...) ((void)0)
+#endif
+#if LOG_RING_LEVEL >= LOG_RING_ERROR
+#define ESP_LOGE(tag, ...) LOG_AT(LOG_RING_ERROR, tag, __VA_ARGS__)
+#else
+#define ESP_LOGE(tag, ...) ((void)0)
+#endif
 
 #define ESP_OK 0
 #define ESP_FAIL -1
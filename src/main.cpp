@@ -1,6 +1,5 @@
 #ifdef ARDUINO
 #include <Arduino.h>
-#include <ESP8266WebServer.h>
 #include <ESP8266WiFi.h>
 #include <LittleFS.h>
 #include <NTPClient.h>
@@ -24,22 +23,18 @@
 #include <string.h>
 
 #include "data_manager.h"
+#include "gates.h"
 #include "logging_macros.h"
+#include "metrics.h"
 #include "mqtt_manager.h"
+#include "profiler.h"
+#include "storage.h"
 #include "web_server.h"
 
 #define EXAMPLE_ESP_WIFI_SSID "Kader"
 #define EXAMPLE_ESP_WIFI_PASS "kaderkodeljevo"
 #define EXAMPLE_ESP_WIFI_MAXIMUM_RETRY 5
 
-#if defined(ESP8266)
-#define GPIO_RELAY_1 4  // D2 (GPIO 4)
-#define GPIO_RELAY_2 14 // D5
-#else
-#define GPIO_RELAY_1 2  // D2 (GPIO 2)
-#define GPIO_RELAY_2 18 // D5 (GPIO 18)
-#endif
-
 static const char *TAG = "GATE_CONTROL";
 
 #ifndef ARDUINO
@@ -71,17 +66,15 @@ static void wifi_event_handler(void *arg, esp_event_base_t event_base,
 // Helper to print detailed WiFi status
 void print_wifi_status() {
   if (WiFi.status() == WL_CONNECTED) {
-    Serial.println("\n--- WiFi Connected ---");
-    Serial.printf("SSID: %s\n", WiFi.SSID().c_str());
-    Serial.printf("IP Address: %s\n", WiFi.localIP().toString().c_str());
-    Serial.printf("Subnet Mask: %s\n", WiFi.subnetMask().toString().c_str());
-    Serial.printf("Gateway IP: %s\n", WiFi.gatewayIP().toString().c_str());
-    Serial.printf("MAC Address: %s\n", WiFi.macAddress().c_str());
-    Serial.printf("BSSID: %s\n", WiFi.BSSIDstr().c_str());
-    Serial.printf("RSSI: %d dBm\n", WiFi.RSSI());
-    Serial.println("----------------------\n");
+    ESP_LOGI(TAG, "WiFi Connected, SSID: %s", WiFi.SSID().c_str());
+    ESP_LOGI(TAG, "IP Address: %s", WiFi.localIP().toString().c_str());
+    ESP_LOGI(TAG, "Subnet Mask: %s", WiFi.subnetMask().toString().c_str());
+    ESP_LOGI(TAG, "Gateway IP: %s", WiFi.gatewayIP().toString().c_str());
+    ESP_LOGI(TAG, "MAC Address: %s", WiFi.macAddress().c_str());
+    ESP_LOGI(TAG, "BSSID: %s", WiFi.BSSIDstr().c_str());
+    ESP_LOGI(TAG, "RSSI: %d dBm", (int)WiFi.RSSI());
   } else {
-    Serial.println("\n--- WiFi Disconnected ---");
+    ESP_LOGW(TAG, "WiFi Disconnected");
   }
 }
 
@@ -94,6 +87,7 @@ void wifi_init_sta(void) {
   while (WiFi.status() != WL_CONNECTED) {
     delay(500);
     ESP_LOGI(TAG, "Connecting to WiFi... Status: %d", WiFi.status());
+    log_ring_drain();
   }
 
   if (WiFi.status() == WL_CONNECTED) {
@@ -150,35 +144,26 @@ void init_spiffs(void) {
 }
 #endif
 
-void trigger_relay(void) {
-  ESP_LOGI(TAG, "Triggering Relays on GPIO %d & %d", GPIO_RELAY_1,
-           GPIO_RELAY_2);
-  digitalWrite(GPIO_RELAY_1, LOW);
-  digitalWrite(GPIO_RELAY_2, LOW);
-  delay(2000); // 2 second pulse
-  digitalWrite(GPIO_RELAY_1, HIGH);
-  digitalWrite(GPIO_RELAY_2, HIGH);
-}
-
 void setup(void) {
   Serial.begin(115200);
-  // Initialize GPIO
-  pinMode(GPIO_RELAY_1, OUTPUT);
-  digitalWrite(GPIO_RELAY_1, HIGH);
-
-  pinMode(GPIO_RELAY_2, OUTPUT);
-  digitalWrite(GPIO_RELAY_2, HIGH);
+  metrics_init();
+  log_ring_init();
+  profiler_init();
 
   // Initialize SPIFFS
   if (!LittleFS.begin()) {
-    Serial.println("LittleFS Mount Failed");
+    ESP_LOGE(TAG, "LittleFS Mount Failed");
   } else {
-    Serial.println("LittleFS Mounted");
+    ESP_LOGI(TAG, "LittleFS Mounted");
   }
 
-  // Initialize Data Manager
+  // Bind data classes to their backends, then load
+  storage_init();
   data_manager_init();
 
+  // Initialize GPIO: relays idle until a gate is opened
+  gates_init();
+
   // Initialize WiFi
   ESP_LOGI(TAG, "ESP_WIFI_MODE_STA");
   wifi_init_sta();
@@ -190,32 +175,43 @@ void setup(void) {
 
   // Initialize MQTT
   mqtt_manager_init();
+  log_ring_flush(); // Boot messages, before the first loop()
 }
 
 void loop() {
+  profiler_enter("loop");
   static unsigned long last_debug_time = 0;
   if (millis() - last_debug_time > 5000) {
     last_debug_time = millis();
 
     long rssi = WiFi.RSSI();
-    String ip = WiFi.localIP().toString();
+    IPAddress addr = WiFi.localIP();
+    char ip[16];
+    snprintf(ip, sizeof(ip), "%u.%u.%u.%u", addr[0], addr[1], addr[2],
+             addr[3]);
     uint32_t free_heap = ESP.getFreeHeap();
 
-    Serial.printf(
-        "[DEBUG] Uptime: %lu ms | WiFi: %s | IP: %s | Signal: %ld dBm | Free "
-        "Heap: %u bytes\n",
-        millis(),
-        (WiFi.status() == WL_CONNECTED ? "Connected" : "Disconnected"),
-        ip.c_str(), rssi, free_heap);
+    ESP_LOGI(TAG,
+             "Uptime: %lu ms | WiFi: %s | IP: %s | Signal: %ld dBm | Free "
+             "Heap: %u bytes",
+             millis(),
+             (WiFi.status() == WL_CONNECTED ? "Connected" : "Disconnected"),
+             ip, rssi, (unsigned)free_heap);
 
     if (WiFi.status() != WL_CONNECTED) {
-      Serial.println(
-          "[WARN] WiFi lost! Attempting reconnect in loop if needed...");
+      ESP_LOGW(TAG, "WiFi lost! Attempting reconnect in loop if needed...");
       // Logic to reconnect if needed could go here, though ESP8266/ESP32
       // usually auto-reconnects
     }
   }
 
   // Handle Web Server Client
-  web_server_loop();
+  PROFILE("web server", web_server_loop());
+  PROFILE("mqtt", mqtt_manager_loop());
+  PROFILE("gates", gates_loop());
+  PROFILE("metrics", metrics_loop());
+  PROFILE("event flush", data_manager_flush_events());
+  PROFILE("user sweep", data_manager_sweep());
+  PROFILE("log drain", log_ring_drain()); // Last: whatever time is left
+  profiler_exit();
 }
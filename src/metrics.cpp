@@ -0,0 +1,322 @@
+#include "metrics.h"
+#include "logging_macros.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#endif
+#include <stdio.h>
+#include <string.h>
+
+static const char *TAG = "METRICS";
+
+#ifdef ARDUINO
+// Everything records from loop() on the ESP8266
+#define METRIC_ADD(p, n) (*(p) += (n))
+#else
+// Handlers, the MQTT task and timers record concurrently on the ESP32
+#define METRIC_ADD(p, n) __atomic_fetch_add((p), (n), __ATOMIC_RELAXED)
+#endif
+
+typedef enum { METRIC_COUNTER, METRIC_GAUGE, METRIC_HISTOGRAM } metric_type_t;
+
+typedef struct {
+  uint32_t buckets[METRICS_BUCKETS + 1]; // Per bucket, last one is +Inf
+  uint64_t sum_us;
+} metric_hist_t;
+
+struct metric {
+  const char *name;
+  const char *help;
+  const char *labels;
+  uint8_t type;
+  uint32_t value; // Counter, or gauge stored as int32_t
+  metrics_read_fn read;
+  const void *arg;
+  metric_hist_t *hist;
+};
+
+static const uint32_t bucket_us[METRICS_BUCKETS] = {
+    100,   500,    1000,   5000,   10000,   25000,
+    50000, 100000, 250000, 500000, 1000000, 2500000};
+static const char *bucket_le[METRICS_BUCKETS + 1] = {
+    "0.0001", "0.0005", "0.001", "0.005", "0.01", "0.025", "0.05",
+    "0.1",    "0.25",   "0.5",   "1",     "2.5",  "+Inf"};
+static const char *type_names[] = {"counter", "gauge", "histogram"};
+
+static metric_t metrics[METRICS_MAX];
+static int metric_count = 0;
+static metric_hist_t hists[METRICS_MAX_HISTOGRAMS];
+static int hist_count = 0;
+
+#ifdef ARDUINO
+static uint32_t heap_min = UINT32_MAX;
+#endif
+static uint32_t block_min = UINT32_MAX; // Smallest largest-free-block seen
+
+uint32_t metrics_now_us(void) {
+#ifdef ARDUINO
+  return micros();
+#else
+  return (uint32_t)esp_timer_get_time();
+#endif
+}
+
+static metric_t *metrics_register(const char *name, const char *help,
+                                  const char *labels, metric_type_t type) {
+  if (metric_count >= METRICS_MAX ||
+      (type == METRIC_HISTOGRAM && hist_count >= METRICS_MAX_HISTOGRAMS)) {
+    ESP_LOGE(TAG, "Registry full, %s not registered", name);
+    return NULL;
+  }
+  metric_t *m = &metrics[metric_count++];
+  memset(m, 0, sizeof(*m));
+  m->name = name;
+  m->help = help;
+  m->labels = labels;
+  m->type = type;
+  if (type == METRIC_HISTOGRAM)
+    m->hist = &hists[hist_count++];
+  return m;
+}
+
+metric_t *metrics_counter(const char *name, const char *help,
+                          const char *labels) {
+  return metrics_register(name, help, labels, METRIC_COUNTER);
+}
+
+metric_t *metrics_gauge(const char *name, const char *help,
+                        const char *labels) {
+  return metrics_register(name, help, labels, METRIC_GAUGE);
+}
+
+metric_t *metrics_histogram(const char *name, const char *help,
+                            const char *labels) {
+  return metrics_register(name, help, labels, METRIC_HISTOGRAM);
+}
+
+metric_t *metrics_counter_fn(const char *name, const char *help,
+                             const char *labels, metrics_read_fn read,
+                             const void *arg) {
+  metric_t *m = metrics_register(name, help, labels, METRIC_COUNTER);
+  if (m) {
+    m->read = read;
+    m->arg = arg;
+  }
+  return m;
+}
+
+metric_t *metrics_gauge_fn(const char *name, const char *help,
+                           const char *labels, metrics_read_fn read,
+                           const void *arg) {
+  metric_t *m = metrics_register(name, help, labels, METRIC_GAUGE);
+  if (m) {
+    m->read = read;
+    m->arg = arg;
+  }
+  return m;
+}
+
+void metrics_inc(metric_t *m) {
+  if (m)
+    METRIC_ADD(&m->value, 1);
+}
+
+void metrics_add(metric_t *m, uint32_t n) {
+  if (m)
+    METRIC_ADD(&m->value, n);
+}
+
+void metrics_set(metric_t *m, int32_t value) {
+  if (m)
+    m->value = (uint32_t)value;
+}
+
+void metrics_observe_us(metric_t *m, uint32_t us) {
+  if (!m || !m->hist)
+    return;
+  int b = 0;
+  while (b < METRICS_BUCKETS && us > bucket_us[b])
+    b++;
+  METRIC_ADD(&m->hist->buckets[b], 1);
+  METRIC_ADD(&m->hist->sum_us, (uint64_t)us);
+}
+
+int64_t metrics_read_u32(const void *arg) { return *(const uint32_t *)arg; }
+
+int64_t metrics_read_u64(const void *arg) {
+  return (int64_t)*(const uint64_t *)arg;
+}
+
+// --- Heap ---
+
+static int64_t read_heap_free(const void *arg) {
+#ifdef ARDUINO
+  return ESP.getFreeHeap();
+#else
+  return heap_caps_get_free_size(MALLOC_CAP_8BIT);
+#endif
+}
+
+static int64_t read_heap_min(const void *arg) {
+#ifdef ARDUINO
+  metrics_loop();
+  return heap_min;
+#else
+  return heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+#endif
+}
+
+static int64_t read_heap_largest(const void *arg) {
+#ifdef ARDUINO
+  return ESP.getMaxFreeBlockSize();
+#else
+  return heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+#endif
+}
+
+// The largest block shrinking while free heap stays level is fragmentation
+static int64_t read_block_min(const void *arg) {
+  metrics_loop();
+  return block_min;
+}
+
+static int64_t read_fragmentation(const void *arg) {
+#ifdef ARDUINO
+  return ESP.getHeapFragmentation();
+#else
+  size_t free_heap = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  size_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  return free_heap ? 100 - (int64_t)largest * 100 / free_heap : 0;
+#endif
+}
+
+static int64_t read_uptime(const void *arg) {
+#ifdef ARDUINO
+  return millis() / 1000;
+#else
+  return esp_timer_get_time() / 1000000;
+#endif
+}
+
+void metrics_init(void) {
+  metrics_gauge_fn("uptime_seconds", "Seconds since boot", NULL, read_uptime,
+                   NULL);
+  metrics_gauge_fn("heap_free_bytes", "Free heap", NULL, read_heap_free, NULL);
+  metrics_gauge_fn("heap_min_free_bytes", "Lowest free heap since boot", NULL,
+                   read_heap_min, NULL);
+  metrics_gauge_fn("heap_largest_free_block_bytes",
+                   "Largest allocatable heap block", NULL, read_heap_largest,
+                   NULL);
+  metrics_gauge_fn("heap_min_largest_free_block_bytes",
+                   "Smallest largest-free-block since boot", NULL,
+                   read_block_min, NULL);
+  metrics_gauge_fn("heap_fragmentation_percent",
+                   "Free heap outside the largest block", NULL,
+                   read_fragmentation, NULL);
+}
+
+void metrics_loop(void) {
+#ifdef ARDUINO
+  // The ESP8266 heap keeps no low-water mark, so sample one
+  uint32_t free_heap = ESP.getFreeHeap();
+  if (free_heap < heap_min)
+    heap_min = free_heap;
+#endif
+  uint32_t largest = read_heap_largest(NULL);
+  if (largest < block_min)
+    block_min = largest;
+}
+
+// --- Prometheus text rendering ---
+
+static void format_labels(char *out, size_t cap, const char *labels,
+                          const char *le) {
+  if (labels && le)
+    snprintf(out, cap, "{%s,le=\"%s\"}", labels, le);
+  else if (labels)
+    snprintf(out, cap, "{%s}", labels);
+  else if (le)
+    snprintf(out, cap, "{le=\"%s\"}", le);
+  else
+    out[0] = 0;
+}
+
+static int64_t metric_value(const metric_t *m) {
+  if (m->read)
+    return m->read(m->arg);
+  if (m->type == METRIC_GAUGE)
+    return (int32_t)m->value;
+  return m->value;
+}
+
+// Formats line number `line` of metric `idx`. Returns its length, 0 for a
+// line that is skipped, or -1 once the metric has no more lines.
+static int render_line(int idx, uint32_t line, char *out, size_t cap) {
+  const metric_t *m = &metrics[idx];
+  bool first = idx == 0 || strcmp(metrics[idx - 1].name, m->name) != 0;
+  char labels[128];
+
+  if (line == 0)
+    return first ? snprintf(out, cap, "# HELP %s %s\n", m->name, m->help) : 0;
+  if (line == 1)
+    return first ? snprintf(out, cap, "# TYPE %s %s\n", m->name,
+                            type_names[m->type])
+                 : 0;
+  line -= 2;
+
+  if (m->type != METRIC_HISTOGRAM) {
+    if (line > 0)
+      return -1;
+    format_labels(labels, sizeof(labels), m->labels, NULL);
+    return snprintf(out, cap, "%s%s %lld\n", m->name, labels,
+                    (long long)metric_value(m));
+  }
+
+  const metric_hist_t *h = m->hist;
+  uint64_t count = 0;
+  for (int b = 0; b <= METRICS_BUCKETS; b++)
+    count += h->buckets[b];
+
+  if (line <= METRICS_BUCKETS) {
+    uint64_t cumulative = 0;
+    for (uint32_t b = 0; b <= line; b++)
+      cumulative += h->buckets[b];
+    format_labels(labels, sizeof(labels), m->labels, bucket_le[line]);
+    return snprintf(out, cap, "%s_bucket%s %llu\n", m->name, labels,
+                    (unsigned long long)cumulative);
+  }
+  format_labels(labels, sizeof(labels), m->labels, NULL);
+  if (line == METRICS_BUCKETS + 1)
+    return snprintf(out, cap, "%s_sum%s %llu.%06u\n", m->name, labels,
+                    (unsigned long long)(h->sum_us / 1000000),
+                    (unsigned)(h->sum_us % 1000000));
+  if (line == METRICS_BUCKETS + 2)
+    return snprintf(out, cap, "%s_count%s %llu\n", m->name, labels,
+                    (unsigned long long)count);
+  return -1;
+}
+
+size_t metrics_render(uint32_t *item, uint32_t *line, char *buf, size_t cap) {
+  size_t n = 0;
+  char tmp[256];
+  while (*item < (uint32_t)metric_count) {
+    int len = render_line(*item, *line, tmp, sizeof(tmp));
+    if (len < 0) {
+      (*item)++;
+      *line = 0;
+      continue;
+    }
+    if (len >= (int)sizeof(tmp))
+      len = sizeof(tmp) - 1;
+    if (n + len > cap)
+      break; // Resume with this line on the next call
+    memcpy(buf + n, tmp, len);
+    n += len;
+    (*line)++;
+  }
+  return n;
+}
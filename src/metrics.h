@@ -0,0 +1,59 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Runtime metrics registry.
+// Metrics are registered once at startup into static tables and recorded
+// through the returned handle, which is a few stores with no allocation or
+// locking. All recording functions accept NULL (registry full) as a no-op.
+// /api/admin/metrics renders the registry in Prometheus text format.
+//
+// Series that share a name must be registered one after another so they
+// render as one family. Label strings are not copied; pass literals such as
+// "route=\"/api/x\",method=\"GET\"".
+
+#define METRICS_MAX 64
+#define METRICS_MAX_HISTOGRAMS 24
+#define METRICS_BUCKETS 12 // 100us .. 2.5s, plus +Inf
+
+typedef struct metric metric_t;
+
+// Sampled when the registry is rendered
+typedef int64_t (*metrics_read_fn)(const void *arg);
+
+void metrics_init(void);
+void metrics_loop(void); // Samples the heap low-water marks
+
+metric_t *metrics_counter(const char *name, const char *help,
+                          const char *labels);
+metric_t *metrics_gauge(const char *name, const char *help,
+                        const char *labels);
+metric_t *metrics_histogram(const char *name, const char *help,
+                            const char *labels);
+// Counter or gauge whose value is read by a callback at render time
+metric_t *metrics_counter_fn(const char *name, const char *help,
+                             const char *labels, metrics_read_fn read,
+                             const void *arg);
+metric_t *metrics_gauge_fn(const char *name, const char *help,
+                           const char *labels, metrics_read_fn read,
+                           const void *arg);
+
+void metrics_inc(metric_t *m);
+void metrics_add(metric_t *m, uint32_t n);
+void metrics_set(metric_t *m, int32_t value);
+void metrics_observe_us(metric_t *m, uint32_t us);
+
+uint32_t metrics_now_us(void);
+
+// Read callbacks for values owned by other modules
+int64_t metrics_read_u32(const void *arg);
+int64_t metrics_read_u64(const void *arg);
+
+// Renders whole lines into buf, resuming from *item / *line (both start at
+// 0). Returns the bytes written; 0 once everything has been rendered.
+size_t metrics_render(uint32_t *item, uint32_t *line, char *buf, size_t cap);
+
+#endif // METRICS_H
@@ -4,14 +4,22 @@
 #include <WiFiClient.h>
 #else
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "mqtt_client.h"
 
 #endif
-#include "data_manager.h"      // For logging access if needed
-#include "gate_control_main.h" // To trigger relay
+#include "data_manager.h" // For logging access if needed
+#include "gates.h"
 #include "logging_macros.h"
+#include "metrics.h"
+#include "profiler.h"
+#include "replication.h"
+#include "storage.h"
 
 static const char *TAG = "MQTT_MANAGER";
+#define MQTT_RETRY_MS 10000
 #ifdef ARDUINO
 WiFiClient wifiClient;
 PubSubClient client(wifiClient);
@@ -33,46 +41,99 @@ typedef struct {
 } mqtt_config_t;
 
 static mqtt_config_t mqtt_config;
+static uint32_t config_generation = 0;
+static char client_id[16]; // Unique per node so controllers share a broker
 
-void mqtt_load_config(void) {
+static metric_t *reconnects = NULL;
+
+static void mqtt_register_metrics(void) {
+  reconnects = metrics_counter("mqtt_reconnects_total",
+                               "MQTT connections after the first", NULL);
+}
+
+static const char *CONFIG_KEY = "mqtt_cfg";
+
+static void mqtt_default_config(void) {
 #ifdef ARDUINO
-  // Defaults
   strcpy(mqtt_config.broker_uri, "test.mosquitto.org");
+#else
+  strcpy(mqtt_config.broker_uri, "mqtt://test.mosquitto.org");
+#endif
   strcpy(mqtt_config.topic_cmd, "antigravity_gate/cmd");
   strcpy(mqtt_config.topic_status, "antigravity_gate/status");
-  ESP_LOGW(TAG, "MQTT Config using defaults");
-#else
+}
+
+#ifndef ARDUINO
+// Config written by older firmware directly to NVS
+static bool mqtt_load_legacy_config(void) {
   nvs_handle_t handle;
-  esp_err_t err = nvs_open("mqtt_cfg", NVS_READONLY, &handle);
-  if (err == ESP_OK) {
-    size_t len = sizeof(mqtt_config_t);
-    nvs_get_blob(handle, "config", &mqtt_config, &len);
-    nvs_close(handle);
-    ESP_LOGI(TAG, "MQTT Config loaded from NVS");
-  } else {
-    // Defaults
-    strcpy(mqtt_config.broker_uri, "mqtt://test.mosquitto.org");
-    strcpy(mqtt_config.topic_cmd, "antigravity_gate/cmd");
-    strcpy(mqtt_config.topic_status, "antigravity_gate/status");
-    ESP_LOGW(TAG, "MQTT Config not found, using defaults");
+  if (nvs_open("mqtt_cfg", NVS_READONLY, &handle) != ESP_OK)
+    return false;
+  size_t len = sizeof(mqtt_config_t);
+  esp_err_t err = nvs_get_blob(handle, "config", &mqtt_config, &len);
+  nvs_close(handle);
+  return err == ESP_OK && len == sizeof(mqtt_config_t);
+}
+#endif
+
+void mqtt_load_config(void) {
+  int n = storage_read(STORAGE_CONFIG, CONFIG_KEY, 0, &mqtt_config,
+                       sizeof(mqtt_config_t));
+  if (n == sizeof(mqtt_config_t)) {
+    ESP_LOGI(TAG, "MQTT Config loaded");
+    return;
+  }
+#ifndef ARDUINO
+  if (mqtt_load_legacy_config()) {
+    ESP_LOGI(TAG, "MQTT Config migrated from NVS");
+    storage_write(STORAGE_CONFIG, CONFIG_KEY, &mqtt_config,
+                  sizeof(mqtt_config_t));
+    return;
   }
 #endif
+  mqtt_default_config();
+  ESP_LOGW(TAG, "MQTT Config not found, using defaults");
 }
 
 void mqtt_save_config(const mqtt_config_t *new_config) {
-#ifdef ARDUINO
-  // Not implemented
+  if (!storage_write(STORAGE_CONFIG, CONFIG_KEY, new_config,
+                     sizeof(mqtt_config_t)))
+    ESP_LOGE(TAG, "Failed to save MQTT Config");
   memcpy(&mqtt_config, new_config, sizeof(mqtt_config_t));
+  config_generation++;
+}
+
+#ifdef ARDUINO
+static bool mqtt_connect(void) {
+  profiler_enter("mqtt connect");
+  bool ok = client.connect(client_id);
+  profiler_exit();
+  if (!ok)
+    return false;
+  ESP_LOGI(TAG, "MQTT Connected as %s", client_id);
+  client.subscribe(mqtt_config.topic_cmd);
+  client.subscribe(REPL_TOPIC "/#");
+  client.publish(mqtt_config.topic_status, "ONLINE");
+  repl_on_connected();
+  return true;
+}
 #else
-  nvs_handle_t handle;
-  ESP_ERROR_CHECK(nvs_open("mqtt_cfg", NVS_READWRITE, &handle));
-  nvs_set_blob(handle, "config", new_config, sizeof(mqtt_config_t));
-  nvs_commit(handle);
-  nvs_close(handle);
-  memcpy(&mqtt_config, new_config, sizeof(mqtt_config_t));
-#endif
+static bool connected = false;
+static esp_timer_handle_t repl_timer = NULL;
+// repl_loop() saves applied records to flash, too slow for the esp_timer task
+// that also ends gate pulses: the timer only wakes this task
+static TaskHandle_t repl_task = NULL;
+
+static void repl_task_fn(void *arg) {
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    PROFILE("repl timer", repl_loop());
+  }
 }
 
+static void repl_timer_cb(void *arg) { xTaskNotifyGive(repl_task); }
+#endif
+
 // Public API for Web Server
 void mqtt_manager_get_config(char *uri, char *cmd, char *status) {
   strcpy(uri, mqtt_config.broker_uri);
@@ -80,9 +141,12 @@ void mqtt_manager_get_config(char *uri, char *cmd, char *status) {
   strcpy(status, mqtt_config.topic_status);
 }
 
+uint32_t mqtt_manager_config_generation(void) { return config_generation; }
+
 void mqtt_manager_update_config(const char *uri, const char *cmd,
                                 const char *status) {
-  mqtt_config_t new_cfg;
+  // Fields that are not given keep their current value
+  mqtt_config_t new_cfg = mqtt_config;
   if (uri)
     strncpy(new_cfg.broker_uri, uri, 63);
   if (cmd)
@@ -97,11 +161,9 @@ void mqtt_manager_update_config(const char *uri, const char *cmd,
   if (client.connected()) {
     client.disconnect();
   }
+  metrics_inc(reconnects);
   client.setServer(new_cfg.broker_uri, 1883);
-  if (client.connect("ESP8266Client")) {
-    client.subscribe(new_cfg.topic_cmd);
-    client.publish(new_cfg.topic_status, "ONLINE");
-  }
+  mqtt_connect();
 #else
   if (client) {
     esp_mqtt_client_stop(client);
@@ -111,47 +173,89 @@ void mqtt_manager_update_config(const char *uri, const char *cmd,
 #endif
 }
 
+// Command topic payloads: "OPEN" opens every gate, "OPEN <id>" one gate
+static void mqtt_handle_command(const char *data, size_t len) {
+  int gate = GATE_ANY;
+  if (len < 4 || strncmp(data, "OPEN", 4) != 0)
+    return;
+  if (len == 6 && data[4] == ' ' && data[5] >= '0' &&
+      data[5] < '0' + MAX_GATES) {
+    gate = data[5] - '0';
+  } else if (len != 4) {
+    ESP_LOGW(TAG, "Unknown MQTT command");
+    return;
+  }
+
+  ESP_LOGI(TAG, "Received OPEN command via MQTT");
+  bool opened = gate == GATE_ANY ? gates_open_mask(GATE_MASK_ALL) != 0
+                                 : gates_open(gate);
+  if (!opened) {
+    mqtt_manager_publish_status("UNKNOWN_GATE");
+    return;
+  }
+  mqtt_manager_publish_status("OPENING");
+  data_manager_log_access("MQTT", true, "Remote Open");
+}
+
 #ifndef ARDUINO
+static bool connected_once = false;
+
+// Bytes of QoS>0 messages waiting for an ack
+static int64_t read_outbox_size(const void *arg) {
+  return client ? esp_mqtt_client_get_outbox_size(client) : 0;
+}
+
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base,
                                int32_t event_id, void *event_data) {
   esp_mqtt_event_handle_t event = event_data;
 
+  profiler_enter("mqtt event");
   switch ((esp_mqtt_event_id_t)event_id) {
   case MQTT_EVENT_CONNECTED:
     ESP_LOGI(TAG, "MQTT Connected");
+    if (connected_once)
+      metrics_inc(reconnects);
+    connected_once = true;
+    connected = true;
     esp_mqtt_client_subscribe(client, mqtt_config.topic_cmd, 0);
+    esp_mqtt_client_subscribe(client, REPL_TOPIC "/#", 1);
     esp_mqtt_client_publish(client, mqtt_config.topic_status, "ONLINE", 0, 1,
                             0);
+    repl_on_connected();
     break;
 
   case MQTT_EVENT_DISCONNECTED:
     ESP_LOGI(TAG, "MQTT Disconnected");
+    connected = false;
     break;
 
   case MQTT_EVENT_DATA:
+    // Replication records are small enough to never arrive fragmented
+    if (event->current_data_offset == 0 &&
+        event->data_len == event->total_data_len &&
+        repl_handle_message(event->topic, event->topic_len,
+                            (const uint8_t *)event->data, event->data_len))
+      break;
     ESP_LOGI(TAG, "MQTT Data received");
     printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
     printf("DATA=%.*s\r\n", event->data_len, event->data);
 
     // Handle Command
-    if (strncmp(event->topic, mqtt_config.topic_cmd, event->topic_len) == 0) {
-      if (strncmp(event->data, "OPEN", event->data_len) == 0) {
-        ESP_LOGI(TAG, "Received OPEN command via MQTT");
-        trigger_relay(); // Defined in main
-        mqtt_manager_publish_status("OPENING");
-        data_manager_log_access("MQTT", true, "Remote Open");
-      }
-    }
+    if (strncmp(event->topic, mqtt_config.topic_cmd, event->topic_len) == 0)
+      mqtt_handle_command(event->data, event->data_len);
     break;
 
   default:
     break;
   }
+  profiler_exit();
 }
 #endif
 
 #ifdef ARDUINO
-void mqtt_callback(char *topic, byte *payload, unsigned int length) {
+static void mqtt_on_message(char *topic, byte *payload, unsigned int length) {
+  if (repl_handle_message(topic, strlen(topic), payload, length))
+    return;
   ESP_LOGI(TAG, "MQTT Data received");
   Serial.printf("TOPIC=%s\n", topic);
   Serial.printf("DATA=");
@@ -161,39 +265,85 @@ void mqtt_callback(char *topic, byte *payload, unsigned int length) {
   Serial.println();
 
   // Handle Command
-  if (strcmp(topic, mqtt_config.topic_cmd) == 0) {
-    if (length == 4 && strncmp((char *)payload, "OPEN", 4) == 0) {
-      ESP_LOGI(TAG, "Received OPEN command via MQTT");
-      trigger_relay(); // Defined in main
-      mqtt_manager_publish_status("OPENING");
-    }
-  }
+  if (strcmp(topic, mqtt_config.topic_cmd) == 0)
+    mqtt_handle_command((const char *)payload, length);
+}
+
+void mqtt_callback(char *topic, byte *payload, unsigned int length) {
+  PROFILE("mqtt message", mqtt_on_message(topic, payload, length));
 }
 #endif
 
 void mqtt_manager_init(void) {
+  mqtt_register_metrics();
+  repl_init();
+  snprintf(client_id, sizeof(client_id), "gate-%08x",
+           (unsigned)repl_node_id());
+#ifndef ARDUINO
+  metrics_gauge_fn("mqtt_outbox_bytes", "MQTT messages queued for delivery",
+                   NULL, read_outbox_size, NULL);
+#endif
 #ifdef ARDUINO
   mqtt_load_config();
   client.setServer(mqtt_config.broker_uri, 1883);
   client.setCallback(mqtt_callback);
-  if (client.connect("ESP8266Client")) {
-    ESP_LOGI(TAG, "MQTT Connected");
-    client.subscribe(mqtt_config.topic_cmd);
-    client.publish(mqtt_config.topic_status, "ONLINE");
-  } else {
+  if (!mqtt_connect())
     ESP_LOGE(TAG, "MQTT Connection failed");
-  }
 #else
   mqtt_load_config();
 
   esp_mqtt_client_config_t mqtt_cfg = {
       .broker.address.uri = mqtt_config.broker_uri,
+      .credentials.client_id = client_id,
   };
 
   client = esp_mqtt_client_init(&mqtt_cfg);
   esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler,
                                  client);
   esp_mqtt_client_start(client);
+
+  xTaskCreate(repl_task_fn, "repl", 4096, NULL, tskIDLE_PRIORITY + 1,
+              &repl_task);
+  esp_timer_create_args_t args = {.callback = repl_timer_cb,
+                                  .name = "repl"};
+  esp_timer_create(&args, &repl_timer);
+  esp_timer_start_periodic(repl_timer, 100 * 1000);
+#endif
+}
+
+void mqtt_manager_loop(void) {
+#ifdef ARDUINO
+  static unsigned long last_attempt = 0;
+  if (client.connected()) {
+    client.loop();
+  } else if (millis() - last_attempt > MQTT_RETRY_MS) {
+    // connect() blocks for up to the socket timeout, so retry sparingly
+    last_attempt = millis();
+    if (mqtt_connect())
+      metrics_inc(reconnects);
+  }
+  repl_loop();
+#endif
+}
+
+bool mqtt_manager_connected(void) {
+#ifdef ARDUINO
+  return client.connected();
+#else
+  return connected;
+#endif
+}
+
+bool mqtt_manager_publish_raw(const char *topic, const void *data,
+                              size_t len) {
+#ifdef ARDUINO
+  return client.connected() &&
+         client.publish(topic, (const uint8_t *)data, len);
+#else
+  // Queued, so the caller's task never waits on the network
+  return connected && esp_mqtt_client_enqueue(client, topic,
+                                              (const char *)data, len, 1, 0,
+                                              true) >= 0;
 #endif
 }
 
@@ -2,10 +2,18 @@
 #define MQTT_MANAGER_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 void mqtt_manager_init(void);
+void mqtt_manager_loop(void); // Keeps the ESP8266 connection serviced
 void mqtt_manager_publish_status(const char *status);
 void mqtt_manager_get_config(char *uri, char *cmd, char *status);
 void mqtt_manager_update_config(const char *uri, const char *cmd, const char *status);
+// Bumped whenever the config changes
+uint32_t mqtt_manager_config_generation(void);
+bool mqtt_manager_connected(void);
+// Binary publish for replication; false when it could not be queued
+bool mqtt_manager_publish_raw(const char *topic, const void *data, size_t len);
 
 #endif // MQTT_MANAGER_H
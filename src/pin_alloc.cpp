@@ -0,0 +1,110 @@
+#include "pin_alloc.h"
+#include "logging_macros.h"
+#include "storage.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include "esp_log.h"
+#include "esp_random.h"
+#endif
+#include <stdio.h>
+#include <string.h>
+
+static const char *TAG = "PIN_ALLOC";
+static const char *STATE_KEY = "pin_alloc";
+
+#define FEISTEL_ROUNDS 4
+
+// Persisted so a reboot does not re-issue recently deleted codes
+typedef struct {
+  uint32_t key;
+  uint32_t next; // Position in the permutation
+  uint8_t digits;
+} pin_alloc_state_t;
+
+static pin_alloc_state_t state;
+static uint32_t space = 0; // 10^digits
+static uint32_t side = 0;  // Feistel works on side x side >= space
+
+static uint32_t draw_random(void) {
+#ifdef ARDUINO
+  return RANDOM_REG32;
+#else
+  return esp_random();
+#endif
+}
+
+static uint32_t mix(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  x ^= x >> 16;
+  return x;
+}
+
+// Bijection on [0, side^2): a balanced Feistel network over base-side
+// digits, cycle-walked until the result falls inside [0, space)
+static uint32_t permute(uint32_t x) {
+  do {
+    uint32_t l = x / side, r = x % side;
+    for (int i = 0; i < FEISTEL_ROUNDS; i++) {
+      uint32_t f = mix(r ^ (state.key + i * 0x9e3779b9)) % side;
+      uint32_t t = (l + f) % side;
+      l = r;
+      r = t;
+    }
+    x = l * side + r;
+  } while (x >= space);
+  return x;
+}
+
+static void rekey(void) {
+  state.key = draw_random();
+  state.next = 0;
+}
+
+static void save_state(void) {
+  if (!storage_write(STORAGE_CONFIG, STATE_KEY, &state, sizeof(state)))
+    ESP_LOGE(TAG, "Failed to save allocator state");
+}
+
+void pin_alloc_init(int digits) {
+  if (digits < PIN_ALLOC_MIN_DIGITS || digits > PIN_ALLOC_MAX_DIGITS)
+    digits = PIN_ALLOC_MIN_DIGITS;
+  space = 1;
+  for (int i = 0; i < digits; i++)
+    space *= 10;
+  side = 1;
+  while (side * side < space)
+    side++;
+
+  int n = storage_read(STORAGE_CONFIG, STATE_KEY, 0, &state, sizeof(state));
+  if (n != sizeof(state) || state.digits != digits || state.next >= space) {
+    state.digits = digits;
+    rekey();
+    save_state();
+    ESP_LOGI(TAG, "New %d-digit code sequence", digits);
+  }
+}
+
+bool pin_alloc_next(char *out, size_t cap, pin_in_use_fn in_use) {
+  // Only records in the table can collide, so this loop is short unless
+  // nearly the whole space is taken
+  for (uint32_t tries = 0; tries < space; tries++) {
+    if (state.next >= space) {
+      rekey(); // Sequence used up: start a fresh one
+      ESP_LOGI(TAG, "Code sequence wrapped, rekeyed");
+    }
+    uint32_t code = permute(state.next++);
+    snprintf(out, cap, "%0*u", state.digits, (unsigned)code);
+    if (!in_use || !in_use(out)) {
+      save_state();
+      return true;
+    }
+  }
+  save_state();
+  ESP_LOGE(TAG, "No free %d-digit codes", state.digits);
+  return false;
+}
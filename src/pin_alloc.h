@@ -0,0 +1,27 @@
+#ifndef PIN_ALLOC_H
+#define PIN_ALLOC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// PIN allocator.
+// Walks a keyed permutation of the 10^digits code space, so every code is
+// issued once per key in an unpredictable order without retry loops. The
+// key and position persist in the STORAGE_CONFIG class; a new key is drawn
+// when the space is used up or the PIN length changes.
+
+#define PIN_ALLOC_MIN_DIGITS 4
+#define PIN_ALLOC_MAX_DIGITS 8
+
+// Returns true when the code is held by an existing record
+typedef bool (*pin_in_use_fn)(const char *pin);
+
+void pin_alloc_init(int digits);
+
+// Writes the next free code (digits + NUL) to out. Codes that are in use,
+// e.g. received from another controller, are skipped. Returns false only if
+// every code is taken.
+bool pin_alloc_next(char *out, size_t cap, pin_in_use_fn in_use);
+
+#endif // PIN_ALLOC_H
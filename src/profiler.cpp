@@ -0,0 +1,298 @@
+#include "profiler.h"
+#include "json_reader.h"
+#include "logging_macros.h"
+#include "metrics.h"
+#include "storage.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#endif
+#include <stdio.h>
+#include <string.h>
+
+static const char *TAG = "PROFILER";
+
+typedef struct {
+  const char *name;
+  uint32_t count;
+  uint32_t max_us;
+  uint32_t stalls; // Stalls it took the most time in
+  uint64_t total_us;
+} span_stat_t;
+
+typedef struct {
+  uint32_t at_ms; // Uptime when the iteration ended
+  uint32_t us;
+  const char *span; // Most self time in the iteration
+  uint32_t span_us;
+  uint32_t storage_us; // Slowest storage operation, 0 when there was none
+  uint8_t storage_class;
+  uint8_t storage_op;
+  char storage_key[STORAGE_MAX_KEY];
+} stall_t;
+
+typedef struct {
+  const char *name;
+  uint32_t start;
+  uint32_t child_us;
+} frame_t;
+
+// The spans one task is in, and its iteration's worst so far
+typedef struct {
+  frame_t frames[PROFILER_DEPTH];
+  int depth; // Past PROFILER_DEPTH, spans are counted but not timed
+  stall_t cur;
+} task_state_t;
+
+#ifdef ARDUINO
+// Everything runs from loop() on the ESP8266
+static task_state_t state;
+#define LOCK()
+#define UNLOCK()
+#else
+// Handlers, the MQTT task and timers nest spans independently
+static __thread task_state_t state;
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+#define LOCK() portENTER_CRITICAL(&lock)
+#define UNLOCK() portEXIT_CRITICAL(&lock)
+#endif
+
+static span_stat_t spans[PROFILER_SPANS];
+static int span_count = 0;
+static stall_t stalls[PROFILER_STALLS];
+static int stall_count = 0;
+static uint32_t iterations = 0;
+static uint32_t stall_total = 0;
+
+static metric_t *iteration_duration = NULL;
+
+void profiler_init(void) {
+  iteration_duration = metrics_histogram(
+      "loop_iteration_duration_seconds",
+      "Outermost span durations: loop() iterations on the ESP8266", NULL);
+  metrics_counter_fn("loop_stalls_total",
+                     "Iterations over the stall budget", NULL,
+                     metrics_read_u32, &stall_total);
+}
+
+void profiler_enter(const char *name) {
+  task_state_t *t = &state;
+  if (t->depth == 0)
+    memset(&t->cur, 0, sizeof(t->cur));
+  if (t->depth < PROFILER_DEPTH) {
+    frame_t *f = &t->frames[t->depth];
+    f->name = name;
+    f->child_us = 0;
+    f->start = metrics_now_us();
+  }
+  t->depth++;
+}
+
+// Stats slot for name, NULL when the table is full. Caller holds the lock.
+static span_stat_t *span_stat(const char *name) {
+  for (int i = 0; i < span_count; i++) {
+    if (spans[i].name == name || strcmp(spans[i].name, name) == 0)
+      return &spans[i];
+  }
+  if (span_count == PROFILER_SPANS)
+    return NULL;
+  span_stat_t *s = &spans[span_count++];
+  memset(s, 0, sizeof(*s));
+  s->name = name;
+  return s;
+}
+
+// Keeps s if it is among the worst stalls. Caller holds the lock.
+static bool stall_keep(const stall_t *s) {
+  int slot = stall_count;
+  if (stall_count == PROFILER_STALLS) {
+    slot = 0;
+    for (int i = 1; i < stall_count; i++) {
+      if (stalls[i].us < stalls[slot].us)
+        slot = i;
+    }
+    if (stalls[slot].us >= s->us)
+      return false;
+  } else {
+    stall_count++;
+  }
+  stalls[slot] = *s;
+  return true;
+}
+
+static uint32_t uptime_ms(void) {
+#ifdef ARDUINO
+  return millis();
+#else
+  return (uint32_t)(esp_timer_get_time() / 1000);
+#endif
+}
+
+void profiler_exit(void) {
+  task_state_t *t = &state;
+  if (t->depth == 0)
+    return; // Unbalanced
+  if (--t->depth >= PROFILER_DEPTH)
+    return;
+  const frame_t *f = &t->frames[t->depth];
+  uint32_t us = metrics_now_us() - f->start;
+  uint32_t self = us - f->child_us;
+  if (t->depth > 0)
+    t->frames[t->depth - 1].child_us += us;
+  if (!t->cur.span || self > t->cur.span_us) {
+    t->cur.span = f->name;
+    t->cur.span_us = self;
+  }
+
+  bool stalled = t->depth == 0 && us > PROFILER_BUDGET_US;
+  bool kept = false;
+  LOCK();
+  span_stat_t *s = span_stat(f->name);
+  if (s) {
+    s->count++;
+    s->total_us += self;
+    if (self > s->max_us)
+      s->max_us = self;
+  }
+  if (t->depth == 0)
+    iterations++;
+  if (stalled) {
+    stall_total++;
+    if ((s = span_stat(t->cur.span)))
+      s->stalls++;
+    t->cur.at_ms = uptime_ms();
+    t->cur.us = us;
+    kept = stall_keep(&t->cur);
+  }
+  UNLOCK();
+
+  if (t->depth == 0)
+    metrics_observe_us(iteration_duration, us);
+  if (kept)
+    ESP_LOGW(TAG, "Stalled %u ms, %u ms of it in %s", (unsigned)(us / 1000),
+             (unsigned)(t->cur.span_us / 1000), t->cur.span);
+}
+
+void profiler_storage_op(uint8_t cls, uint8_t op, const char *key,
+                         uint32_t us) {
+  task_state_t *t = &state;
+  if (t->depth == 0 || us <= t->cur.storage_us)
+    return;
+  t->cur.storage_us = us;
+  t->cur.storage_class = cls;
+  t->cur.storage_op = op;
+  snprintf(t->cur.storage_key, sizeof(t->cur.storage_key), "%s", key);
+}
+
+// --- Rendering ---
+
+static uint64_t stall_key(int i) { return stalls[i].us; }
+static uint64_t span_key(int i) { return spans[i].total_us; }
+
+// Index of the entry ranked rank-th by key, largest first; -1 past the
+// end. Caller holds the lock.
+static int ranked(uint64_t (*key)(int), int count, uint32_t rank) {
+  for (int i = 0; i < count; i++) {
+    uint32_t above = 0;
+    for (int j = 0; j < count; j++)
+      above += key(j) > key(i) || (key(j) == key(i) && j < i);
+    if (above == rank)
+      return i;
+  }
+  return -1;
+}
+
+static int render_stall(const stall_t *s, bool first, char *out, size_t cap) {
+  char span[64], key[2 * STORAGE_MAX_KEY + 2], storage[128];
+  json_quote(span, sizeof(span), s->span);
+  if (s->storage_us) {
+    json_quote(key, sizeof(key), s->storage_key);
+    snprintf(storage, sizeof(storage),
+             "{\"class\":\"%s\",\"op\":\"%s\",\"key\":%s,\"us\":%u}",
+             storage_class_name((storage_class_t)s->storage_class),
+             storage_op_name((storage_op_t)s->storage_op), key,
+             (unsigned)s->storage_us);
+  } else {
+    snprintf(storage, sizeof(storage), "null");
+  }
+  return snprintf(out, cap,
+                  "%s{\"at_ms\":%u,\"us\":%u,\"span\":%s,\"span_us\":%u,"
+                  "\"storage\":%s}",
+                  first ? "" : ",", (unsigned)s->at_ms, (unsigned)s->us, span,
+                  (unsigned)s->span_us, storage);
+}
+
+static int render_span(const span_stat_t *s, bool first, char *out,
+                       size_t cap) {
+  char name[64];
+  json_quote(name, sizeof(name), s->name);
+  return snprintf(out, cap,
+                  "%s{\"name\":%s,\"count\":%u,\"total_us\":%llu,"
+                  "\"max_us\":%u,\"stalls\":%u}",
+                  first ? "" : ",", name, (unsigned)s->count,
+                  (unsigned long long)s->total_us, (unsigned)s->max_us,
+                  (unsigned)s->stalls);
+}
+
+// One piece of the document: its length, or -1 once the item is complete.
+// Entries are copied out under the lock and formatted after.
+static int render_piece(uint32_t item, uint32_t line, char *out, size_t cap) {
+  switch (item) {
+  case 0:
+    if (line > 0)
+      return -1;
+    return snprintf(out, cap,
+                    "{\"budget_us\":%u,\"iterations\":%u,\"stalls\":%u,"
+                    "\"worst\":[",
+                    (unsigned)PROFILER_BUDGET_US, (unsigned)iterations,
+                    (unsigned)stall_total);
+  case 1: {
+    stall_t s;
+    LOCK();
+    int i = ranked(stall_key, stall_count, line);
+    if (i >= 0)
+      s = stalls[i];
+    UNLOCK();
+    return i < 0 ? -1 : render_stall(&s, line == 0, out, cap);
+  }
+  case 2: {
+    if (line == 0)
+      return snprintf(out, cap, "],\"spans\":[");
+    span_stat_t s;
+    LOCK();
+    int i = ranked(span_key, span_count, line - 1);
+    if (i >= 0)
+      s = spans[i];
+    UNLOCK();
+    return i < 0 ? -1 : render_span(&s, line == 1, out, cap);
+  }
+  case 3:
+    return line == 0 ? snprintf(out, cap, "]}") : -1;
+  }
+  return -1;
+}
+
+size_t profiler_render(uint32_t *item, uint32_t *line, char *buf, size_t cap) {
+  size_t n = 0;
+  char tmp[256];
+  while (*item <= 3) {
+    int len = render_piece(*item, *line, tmp, sizeof(tmp));
+    if (len < 0) {
+      (*item)++;
+      *line = 0;
+      continue;
+    }
+    if (len >= (int)sizeof(tmp))
+      len = sizeof(tmp) - 1;
+    if (n + len > cap)
+      break; // Resume with this piece on the next call
+    memcpy(buf + n, tmp, len);
+    n += len;
+    (*line)++;
+  }
+  return n;
+}
@@ -0,0 +1,46 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Stall detector and span profiler.
+// Handlers, tasks and callbacks wrap their bodies in profiler_enter() /
+// profiler_exit(). Each span's self time (less the spans nested in it) is
+// totalled per name. The outermost span is one iteration: loop() on the
+// ESP8266, a handler or callback in its own task on the ESP32. An
+// iteration over PROFILER_BUDGET_US is a stall; the PROFILER_STALLS worst
+// are kept with the span and the storage operation that took longest in
+// them. /api/admin/profile renders both, worst first.
+
+#ifndef PROFILER_BUDGET_US
+#define PROFILER_BUDGET_US 50000
+#endif
+#define PROFILER_STALLS 8
+#define PROFILER_SPANS 24
+#define PROFILER_DEPTH 6 // Deeper spans count toward their parent
+
+void profiler_init(void);
+
+// name is kept, not copied: pass a literal. Spans are totalled by name.
+void profiler_enter(const char *name);
+void profiler_exit(void);
+// Runs stmt as a span
+#define PROFILE(name, stmt)                                                    \
+  do {                                                                         \
+    profiler_enter(name);                                                      \
+    stmt;                                                                      \
+    profiler_exit();                                                           \
+  } while (0)
+
+// Called by the storage layer after each timed operation
+void profiler_storage_op(uint8_t cls, uint8_t op, const char *key,
+                         uint32_t us);
+
+// Renders the stalls and spans as JSON, as much as fits in cap. item and
+// line start at 0 and carry the position between calls; returns 0 when
+// done.
+size_t profiler_render(uint32_t *item, uint32_t *line, char *buf, size_t cap);
+
+#endif // PROFILER_H
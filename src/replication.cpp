@@ -0,0 +1,563 @@
+#include "replication.h"
+#include "logging_macros.h"
+#include "metrics.h"
+#include "mqtt_manager.h"
+#include "storage.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_timer.h"
+#endif
+#include <string.h>
+
+static const char *TAG = "REPL";
+static const char *FLOOR_KEY = "repl.floor";
+
+#if MAX_USERS > 64
+#error "replication tracks dirty records in a 64-bit mask"
+#endif
+
+#define REPL_TOPIC_RECORD REPL_TOPIC "/u"
+#define REPL_TOPIC_DIGEST REPL_TOPIC "/d"
+
+#define REPL_TICK_MS 100
+#define REPL_SEND_PER_TICK 4 // Keeps a full resend from flooding the socket
+#define REPL_DIGEST_INTERVAL_MS 60000
+#define REPL_RESEND_HOLDOFF_MS 30000
+#define REPL_MAX_REFUSALS 4 // Deletes waiting to answer refused records
+
+// Wire format, little-endian:
+//   record: 'U' origin:4 created:4 version:4 pin:PIN_LENGTH flags:1 type:1
+//           gates:1 days:1 start:2 end:2 limit:4 expiry:8 name_len:1 name
+//           uses_len:1 (node:4 count:4)*uses_len, uses sorted by node
+//   digest: 'D' origin:4 hash:4 count:2 clock:4
+#define MSG_RECORD 'U'
+#define MSG_DIGEST 'D'
+#define RECORD_FIXED_LEN (1 + 12 + PIN_LENGTH + 4 + 4 + 4 + 8 + 1)
+#define RECORD_USE_LEN 8
+#define RECORD_MAX_LEN                                                         \
+  (RECORD_FIXED_LEN + NAME_LENGTH - 1 + 1 + USER_USE_NODES * RECORD_USE_LEN)
+#define DIGEST_LEN 15
+#define FLAG_ACTIVE 0x01
+#define FLAG_USES_LOST 0x02
+
+static uint32_t node_id = 0;
+static uint8_t node_tag = 0;
+static uint32_t counter = 0; // Lamport counter, stamps are counter << 8 | tag
+static uint64_t dirty = 0;   // Slots waiting to be published
+static bool save_pending = false;
+static bool resend_done = false;
+static uint32_t last_tick = 0;
+static uint32_t last_digest = 0;
+static uint32_t last_resend = 0;
+// Newest creation stamp among the tombstones this node has forgotten
+static uint32_t tombstone_floor = 0;
+
+static metric_t *records_sent = NULL;
+static metric_t *records_applied = NULL;
+static metric_t *resends = NULL;
+
+static uint32_t now_ms(void) {
+#ifdef ARDUINO
+  return millis();
+#else
+  return (uint32_t)(esp_timer_get_time() / 1000);
+#endif
+}
+
+static void put_u16(uint8_t *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+  put_u16(p, v);
+  put_u16(p + 2, v >> 16);
+}
+
+static void put_u64(uint8_t *p, uint64_t v) {
+  put_u32(p, (uint32_t)v);
+  put_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint16_t get_u16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+
+static uint32_t get_u32(const uint8_t *p) {
+  return get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+  return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+static uint32_t next_stamp(void) { return (++counter << 8) | node_tag; }
+
+static void observe_stamp(uint32_t stamp) {
+  if ((stamp >> 8) > counter)
+    counter = stamp >> 8;
+}
+
+static int slot_of(const user_t *u) {
+  return (int)(u - data_manager_get_data()->users);
+}
+
+// A record with its name, as sent on the wire
+typedef struct {
+  user_t u;
+  char name[NAME_LENGTH];
+} repl_record_t;
+
+static void load_record(const user_t *u, repl_record_t *r) {
+  r->u = *u;
+  strncpy(r->name, data_manager_user_name(u), NAME_LENGTH - 1);
+  r->name[NAME_LENGTH - 1] = 0;
+}
+
+// --- Encoding ---
+
+static size_t encode_record(const repl_record_t *r, uint8_t *buf) {
+  const user_t *u = &r->u;
+  uint8_t *p = buf;
+  size_t name_len = strnlen(r->name, NAME_LENGTH - 1);
+  *p++ = MSG_RECORD;
+  put_u32(p, node_id);
+  put_u32(p + 4, u->created);
+  put_u32(p + 8, u->version);
+  p += 12;
+  memcpy(p, u->pin, PIN_LENGTH);
+  p += PIN_LENGTH;
+  *p++ = (u->active ? FLAG_ACTIVE : 0) | (u->uses_lost ? FLAG_USES_LOST : 0);
+  *p++ = u->type;
+  *p++ = u->gate_mask;
+  *p++ = u->allowed_days;
+  put_u16(p, u->start_time);
+  put_u16(p + 2, u->end_time);
+  put_u32(p + 4, u->use_limit);
+  put_u64(p + 8, u->expiry_date);
+  p += 16;
+  *p++ = (uint8_t)name_len;
+  memcpy(p, r->name, name_len);
+  p += name_len;
+
+  // Sorted, so replicas holding the same counts in other slots hash the same
+  uint8_t *uses_len = p++;
+  *uses_len = 0;
+  const user_uses_t *last = NULL;
+  for (;;) {
+    const user_uses_t *next = NULL;
+    for (int i = 0; i < USER_USE_NODES; i++) {
+      const user_uses_t *e = &u->uses[i];
+      if (e->count && (!last || e->node > last->node) &&
+          (!next || e->node < next->node))
+        next = e;
+    }
+    if (!next)
+      break;
+    put_u32(p, next->node);
+    put_u32(p + 4, next->count);
+    p += RECORD_USE_LEN;
+    (*uses_len)++;
+    last = next;
+  }
+  return p - buf;
+}
+
+static bool decode_record(const uint8_t *p, size_t len, uint32_t *origin,
+                          repl_record_t *r) {
+  if (len < RECORD_FIXED_LEN || p[0] != MSG_RECORD)
+    return false;
+  size_t name_len = p[RECORD_FIXED_LEN - 1];
+  if (name_len >= NAME_LENGTH || len < RECORD_FIXED_LEN + name_len + 1)
+    return false;
+  size_t uses_len = p[RECORD_FIXED_LEN + name_len];
+  if (uses_len > USER_USE_NODES ||
+      len != RECORD_FIXED_LEN + name_len + 1 + uses_len * RECORD_USE_LEN)
+    return false;
+
+  memset(r, 0, sizeof(*r));
+  user_t *u = &r->u;
+  *origin = get_u32(p + 1);
+  u->created = get_u32(p + 5);
+  u->version = get_u32(p + 9);
+  p += 13;
+  memcpy(u->pin, p, PIN_LENGTH);
+  p += PIN_LENGTH;
+  if (u->pin[PIN_LENGTH - 1] != 0 || u->pin[0] == 0 || u->created == 0)
+    return false;
+  u->active = (*p & FLAG_ACTIVE) != 0;
+  u->uses_lost = (*p++ & FLAG_USES_LOST) != 0;
+  u->type = *p++;
+  if (u->type > USER_TYPE_ONE_TIME)
+    return false;
+  u->gate_mask = *p++;
+  u->allowed_days = *p++;
+  u->start_time = get_u16(p);
+  u->end_time = get_u16(p + 2);
+  u->use_limit = get_u32(p + 4);
+  uint64_t expiry = get_u64(p + 8);
+  if (expiry > UINT32_MAX)
+    return false;
+  u->expiry_date = (uint32_t)expiry;
+  p += 17;
+  memcpy(r->name, p, name_len);
+  p += name_len + 1;
+  for (size_t i = 0; i < uses_len; i++, p += RECORD_USE_LEN) {
+    u->uses[i].node = get_u32(p);
+    u->uses[i].count = get_u32(p + 4);
+    if ((i && u->uses[i].node <= u->uses[i - 1].node) || !u->uses[i].count)
+      return false; // Out of order, repeated or empty
+  }
+  data_manager_count_uses(u);
+  return true;
+}
+
+// FNV-1a over the encoded record, without the origin
+static uint32_t record_hash(const user_t *u) {
+  repl_record_t r;
+  uint8_t buf[RECORD_MAX_LEN];
+  load_record(u, &r);
+  size_t len = encode_record(&r, buf);
+  uint32_t h = 2166136261u;
+  for (size_t i = 5; i < len; i++)
+    h = (h ^ buf[i]) * 16777619u;
+  return h;
+}
+
+// Order-independent summary of every replicated record
+static uint32_t table_digest(uint16_t *count) {
+  system_data_t *d = data_manager_get_data();
+  uint32_t sum = 0;
+  *count = 0;
+  for (int i = 0; i < MAX_USERS; i++) {
+    if (d->users[i].created) {
+      sum += record_hash(&d->users[i]);
+      (*count)++;
+    }
+  }
+  return sum;
+}
+
+// Compares the wire form, so layout padding and name pool offsets do not
+// count as differences
+static int record_cmp(const repl_record_t *a, const repl_record_t *b) {
+  uint8_t ea[RECORD_MAX_LEN], eb[RECORD_MAX_LEN];
+  size_t la = encode_record(a, ea), lb = encode_record(b, eb);
+  int c = memcmp(ea + 5, eb + 5, (la < lb ? la : lb) - 5);
+  return c != 0 ? c : (int)la - (int)lb;
+}
+
+// --- Merge ---
+
+// Total order for two changes to the same record. Stamps only tie between
+// nodes sharing a tag; the content then decides so every node agrees.
+static bool wins_over(const repl_record_t *a, const repl_record_t *b) {
+  if (a->u.version != b->u.version)
+    return a->u.version > b->u.version;
+  return record_cmp(a, b) > 0;
+}
+
+// Merges in into local. A later incarnation of the PIN replaces the record;
+// for the same incarnation spent uses add up across nodes and deletes stick,
+// the rest is last writer wins.
+static void merge_record(repl_record_t *local, const repl_record_t *in) {
+  if (in->u.created != local->u.created) {
+    if (in->u.created > local->u.created) {
+      if (local->u.active && in->u.active &&
+          strcmp(local->name, in->name) != 0)
+        ESP_LOGW(TAG, "PIN %s re-created elsewhere, replacing %s", in->u.pin,
+                 local->name);
+      *local = *in;
+    }
+    return;
+  }
+  bool in_wins = wins_over(in, local);
+  repl_record_t merged = in_wins ? *in : *local;
+  data_manager_merge_uses(&merged.u, in_wins ? &local->u : &in->u);
+  merged.u.active = in->u.active && local->u.active;
+  *local = merged;
+}
+
+// Existing record for the same incarnation, else the latest one for the PIN
+static user_t *find_record(const user_t *in) {
+  system_data_t *d = data_manager_get_data();
+  user_t *best = NULL;
+  for (int i = 0; i < MAX_USERS; i++) {
+    user_t *u = &d->users[i];
+    if (!u->created || strcmp(u->pin, in->pin) != 0)
+      continue;
+    if (u->created == in->created)
+      return u;
+    if (!best || u->created > best->created)
+      best = u;
+  }
+  return best;
+}
+
+static void recount_users(void) {
+  system_data_t *d = data_manager_get_data();
+  int count = 0;
+  for (int i = 0; i < MAX_USERS; i++)
+    count += d->users[i].active;
+  d->user_count = count;
+}
+
+// Writes r into the table slot, moving the name only when it changed. On
+// failure an existing record is left as it was and a fresh slot stays empty.
+static bool store_record(user_t *slot, const repl_record_t *r, bool fresh) {
+  user_t u = r->u;
+  if (fresh) {
+    // An empty slot holds no name, so the old one can be reclaimed
+    memset(slot, 0, sizeof(*slot));
+    if (!data_manager_set_user_name(slot, r->name))
+      return false;
+  } else if (strcmp(data_manager_user_name(slot), r->name) != 0 &&
+             !data_manager_set_user_name(slot, r->name)) {
+    return false;
+  }
+  u.name_off = slot->name_off;
+  data_manager_store_user(slot, &u);
+  return true;
+}
+
+// Deletes for refused records, sent ahead of the dirty slots
+static repl_record_t refusals[REPL_MAX_REFUSALS];
+static int refusal_count = 0;
+
+static void refuse_record(const repl_record_t *in) {
+  ESP_LOGW(TAG, "Refusing %s: created before a forgotten delete", in->name);
+  if (refusal_count == REPL_MAX_REFUSALS)
+    return; // The sender's next resend brings it back
+  repl_record_t *r = &refusals[refusal_count++];
+  *r = *in;
+  r->u.active = false;
+  r->u.version = next_stamp();
+}
+
+static void apply_record(const repl_record_t *in) {
+  observe_stamp(in->u.created);
+  observe_stamp(in->u.version);
+
+  repl_record_t merged = *in;
+  user_t *local = find_record(&in->u);
+  if (!local && in->u.active && in->u.created <= tombstone_floor) {
+    refuse_record(in);
+    return;
+  }
+  if (!local) {
+    int slot = data_manager_free_slot();
+    // Only keep a delete for a record never seen here when it costs nothing
+    if (slot < 0 || (!in->u.active &&
+                     data_manager_get_data()->users[slot].created != 0)) {
+      if (in->u.active)
+        ESP_LOGE(TAG, "User table full, dropping %s", in->name);
+      return;
+    }
+    local = &data_manager_get_data()->users[slot];
+    if (local->created)
+      repl_tombstone_dropped(local);
+    if (!store_record(local, in, true)) {
+      ESP_LOGE(TAG, "No room for the name of %s", in->name);
+      return;
+    }
+  } else {
+    repl_record_t before;
+    load_record(local, &before);
+    merged = before;
+    merge_record(&merged, in);
+    if (record_cmp(&before, &merged) == 0)
+      return;
+    if (!store_record(local, &merged, false)) {
+      ESP_LOGE(TAG, "No room for the name of %s", merged.name);
+      return;
+    }
+  }
+
+  // The sender is behind on something this node knew; answer with the merge
+  if (record_cmp(&merged, in) != 0)
+    dirty |= 1ULL << slot_of(local);
+  recount_users();
+  data_manager_reindex();
+  save_pending = true;
+  metrics_inc(records_applied);
+  ESP_LOGI(TAG, "Applied %s (%s)", merged.name,
+           merged.u.active ? "active" : "deleted");
+}
+
+// --- Public API ---
+
+uint32_t repl_node_id(void) { return node_id; }
+
+void repl_user_changed(user_t *u) {
+  u->version = next_stamp();
+  if (!u->created)
+    u->created = u->version;
+  dirty |= 1ULL << slot_of(u);
+}
+
+void repl_tombstone_dropped(const user_t *u) {
+  if (u->created <= tombstone_floor)
+    return;
+  tombstone_floor = u->created;
+  if (!storage_write(STORAGE_CONFIG, FLOOR_KEY, &tombstone_floor,
+                     sizeof(tombstone_floor)))
+    ESP_LOGE(TAG, "Failed to save the tombstone floor");
+}
+
+void repl_init(void) {
+#ifdef ARDUINO
+  node_id = ESP.getChipId();
+#else
+  uint8_t mac[6];
+  esp_read_mac(mac, ESP_MAC_WIFI_STA);
+  node_id = ((uint32_t)mac[2] << 24) | ((uint32_t)mac[3] << 16) |
+            ((uint32_t)mac[4] << 8) | mac[5];
+#endif
+  node_tag = (uint8_t)(node_id ^ (node_id >> 8) ^ (node_id >> 16) ^
+                       (node_id >> 24));
+
+  records_sent = metrics_counter("repl_records_sent_total",
+                                 "User records published to peers", NULL);
+  records_applied = metrics_counter("repl_records_applied_total",
+                                    "Peer user records merged locally", NULL);
+  resends = metrics_counter("repl_resends_total",
+                            "Full table resends after a digest mismatch",
+                            NULL);
+
+  if (storage_read(STORAGE_CONFIG, FLOOR_KEY, 0, &tombstone_floor,
+                   sizeof(tombstone_floor)) != sizeof(tombstone_floor))
+    tombstone_floor = 0;
+  observe_stamp(tombstone_floor);
+
+  system_data_t *d = data_manager_get_data();
+  for (int i = 0; i < MAX_USERS; i++) {
+    observe_stamp(d->users[i].created);
+    observe_stamp(d->users[i].version);
+  }
+  // Users from before replication join the shared table as new records
+  bool stamped = false;
+  for (int i = 0; i < MAX_USERS; i++) {
+    if (d->users[i].active && !d->users[i].created) {
+      repl_user_changed(&d->users[i]);
+      stamped = true;
+    }
+  }
+  if (stamped)
+    data_manager_save();
+  ESP_LOGI(TAG, "Node %08x, clock %u", (unsigned)node_id, (unsigned)counter);
+}
+
+void repl_on_connected(void) {
+  // Digest straight away so peers notice what changed while offline
+  last_digest = now_ms() - REPL_DIGEST_INTERVAL_MS;
+}
+
+static void publish_digest(void) {
+  uint8_t msg[DIGEST_LEN];
+  uint16_t count;
+  uint32_t hash = table_digest(&count);
+  msg[0] = MSG_DIGEST;
+  put_u32(msg + 1, node_id);
+  put_u32(msg + 5, hash);
+  put_u16(msg + 9, count);
+  put_u32(msg + 11, counter);
+  mqtt_manager_publish_raw(REPL_TOPIC_DIGEST, msg, sizeof(msg));
+}
+
+static void handle_digest(const uint8_t *msg, size_t len) {
+  if (len != DIGEST_LEN || msg[0] != MSG_DIGEST || get_u32(msg + 1) == node_id)
+    return;
+  if (get_u32(msg + 11) > counter)
+    counter = get_u32(msg + 11);
+
+  uint16_t count;
+  if (get_u32(msg + 5) == table_digest(&count))
+    return;
+  uint32_t now = now_ms();
+  if (resend_done && now - last_resend < REPL_RESEND_HOLDOFF_MS)
+    return;
+  resend_done = true;
+  last_resend = now;
+
+  system_data_t *d = data_manager_get_data();
+  for (int i = 0; i < MAX_USERS; i++) {
+    if (d->users[i].created)
+      dirty |= 1ULL << i;
+  }
+  metrics_inc(resends);
+  ESP_LOGI(TAG, "Table differs from node %08x, resending %u records",
+           (unsigned)get_u32(msg + 1), count);
+}
+
+bool repl_handle_message(const char *topic, size_t topic_len,
+                         const uint8_t *data, size_t len) {
+  size_t prefix = sizeof(REPL_TOPIC) - 1;
+  if (topic_len != prefix + 2 || strncmp(topic, REPL_TOPIC "/", prefix + 1))
+    return false;
+
+  // Records and the dirty set are shared with the web server's task
+  data_manager_lock();
+  if (topic[prefix + 1] == 'd') {
+    handle_digest(data, len);
+  } else if (topic[prefix + 1] == 'u') {
+    uint32_t origin;
+    repl_record_t in;
+    if (!decode_record(data, len, &origin, &in))
+      ESP_LOGW(TAG, "Malformed record (%u bytes)", (unsigned)len);
+    else if (origin != node_id)
+      apply_record(&in);
+  }
+  data_manager_unlock();
+  return true;
+}
+
+static void repl_tick(uint32_t now) {
+  // Batches the saves of a full resend into one write
+  if (save_pending) {
+    save_pending = false;
+    data_manager_save();
+  }
+  if (!mqtt_manager_connected())
+    return;
+
+  uint8_t msg[RECORD_MAX_LEN];
+  int sent = 0;
+  for (; refusal_count > 0 && sent < REPL_SEND_PER_TICK; sent++) {
+    size_t len = encode_record(&refusals[refusal_count - 1], msg);
+    if (!mqtt_manager_publish_raw(REPL_TOPIC_RECORD, msg, len))
+      return;
+    refusal_count--;
+    metrics_inc(records_sent);
+  }
+
+  system_data_t *d = data_manager_get_data();
+  for (; dirty && sent < REPL_SEND_PER_TICK; sent++) {
+    int i = __builtin_ctzll(dirty);
+    repl_record_t r;
+    load_record(&d->users[i], &r);
+    size_t len = encode_record(&r, msg);
+    if (!mqtt_manager_publish_raw(REPL_TOPIC_RECORD, msg, len))
+      return; // Retry on the next tick
+    dirty &= ~(1ULL << i);
+    metrics_inc(records_sent);
+  }
+
+  // A digest taken mid-resend would only trigger another resend
+  if (!dirty && !refusal_count && now - last_digest >= REPL_DIGEST_INTERVAL_MS) {
+    last_digest = now;
+    publish_digest();
+  }
+}
+
+void repl_loop(void) {
+  uint32_t now = now_ms();
+  if (now - last_tick < REPL_TICK_MS)
+    return;
+  last_tick = now;
+
+  data_manager_lock();
+  repl_tick(now);
+  data_manager_unlock();
+}
@@ -0,0 +1,46 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "data_manager.h"
+
+// User table replication between controllers over MQTT.
+// Each record carries the stamp it was created with and the stamp of its
+// last change (Lamport counter plus a node tag). Local changes are published
+// as single-record deltas. Peers merge them so that deletions always win,
+// each node's count of spent uses only grows and is added to the others,
+// and the other fields follow the newest change.
+// Nodes publish a table digest on connect and every minute; a peer whose
+// table differs resends every record, which catches up a node that was
+// offline.
+//
+// Deleted records are kept as tombstones until their slot is needed. Once
+// one is reused, an unknown active record created no later than it may be
+// one that was deleted here, so such records are refused and answered with
+// a delete rather than brought back.
+//
+// Records are matched by PIN, so a PIN is the same user on every node.
+
+#ifndef REPL_TOPIC
+#define REPL_TOPIC "antigravity_gate/sync" // Shared by every node in a site
+#endif
+
+void repl_init(void); // After data_manager_init
+void repl_loop(void); // Publishes queued records and the periodic digest
+void repl_on_connected(void);
+
+uint32_t repl_node_id(void);
+
+// Stamps a locally changed record and queues it for publishing
+void repl_user_changed(user_t *u);
+// Call before a deleted record's slot is reused for another one
+void repl_tombstone_dropped(const user_t *u);
+
+// Returns false when the topic is not a replication topic
+bool repl_handle_message(const char *topic, size_t topic_len,
+                         const uint8_t *data, size_t len);
+
+#endif // REPLICATION_H
@@ -0,0 +1,168 @@
+#include "response_cache.h"
+#include "metrics.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include "esp_random.h"
+#endif
+#include <stdio.h>
+#include <string.h>
+
+typedef struct {
+  uint32_t hash;
+  uint32_t generation;
+  uint32_t off;     // The request, then the body
+  uint16_t request; // Request bytes: route, NUL, query, NUL, encoding
+  uint32_t len;     // TOO_LARGE: known not to fit, rendered by the caller
+} entry_t;
+
+#define TOO_LARGE UINT32_MAX
+
+static uint8_t arena[RESPONSE_CACHE_BYTES] __attribute__((aligned(4)));
+static size_t arena_used = 0;
+static entry_t entries[RESPONSE_CACHE_ENTRIES];
+static int entry_count = 0;
+static uint32_t boot_id = 0; // Keeps ETags from before a reboot from matching
+
+static metric_t *hits = NULL;
+static metric_t *misses = NULL;
+
+static uint32_t fnv1a(uint32_t h, const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *)data;
+  while (len--)
+    h = (h ^ *p++) * 16777619u;
+  return h;
+}
+
+void response_cache_init(void) {
+#ifdef ARDUINO
+  boot_id = RANDOM_REG32 | 1;
+#else
+  boot_id = esp_random() | 1;
+#endif
+  hits = metrics_counter("response_cache_hits_total",
+                         "API responses served from the cache", NULL);
+  misses = metrics_counter("response_cache_misses_total",
+                           "API responses rendered for the cache", NULL);
+}
+
+void response_cache_key(response_key_t *key, const char *route,
+                        const char *query, int encoding) {
+  uint32_t h = fnv1a(2166136261u, &boot_id, sizeof(boot_id));
+  h = fnv1a(h, route, strlen(route) + 1);
+  h = fnv1a(h, query, strlen(query) + 1);
+  key->hash = fnv1a(h, &encoding, sizeof(encoding));
+  key->route = route;
+  key->query = query;
+  key->encoding = encoding;
+}
+
+void response_cache_etag(const response_key_t *key, uint32_t generation,
+                         char *out) {
+  snprintf(out, RESPONSE_ETAG_LEN, "\"%08x-%x\"", (unsigned)key->hash,
+           (unsigned)generation);
+}
+
+bool response_cache_etag_matches(const char *if_none_match,
+                                 const char *etag) {
+  // Weak comparison, as If-None-Match asks: a W/ prefix does not matter
+  return strcmp(if_none_match, "*") == 0 || strstr(if_none_match, etag);
+}
+
+static size_t request_size(const response_key_t *key) {
+  return strlen(key->route) + strlen(key->query) + 3;
+}
+
+static bool request_equal(const entry_t *e, const response_key_t *key) {
+  const char *p = (const char *)arena + e->off;
+  size_t route = strlen(key->route) + 1;
+  size_t query = strlen(key->query) + 1;
+  return e->request == route + query + 1 &&
+         memcmp(p, key->route, route) == 0 &&
+         memcmp(p + route, key->query, query) == 0 &&
+         (uint8_t)p[route + query] == (uint8_t)key->encoding;
+}
+
+static entry_t *find(const response_key_t *key, uint32_t generation) {
+  for (int i = 0; i < entry_count; i++) {
+    entry_t *e = &entries[i];
+    if (e->hash == key->hash && e->generation == generation &&
+        request_equal(e, key))
+      return e;
+  }
+  return NULL;
+}
+
+// A new entry holding the request, starting over when the table or the
+// arena is full
+static entry_t *add(const response_key_t *key, uint32_t generation) {
+  size_t need = request_size(key);
+  if (entry_count == RESPONSE_CACHE_ENTRIES ||
+      need > sizeof(arena) - arena_used) {
+    entry_count = 0;
+    arena_used = 0;
+  }
+  entry_t *e = &entries[entry_count++];
+  e->hash = key->hash;
+  e->generation = generation;
+  e->off = arena_used;
+  e->request = need;
+  e->len = TOO_LARGE;
+  char *p = (char *)arena + e->off;
+  size_t route = strlen(key->route) + 1;
+  memcpy(p, key->route, route);
+  memcpy(p + route, key->query, need - route - 1);
+  p[need - 1] = (char)key->encoding;
+  arena_used += need;
+  return e;
+}
+
+bool response_cache_get(const response_key_t *key, uint32_t generation,
+                        response_render_t render, void *ctx,
+                        const uint8_t **data, size_t *len) {
+  entry_t *e = find(key, generation);
+  if (e) {
+    if (e->len == TOO_LARGE)
+      return false;
+    metrics_inc(hits);
+    *data = arena + e->off + e->request;
+    *len = e->len;
+    return true;
+  }
+
+  metrics_inc(misses);
+  if (request_size(key) > sizeof(arena))
+    return false;
+  e = add(key, generation);
+  size_t at = e->off + e->request;
+  size_t n = render(ctx, arena + at, sizeof(arena) - at);
+  if (n > sizeof(arena) - at && e->off > 0 && n <= sizeof(arena) - e->request) {
+    // Fits once the older bodies make room
+    memmove(arena, arena + e->off, e->request);
+    entries[0] = *e;
+    entry_count = 1;
+    e = &entries[0];
+    e->off = 0;
+    at = e->request;
+    n = render(ctx, arena + at, sizeof(arena) - at);
+  }
+  if (n > sizeof(arena) - at) {
+    arena_used = at;
+    return false; // Remembered, so the next request skips the attempt
+  }
+  e->len = n;
+  arena_used = at + n;
+  *data = arena + at;
+  *len = n;
+  return true;
+}
+
+const uint8_t *response_cache_find(const response_key_t *key,
+                                   uint32_t generation, size_t *len) {
+  entry_t *e = find(key, generation);
+  if (!e || e->len == TOO_LARGE)
+    return NULL;
+  *len = e->len;
+  return arena + e->off + e->request;
+}
@@ -0,0 +1,58 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Serialized API responses, kept until the data behind them changes.
+// An entry is found by a key naming the request (route, query, encoding)
+// and by the generation of the data it was rendered from. The request is
+// stored with the body and compared in full, not just by its hash. Every change
+// bumps the generation, so stale entries are simply never hit again;
+// nothing is invalidated explicitly. Bodies are appended to one bounded
+// arena that starts over when full. Only the web server task uses it.
+
+#ifndef RESPONSE_CACHE_BYTES
+#ifdef ARDUINO
+#define RESPONSE_CACHE_BYTES 4096
+#else
+#define RESPONSE_CACHE_BYTES 16384
+#endif
+#endif
+#define RESPONSE_CACHE_ENTRIES 8
+#define RESPONSE_ETAG_LEN 24
+
+// Writes a body into buf. Returns its length, or more than cap when it did
+// not fit.
+typedef size_t (*response_render_t)(void *ctx, uint8_t *buf, size_t cap);
+
+// Names a request. The strings are the caller's and must outlive the calls
+// the key is passed to.
+typedef struct {
+  uint32_t hash;
+  const char *route;
+  const char *query;
+  int encoding;
+} response_key_t;
+
+void response_cache_init(void);
+void response_cache_key(response_key_t *key, const char *route,
+                        const char *query, int encoding);
+// Strong ETag for the body of key at generation, distinct across reboots
+void response_cache_etag(const response_key_t *key, uint32_t generation,
+                         char *out);
+// True when an If-None-Match value lists etag (or is "*")
+bool response_cache_etag_matches(const char *if_none_match, const char *etag);
+
+// The body of key at generation, rendered and stored on a miss. False when
+// it is larger than the cache; the caller then renders it as it goes.
+bool response_cache_get(const response_key_t *key, uint32_t generation,
+                        response_render_t render, void *ctx,
+                        const uint8_t **data, size_t *len);
+// The stored body, NULL once it has been dropped. Lets a response streamed
+// over several calls check that its body is still in place.
+const uint8_t *response_cache_find(const response_key_t *key,
+                                   uint32_t generation, size_t *len);
+
+#endif // RESPONSE_CACHE_H
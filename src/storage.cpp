@@ -0,0 +1,563 @@
+#include "storage.h"
+#include "logging_macros.h"
+#include "metrics.h"
+#include "profiler.h"
+
+#ifdef ARDUINO
+#include <LittleFS.h>
+#else
+#include "esp_log.h"
+#include "nvs.h"
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "STORAGE";
+
+// ---------------------------------------------------------------------------
+// RAM backend: a handful of heap buffers, for tests and for measuring the
+// cost of the callers themselves
+
+typedef struct {
+  char key[STORAGE_MAX_KEY];
+  uint8_t *data;
+  size_t len;
+} ram_slot_t;
+
+static ram_slot_t ram_slots[STORAGE_RAM_SLOTS];
+static size_t ram_used = 0;
+
+static ram_slot_t *ram_find(const char *key) {
+  for (int i = 0; i < STORAGE_RAM_SLOTS; i++) {
+    if (ram_slots[i].key[0] && strcmp(ram_slots[i].key, key) == 0)
+      return &ram_slots[i];
+  }
+  return NULL;
+}
+
+static ram_slot_t *ram_find_or_add(const char *key) {
+  ram_slot_t *s = ram_find(key);
+  if (s)
+    return s;
+  for (int i = 0; i < STORAGE_RAM_SLOTS; i++) {
+    if (!ram_slots[i].key[0]) {
+      strncpy(ram_slots[i].key, key, STORAGE_MAX_KEY - 1);
+      return &ram_slots[i];
+    }
+  }
+  return NULL;
+}
+
+static bool ram_resize(ram_slot_t *s, size_t len) {
+  if (ram_used - s->len + len > STORAGE_RAM_MAX_BYTES)
+    return false;
+  uint8_t *data = (uint8_t *)realloc(s->data, len ? len : 1);
+  if (!data)
+    return false;
+  ram_used = ram_used - s->len + len;
+  s->data = data;
+  s->len = len;
+  return true;
+}
+
+static void ram_free(ram_slot_t *s) {
+  ram_used -= s->len;
+  free(s->data);
+  memset(s, 0, sizeof(*s));
+}
+
+static int ram_read(const char *key, size_t offset, void *buf, size_t cap) {
+  ram_slot_t *s = ram_find(key);
+  if (!s)
+    return -1;
+  if (offset >= s->len)
+    return 0;
+  size_t n = s->len - offset < cap ? s->len - offset : cap;
+  memcpy(buf, s->data + offset, n);
+  return (int)n;
+}
+
+static bool ram_write(const char *key, const void *data, size_t len) {
+  ram_slot_t *s = ram_find_or_add(key);
+  if (!s || !ram_resize(s, len))
+    return false;
+  memcpy(s->data, data, len);
+  return true;
+}
+
+static bool ram_append(const char *key, const void *data, size_t len) {
+  ram_slot_t *s = ram_find_or_add(key);
+  if (!s)
+    return false;
+  size_t old = s->len;
+  if (!ram_resize(s, old + len))
+    return false;
+  memcpy(s->data + old, data, len);
+  return true;
+}
+
+static int32_t ram_size(const char *key) {
+  ram_slot_t *s = ram_find(key);
+  return s ? (int32_t)s->len : -1;
+}
+
+static bool ram_remove(const char *key) {
+  ram_slot_t *s = ram_find(key);
+  if (s)
+    ram_free(s);
+  return true;
+}
+
+static bool ram_rename(const char *from, const char *to) {
+  ram_slot_t *s = ram_find(from);
+  if (!s)
+    return false;
+  ram_slot_t *old = ram_find(to);
+  if (old)
+    ram_free(old);
+  memset(s->key, 0, sizeof(s->key));
+  strncpy(s->key, to, STORAGE_MAX_KEY - 1);
+  return true;
+}
+
+static const storage_backend_t ram_backend = {
+    "ram", NULL, ram_read, ram_write, ram_append, ram_size, ram_remove,
+    ram_rename};
+
+#ifdef ARDUINO
+// ---------------------------------------------------------------------------
+// LittleFS backend: one file per key in FS_DIR. The web server serves the
+// root to anyone, so keys (PINs, the PIN key, history) stay out of it.
+
+#define FS_DIR "/.db"
+#define FS_PATH_MAX (sizeof(FS_DIR "/") + STORAGE_MAX_KEY)
+
+static void fs_path(char *out, size_t cap, const char *key) {
+  snprintf(out, cap, FS_DIR "/%s", key);
+}
+
+// The files the web UI is made of, left in the root
+static bool fs_is_asset(const char *name) {
+  static const char *exts[] = {".html", ".css", ".js", ".ico", ".png"};
+  size_t len = strlen(name);
+  for (size_t i = 0; i < sizeof(exts) / sizeof(exts[0]); i++) {
+    size_t n = strlen(exts[i]);
+    if (len >= n && strcmp(name + len - n, exts[i]) == 0)
+      return true;
+  }
+  return false;
+}
+
+// Moves the files in dir other than UI assets into FS_DIR
+static void fs_adopt(const char *dir_path) {
+  Dir dir = LittleFS.openDir(dir_path);
+  while (dir.next()) {
+    String name = dir.fileName();
+    if (!dir.isFile() || fs_is_asset(name.c_str()))
+      continue;
+    char from[40], to[40];
+    snprintf(from, sizeof(from), "%s/%s", strcmp(dir_path, "/") ? dir_path : "",
+             name.c_str());
+    fs_path(to, sizeof(to), name.c_str());
+    if (!LittleFS.exists(to) && LittleFS.rename(from, to))
+      ESP_LOGI(TAG, "Moved %s to %s", from, to);
+  }
+}
+
+static bool littlefs_init(void) {
+  if (!LittleFS.exists(FS_DIR) && !LittleFS.mkdir(FS_DIR))
+    return false;
+  // Older firmware wrote its snapshot under /spiffs/ and the access log and
+  // other keys in the root
+  fs_adopt("/spiffs");
+  fs_adopt("/");
+  return true;
+}
+
+static int littlefs_read(const char *key, size_t offset, void *buf,
+                         size_t cap) {
+  char path[FS_PATH_MAX];
+  fs_path(path, sizeof(path), key);
+  File f = LittleFS.open(path, "r");
+  if (!f)
+    return -1;
+  int n = 0;
+  if (offset == 0 || f.seek(offset, SeekSet))
+    n = f.read((uint8_t *)buf, cap);
+  f.close();
+  return n;
+}
+
+static bool littlefs_put(const char *key, const void *data, size_t len,
+                         const char *mode) {
+  char path[FS_PATH_MAX];
+  fs_path(path, sizeof(path), key);
+  File f = LittleFS.open(path, mode);
+  if (!f)
+    return false;
+  size_t n = f.write((const uint8_t *)data, len);
+  f.close();
+  return n == len;
+}
+
+static bool littlefs_write(const char *key, const void *data, size_t len) {
+  return littlefs_put(key, data, len, "w");
+}
+
+static bool littlefs_append(const char *key, const void *data, size_t len) {
+  return littlefs_put(key, data, len, "a");
+}
+
+static int32_t littlefs_size(const char *key) {
+  char path[FS_PATH_MAX];
+  fs_path(path, sizeof(path), key);
+  if (!LittleFS.exists(path))
+    return -1;
+  File f = LittleFS.open(path, "r");
+  if (!f)
+    return -1;
+  int32_t size = f.size();
+  f.close();
+  return size;
+}
+
+static bool littlefs_remove(const char *key) {
+  char path[FS_PATH_MAX];
+  fs_path(path, sizeof(path), key);
+  return !LittleFS.exists(path) || LittleFS.remove(path);
+}
+
+static bool littlefs_rename(const char *from, const char *to) {
+  char src[FS_PATH_MAX], dst[FS_PATH_MAX];
+  fs_path(src, sizeof(src), from);
+  fs_path(dst, sizeof(dst), to);
+  return LittleFS.rename(src, dst);
+}
+
+static const storage_backend_t littlefs_backend = {
+    "littlefs", littlefs_init, littlefs_read, littlefs_write, littlefs_append,
+    littlefs_size, littlefs_remove, littlefs_rename};
+
+#else
+// ---------------------------------------------------------------------------
+// SPIFFS backend: one file per key under the VFS mount point
+
+#define SPIFFS_PATH_MAX (sizeof("/spiffs/") + STORAGE_MAX_KEY)
+
+static void spiffs_path(char *out, size_t cap, const char *key) {
+  snprintf(out, cap, "/spiffs/%s", key);
+}
+
+static int spiffs_read(const char *key, size_t offset, void *buf, size_t cap) {
+  char path[SPIFFS_PATH_MAX];
+  spiffs_path(path, sizeof(path), key);
+  FILE *f = fopen(path, "rb");
+  if (f == NULL)
+    return -1;
+  int n = 0;
+  if (offset == 0 || fseek(f, offset, SEEK_SET) == 0)
+    n = fread(buf, 1, cap, f);
+  fclose(f);
+  return n;
+}
+
+static bool spiffs_put(const char *key, const void *data, size_t len,
+                       const char *mode) {
+  char path[SPIFFS_PATH_MAX];
+  spiffs_path(path, sizeof(path), key);
+  FILE *f = fopen(path, mode);
+  if (f == NULL)
+    return false;
+  size_t n = fwrite(data, 1, len, f);
+  fclose(f);
+  return n == len;
+}
+
+static bool spiffs_write(const char *key, const void *data, size_t len) {
+  return spiffs_put(key, data, len, "wb");
+}
+
+static bool spiffs_append(const char *key, const void *data, size_t len) {
+  return spiffs_put(key, data, len, "ab");
+}
+
+static int32_t spiffs_size(const char *key) {
+  char path[SPIFFS_PATH_MAX];
+  struct stat st;
+  spiffs_path(path, sizeof(path), key);
+  return stat(path, &st) == 0 ? (int32_t)st.st_size : -1;
+}
+
+static bool spiffs_remove(const char *key) {
+  char path[SPIFFS_PATH_MAX];
+  struct stat st;
+  spiffs_path(path, sizeof(path), key);
+  return stat(path, &st) != 0 || unlink(path) == 0;
+}
+
+static bool spiffs_rename(const char *from, const char *to) {
+  char src[SPIFFS_PATH_MAX], dst[SPIFFS_PATH_MAX];
+  spiffs_path(src, sizeof(src), from);
+  spiffs_path(dst, sizeof(dst), to);
+  return rename(src, dst) == 0;
+}
+
+static const storage_backend_t spiffs_backend = {
+    "spiffs", NULL, spiffs_read, spiffs_write, spiffs_append, spiffs_size,
+    spiffs_remove, spiffs_rename};
+
+// ---------------------------------------------------------------------------
+// NVS backend: one blob per key. Blobs are read whole and cannot be appended
+// to, so it only suits small snapshot classes.
+
+#define NVS_NAMESPACE "storage"
+
+static int nvs_read(const char *key, size_t offset, void *buf, size_t cap) {
+  nvs_handle_t handle;
+  if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+    return -1;
+  size_t len = 0;
+  int n = -1;
+  if (nvs_get_blob(handle, key, NULL, &len) == ESP_OK) {
+    if (offset >= len) {
+      n = 0;
+    } else if (offset == 0 && len <= cap &&
+               nvs_get_blob(handle, key, buf, &len) == ESP_OK) {
+      n = (int)len;
+    }
+  }
+  nvs_close(handle);
+  return n;
+}
+
+static bool nvs_write(const char *key, const void *data, size_t len) {
+  nvs_handle_t handle;
+  if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+    return false;
+  bool ok = nvs_set_blob(handle, key, data, len) == ESP_OK &&
+            nvs_commit(handle) == ESP_OK;
+  nvs_close(handle);
+  return ok;
+}
+
+static int32_t nvs_size(const char *key) {
+  nvs_handle_t handle;
+  if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+    return -1;
+  size_t len = 0;
+  esp_err_t err = nvs_get_blob(handle, key, NULL, &len);
+  nvs_close(handle);
+  return err == ESP_OK ? (int32_t)len : -1;
+}
+
+static bool nvs_remove(const char *key) {
+  nvs_handle_t handle;
+  if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+    return false;
+  nvs_erase_key(handle, key); // Missing key is fine
+  bool ok = nvs_commit(handle) == ESP_OK;
+  nvs_close(handle);
+  return ok;
+}
+
+static const storage_backend_t nvs_backend = {
+    "nvs", NULL, nvs_read, nvs_write, NULL, nvs_size, nvs_remove, NULL};
+#endif
+
+// ---------------------------------------------------------------------------
+
+static const storage_backend_t *backends[STORAGE_BACKEND_COUNT] = {
+    &ram_backend,
+#ifdef ARDUINO
+    &littlefs_backend, NULL, NULL
+#else
+    NULL, &spiffs_backend, &nvs_backend
+#endif
+};
+
+static const char *backend_names[STORAGE_BACKEND_COUNT] = {"ram", "littlefs",
+                                                           "spiffs", "nvs"};
+static const char *class_names[STORAGE_CLASS_COUNT] = {"users", "logs",
+                                                       "config"};
+static const char *op_names[STORAGE_OP_COUNT] = {"read", "write", "append",
+                                                 "remove"};
+
+static storage_backend_id_t bindings[STORAGE_CLASS_COUNT];
+static storage_stats_t stats[STORAGE_CLASS_COUNT];
+
+static void record(storage_class_t cls, storage_op_t op, const char *key,
+                   uint32_t start, bool ok) {
+  uint32_t elapsed = metrics_now_us() - start;
+  profiler_storage_op(cls, op, key, elapsed);
+  storage_op_stats_t *s = &stats[cls].ops[op];
+  s->count++;
+  if (!ok)
+    s->errors++;
+  s->total_us += elapsed;
+  if (elapsed > s->max_us)
+    s->max_us = elapsed;
+}
+
+static const storage_backend_t *backend_for(storage_class_t cls) {
+  return backends[bindings[cls]];
+}
+
+static bool backend_supports(const storage_backend_t *b, storage_class_t cls) {
+  if (!b || !b->read || !b->write || !b->size || !b->remove)
+    return false;
+  if (cls == STORAGE_LOGS)
+    return b->append && b->rename;
+  return true;
+}
+
+static const char *class_labels[STORAGE_CLASS_COUNT] = {
+    "class=\"users\"", "class=\"logs\"", "class=\"config\""};
+
+static int64_t read_write_ops(const void *arg) {
+  const storage_stats_t *s = (const storage_stats_t *)arg;
+  return (int64_t)s->ops[STORAGE_OP_WRITE].count +
+         s->ops[STORAGE_OP_APPEND].count;
+}
+
+static void storage_register_metrics(void) {
+  for (int i = 0; i < STORAGE_CLASS_COUNT; i++)
+    metrics_counter_fn("storage_written_bytes_total",
+                       "Bytes written per data class", class_labels[i],
+                       metrics_read_u64, &stats[i].bytes_written);
+  for (int i = 0; i < STORAGE_CLASS_COUNT; i++)
+    metrics_counter_fn("storage_writes_total",
+                       "Write and append operations per data class",
+                       class_labels[i], read_write_ops, &stats[i]);
+  for (int i = 0; i < STORAGE_CLASS_COUNT; i++)
+    metrics_counter_fn("storage_read_bytes_total", "Bytes read per data class",
+                       class_labels[i], metrics_read_u64, &stats[i].bytes_read);
+}
+
+void storage_init(void) {
+  for (int i = 0; i < STORAGE_BACKEND_COUNT; i++) {
+    if (backends[i] && backends[i]->init && !backends[i]->init())
+      ESP_LOGE(TAG, "Backend %s failed to initialize", backend_names[i]);
+  }
+
+  const storage_backend_id_t defaults[STORAGE_CLASS_COUNT] = {
+      STORAGE_USERS_BACKEND, STORAGE_LOGS_BACKEND, STORAGE_CONFIG_BACKEND};
+  for (int i = 0; i < STORAGE_CLASS_COUNT; i++) {
+    if (!storage_bind((storage_class_t)i, defaults[i])) {
+      ESP_LOGE(TAG, "Falling back to RAM for %s", class_names[i]);
+      storage_bind((storage_class_t)i, STORAGE_RAM);
+    }
+  }
+  storage_register_metrics();
+}
+
+bool storage_bind(storage_class_t cls, storage_backend_id_t backend) {
+  if (cls >= STORAGE_CLASS_COUNT || backend >= STORAGE_BACKEND_COUNT ||
+      !backend_supports(backends[backend], cls)) {
+    ESP_LOGE(TAG, "Backend %s cannot hold %s",
+             backend < STORAGE_BACKEND_COUNT ? backend_names[backend] : "?",
+             cls < STORAGE_CLASS_COUNT ? class_names[cls] : "?");
+    return false;
+  }
+  bindings[cls] = backend;
+  storage_reset_stats(cls);
+  ESP_LOGI(TAG, "%s -> %s", class_names[cls], backend_names[backend]);
+  return true;
+}
+
+const char *storage_op_name(storage_op_t op) {
+  return op < STORAGE_OP_COUNT ? op_names[op] : "?";
+}
+
+storage_backend_id_t storage_bound(storage_class_t cls) {
+  return bindings[cls];
+}
+
+const char *storage_backend_name(storage_backend_id_t backend) {
+  return backend < STORAGE_BACKEND_COUNT ? backend_names[backend] : "?";
+}
+
+const char *storage_class_name(storage_class_t cls) {
+  return cls < STORAGE_CLASS_COUNT ? class_names[cls] : "?";
+}
+
+int storage_read(storage_class_t cls, const char *key, size_t offset,
+                 void *buf, size_t cap) {
+  uint32_t start = metrics_now_us();
+  int n = backend_for(cls)->read(key, offset, buf, cap);
+  if (n > 0)
+    stats[cls].bytes_read += n;
+  record(cls, STORAGE_OP_READ, key, start, n >= 0);
+  return n;
+}
+
+bool storage_write(storage_class_t cls, const char *key, const void *data,
+                   size_t len) {
+  uint32_t start = metrics_now_us();
+  bool ok = backend_for(cls)->write(key, data, len);
+  if (ok)
+    stats[cls].bytes_written += len;
+  record(cls, STORAGE_OP_WRITE, key, start, ok);
+  return ok;
+}
+
+bool storage_append(storage_class_t cls, const char *key, const void *data,
+                    size_t len) {
+  const storage_backend_t *b = backend_for(cls);
+  if (!b->append)
+    return false;
+  uint32_t start = metrics_now_us();
+  bool ok = b->append(key, data, len);
+  if (ok)
+    stats[cls].bytes_written += len;
+  record(cls, STORAGE_OP_APPEND, key, start, ok);
+  return ok;
+}
+
+int32_t storage_size(storage_class_t cls, const char *key) {
+  return backend_for(cls)->size(key);
+}
+
+bool storage_remove(storage_class_t cls, const char *key) {
+  uint32_t start = metrics_now_us();
+  bool ok = backend_for(cls)->remove(key);
+  record(cls, STORAGE_OP_REMOVE, key, start, ok);
+  return ok;
+}
+
+bool storage_rename(storage_class_t cls, const char *from, const char *to) {
+  const storage_backend_t *b = backend_for(cls);
+  if (!b->rename)
+    return false;
+  uint32_t start = metrics_now_us();
+  bool ok = b->rename(from, to);
+  record(cls, STORAGE_OP_REMOVE, from, start, ok);
+  return ok;
+}
+
+const storage_stats_t *storage_get_stats(storage_class_t cls) {
+  return &stats[cls];
+}
+
+void storage_reset_stats(storage_class_t cls) {
+  memset(&stats[cls], 0, sizeof(stats[cls]));
+}
+
+void storage_log_stats(void) {
+  for (int i = 0; i < STORAGE_CLASS_COUNT; i++) {
+    const storage_stats_t *s = &stats[i];
+    ESP_LOGI(TAG, "%s on %s: %llu B read, %llu B written", class_names[i],
+             backend_names[bindings[i]], (unsigned long long)s->bytes_read,
+             (unsigned long long)s->bytes_written);
+    for (int op = 0; op < STORAGE_OP_COUNT; op++) {
+      const storage_op_stats_t *o = &s->ops[op];
+      if (o->count == 0)
+        continue;
+      ESP_LOGI(TAG, "  %-6s n=%u err=%u avg=%uus max=%uus", op_names[op],
+               (unsigned)o->count, (unsigned)o->errors,
+               (unsigned)(o->total_us / o->count), (unsigned)o->max_us);
+    }
+  }
+}
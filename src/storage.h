@@ -0,0 +1,115 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Persistence layer. Each data class is bound to one backend; callers only
+// name the class and a short key (at most STORAGE_MAX_KEY - 1 chars, so it
+// also fits an NVS key). Every operation is counted and timed per class so
+// backends can be compared on the real workload.
+
+#define STORAGE_MAX_KEY 16
+
+typedef enum {
+  STORAGE_RAM = 0,
+  STORAGE_LITTLEFS,
+  STORAGE_SPIFFS,
+  STORAGE_NVS,
+  STORAGE_BACKEND_COUNT
+} storage_backend_id_t;
+
+typedef enum {
+  STORAGE_USERS = 0, // User table snapshot
+  STORAGE_LOGS,      // Access history (append-only)
+  STORAGE_CONFIG,    // Small settings blobs
+  STORAGE_CLASS_COUNT
+} storage_class_t;
+
+// Default bindings, override with -D to run on another medium
+#ifdef ARDUINO
+#ifndef STORAGE_USERS_BACKEND
+#define STORAGE_USERS_BACKEND STORAGE_LITTLEFS
+#endif
+#ifndef STORAGE_LOGS_BACKEND
+#define STORAGE_LOGS_BACKEND STORAGE_LITTLEFS
+#endif
+#ifndef STORAGE_CONFIG_BACKEND
+#define STORAGE_CONFIG_BACKEND STORAGE_LITTLEFS
+#endif
+#else
+#ifndef STORAGE_USERS_BACKEND
+#define STORAGE_USERS_BACKEND STORAGE_SPIFFS
+#endif
+#ifndef STORAGE_LOGS_BACKEND
+#define STORAGE_LOGS_BACKEND STORAGE_SPIFFS
+#endif
+#ifndef STORAGE_CONFIG_BACKEND
+#define STORAGE_CONFIG_BACKEND STORAGE_NVS
+#endif
+#endif
+
+// RAM backend limits (contents are lost on reset)
+#define STORAGE_RAM_SLOTS 6
+#define STORAGE_RAM_MAX_BYTES (64 * 1024)
+
+typedef enum {
+  STORAGE_OP_READ = 0,
+  STORAGE_OP_WRITE,
+  STORAGE_OP_APPEND,
+  STORAGE_OP_REMOVE, // remove and rename
+  STORAGE_OP_COUNT
+} storage_op_t;
+
+typedef struct {
+  uint32_t count;
+  uint32_t errors;
+  uint64_t total_us;
+  uint32_t max_us;
+} storage_op_stats_t;
+
+typedef struct {
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  storage_op_stats_t ops[STORAGE_OP_COUNT];
+} storage_stats_t;
+
+// Backend interface. Missing operations are NULL; a class can only be bound
+// to a backend that has the operations it needs.
+typedef struct {
+  const char *name;
+  bool (*init)(void);
+  // Reads up to cap bytes starting at offset. Returns bytes read, or -1 when
+  // the key does not exist.
+  int (*read)(const char *key, size_t offset, void *buf, size_t cap);
+  bool (*write)(const char *key, const void *data, size_t len);
+  bool (*append)(const char *key, const void *data, size_t len);
+  int32_t (*size)(const char *key); // -1 when the key does not exist
+  bool (*remove)(const char *key);
+  bool (*rename)(const char *from, const char *to);
+} storage_backend_t;
+
+void storage_init(void);
+bool storage_bind(storage_class_t cls, storage_backend_id_t backend);
+storage_backend_id_t storage_bound(storage_class_t cls);
+const char *storage_backend_name(storage_backend_id_t backend);
+const char *storage_class_name(storage_class_t cls);
+const char *storage_op_name(storage_op_t op);
+
+int storage_read(storage_class_t cls, const char *key, size_t offset,
+                 void *buf, size_t cap);
+bool storage_write(storage_class_t cls, const char *key, const void *data,
+                   size_t len);
+bool storage_append(storage_class_t cls, const char *key, const void *data,
+                    size_t len);
+int32_t storage_size(storage_class_t cls, const char *key);
+bool storage_remove(storage_class_t cls, const char *key);
+bool storage_rename(storage_class_t cls, const char *from, const char *to);
+
+// Stats are per class and restart whenever the class is rebound
+const storage_stats_t *storage_get_stats(storage_class_t cls);
+void storage_reset_stats(storage_class_t cls);
+void storage_log_stats(void);
+
+#endif // STORAGE_H
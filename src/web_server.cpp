@@ -1,19 +1,721 @@
 #include "web_server.h"
+#include "access_stats.h"
+#include "cbor.h"
 #include "data_manager.h"
+#include "gates.h"
+#include "history.h"
+#include "json_pool.h"
+#include "json_reader.h"
+#include "metrics.h"
 #include "logging_macros.h"
 #include "mqtt_manager.h"
+#include "profiler.h"
+#include "response_cache.h"
+#include "storage.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 // Admin password hash (SHA256 of "Baracuda1106")
 static const char *ADMIN_PASS_HASH =
     "377c977eb381cfd5ae17467fb99bb376069c1b85cc18fdcab81bf0d3fa062563";
 
+// Keypad WebSocket channel. Frames are tiny text messages:
+//   client -> "P<pin>"  submit a PIN for every gate the user may open
+//             "P<pin>@<gate>"  submit a PIN for one gate
+//   server -> "G"       granted
+//             "D"       denied
+//             "L<sec>"  locked out for <sec> seconds (reply or push)
+//             "U"       not locked (on connect, and pushed when a lockout ends)
+#define KEYPAD_WS_URI "/ws/keypad"
+#define KEYPAD_MAX_PIN 16
+
+typedef enum { VERIFY_GRANTED, VERIFY_DENIED, VERIFY_LOCKED } verify_result_t;
+
+// On success gates receives the gates to open
+static verify_result_t verify_pin(const char *pin, int gate, uint8_t *gates) {
+  char user_name[NAME_LENGTH];
+  if (data_manager_validate_pin(pin, gate, user_name, gates))
+    return VERIFY_GRANTED;
+  return data_manager_lockout_remaining() > 0 ? VERIFY_LOCKED : VERIFY_DENIED;
+}
+
+static void keypad_state_msg(char *out, size_t cap) {
+  int64_t remaining = data_manager_lockout_remaining();
+  if (remaining > 0)
+    snprintf(out, cap, "L%lld", (long long)remaining);
+  else
+    snprintf(out, cap, "U");
+}
+
+// Parses a decimal gate id; returns GATE_ANY for anything else
+static int parse_gate_id(const char *s, size_t len) {
+  if (len != 1 || s[0] < '0' || s[0] >= '0' + MAX_GATES)
+    return GATE_ANY;
+  return s[0] - '0';
+}
+
+// Handles one keypad frame and writes the reply. The caller sends the reply
+// before opening the gates so feedback is not held up by the relays.
+static verify_result_t keypad_handle_frame(const char *msg, size_t len,
+                                           char *reply, size_t cap,
+                                           uint8_t *gates) {
+  char pin[KEYPAD_MAX_PIN + 1];
+  int gate = GATE_ANY;
+  const char *at = len > 0 ? (const char *)memchr(msg, '@', len) : NULL;
+  size_t pin_len = at ? (size_t)(at - msg) - 1 : len - 1;
+  if (at) {
+    gate = parse_gate_id(at + 1, len - (at + 1 - msg));
+    if (gate == GATE_ANY) {
+      snprintf(reply, cap, "D");
+      return VERIFY_DENIED;
+    }
+  }
+  if (len < 2 || msg[0] != 'P' || pin_len < 1 || pin_len > KEYPAD_MAX_PIN) {
+    snprintf(reply, cap, "D");
+    return VERIFY_DENIED;
+  }
+  memcpy(pin, msg + 1, pin_len);
+  pin[pin_len] = 0;
+
+  verify_result_t res = verify_pin(pin, gate, gates);
+  if (res == VERIFY_GRANTED)
+    snprintf(reply, cap, "G");
+  else if (res == VERIFY_LOCKED)
+    keypad_state_msg(reply, cap);
+  else
+    snprintf(reply, cap, "D");
+  return res;
+}
+
+// Request bodies. Known members are bound straight from the body stream into
+// these structs; no JSON tree is built. A body sent as application/cbor is
+// bound through the same tables.
+#define API_MAX_BODY 384
+
+// Response encoding, from the Accept header
+typedef enum { BODY_JSON, BODY_CBOR } body_format_t;
+
+static const char *body_type(body_format_t fmt) {
+  return fmt == BODY_CBOR ? CBOR_CONTENT_TYPE : "application/json";
+}
+
+static const char *list_open(body_format_t fmt) {
+  return fmt == BODY_CBOR ? CBOR_LIST_OPEN : "[";
+}
+
+static const char *list_end(body_format_t fmt) {
+  return fmt == BODY_CBOR ? CBOR_LIST_END : "]";
+}
+
+// CBOR documents have the JSON shape, but records in the user, log and MQTT
+// config responses use these small integer keys in place of member names;
+// that is most of the size saving. Requests may use either key form.
+static const char *const user_keys[] = {
+    "id",    "name", "pin",  "type",  "expiry", "remaining",
+    "start", "end",  "days", "gates", "limit"};
+enum {
+  USER_KEY_ID,
+  USER_KEY_NAME,
+  USER_KEY_PIN,
+  USER_KEY_TYPE,
+  USER_KEY_EXPIRY,
+  USER_KEY_REMAINING,
+  USER_KEY_START,
+  USER_KEY_END,
+  USER_KEY_DAYS,
+  USER_KEY_GATES
+};
+
+enum { LOG_KEY_TIME, LOG_KEY_USER, LOG_KEY_GRANTED, LOG_KEY_DETAILS };
+
+static const char *const mqtt_keys[] = {"uri", "cmd_topic", "status_topic"};
+enum { MQTT_KEY_URI, MQTT_KEY_CMD, MQTT_KEY_STATUS };
+
+#define KEY_COUNT(keys) (sizeof(keys) / sizeof((keys)[0]))
+
+typedef struct {
+  char pin[KEYPAD_MAX_PIN + 1];
+  int32_t gate;
+} pin_req_t;
+
+enum { PIN_REQ_GATE = 1 };
+
+static const json_field_t pin_req_fields[] = {
+    JSON_STR("pin", pin_req_t, pin, JSON_REQUIRED),
+    JSON_INT("gate", pin_req_t, gate, 0)};
+
+typedef struct {
+  int32_t gate;
+} open_req_t;
+
+static const json_field_t open_req_fields[] = {
+    JSON_INT("gate", open_req_t, gate, JSON_REQUIRED)};
+
+typedef struct {
+  int32_t id;
+  char name[GATE_NAME_LENGTH];
+  int32_t gpio;
+  int32_t pulse_ms;
+  bool active_high;
+} gate_req_t;
+
+enum { GATE_REQ_NAME = 1, GATE_REQ_GPIO, GATE_REQ_PULSE, GATE_REQ_ACTIVE };
+
+static const json_field_t gate_req_fields[] = {
+    JSON_INT("id", gate_req_t, id, JSON_REQUIRED),
+    JSON_STR("name", gate_req_t, name, 0),
+    JSON_INT("gpio", gate_req_t, gpio, 0),
+    JSON_INT("pulse_ms", gate_req_t, pulse_ms, 0),
+    JSON_BOOL("active_high", gate_req_t, active_high, 0)};
+
+typedef struct {
+  char password[65];
+} login_req_t;
+
+static const json_field_t login_req_fields[] = {
+    JSON_STR("password", login_req_t, password, JSON_REQUIRED)};
+
+typedef struct {
+  char name[NAME_LENGTH];
+  int32_t type;
+  int32_t limit;
+  int32_t start;
+  int32_t end;
+  int32_t days;
+  int32_t gates;
+} add_user_req_t;
+
+// Members in USER_FIELD_* order: member i sets bit i
+static const json_field_t add_user_req_fields[] = {
+    JSON_STR("name", add_user_req_t, name, JSON_REQUIRED),
+    JSON_INT("type", add_user_req_t, type, 0),
+    JSON_INT("limit", add_user_req_t, limit, 0),
+    JSON_INT("start", add_user_req_t, start, 0),
+    JSON_INT("end", add_user_req_t, end, 0),
+    JSON_INT("days", add_user_req_t, days, 0),
+    JSON_INT("gates", add_user_req_t, gates, 0)};
+
+// PATCH takes any subset of the same members
+static const json_field_t update_user_req_fields[] = {
+    JSON_STR("name", add_user_req_t, name, 0),
+    JSON_INT("type", add_user_req_t, type, 0),
+    JSON_INT("limit", add_user_req_t, limit, 0),
+    JSON_INT("start", add_user_req_t, start, 0),
+    JSON_INT("end", add_user_req_t, end, 0),
+    JSON_INT("days", add_user_req_t, days, 0),
+    JSON_INT("gates", add_user_req_t, gates, 0)};
+
+#define USERS_URI "/api/admin/users"
+
+typedef struct {
+  char uri[64];
+  char cmd_topic[64];
+  char status_topic[64];
+} mqtt_req_t;
+
+enum { MQTT_REQ_CMD = 1, MQTT_REQ_STATUS };
+
+static const json_field_t mqtt_req_fields[] = {
+    JSON_STR("uri", mqtt_req_t, uri, JSON_REQUIRED),
+    JSON_STR("cmd_topic", mqtt_req_t, cmd_topic, 0),
+    JSON_STR("status_topic", mqtt_req_t, status_topic, 0)};
+
+static void json_error_body(char *out, size_t cap, json_status_t status) {
+  snprintf(out, cap, "{\"error\":\"%s\"}", json_status_str(status));
+}
+
+static bool add_user_request_valid(const add_user_req_t *req) {
+  return req->type >= USER_TYPE_UNLIMITED && req->type <= USER_TYPE_ONE_TIME &&
+         req->limit >= 0 && req->start >= 0 && req->start < 24 * 60 &&
+         req->end >= 0 && req->end < 24 * 60 && req->days >= 0 &&
+         req->days <= 0x7F && req->gates >= 0 && req->gates <= GATE_MASK_ALL;
+}
+
+// Request members as a user record; returns the USER_FIELD_* present
+static uint32_t user_fields_from_request(const json_reader_t *r,
+                                         const add_user_req_t *req,
+                                         user_fields_t *f) {
+  f->name = req->name;
+  f->type = (user_type_t)req->type;
+  f->limit = req->limit;
+  f->expiry = 0;
+  f->start_time = req->start;
+  f->end_time = req->end;
+  f->allowed_days = req->days;
+  f->gate_mask = req->gates;
+  uint32_t fields = 0;
+  for (size_t i = 0; i < JSON_FIELD_COUNT(add_user_req_fields); i++) {
+    if (json_reader_has(r, i))
+      fields |= 1u << i;
+  }
+  return fields;
+}
+
+// Response to a create: the new record's id and PIN
+static bool add_user_from_request(const json_reader_t *r,
+                                  const add_user_req_t *req, char *out,
+                                  size_t cap) {
+  user_fields_t f;
+  user_fields_from_request(r, req, &f);
+  user_id_t id;
+  char pin[PIN_LENGTH];
+  if (!data_manager_create_user(&f, &id, pin))
+    return false;
+  snprintf(out, cap, "{\"status\":\"ok\",\"id\":%llu,\"pin\":\"%s\"}",
+           (unsigned long long)id, pin);
+  return true;
+}
+
+// Id from USERS_URI "/{id}", USER_ID_NONE when malformed. A query string
+// may follow.
+static user_id_t user_id_from_uri(const char *uri) {
+  size_t len = strlen(USERS_URI);
+  if (strncmp(uri, USERS_URI, len) != 0 || uri[len] != '/' ||
+      uri[len + 1] < '0' || uri[len + 1] > '9')
+    return USER_ID_NONE;
+  char *end;
+  unsigned long long id = strtoull(uri + len + 1, &end, 10);
+  return *end == 0 || *end == '?' ? (user_id_t)id : USER_ID_NONE;
+}
+
+// True while id names a live record
+static bool user_id_known(user_id_t id) {
+  int slot = id & 0xFF;
+  if (id == USER_ID_NONE || slot >= MAX_USERS)
+    return false;
+  const user_snapshot_t *snap = data_manager_snapshot_acquire();
+  const user_t *u = &data_manager_snapshot_data(snap)->users[slot];
+  bool known = u->active && data_manager_user_id(slot, u) == id;
+  data_manager_snapshot_release(snap);
+  return known;
+}
+
+// Appends one array element to a streamed JSON body if it fits
+static bool stream_append(char *buf, size_t cap, size_t *n, const char *item,
+                          size_t len) {
+  if (*n + len > cap)
+    return false;
+  memcpy(buf + *n, item, len);
+  *n += len;
+  return true;
+}
+
+#define USERS_PAGE_DEFAULT 50
+#define USERS_PAGE_MAX 100
+
+// One page of the user list: ?offset=&limit=&q=&sort=&type=
+typedef struct {
+  char prefix[NAME_LENGTH]; // q: names starting with it, any case
+  uint32_t offset;
+  uint32_t limit;
+  int type;  // user_type_t, -1 for any
+  bool desc; // sort=-name; name order is the default
+} users_query_t;
+
+static int hex_digit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  c |= 0x20;
+  return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+// URL-decoded value of key in a query string. Returns 1 when found, 0 when
+// absent and -1 when the value does not fit or is badly escaped.
+static int query_param(const char *query, const char *key, char *out,
+                       size_t cap) {
+  size_t klen = strlen(key);
+  for (const char *p = query; *p;) {
+    const char *end = strchr(p, '&');
+    if (!end)
+      end = p + strlen(p);
+    if (strncmp(p, key, klen) == 0 && p[klen] == '=') {
+      size_t n = 0;
+      for (p += klen + 1; p < end; p++) {
+        char c = *p;
+        if (c == '+') {
+          c = ' ';
+        } else if (c == '%') {
+          int hi = p + 2 < end ? hex_digit(p[1]) : -1;
+          int lo = hi >= 0 ? hex_digit(p[2]) : -1;
+          if (lo < 0)
+            return -1;
+          c = (char)(hi << 4 | lo);
+          p += 2;
+        }
+        if (n + 1 >= cap)
+          return -1;
+        out[n++] = c;
+      }
+      out[n] = 0;
+      return 1;
+    }
+    p = *end ? end + 1 : end;
+  }
+  return 0;
+}
+
+// Decimal parameter within [min, max]; absent leaves *out alone
+static bool query_uint(const char *query, const char *key, uint32_t min,
+                       uint32_t max, uint32_t *out) {
+  char v[12];
+  int found = query_param(query, key, v, sizeof(v));
+  if (found <= 0)
+    return found == 0;
+  char *end;
+  unsigned long n = strtoul(v, &end, 10);
+  if (end == v || *end || n < min || n > max)
+    return false;
+  *out = n;
+  return true;
+}
+
+// False when a parameter is malformed
+static bool users_query_parse(const char *query, users_query_t *q) {
+  memset(q, 0, sizeof(*q));
+  q->limit = USERS_PAGE_DEFAULT;
+  q->type = -1;
+  uint32_t type = UINT32_MAX;
+  char sort[8];
+  if (!query_uint(query, "offset", 0, UINT16_MAX, &q->offset) ||
+      !query_uint(query, "limit", 1, USERS_PAGE_MAX, &q->limit) ||
+      !query_uint(query, "type", USER_TYPE_UNLIMITED, USER_TYPE_ONE_TIME,
+                  &type))
+    return false;
+  if (type != UINT32_MAX)
+    q->type = type;
+  int found = query_param(query, "sort", sort, sizeof(sort));
+  if (found < 0 || (found && strcmp(sort, "name") != 0 &&
+                    strcmp(sort, "-name") != 0))
+    return false;
+  q->desc = found && sort[0] == '-';
+  return query_param(query, "q", q->prefix, sizeof(q->prefix)) >= 0;
+}
+
+// Slot of the k-th user in the prefix range [lo, hi), in the query's order
+static int users_query_slot(const user_snapshot_t *snap, const users_query_t *q,
+                            int lo, int hi, uint32_t k) {
+  return data_manager_snapshot_ordered(snap, q->desc ? hi - 1 - k : lo + k);
+}
+
+static bool users_query_match(const users_query_t *q, const user_t *u) {
+  return q->type < 0 || u->type == q->type;
+}
+
+// Users matching q across all pages. The prefix range comes from a binary
+// search; only a type filter scans it.
+static int users_query_total(const users_query_t *q) {
+  const user_snapshot_t *snap = data_manager_snapshot_acquire();
+  const system_data_t *data = data_manager_snapshot_data(snap);
+  int lo, hi;
+  data_manager_snapshot_prefix(snap, q->prefix, &lo, &hi);
+  int total = hi - lo;
+  if (q->type >= 0) {
+    total = 0;
+    for (int k = 0; k < hi - lo; k++)
+      total += users_query_match(
+          q, &data->users[users_query_slot(snap, q, lo, hi, k)]);
+  }
+  data_manager_snapshot_release(snap);
+  return total;
+}
+
+static int user_item(const user_snapshot_t *snap, int slot,
+                     body_format_t fmt, bool first, char *out, size_t cap) {
+  const user_t *u = &data_manager_snapshot_data(snap)->users[slot];
+  if (fmt == BODY_CBOR) {
+    cbor_writer_t w;
+    cbor_writer_init(&w, out, cap);
+    cbor_put_map(&w, 10);
+    cbor_put_uint(&w, USER_KEY_ID);
+    cbor_put_uint(&w, data_manager_user_id(slot, u));
+    cbor_put_uint(&w, USER_KEY_NAME);
+    cbor_put_text(&w, data_manager_snapshot_name(snap, u));
+    cbor_put_uint(&w, USER_KEY_PIN);
+    cbor_put_text(&w, u->pin);
+    cbor_put_uint(&w, USER_KEY_TYPE);
+    cbor_put_int(&w, u->type);
+    cbor_put_uint(&w, USER_KEY_EXPIRY);
+    cbor_put_int(&w, u->expiry_date);
+    cbor_put_uint(&w, USER_KEY_REMAINING);
+    cbor_put_int(&w, u->access_count_remaining);
+    cbor_put_uint(&w, USER_KEY_START);
+    cbor_put_uint(&w, u->start_time);
+    cbor_put_uint(&w, USER_KEY_END);
+    cbor_put_uint(&w, u->end_time);
+    cbor_put_uint(&w, USER_KEY_DAYS);
+    cbor_put_uint(&w, u->allowed_days);
+    cbor_put_uint(&w, USER_KEY_GATES);
+    cbor_put_uint(&w, u->gate_mask ? u->gate_mask : GATE_MASK_ALL);
+    return w.len;
+  }
+  char name[2 * NAME_LENGTH + 2];
+  json_quote(name, sizeof(name), data_manager_snapshot_name(snap, u));
+  return snprintf(
+      out, cap,
+      "%s{\"id\":%llu,\"name\":%s,\"pin\":\"%s\",\"type\":%d,"
+      "\"expiry\":%lld,\"remaining\":%d,\"start\":%u,\"end\":%u,"
+      "\"days\":%u,\"gates\":%u}",
+      first ? "" : ",", (unsigned long long)data_manager_user_id(slot, u),
+      name, u->pin, u->type, (long long)u->expiry_date,
+      u->access_count_remaining, u->start_time, u->end_time, u->allowed_days,
+      u->gate_mask ? u->gate_mask : GATE_MASK_ALL);
+}
+
+#define USERS_PAGE_DONE UINT32_MAX
+
+// Renders one page of users as an array, as much as fits in cap. pos
+// and count start at 0 and carry the position between calls; returns 0
+// when done. The work per call is bounded by the page, not the table. A
+// record added or removed mid-response may shift the rest of the page.
+static size_t users_page_render(const users_query_t *q, body_format_t fmt,
+                                uint32_t *pos, uint32_t *count, char *buf,
+                                size_t cap) {
+  if (*pos == USERS_PAGE_DONE)
+    return 0;
+  size_t n = 0;
+  const user_snapshot_t *snap = data_manager_snapshot_acquire();
+  const system_data_t *data = data_manager_snapshot_data(snap);
+  int lo, hi;
+  data_manager_snapshot_prefix(snap, q->prefix, &lo, &hi);
+  uint32_t span = hi - lo;
+
+  // pos is one past the range position, 0 before the opening bracket
+  if (*pos == 0) {
+    buf[n++] = *list_open(fmt);
+    uint32_t k = q->offset < span ? q->offset : span;
+    if (q->type >= 0) {
+      uint32_t skip = q->offset;
+      for (k = 0; k < span; k++) {
+        const user_t *u = &data->users[users_query_slot(snap, q, lo, hi, k)];
+        if (users_query_match(q, u) && skip-- == 0)
+          break;
+      }
+    }
+    *pos = k + 1;
+  }
+  for (; *pos - 1 < span && *count < q->limit; (*pos)++) {
+    int slot = users_query_slot(snap, q, lo, hi, *pos - 1);
+    if (!users_query_match(q, &data->users[slot]))
+      continue;
+    char item[240];
+    int len = user_item(snap, slot, fmt, *count == 0, item, sizeof(item));
+    if (!stream_append(buf, cap, &n, item, len))
+      break;
+    (*count)++;
+  }
+  data_manager_snapshot_release(snap);
+  if ((*pos - 1 >= span || *count >= q->limit) &&
+      stream_append(buf, cap, &n, list_end(fmt), 1))
+    *pos = USERS_PAGE_DONE;
+  return n;
+}
+
+static int log_item(const access_log_view_t *log, body_format_t fmt,
+                    bool first, char *out, size_t cap) {
+  if (fmt == BODY_CBOR) {
+    cbor_writer_t w;
+    cbor_writer_init(&w, out, cap);
+    cbor_put_map(&w, 4);
+    cbor_put_uint(&w, LOG_KEY_TIME);
+    cbor_put_int(&w, log->timestamp);
+    cbor_put_uint(&w, LOG_KEY_USER);
+    cbor_put_text(&w, log->user_name);
+    cbor_put_uint(&w, LOG_KEY_GRANTED);
+    cbor_put_bool(&w, log->granted);
+    cbor_put_uint(&w, LOG_KEY_DETAILS);
+    cbor_put_text(&w, log->details);
+    return w.len;
+  }
+  char user[2 * NAME_LENGTH + 2], details[2 * 32 + 2];
+  json_quote(user, sizeof(user), log->user_name);
+  json_quote(details, sizeof(details), log->details);
+  return snprintf(out, cap,
+                  "%s{\"time\":%lld,\"user\":%s,\"granted\":%s,"
+                  "\"details\":%s}",
+                  first ? "" : ",", (long long)log->timestamp, user,
+                  log->granted ? "true" : "false", details);
+}
+
+#define LOGS_DONE UINT32_MAX
+
+// Renders the recent log ring as an array, newest first, in the same way:
+// pos starts at 0 and the call returns 0 when done
+static size_t logs_render(body_format_t fmt, uint32_t *pos, char *buf,
+                          size_t cap) {
+  if (*pos == LOGS_DONE)
+    return 0;
+  size_t n = 0;
+  // Position 0 is the opening bracket, entry k is at k + 1
+  if (*pos == 0) {
+    buf[n++] = *list_open(fmt);
+    *pos = 1;
+  }
+  access_log_view_t log;
+  for (; data_manager_log_entry(*pos - 1, &log); (*pos)++) {
+    char item[200];
+    int len = log_item(&log, fmt, *pos == 1, item, sizeof(item));
+    if (len >= (int)sizeof(item) || !stream_append(buf, cap, &n, item, len))
+      return n;
+  }
+  if (stream_append(buf, cap, &n, list_end(fmt), 1))
+    *pos = LOGS_DONE;
+  return n;
+}
+
+// The MQTT settings as one document; returns its length
+static size_t mqtt_config_render(body_format_t fmt, char *buf, size_t cap) {
+  char uri[64], cmd[64], status[64];
+  mqtt_manager_get_config(uri, cmd, status);
+  if (fmt == BODY_CBOR) {
+    cbor_writer_t w;
+    cbor_writer_init(&w, buf, cap);
+    cbor_put_map(&w, 3);
+    cbor_put_uint(&w, MQTT_KEY_URI);
+    cbor_put_text(&w, uri);
+    cbor_put_uint(&w, MQTT_KEY_CMD);
+    cbor_put_text(&w, cmd);
+    cbor_put_uint(&w, MQTT_KEY_STATUS);
+    cbor_put_text(&w, status);
+    return w.len <= cap ? w.len : 0;
+  }
+  char q_uri[2 * 64 + 2], q_cmd[2 * 64 + 2], q_status[2 * 64 + 2];
+  json_quote(q_uri, sizeof(q_uri), uri);
+  json_quote(q_cmd, sizeof(q_cmd), cmd);
+  json_quote(q_status, sizeof(q_status), status);
+  int n = snprintf(buf, cap,
+                   "{\"uri\":%s,\"cmd_topic\":%s,\"status_topic\":%s}",
+                   q_uri, q_cmd, q_status);
+  return n > 0 && (size_t)n < cap ? n : 0;
+}
+
+// Whole bodies for the response cache. Both depend only on the query, the
+// encoding and the generation of their data, which makes them cacheable.
+#define MQTT_URI "/api/admin/mqtt"
+
+typedef struct {
+  const users_query_t *q;
+  body_format_t fmt;
+} users_body_t;
+
+static size_t users_page_body(void *ctx, uint8_t *buf, size_t cap) {
+  const users_body_t *b = (const users_body_t *)ctx;
+  uint32_t pos = 0, count = 0;
+  size_t n = 0, part;
+  while (n < cap && (part = users_page_render(b->q, b->fmt, &pos, &count,
+                                              (char *)buf + n, cap - n)) > 0)
+    n += part;
+  return pos == USERS_PAGE_DONE ? n : cap + 1;
+}
+
+static size_t mqtt_config_body(void *ctx, uint8_t *buf, size_t cap) {
+  size_t n = mqtt_config_render(*(body_format_t *)ctx, (char *)buf, cap);
+  return n ? n : cap + 1;
+}
+
+// Gate id from a verify body, GATE_ANY when absent
+static int pin_request_gate(const json_reader_t *r, const pin_req_t *req) {
+  return json_reader_has(r, PIN_REQ_GATE) ? req->gate : GATE_ANY;
+}
+
+// Applies the members present in a gate config request. Returns false when
+// the id is unknown or the result is invalid.
+static bool gate_from_request(const json_reader_t *r, const gate_req_t *req) {
+  const gate_t *cur = gates_get(req->id);
+  if (!cur)
+    return false;
+  gate_t g = *cur;
+  if (json_reader_has(r, GATE_REQ_NAME))
+    strcpy(g.name, req->name);
+  if (json_reader_has(r, GATE_REQ_GPIO)) {
+    if (req->gpio < -1 || req->gpio > INT8_MAX)
+      return false;
+    g.gpio = (int8_t)req->gpio;
+  }
+  if (json_reader_has(r, GATE_REQ_PULSE)) {
+    if (req->pulse_ms < GATE_MIN_PULSE_MS || req->pulse_ms > GATE_MAX_PULSE_MS)
+      return false;
+    g.pulse_ms = (uint16_t)req->pulse_ms;
+  }
+  if (json_reader_has(r, GATE_REQ_ACTIVE))
+    g.active_high = req->active_high;
+  return gates_configure(req->id, &g);
+}
+
+// Parses a single "bytes=" range against size. Returns 1 with the inclusive
+// range in first/last, 0 to send the whole file (no header, or a form not
+// served here), -1 when the range is not satisfiable.
+static int parse_byte_range(const char *h, uint32_t size, uint32_t *first,
+                            uint32_t *last) {
+  if (strncmp(h, "bytes=", 6) != 0 || strchr(h, ','))
+    return 0;
+  h += 6;
+  char *end;
+  if (*h == '-') {
+    unsigned long n = strtoul(h + 1, &end, 10);
+    if (end == h + 1 || *end)
+      return 0;
+    if (n == 0 || size == 0)
+      return -1;
+    *first = n >= size ? 0 : size - n;
+    *last = size - 1;
+    return 1;
+  }
+  unsigned long a = strtoul(h, &end, 10);
+  if (end == h || *end != '-')
+    return 0;
+  h = end + 1;
+  unsigned long b = ULONG_MAX;
+  if (*h) {
+    b = strtoul(h, &end, 10);
+    if (end == h || *end || b < a)
+      return 0;
+  }
+  if (a >= size)
+    return -1;
+  *first = a;
+  *last = b >= size ? size - 1 : b;
+  return 1;
+}
+
+static void history_etag(char *out, size_t cap) {
+  snprintf(out, cap, "\"%08x\"", (unsigned)history_tag());
+}
+
+// Part of the access history still to be sent
+typedef struct {
+  uint32_t pos;
+  uint32_t end;
+} history_span_t;
+
+static size_t history_span_read(void *ctx, uint8_t *buf, size_t cap) {
+  history_span_t *span = (history_span_t *)ctx;
+  if (span->pos >= span->end)
+    return 0;
+  if (cap > span->end - span->pos)
+    cap = span->end - span->pos;
+  int n = history_read(span->pos, buf, cap);
+  if (n <= 0)
+    return 0;
+  span->pos += n;
+  return n;
+}
+
+// API routes are table-driven so both backends register the same set and
+// time every handler in one place. Labels are built at compile time.
+#define API_ROUTE(uri, method, handler)                                        \
+  {uri, HTTP_##method, handler, #method " " uri,                               \
+   "route=\"" uri "\",method=\"" #method "\"", NULL}
+#define API_ROUTE_COUNT(table) (sizeof(table) / sizeof((table)[0]))
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4"
+
 #ifdef ARDUINO
+#include "async_http.h"
 #include <ArduinoJson.h>
-#include <ESP8266WebServer.h>
 #include <LittleFS.h>
 #include <bearssl/bearssl.h>
 
-ESP8266WebServer server(80);
 static const char *TAG = "WEB_SERVER";
 
 // Helper to calculate SHA256 using BearSSL
@@ -30,270 +732,644 @@ void sha256_string(const char *str, char outputBuffer[65]) {
   outputBuffer[64] = 0;
 }
 
+static body_format_t response_format(http_conn_t *c) {
+  return async_http_accepts_cbor(c) ? BODY_CBOR : BODY_JSON;
+}
+
+// Binds the request body, JSON or CBOR, into out, or replies 400 and returns
+// false. A CBOR map may use the integer keys in names.
+static bool parse_request_keys(http_conn_t *c, json_reader_t *r,
+                               const json_field_t *fields, size_t count,
+                               void *out, const char *const *names,
+                               size_t name_count) {
+  json_status_t status =
+      async_http_body_is_cbor(c)
+          ? cbor_parse_buffer(r, fields, count, out, names, name_count,
+                              (const uint8_t *)async_http_body(c),
+                              async_http_body_len(c))
+          : json_parse_buffer(r, fields, count, out, async_http_body(c),
+                              async_http_body_len(c));
+  if (status == JSON_OK)
+    return true;
+  char body[64];
+  json_error_body(body, sizeof(body), status);
+  async_http_send(c, 400, "application/json", body);
+  return false;
+}
+
+static bool parse_request(http_conn_t *c, json_reader_t *r,
+                          const json_field_t *fields, size_t count, void *out) {
+  return parse_request_keys(c, r, fields, count, out, NULL, 0);
+}
+
 // Handler: Verify PIN
-void handle_api_verify_pin() {
-  if (!server.hasArg("plain")) {
-    server.send(400, "application/json", "{\"error\":\"Missing body\"}");
+void handle_api_verify_pin(http_conn_t *c) {
+  json_reader_t r;
+  pin_req_t req = {};
+  if (!parse_request(c, &r, pin_req_fields, JSON_FIELD_COUNT(pin_req_fields),
+                     &req))
     return;
+  uint8_t gates = 0;
+  verify_result_t res = verify_pin(req.pin, pin_request_gate(&r, &req), &gates);
+  if (res == VERIFY_GRANTED) {
+    gates_open_mask(gates);
+    async_http_send(c, 200, "application/json", "{\"status\":\"granted\"}");
+  } else if (res == VERIFY_LOCKED) {
+    async_http_send(c, 403, "application/json", "{\"status\":\"locked\"}");
+  } else {
+    async_http_send(c, 401, "application/json", "{\"status\":\"denied\"}");
   }
-  JsonDocument doc;
-  DeserializationError error = deserializeJson(doc, server.arg("plain"));
-  if (error) {
-    server.send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
+}
+
+// WebSocket: Keypad channel
+void handle_ws_keypad(http_conn_t *c, http_ws_event_t event, const char *data,
+                      size_t len) {
+  char reply[16];
+  if (event == HTTP_WS_OPEN) {
+    keypad_state_msg(reply, sizeof(reply));
+    async_http_ws_send(c, reply);
     return;
   }
-  const char *pin = doc["pin"];
-  char user_name[32];
-  if (pin && data_manager_validate_pin(pin, user_name)) {
-    trigger_relay();
-    server.send(200, "application/json", "{\"status\":\"granted\"}");
-  } else {
-    server.send(401, "application/json", "{\"status\":\"denied\"}");
-  }
+  uint8_t gates = 0;
+  verify_result_t res =
+      keypad_handle_frame(data, len, reply, sizeof(reply), &gates);
+  async_http_ws_send(c, reply);
+  if (res == VERIFY_GRANTED)
+    gates_open_mask(gates);
+}
+
+// Pushes lockout start/end to all open keypads
+static void keypad_push_lockout(void) {
+  static bool locked = false;
+  static unsigned long last_check = 0;
+  if (millis() - last_check < 250)
+    return;
+  last_check = millis();
+
+  bool now_locked = data_manager_lockout_remaining() > 0;
+  if (now_locked == locked)
+    return;
+  locked = now_locked;
+  char msg[16];
+  keypad_state_msg(msg, sizeof(msg));
+  async_http_ws_broadcast(KEYPAD_WS_URI, msg);
 }
 
 // Handler: Login
-void handle_api_login() {
-  if (!server.hasArg("plain")) {
-    server.send(400, "application/json", "{\"error\":\"Missing body\"}");
+void handle_api_login(http_conn_t *c) {
+  json_reader_t r;
+  login_req_t req = {};
+  if (!parse_request(c, &r, login_req_fields,
+                     JSON_FIELD_COUNT(login_req_fields), &req))
     return;
-  }
-  JsonDocument doc;
-  DeserializationError error = deserializeJson(doc, server.arg("plain"));
-  if (error) {
-    server.send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
+  char hash[65];
+  sha256_string(req.password, hash);
+  ESP_LOGI(TAG, "Login Attempt: Hash='%s'", hash);
+
+  if (strcmp(hash, ADMIN_PASS_HASH) == 0) {
+    async_http_send(c, 200, "application/json", "{\"status\":\"ok\"}");
     return;
   }
-  const char *password = doc["password"];
-  if (password) {
-    char hash[65];
-    sha256_string(password, hash);
-    ESP_LOGI(TAG, "Login Attempt: Pass='%s', Hash='%s'", password, hash);
-    ESP_LOGI(TAG, "Expected Hash='%s'", ADMIN_PASS_HASH);
-    ESP_LOGI(TAG, "Strcmp Result: %d", strcmp(hash, ADMIN_PASS_HASH));
+  async_http_send(c, 401, "application/json", "{\"status\":\"denied\"}");
+}
 
-    if (strcmp(hash, ADMIN_PASS_HASH) == 0) {
-      server.send(200, "application/json", "{\"status\":\"ok\"}");
-      return;
-    }
-  } else {
-    ESP_LOGE(TAG, "Login Attempt: Password field missing or null");
-  }
-  server.send(401, "application/json", "{\"status\":\"denied\"}");
+// Streams a page of users, as many records per call as fit
+static size_t fill_users(http_conn_t *c, char *buf, size_t cap) {
+  users_query_t q;
+  users_query_parse(async_http_query(c), &q); // Checked by the handler
+  http_cursor_t *cur = async_http_cursor(c);
+  return users_page_render(&q, response_format(c), &cur->pos, &cur->count,
+                           buf, cap);
 }
 
-// Handler: Get Users
-void handle_api_get_users() {
-  system_data_t *data = data_manager_get_data();
-  JsonDocument doc;
-  JsonArray array = doc.to<JsonArray>();
+// Streams a users page held by the response cache. One dropped for newer
+// bodies midway ends the response early, which closes the connection.
+static size_t fill_cached_users(http_conn_t *c, char *buf, size_t cap) {
+  http_cursor_t *cur = async_http_cursor(c);
+  response_key_t key;
+  response_cache_key(&key, USERS_URI, async_http_query(c), response_format(c));
+  size_t len;
+  const uint8_t *body = response_cache_find(&key, cur->end, &len);
+  if (!body || cur->pos >= len)
+    return 0;
+  size_t n = len - cur->pos < cap ? len - cur->pos : cap;
+  memcpy(buf, body + cur->pos, n);
+  cur->pos += n;
+  return n;
+}
 
-  for (int i = 0; i < MAX_USERS; i++) {
-    if (data->users[i].active) {
-      JsonObject user = array.add<JsonObject>();
-      user["name"] = data->users[i].name;
-      user["pin"] = data->users[i].pin;
-      user["type"] = data->users[i].type;
-      user["expiry"] = data->users[i].expiry_date;
-      user["remaining"] = data->users[i].access_count_remaining;
-    }
+static void send_cached_users(http_conn_t *c, body_format_t fmt,
+                              uint32_t generation, size_t len) {
+  async_http_send_stream_len(c, 200, body_type(fmt), len, fill_cached_users);
+  async_http_cursor(c)->end = generation;
+}
+
+// Adds the validators of a cacheable response. Replies 304 and returns true
+// when the client's copy is current.
+static bool send_not_modified(http_conn_t *c, const response_key_t *key,
+                              uint32_t generation) {
+  char etag[RESPONSE_ETAG_LEN];
+  response_cache_etag(key, generation, etag);
+  async_http_add_header(c, "ETag", etag);
+  async_http_add_header(c, "Cache-Control", "no-cache");
+  async_http_add_header(c, "Vary", "Accept");
+  if (!response_cache_etag_matches(async_http_if_none_match(c), etag))
+    return false;
+  async_http_send(c, 304, NULL, NULL);
+  return true;
+}
+
+// Handler: Get Users. X-Total-Count carries the matches across all pages.
+void handle_api_get_users(http_conn_t *c) {
+  users_query_t q;
+  if (!users_query_parse(async_http_query(c), &q)) {
+    async_http_send(c, 400, "application/json",
+                    "{\"error\":\"Invalid query\"}");
+    return;
   }
-  String response;
-  serializeJson(doc, response);
-  server.send(200, "application/json", response);
+  body_format_t fmt = response_format(c);
+  response_key_t key;
+  response_cache_key(&key, USERS_URI, async_http_query(c), fmt);
+  uint32_t generation = data_manager_generation();
+  if (send_not_modified(c, &key, generation))
+    return;
+  char total[12];
+  snprintf(total, sizeof(total), "%d", users_query_total(&q));
+  async_http_add_header(c, "X-Total-Count", total);
+
+  users_body_t ctx = {&q, fmt};
+  const uint8_t *body;
+  size_t len;
+  if (response_cache_get(&key, generation, users_page_body, &ctx, &body,
+                         &len))
+    send_cached_users(c, fmt, generation, len);
+  else
+    async_http_send_stream(c, 200, body_type(fmt), fill_users);
 }
 
 // Handler: Add User
-void handle_api_add_user() {
-  if (!server.hasArg("plain")) {
-    server.send(400, "application/json", "{\"error\":\"Missing body\"}");
+void handle_api_add_user(http_conn_t *c) {
+  json_reader_t r;
+  add_user_req_t req = {};
+  if (!parse_request_keys(c, &r, add_user_req_fields,
+                          JSON_FIELD_COUNT(add_user_req_fields), &req,
+                          user_keys, KEY_COUNT(user_keys)))
+    return;
+  if (!add_user_request_valid(&req)) {
+    async_http_send(c, 400, "application/json",
+                    "{\"error\":\"Invalid user\"}");
     return;
   }
-  JsonDocument doc;
-  DeserializationError error = deserializeJson(doc, server.arg("plain"));
-  if (error) {
-    server.send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
+
+  char body[96];
+  if (add_user_from_request(&r, &req, body, sizeof(body))) {
+    async_http_send(c, 200, "application/json", body);
+  } else {
+    async_http_send(c, 500, "application/json",
+                    "{\"error\":\"Failed to add user\"}");
+  }
+}
+
+// Handler: Update User by id
+void handle_api_update_user(http_conn_t *c) {
+  user_id_t id = user_id_from_uri(async_http_uri(c));
+  if (!user_id_known(id)) {
+    async_http_send(c, 404, "application/json",
+                    "{\"error\":\"User not found\"}");
+    return;
+  }
+  json_reader_t r;
+  add_user_req_t req = {};
+  if (!parse_request_keys(c, &r, update_user_req_fields,
+                          JSON_FIELD_COUNT(update_user_req_fields), &req,
+                          user_keys, KEY_COUNT(user_keys)))
+    return;
+  if (!add_user_request_valid(&req)) {
+    async_http_send(c, 400, "application/json",
+                    "{\"error\":\"Invalid user\"}");
     return;
   }
 
-  const char *name = doc["name"];
-  int typeInt = doc["type"];
-  int limit = doc["limit"];
-
-  if (data_manager_add_user(name, (user_type_t)typeInt, limit)) {
-    // Schedule update logic
-    system_data_t *data = data_manager_get_data();
-    for (int i = 0; i < MAX_USERS; i++) {
-      if (data->users[i].active && strcmp(data->users[i].name, name) == 0) {
-        if (!doc["start"].isNull())
-          data->users[i].start_time = doc["start"];
-        if (!doc["end"].isNull())
-          data->users[i].end_time = doc["end"];
-        if (!doc["days"].isNull())
-          data->users[i].allowed_days = doc["days"];
-        data_manager_save();
-        break;
-      }
-    }
-    server.send(200, "application/json", "{\"status\":\"ok\"}");
+  user_fields_t f;
+  uint32_t fields = user_fields_from_request(&r, &req, &f);
+  if (data_manager_update_user(id, &f, fields)) {
+    async_http_send(c, 200, "application/json", "{\"status\":\"ok\"}");
   } else {
-    server.send(500, "application/json", "{\"error\":\"Failed to add user\"}");
+    async_http_send(c, 500, "application/json",
+                    "{\"error\":\"Failed to update user\"}");
   }
 }
 
 // Handler: Delete User
-void handle_api_delete_user() {
-  if (!server.hasArg("plain")) {
-    server.send(400, "application/json", "{\"error\":\"Missing body\"}");
+void handle_api_delete_user(http_conn_t *c) {
+  json_reader_t r;
+  pin_req_t req = {};
+  if (!parse_request(c, &r, pin_req_fields, JSON_FIELD_COUNT(pin_req_fields),
+                     &req))
     return;
+  if (data_manager_delete_user(req.pin)) {
+    async_http_send(c, 200, "application/json", "{\"status\":\"ok\"}");
+  } else {
+    async_http_send(c, 500, "application/json",
+                    "{\"error\":\"Failed to delete\"}");
   }
-  JsonDocument doc;
-  deserializeJson(doc, server.arg("plain"));
-  const char *pin = doc["pin"];
-  if (pin && data_manager_delete_user(pin)) {
-    server.send(200, "application/json", "{\"status\":\"ok\"}");
+}
+
+// Handler: Delete User by id
+void handle_api_delete_user_id(http_conn_t *c) {
+  if (data_manager_delete_user_id(user_id_from_uri(async_http_uri(c)))) {
+    async_http_send(c, 200, "application/json", "{\"status\":\"ok\"}");
   } else {
-    server.send(500, "application/json", "{\"error\":\"Failed to delete\"}");
+    async_http_send(c, 404, "application/json",
+                    "{\"error\":\"User not found\"}");
   }
 }
 
+// Streams the recent log ring, as many entries per call as fit
+static size_t fill_logs(http_conn_t *c, char *buf, size_t cap) {
+  return logs_render(response_format(c), &async_http_cursor(c)->pos, buf,
+                     cap);
+}
+
 // Handler: Get Logs
-void handle_api_get_logs() {
-  system_data_t *data = data_manager_get_data();
-  JsonDocument doc;
-  JsonArray array = doc.to<JsonArray>();
-
-  for (int i = 0; i < MAX_LOGS; i++) {
-    if (data->logs[i].timestamp != 0) {
-      JsonObject log = array.add<JsonObject>();
-      log["time"] = data->logs[i].timestamp;
-      log["user"] = data->logs[i].user_name;
-      log["granted"] = data->logs[i].granted;
-      log["details"] = data->logs[i].details;
+void handle_api_get_logs(http_conn_t *c) {
+  async_http_add_header(c, "Vary", "Accept");
+  async_http_send_stream(c, 200, body_type(response_format(c)), fill_logs);
+}
+
+// Streams the access history between the cursor's pos and end
+static size_t fill_history(http_conn_t *c, char *buf, size_t cap) {
+  http_cursor_t *cur = async_http_cursor(c);
+  history_span_t span = {cur->pos, cur->end};
+  size_t n = history_span_read(&span, (uint8_t *)buf, cap);
+  cur->pos = span.pos;
+  return n;
+}
+
+// One compressed download at a time; others are told to retry. The encoder
+// is reclaimed from a client that went away mid-stream.
+static history_gz_t *history_gz = NULL;
+static http_conn_t *history_gz_conn = NULL;
+
+static size_t fill_history_gzip(http_conn_t *c, char *buf, size_t cap) {
+  size_t n = history_gz_read(history_gz, (uint8_t *)buf, cap);
+  if (n == 0) {
+    history_gz_close(history_gz);
+    history_gz = NULL;
+    history_gz_conn = NULL;
+  }
+  return n;
+}
+
+// Handler: Download Logs. Supports single byte ranges, validated by an
+// ETag, and gzip for full downloads.
+void handle_api_download_logs(http_conn_t *c) {
+  int32_t size = history_size();
+  if (size < 0) {
+    async_http_send(c, 404, "text/plain", "Log file not found");
+    return;
+  }
+  char etag[12], range[48];
+  history_etag(etag, sizeof(etag));
+  uint32_t first = 0, last = 0;
+  int ranged = parse_byte_range(async_http_range(c), size, &first, &last);
+  const char *if_range = async_http_if_range(c);
+  if (ranged && if_range[0] && strcmp(if_range, etag) != 0)
+    ranged = 0; // The client's copy is stale: send it all again
+
+  async_http_add_header(c, "Accept-Ranges", "bytes");
+  async_http_add_header(c, "ETag", etag);
+  if (ranged < 0) {
+    snprintf(range, sizeof(range), "bytes */%u", (unsigned)size);
+    async_http_add_header(c, "Content-Range", range);
+    async_http_send(c, 416, "text/plain", "Range not satisfiable");
+    return;
+  }
+  bool gzip = !ranged && async_http_accepts_gzip(c) &&
+              async_http_method(c) == HTTP_GET;
+  if (gzip && history_gz &&
+      !async_http_streaming(history_gz_conn, fill_history_gzip)) {
+    history_gz_close(history_gz); // Its client went away
+    history_gz = NULL;
+  }
+  if (gzip && history_gz) {
+    // Taking the encoder over would cut the other body short
+    async_http_add_header(c, "Retry-After", "10");
+    async_http_send(c, 503, "text/plain",
+                    "Another compressed download is in progress");
+    return;
+  }
+  async_http_add_header(c, "Content-Disposition",
+                        "attachment; filename=\"access_history.csv\"");
+
+  if (ranged) {
+    snprintf(range, sizeof(range), "bytes %u-%u/%u", (unsigned)first,
+             (unsigned)last, (unsigned)size);
+    async_http_add_header(c, "Content-Range", range);
+    async_http_send_stream_len(c, 206, "text/csv", last - first + 1,
+                               fill_history);
+    async_http_cursor(c)->pos = first;
+    async_http_cursor(c)->end = last + 1;
+    return;
+  }
+
+  if (gzip) {
+    history_gz = history_gz_open();
+    history_gz_conn = history_gz ? c : NULL;
+    if (history_gz) {
+      async_http_add_header(c, "Content-Encoding", "gzip");
+      async_http_send_stream(c, 200, "text/csv", fill_history_gzip);
+      return;
     }
   }
-  String response;
-  serializeJson(doc, response);
-  server.send(200, "application/json", response);
+  async_http_send_stream_len(c, 200, "text/csv", size, fill_history);
+  async_http_cursor(c)->end = size;
 }
 
-// Handler: Open Gate
-void handle_api_open_gate() {
-  trigger_relay();
-  server.send(200, "application/json", "{\"status\":\"ok\"}");
+// Handler: Open Gate. An empty body opens every gate.
+void handle_api_open_gate(http_conn_t *c) {
+  if (async_http_body_len(c) == 0) {
+    gates_open_mask(GATE_MASK_ALL);
+    async_http_send(c, 200, "application/json", "{\"status\":\"ok\"}");
+    return;
+  }
+  json_reader_t r;
+  open_req_t req = {};
+  if (!parse_request(c, &r, open_req_fields, JSON_FIELD_COUNT(open_req_fields),
+                     &req))
+    return;
+  if (gates_open(req.gate)) {
+    async_http_send(c, 200, "application/json", "{\"status\":\"ok\"}");
+  } else {
+    async_http_send(c, 404, "application/json",
+                    "{\"error\":\"Unknown gate\"}");
+  }
 }
 
-// Handler: Get MQTT
-void handle_api_get_mqtt() {
-  char uri[64], cmd[64], status[64];
-  mqtt_manager_get_config(uri, cmd, status);
-  JsonDocument doc;
-  doc["uri"] = uri;
-  doc["cmd_topic"] = cmd;
-  doc["status_topic"] = status;
-  String response;
-  serializeJson(doc, response);
-  server.send(200, "application/json", response);
+// Handler: Get Gates
+void handle_api_get_gates(http_conn_t *c) {
+  JsonDocument doc(&json_pool_allocator);
+  JsonArray arr = doc.to<JsonArray>();
+  for (int i = 0; i < MAX_GATES; i++) {
+    const gate_t *g = gates_get(i);
+    JsonObject o = arr.add<JsonObject>();
+    o["id"] = i;
+    o["name"] = g->name;
+    o["gpio"] = g->gpio;
+    o["pulse_ms"] = g->pulse_ms;
+    o["active_high"] = g->active_high;
+  }
+  char response[512];
+  serializeJson(doc, response, sizeof(response));
+  async_http_send(c, 200, "application/json", response);
 }
 
-// Handler: Set MQTT
-void handle_api_set_mqtt() {
-  if (!server.hasArg("plain"))
+// Handler: Set Gate
+void handle_api_set_gate(http_conn_t *c) {
+  json_reader_t r;
+  gate_req_t req = {};
+  if (!parse_request(c, &r, gate_req_fields, JSON_FIELD_COUNT(gate_req_fields),
+                     &req))
     return;
-  JsonDocument doc;
-  deserializeJson(doc, server.arg("plain"));
-  const char *uri = doc["uri"];
-  const char *cmd = doc["cmd_topic"];
-  const char *status = doc["status_topic"];
-
-  if (uri) {
-    mqtt_manager_update_config(uri, cmd, status);
-    server.send(200, "application/json", "{\"status\":\"ok\"}");
+  if (gate_from_request(&r, &req)) {
+    async_http_send(c, 200, "application/json", "{\"status\":\"ok\"}");
   } else {
-    server.send(500, "application/json", "{\"error\":\"Invalid config\"}");
+    async_http_send(c, 400, "application/json",
+                    "{\"error\":\"Invalid gate\"}");
   }
 }
 
-// Handler: Static Files
-bool handleFileRead(String path) {
-  if (path.endsWith("/"))
-    path += "index.html";
-  if (path == "/admin")
-    path += ".html";
+// Handler: Get MQTT
+void handle_api_get_mqtt(http_conn_t *c) {
+  body_format_t fmt = response_format(c);
+  response_key_t key;
+  response_cache_key(&key, MQTT_URI, "", fmt);
+  uint32_t generation = mqtt_manager_config_generation();
+  if (send_not_modified(c, &key, generation))
+    return;
+  const uint8_t *body;
+  size_t len;
+  if (response_cache_get(&key, generation, mqtt_config_body, &fmt, &body,
+                         &len)) {
+    async_http_send_data(c, 200, body_type(fmt), body, len);
+    return;
+  }
+  char buf[448];
+  len = mqtt_config_render(fmt, buf, sizeof(buf));
+  async_http_send_data(c, 200, body_type(fmt), buf, len);
+}
 
-  String contentType = "text/plain";
-  if (path.endsWith(".html"))
+// Handler: Set MQTT
+void handle_api_set_mqtt(http_conn_t *c) {
+  json_reader_t r;
+  mqtt_req_t req = {};
+  if (!parse_request_keys(c, &r, mqtt_req_fields,
+                          JSON_FIELD_COUNT(mqtt_req_fields), &req, mqtt_keys,
+                          KEY_COUNT(mqtt_keys)))
+    return;
+  mqtt_manager_update_config(
+      req.uri, json_reader_has(&r, MQTT_REQ_CMD) ? req.cmd_topic : NULL,
+      json_reader_has(&r, MQTT_REQ_STATUS) ? req.status_topic : NULL);
+  async_http_send(c, 200, "application/json", "{\"status\":\"ok\"}");
+}
+
+static bool ends_with(const char *s, const char *suffix) {
+  size_t ls = strlen(s), lx = strlen(suffix);
+  return ls >= lx && strcmp(s + ls - lx, suffix) == 0;
+}
+
+// Handler: Static Files. Only the UI's own file types are served; storage
+// keeps its files in a directory of its own.
+bool handleFileRead(http_conn_t *c) {
+  char path[HTTP_MAX_URI + 16];
+  const char *uri = async_http_uri(c);
+  if (strcmp(uri, "/admin") == 0)
+    snprintf(path, sizeof(path), "/admin.html");
+  else if (ends_with(uri, "/"))
+    snprintf(path, sizeof(path), "%sindex.html", uri);
+  else
+    snprintf(path, sizeof(path), "%s", uri);
+
+  const char *contentType = NULL;
+  if (ends_with(path, ".html"))
     contentType = "text/html";
-  else if (path.endsWith(".css"))
+  else if (ends_with(path, ".css"))
     contentType = "text/css";
-  else if (path.endsWith(".js"))
+  else if (ends_with(path, ".js"))
     contentType = "application/javascript";
-  else if (path.endsWith(".ico"))
+  else if (ends_with(path, ".ico"))
     contentType = "image/x-icon";
-  else if (path.endsWith(".png"))
+  else if (ends_with(path, ".png"))
     contentType = "image/png";
+  if (!contentType || strstr(path, "/."))
+    return false;
 
   if (LittleFS.exists(path)) {
     File file = LittleFS.open(path, "r");
-    server.streamFile(file, contentType);
-    file.close();
+    async_http_send_file(c, file, contentType);
     return true;
   }
   return false;
 }
 
+#if LOG_RING_FLASH
+// Handler: Binary log trace, LOG_RING_FLASH_KEY or (for a URI ending in .old)
+// LOG_RING_FLASH_OLD, for tools/logdecode. Stops at the size it had when
+// the request came in; records appended since are in the next download.
+static const char *trace_key(http_conn_t *c) {
+  return ends_with(async_http_uri(c), ".old") ? LOG_RING_FLASH_OLD
+                                              : LOG_RING_FLASH_KEY;
+}
+
+static size_t fill_trace(http_conn_t *c, char *buf, size_t cap) {
+  http_cursor_t *cur = async_http_cursor(c);
+  if (cur->end - cur->pos < cap)
+    cap = cur->end - cur->pos;
+  int n = cap ? storage_read(STORAGE_LOGS, trace_key(c), cur->pos, buf, cap)
+              : 0;
+  if (n <= 0)
+    return 0;
+  cur->pos += n;
+  return n;
+}
+
+void handle_api_trace(http_conn_t *c) {
+  int32_t size = storage_size(STORAGE_LOGS, trace_key(c));
+  if (size < 0) {
+    async_http_send(c, 404, "text/plain", "No trace");
+    return;
+  }
+  async_http_send_stream_len(c, 200, "application/octet-stream", size,
+                             fill_trace);
+  async_http_cursor(c)->end = size;
+}
+#endif
+
+// Handler: Metrics (Prometheus text format)
+static size_t fill_metrics(http_conn_t *c, char *buf, size_t cap) {
+  http_cursor_t *cur = async_http_cursor(c);
+  return metrics_render(&cur->pos, &cur->count, buf, cap);
+}
+
+void handle_api_metrics(http_conn_t *c) {
+  async_http_send_stream(c, 200, METRICS_CONTENT_TYPE, fill_metrics);
+}
+
+// Handler: Access Statistics
+static size_t fill_stats(http_conn_t *c, char *buf, size_t cap) {
+  http_cursor_t *cur = async_http_cursor(c);
+  return access_stats_render(&cur->pos, &cur->count, buf, cap);
+}
+
+void handle_api_stats(http_conn_t *c) {
+  async_http_send_stream(c, 200, "application/json", fill_stats);
+}
+
+// Handler: Stalls and Span Profile
+static size_t fill_profile(http_conn_t *c, char *buf, size_t cap) {
+  http_cursor_t *cur = async_http_cursor(c);
+  return profiler_render(&cur->pos, &cur->count, buf, cap);
+}
+
+void handle_api_profile(http_conn_t *c) {
+  async_http_send_stream(c, 200, "application/json", fill_profile);
+}
+
+// Handler: Static Fallback
+void handle_not_found(http_conn_t *c) {
+  profiler_enter("GET static");
+  if (!handleFileRead(c)) {
+    async_http_send(c, 404, "text/plain", "404: Not Found");
+  }
+  profiler_exit();
+}
+
+typedef struct {
+  const char *uri;
+  http_method_t method;
+  http_handler_t handler;
+  const char *name; // Profiler span
+  const char *labels;
+  metric_t *latency;
+} api_route_t;
+
+static api_route_t api_routes[] = {
+    API_ROUTE("/api/access/verify", POST, handle_api_verify_pin),
+    API_ROUTE("/api/auth/login", POST, handle_api_login),
+    API_ROUTE("/api/admin/users", GET, handle_api_get_users),
+    API_ROUTE("/api/admin/users", POST, handle_api_add_user),
+    API_ROUTE("/api/admin/users", DELETE, handle_api_delete_user),
+    API_ROUTE("/api/admin/users/*", PATCH, handle_api_update_user),
+    API_ROUTE("/api/admin/users/*", DELETE, handle_api_delete_user_id),
+    API_ROUTE("/api/admin/logs", GET, handle_api_get_logs),
+    API_ROUTE("/api/admin/logs/download", GET, handle_api_download_logs),
+    API_ROUTE("/api/admin/open", POST, handle_api_open_gate),
+    API_ROUTE("/api/admin/gates", GET, handle_api_get_gates),
+    API_ROUTE("/api/admin/gates", POST, handle_api_set_gate),
+    API_ROUTE("/api/admin/mqtt", GET, handle_api_get_mqtt),
+    API_ROUTE("/api/admin/mqtt", POST, handle_api_set_mqtt),
+    API_ROUTE("/api/admin/metrics", GET, handle_api_metrics),
+    API_ROUTE("/api/admin/stats", GET, handle_api_stats),
+    API_ROUTE("/api/admin/profile", GET, handle_api_profile),
+#if LOG_RING_FLASH
+    API_ROUTE("/api/admin/" LOG_RING_FLASH_KEY, GET, handle_api_trace),
+    API_ROUTE("/api/admin/" LOG_RING_FLASH_OLD, GET, handle_api_trace),
+#endif
+};
+
+static void handle_timed(http_conn_t *c) {
+  api_route_t *r = (api_route_t *)async_http_user_ctx(c);
+  uint32_t start = metrics_now_us();
+  profiler_enter(r->name);
+  json_pool_begin();
+  r->handler(c);
+  json_pool_end();
+  profiler_exit();
+  metrics_observe_us(r->latency, metrics_now_us() - start);
+}
+
 void start_web_server(void) {
   ESP_LOGI(TAG, "Starting Web Server...");
+  json_pool_init();
+  response_cache_init();
 
   // API Routes
-  server.on("/api/access/verify", HTTP_POST, handle_api_verify_pin);
-  server.on("/api/auth/login", HTTP_POST, handle_api_login);
-
-  server.on("/api/admin/users", HTTP_GET, handle_api_get_users);
-  server.on("/api/admin/users", HTTP_POST, handle_api_add_user);
-  server.on("/api/admin/users", HTTP_DELETE, handle_api_delete_user);
-
-  server.on("/api/admin/logs", HTTP_GET, handle_api_get_logs);
-  server.on("/api/admin/logs/download", HTTP_GET, []() {
-    // Simply stream the file
-    if (LittleFS.exists("/access.log")) {
-      File f = LittleFS.open("/access.log", "r");
-      server.streamFile(f, "text/csv");
-      f.close();
-    } else {
-      server.send(404, "text/plain", "Log file not found");
-    }
-  });
+  for (size_t i = 0; i < API_ROUTE_COUNT(api_routes); i++) {
+    api_route_t *r = &api_routes[i];
+    if (!r->latency)
+      r->latency = metrics_histogram("http_handler_duration_seconds",
+                                     "API handler latency", r->labels);
+    async_http_on_ctx(r->uri, r->method, handle_timed, r);
+  }
 
-  server.on("/api/admin/open", HTTP_POST, handle_api_open_gate);
-  server.on("/api/admin/mqtt", HTTP_GET, handle_api_get_mqtt);
-  server.on("/api/admin/mqtt", HTTP_POST, handle_api_set_mqtt);
+  async_http_on_ws(KEYPAD_WS_URI, handle_ws_keypad);
+  async_http_on_not_found(handle_not_found);
 
-  // Static Fallback
-  server.onNotFound([]() {
-    if (!handleFileRead(server.uri())) {
-      server.send(404, "text/plain", "404: Not Found");
-    }
-  });
-
-  server.begin();
-  ESP_LOGI(TAG, "Web Server started on port 80");
+  async_http_begin(80);
+  ESP_LOGI(TAG, "Web Server started on port 80 (max %d connections)",
+           HTTP_MAX_CONNECTIONS);
 }
 
-void stop_web_server(void) { server.stop(); }
+void stop_web_server(void) { async_http_end(); }
 
-void web_server_loop(void) { server.handleClient(); }
+void web_server_loop(void) {
+  async_http_loop();
+  keypad_push_lockout();
+}
 
 #else // !ARDUINO -- KEEPING ORIGINAL IDF IMPLEMENTATION BELOW
 
 #include <cJSON.h>
 #include <esp_log.h>
 #include <esp_spiffs.h>
+#include <esp_timer.h>
 #include <mbedtls/md.h>
 
 static const char *TAG = "WEB_SERVER";
 static httpd_handle_t server = NULL;
 
+static void keypad_notify_lockout(void);
+
 // Helper to calculate SHA256 of input
 void sha256_string(const char *str, char outputBuffer[65]) {
   unsigned char hash[32];
@@ -353,63 +1429,221 @@ static esp_err_t static_file_handler(httpd_req_t *req) {
   return ESP_OK;
 }
 
-// API: Verify PIN
-static esp_err_t api_verify_pin_handler(httpd_req_t *req) {
-  char buf[100];
-  int ret, remaining = req->content_len;
-  if (remaining >= sizeof(buf)) {
-    httpd_resp_send_500(req);
-    return ESP_FAIL;
-  }
+typedef struct {
+  httpd_req_t *req;
+  size_t remaining;
+} recv_ctx_t;
+
+// json_read_fn over httpd_req_recv, bounded by Content-Length
+static int recv_body(void *ctx, char *buf, size_t cap) {
+  recv_ctx_t *rc = (recv_ctx_t *)ctx;
+  if (rc->remaining == 0)
+    return 0;
+  if (cap > rc->remaining)
+    cap = rc->remaining;
+  int ret;
+  do {
+    ret = httpd_req_recv(rc->req, buf, cap);
+  } while (ret == HTTPD_SOCK_ERR_TIMEOUT);
+  if (ret <= 0)
+    return -1;
+  rc->remaining -= ret;
+  return ret;
+}
 
-  if ((ret = httpd_req_recv(req, buf, remaining)) <= 0) {
-    return ESP_FAIL;
-  }
-  buf[ret] = 0;
+// True when the named header contains needle, ignoring any past the buffer
+static bool req_header_has(httpd_req_t *req, const char *name,
+                           const char *needle) {
+  char value[96];
+  esp_err_t err = httpd_req_get_hdr_value_str(req, name, value, sizeof(value));
+  return (err == ESP_OK || err == ESP_ERR_HTTPD_RESULT_TRUNC) &&
+         strstr(value, needle) != NULL;
+}
 
-  cJSON *json = cJSON_Parse(buf);
-  cJSON *pin_item = cJSON_GetObjectItem(json, "pin");
+static body_format_t response_format(httpd_req_t *req) {
+  return req_header_has(req, "Accept", CBOR_CONTENT_TYPE) ? BODY_CBOR
+                                                          : BODY_JSON;
+}
 
-  if (!pin_item || !cJSON_IsString(pin_item)) {
-    httpd_resp_send_500(req);
-    cJSON_Delete(json);
-    return ESP_FAIL;
+// A CBOR body is read whole; it is never larger than API_MAX_BODY
+static json_status_t parse_cbor_body(httpd_req_t *req, json_reader_t *r,
+                                     const json_field_t *fields, size_t count,
+                                     void *out, const char *const *names,
+                                     size_t name_count) {
+  uint8_t body[API_MAX_BODY];
+  recv_ctx_t ctx = {req, req->content_len};
+  size_t len = 0;
+  int n;
+  while ((n = recv_body(&ctx, (char *)body + len, sizeof(body) - len)) > 0)
+    len += n;
+  if (n < 0)
+    return JSON_ERR_READ;
+  return cbor_parse_buffer(r, fields, count, out, names, name_count, body,
+                           len);
+}
+
+// Binds the request body, JSON or CBOR, into out, or replies with an error
+// and returns false. A CBOR map may use the integer keys in names.
+static bool parse_request_keys(httpd_req_t *req, json_reader_t *r,
+                               const json_field_t *fields, size_t count,
+                               void *out, const char *const *names,
+                               size_t name_count) {
+  json_status_t status;
+  if (req->content_len > API_MAX_BODY) {
+    status = JSON_ERR_BODY_SIZE;
+  } else if (req_header_has(req, "Content-Type", CBOR_CONTENT_TYPE)) {
+    status = parse_cbor_body(req, r, fields, count, out, names, name_count);
+  } else {
+    recv_ctx_t ctx = {req, req->content_len};
+    status = json_parse_stream(r, fields, count, out, recv_body, &ctx,
+                               API_MAX_BODY);
   }
+  if (status == JSON_OK)
+    return true;
+  if (status == JSON_ERR_READ)
+    return false; // Socket is gone, nothing to reply to
+
+  char body[64];
+  json_error_body(body, sizeof(body), status);
+  httpd_resp_set_status(req, status == JSON_ERR_BODY_SIZE
+                                 ? "413 Content Too Large"
+                                 : "400 Bad Request");
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_sendstr(req, body);
+  return false;
+}
 
-  char user_name[32];
-  bool valid = data_manager_validate_pin(pin_item->valuestring, user_name);
-  cJSON_Delete(json);
+static bool parse_request(httpd_req_t *req, json_reader_t *r,
+                          const json_field_t *fields, size_t count, void *out) {
+  return parse_request_keys(req, r, fields, count, out, NULL, 0);
+}
 
-  if (valid) {
-    trigger_relay();
+// API: Verify PIN
+static esp_err_t api_verify_pin_handler(httpd_req_t *req) {
+  json_reader_t r;
+  pin_req_t body = {0};
+  if (!parse_request(req, &r, pin_req_fields, JSON_FIELD_COUNT(pin_req_fields),
+                     &body))
+    return ESP_OK;
+
+  uint8_t gates = 0;
+  verify_result_t res =
+      verify_pin(body.pin, pin_request_gate(&r, &body), &gates);
+
+  if (res == VERIFY_GRANTED) {
+    gates_open_mask(gates);
     httpd_resp_sendstr(req, "{\"status\":\"granted\"}");
+  } else if (res == VERIFY_LOCKED) {
+    keypad_notify_lockout();
+    httpd_resp_set_status(req, "403 Forbidden");
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr(req, "{\"status\":\"locked\"}");
   } else {
     httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, "{\"status\":\"denied\"}");
   }
   return ESP_OK;
 }
 
-// API: Admin Login
-static esp_err_t api_login_handler(httpd_req_t *req) {
-  char buf[100];
-  int ret, remaining = req->content_len;
-  if (remaining >= sizeof(buf))
-    return ESP_FAIL;
-  if ((ret = httpd_req_recv(req, buf, remaining)) <= 0)
-    return ESP_FAIL;
-  buf[ret] = 0;
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+static char keypad_push_msg[16];
+static esp_timer_handle_t keypad_unlock_timer = NULL;
+static bool keypad_locked = false;
 
-  cJSON *json = cJSON_Parse(buf);
-  cJSON *pass_item = cJSON_GetObjectItem(json, "password");
+// Sends keypad_push_msg to every open keypad socket (runs in httpd task)
+static void keypad_broadcast_work(void *arg) {
+  int fds[CONFIG_LWIP_MAX_SOCKETS];
+  size_t count = CONFIG_LWIP_MAX_SOCKETS;
+  if (httpd_get_client_list(server, &count, fds) != ESP_OK)
+    return;
 
-  if (!pass_item || !cJSON_IsString(pass_item)) {
-    cJSON_Delete(json);
-    return ESP_FAIL;
+  httpd_ws_frame_t frame = {.final = true,
+                            .type = HTTPD_WS_TYPE_TEXT,
+                            .payload = (uint8_t *)keypad_push_msg,
+                            .len = strlen(keypad_push_msg)};
+  for (size_t i = 0; i < count; i++) {
+    if (httpd_ws_get_fd_info(server, fds[i]) == HTTPD_WS_CLIENT_WEBSOCKET)
+      httpd_ws_send_frame_async(server, fds[i], &frame);
+  }
+}
+
+static void keypad_broadcast_state(void) {
+  keypad_locked = data_manager_lockout_remaining() > 0;
+  keypad_state_msg(keypad_push_msg, sizeof(keypad_push_msg));
+  httpd_queue_work(server, keypad_broadcast_work, NULL);
+}
+
+static void keypad_unlock_cb(void *arg) { keypad_broadcast_state(); }
+
+// Pushes a new lockout to all keypads and schedules the unlock notice
+static void keypad_notify_lockout(void) {
+  int64_t remaining = data_manager_lockout_remaining();
+  if (keypad_locked || remaining <= 0)
+    return;
+  keypad_broadcast_state();
+
+  if (!keypad_unlock_timer) {
+    esp_timer_create_args_t args = {.callback = keypad_unlock_cb,
+                                    .name = "keypad_unlock"};
+    esp_timer_create(&args, &keypad_unlock_timer);
+  }
+  esp_timer_stop(keypad_unlock_timer);
+  esp_timer_start_once(keypad_unlock_timer, remaining * 1000000LL);
+}
+
+// WebSocket: Keypad channel
+static esp_err_t ws_keypad_handler(httpd_req_t *req) {
+  char reply[16];
+  httpd_ws_frame_t out = {.final = true, .type = HTTPD_WS_TYPE_TEXT};
+
+  if (req->method == HTTP_GET) {
+    // Handshake completed: greet with the current lockout state
+    keypad_state_msg(reply, sizeof(reply));
+    out.payload = (uint8_t *)reply;
+    out.len = strlen(reply);
+    return httpd_ws_send_frame(req, &out);
   }
 
+  uint8_t buf[KEYPAD_MAX_PIN + 2];
+  httpd_ws_frame_t frame;
+  memset(&frame, 0, sizeof(frame));
+  esp_err_t ret = httpd_ws_recv_frame(req, &frame, 0);
+  if (ret != ESP_OK)
+    return ret;
+  if (frame.len > sizeof(buf))
+    return ESP_FAIL;
+  frame.payload = buf;
+  if ((ret = httpd_ws_recv_frame(req, &frame, frame.len)) != ESP_OK)
+    return ret;
+  if (frame.type != HTTPD_WS_TYPE_TEXT && frame.type != HTTPD_WS_TYPE_BINARY)
+    return ESP_OK;
+
+  uint8_t gates = 0;
+  verify_result_t res = keypad_handle_frame((const char *)buf, frame.len,
+                                            reply, sizeof(reply), &gates);
+  out.payload = (uint8_t *)reply;
+  out.len = strlen(reply);
+  ret = httpd_ws_send_frame(req, &out);
+
+  if (res == VERIFY_GRANTED)
+    gates_open_mask(gates);
+  else if (res == VERIFY_LOCKED)
+    keypad_notify_lockout();
+  return ret;
+}
+#else
+static void keypad_notify_lockout(void) {}
+#endif
+
+// API: Admin Login
+static esp_err_t api_login_handler(httpd_req_t *req) {
+  json_reader_t r;
+  login_req_t body = {0};
+  if (!parse_request(req, &r, login_req_fields,
+                     JSON_FIELD_COUNT(login_req_fields), &body))
+    return ESP_OK;
+
   char hash[65];
-  sha256_string(pass_item->valuestring, hash);
-  cJSON_Delete(json);
+  sha256_string(body.password, hash);
 
   if (strcmp(hash, ADMIN_PASS_HASH) == 0) {
     // Set a simple cookie or token logic. For simplicity, we just return OK and
@@ -421,267 +1655,441 @@ static esp_err_t api_login_handler(httpd_req_t *req) {
   return ESP_OK;
 }
 
+// Sets the validators of a cacheable response; etag is the caller's and
+// must live until the reply is sent. Replies 304 and returns true when the
+// client's copy is current.
+static bool send_not_modified(httpd_req_t *req, const response_key_t *key,
+                              uint32_t generation, char *etag) {
+  response_cache_etag(key, generation, etag);
+  httpd_resp_set_hdr(req, "ETag", etag);
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  httpd_resp_set_hdr(req, "Vary", "Accept");
+  char value[64];
+  if (httpd_req_get_hdr_value_str(req, "If-None-Match", value,
+                                  sizeof(value)) != ESP_OK ||
+      !response_cache_etag_matches(value, etag))
+    return false;
+  httpd_resp_set_status(req, "304 Not Modified");
+  httpd_resp_send(req, NULL, 0);
+  return true;
+}
+
 // API: Get Users
 static esp_err_t api_get_users_handler(httpd_req_t *req) {
-  system_data_t *data = data_manager_get_data();
-  cJSON *root = cJSON_CreateArray();
-
-  for (int i = 0; i < MAX_USERS; i++) {
-    if (data->users[i].active) {
-      cJSON *user = cJSON_CreateObject();
-      cJSON_AddStringToObject(user, "name", data->users[i].name);
-      cJSON_AddStringToObject(user, "pin", data->users[i].pin);
-      cJSON_AddNumberToObject(user, "type", data->users[i].type);
-      cJSON_AddNumberToObject(user, "expiry", data->users[i].expiry_date);
-      cJSON_AddNumberToObject(user, "remaining",
-                              data->users[i].access_count_remaining);
-      cJSON_AddItemToArray(root, user);
-    }
+  char query[128];
+  esp_err_t err = httpd_req_get_url_query_str(req, query, sizeof(query));
+  if (err == ESP_ERR_NOT_FOUND)
+    query[0] = 0;
+  users_query_t q;
+  if ((err != ESP_OK && err != ESP_ERR_NOT_FOUND) ||
+      !users_query_parse(query, &q)) {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid query");
+    return ESP_OK;
   }
 
-  const char *json_str = cJSON_Print(root);
-  httpd_resp_set_type(req, "application/json");
-  httpd_resp_sendstr(req, json_str);
-  cJSON_Delete(root);
-  free((void *)json_str);
-  return ESP_OK;
+  body_format_t fmt = response_format(req);
+  response_key_t key;
+  response_cache_key(&key, USERS_URI, query, fmt);
+  uint32_t generation = data_manager_generation();
+  char etag[RESPONSE_ETAG_LEN];
+  if (send_not_modified(req, &key, generation, etag))
+    return ESP_OK;
+  char total[12];
+  snprintf(total, sizeof(total), "%d", users_query_total(&q));
+  httpd_resp_set_hdr(req, "X-Total-Count", total);
+  httpd_resp_set_type(req, body_type(fmt));
+
+  users_body_t ctx = {&q, fmt};
+  const uint8_t *body;
+  size_t len;
+  if (response_cache_get(&key, generation, users_page_body, &ctx, &body,
+                         &len))
+    return httpd_resp_send(req, (const char *)body, len);
+  char chunk[512];
+  uint32_t pos = 0, count = 0;
+  size_t n;
+  while ((n = users_page_render(&q, fmt, &pos, &count, chunk,
+                                sizeof(chunk))) > 0) {
+    if (httpd_resp_send_chunk(req, chunk, n) != ESP_OK)
+      return ESP_FAIL;
+  }
+  return httpd_resp_send_chunk(req, NULL, 0);
 }
 
 // API: Add User
 static esp_err_t api_add_user_handler(httpd_req_t *req) {
-  char buf[200];
-  int ret, remaining = req->content_len;
-  if (remaining >= sizeof(buf))
-    return ESP_FAIL;
-  if ((ret = httpd_req_recv(req, buf, remaining)) <= 0)
-    return ESP_FAIL;
-  buf[ret] = 0;
-
-  cJSON *json = cJSON_Parse(buf);
-  cJSON *name = cJSON_GetObjectItem(json, "name");
-  cJSON *type = cJSON_GetObjectItem(json, "type");
-  cJSON *limit = cJSON_GetObjectItem(json, "limit");
-  cJSON *start = cJSON_GetObjectItem(json, "start");
-  cJSON *end = cJSON_GetObjectItem(json, "end");
-  cJSON *days = cJSON_GetObjectItem(json, "days");
-
-  if (data_manager_add_user(name->valuestring, type->valueint,
-                            limit ? limit->valueint : 0)) {
-    // Set Schedule if provided
-    system_data_t *data = data_manager_get_data();
-    // Since add_user adds to next slot, we find the user by name to update
-    // schedule Inoptimal but simple for prototype: iterate and match name + pin
-    // just generated? Actually data_manager_add_user returns bool. Let's modify
-    // data_manager_add_user or just set it manually here by finding the last
-    // added? Or better: update data_manager_add_user to accept these? For
-    // minimal changes: find the user we just added. Assumption: Last active
-    // user? Or searching by name.
-    for (int i = 0; i < MAX_USERS; i++) {
-      if (data->users[i].active &&
-          strcmp(data->users[i].name, name->valuestring) == 0) {
-        if (start)
-          data->users[i].start_time = start->valueint;
-        if (end)
-          data->users[i].end_time = end->valueint;
-        if (days)
-          data->users[i].allowed_days = days->valueint;
-        data_manager_save();
-        break;
-      }
-    }
+  json_reader_t r;
+  add_user_req_t body = {0};
+  if (!parse_request_keys(req, &r, add_user_req_fields,
+                          JSON_FIELD_COUNT(add_user_req_fields), &body,
+                          user_keys, KEY_COUNT(user_keys)))
+    return ESP_OK;
+  if (!add_user_request_valid(&body)) {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid user");
+    return ESP_OK;
+  }
+
+  char resp[96];
+  if (add_user_from_request(&r, &body, resp, sizeof(resp))) {
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr(req, resp);
+  } else {
+    httpd_resp_send_500(req);
+  }
+  return ESP_OK;
+}
+
+// API: Update User by id
+static esp_err_t api_update_user_handler(httpd_req_t *req) {
+  user_id_t id = user_id_from_uri(req->uri);
+  if (!user_id_known(id)) {
+    httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "User not found");
+    return ESP_OK;
+  }
+  json_reader_t r;
+  add_user_req_t body = {0};
+  if (!parse_request_keys(req, &r, update_user_req_fields,
+                          JSON_FIELD_COUNT(update_user_req_fields), &body,
+                          user_keys, KEY_COUNT(user_keys)))
+    return ESP_OK;
+  if (!add_user_request_valid(&body)) {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid user");
+    return ESP_OK;
+  }
+
+  user_fields_t f;
+  uint32_t fields = user_fields_from_request(&r, &body, &f);
+  if (data_manager_update_user(id, &f, fields)) {
     httpd_resp_sendstr(req, "{\"status\":\"ok\"}");
   } else {
     httpd_resp_send_500(req);
   }
-  cJSON_Delete(json);
   return ESP_OK;
 }
 
 // API: Delete User
 static esp_err_t api_delete_user_handler(httpd_req_t *req) {
-  char buf[100];
-  int ret, remaining = req->content_len;
-  if (remaining >= sizeof(buf))
-    return ESP_FAIL;
-  if ((ret = httpd_req_recv(req, buf, remaining)) <= 0)
-    return ESP_FAIL;
-  buf[ret] = 0;
-
-  cJSON *json = cJSON_Parse(buf);
-  cJSON *pin = cJSON_GetObjectItem(json, "pin");
+  json_reader_t r;
+  pin_req_t body = {0};
+  if (!parse_request(req, &r, pin_req_fields, JSON_FIELD_COUNT(pin_req_fields),
+                     &body))
+    return ESP_OK;
 
-  if (data_manager_delete_user(pin->valuestring)) {
+  if (data_manager_delete_user(body.pin)) {
     httpd_resp_sendstr(req, "{\"status\":\"ok\"}");
   } else {
     httpd_resp_send_500(req);
   }
-  cJSON_Delete(json);
   return ESP_OK;
 }
 
-// API: Download Log File
+// API: Delete User by id
+static esp_err_t api_delete_user_id_handler(httpd_req_t *req) {
+  if (data_manager_delete_user_id(user_id_from_uri(req->uri))) {
+    httpd_resp_sendstr(req, "{\"status\":\"ok\"}");
+  } else {
+    httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "User not found");
+  }
+  return ESP_OK;
+}
+
+static bool req_accepts_gzip(httpd_req_t *req) {
+  return req_header_has(req, "Accept-Encoding", "gzip");
+}
+
+// API: Download Log File. Supports single byte ranges, validated by an
+// ETag, and gzip for full downloads.
 static esp_err_t api_download_logs_handler(httpd_req_t *req) {
-  FILE *f = fopen("/spiffs/access.log", "r");
-  if (f == NULL) {
+  int32_t size = history_size();
+  if (size < 0) {
     httpd_resp_send_404(req);
     return ESP_FAIL;
   }
 
+  char etag[12], range[48], if_range[24];
+  history_etag(etag, sizeof(etag));
+  uint32_t first = 0, last = 0;
+  int ranged = 0;
+  if (httpd_req_get_hdr_value_str(req, "Range", range, sizeof(range)) ==
+      ESP_OK)
+    ranged = parse_byte_range(range, size, &first, &last);
+  if (ranged &&
+      httpd_req_get_hdr_value_str(req, "If-Range", if_range,
+                                  sizeof(if_range)) == ESP_OK &&
+      strcmp(if_range, etag) != 0)
+    ranged = 0; // The client's copy is stale: send it all again
+
+  httpd_resp_set_hdr(req, "Accept-Ranges", "bytes");
+  httpd_resp_set_hdr(req, "ETag", etag);
+  if (ranged < 0) {
+    snprintf(range, sizeof(range), "bytes */%u", (unsigned)size);
+    httpd_resp_set_hdr(req, "Content-Range", range);
+    httpd_resp_set_status(req, "416 Range Not Satisfiable");
+    httpd_resp_send(req, NULL, 0);
+    return ESP_OK;
+  }
+
   httpd_resp_set_type(req, "text/csv");
   httpd_resp_set_hdr(req, "Content-Disposition",
                      "attachment; filename=\"access_history.csv\"");
+  history_span_t span = {0, (uint32_t)size};
+  history_gz_t *gz = NULL;
+  if (ranged) {
+    span.pos = first;
+    span.end = last + 1;
+    snprintf(range, sizeof(range), "bytes %u-%u/%u", (unsigned)first,
+             (unsigned)last, (unsigned)size);
+    httpd_resp_set_hdr(req, "Content-Range", range);
+    httpd_resp_set_status(req, "206 Partial Content");
+  } else if (req_accepts_gzip(req)) {
+    gz = history_gz_open();
+    if (gz)
+      httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+  }
 
   char chunk[1024];
-  size_t chunksize;
-  while ((chunksize = fread(chunk, 1, sizeof(chunk), f)) > 0) {
-    if (httpd_resp_send_chunk(req, chunk, chunksize) != ESP_OK) {
-      fclose(f);
+  size_t n;
+  while ((n = gz ? history_gz_read(gz, (uint8_t *)chunk, sizeof(chunk))
+                 : history_span_read(&span, (uint8_t *)chunk,
+                                     sizeof(chunk))) > 0) {
+    if (httpd_resp_send_chunk(req, chunk, n) != ESP_OK) {
+      history_gz_close(gz);
       return ESP_FAIL;
     }
   }
-  fclose(f);
+  history_gz_close(gz);
   httpd_resp_send_chunk(req, NULL, 0);
   return ESP_OK;
 }
 
 // API: Get Logs
 static esp_err_t api_get_logs_handler(httpd_req_t *req) {
-  system_data_t *data = data_manager_get_data();
-  cJSON *root = cJSON_CreateArray();
+  body_format_t fmt = response_format(req);
+  httpd_resp_set_hdr(req, "Vary", "Accept");
+  httpd_resp_set_type(req, body_type(fmt));
+  char chunk[512];
+  uint32_t pos = 0;
+  size_t n;
+  while ((n = logs_render(fmt, &pos, chunk, sizeof(chunk))) > 0) {
+    if (httpd_resp_send_chunk(req, chunk, n) != ESP_OK)
+      return ESP_FAIL;
+  }
+  return httpd_resp_send_chunk(req, NULL, 0);
+}
 
-  // Iterate circular buffer. Simplification: Just dump all non-zero logs for
-  // now
-  for (int i = 0; i < MAX_LOGS; i++) {
-    if (data->logs[i].timestamp != 0) {
-      cJSON *log = cJSON_CreateObject();
-      cJSON_AddNumberToObject(log, "time", data->logs[i].timestamp);
-      cJSON_AddStringToObject(log, "user", data->logs[i].user_name);
-      cJSON_AddBoolToObject(log, "granted", data->logs[i].granted);
-      cJSON_AddStringToObject(log, "details", data->logs[i].details);
-      cJSON_AddItemToArray(root, log);
-    }
+// API: Open Gate (Direct Control). An empty body opens every gate.
+static esp_err_t api_open_gate_handler(httpd_req_t *req) {
+  if (req->content_len == 0) {
+    gates_open_mask(GATE_MASK_ALL);
+    httpd_resp_sendstr(req, "{\"status\":\"ok\"}");
+    return ESP_OK;
+  }
+  json_reader_t r;
+  open_req_t body = {0};
+  if (!parse_request(req, &r, open_req_fields,
+                     JSON_FIELD_COUNT(open_req_fields), &body))
+    return ESP_OK;
+
+  if (gates_open(body.gate)) {
+    httpd_resp_sendstr(req, "{\"status\":\"ok\"}");
+  } else {
+    httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Unknown gate");
+  }
+  return ESP_OK;
+}
+
+// API: Get Gates
+static esp_err_t api_get_gates_handler(httpd_req_t *req) {
+  cJSON *root = cJSON_CreateArray();
+  for (int i = 0; i < MAX_GATES; i++) {
+    const gate_t *g = gates_get(i);
+    cJSON *gate = cJSON_CreateObject();
+    cJSON_AddNumberToObject(gate, "id", i);
+    cJSON_AddStringToObject(gate, "name", g->name);
+    cJSON_AddNumberToObject(gate, "gpio", g->gpio);
+    cJSON_AddNumberToObject(gate, "pulse_ms", g->pulse_ms);
+    cJSON_AddBoolToObject(gate, "active_high", g->active_high);
+    cJSON_AddItemToArray(root, gate);
   }
 
   const char *json_str = cJSON_Print(root);
   httpd_resp_set_type(req, "application/json");
   httpd_resp_sendstr(req, json_str);
   cJSON_Delete(root);
-  free((void *)json_str);
+  cJSON_free((void *)json_str);
   return ESP_OK;
 }
 
-// API: Open Gate (Direct Control)
-static esp_err_t api_open_gate_handler(httpd_req_t *req) {
-  trigger_relay();
+// API: Set Gate
+static esp_err_t api_set_gate_handler(httpd_req_t *req) {
+  json_reader_t r;
+  gate_req_t body = {0};
+  if (!parse_request(req, &r, gate_req_fields,
+                     JSON_FIELD_COUNT(gate_req_fields), &body))
+    return ESP_OK;
+
+  if (gate_from_request(&r, &body)) {
+    httpd_resp_sendstr(req, "{\"status\":\"ok\"}");
+  } else {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid gate");
+  }
   return ESP_OK;
 }
 
 // API: Get MQTT Config
 static esp_err_t api_get_mqtt_handler(httpd_req_t *req) {
-  char uri[64], cmd[64], status[64];
-  mqtt_manager_get_config(uri, cmd, status);
-
-  cJSON *root = cJSON_CreateObject();
-  cJSON_AddStringToObject(root, "uri", uri);
-  cJSON_AddStringToObject(root, "cmd_topic", cmd);
-  cJSON_AddStringToObject(root, "status_topic", status);
-
-  const char *json_str = cJSON_Print(root);
-  httpd_resp_set_type(req, "application/json");
-  httpd_resp_sendstr(req, json_str);
-  cJSON_Delete(root);
-  free((void *)json_str);
-  return ESP_OK;
+  body_format_t fmt = response_format(req);
+  response_key_t key;
+  response_cache_key(&key, MQTT_URI, "", fmt);
+  uint32_t generation = mqtt_manager_config_generation();
+  char etag[RESPONSE_ETAG_LEN];
+  if (send_not_modified(req, &key, generation, etag))
+    return ESP_OK;
+  httpd_resp_set_type(req, body_type(fmt));
+  const uint8_t *body;
+  size_t len;
+  if (response_cache_get(&key, generation, mqtt_config_body, &fmt, &body,
+                         &len))
+    return httpd_resp_send(req, (const char *)body, len);
+  char buf[448];
+  len = mqtt_config_render(fmt, buf, sizeof(buf));
+  return httpd_resp_send(req, buf, len);
 }
 
 // API: Set MQTT Config
 static esp_err_t api_set_mqtt_handler(httpd_req_t *req) {
-  char buf[256];
-  int ret, remaining = req->content_len;
-  if (remaining >= sizeof(buf))
-    return ESP_FAIL;
-  if ((ret = httpd_req_recv(req, buf, remaining)) <= 0)
-    return ESP_FAIL;
-  buf[ret] = 0;
+  json_reader_t r;
+  mqtt_req_t body = {0};
+  if (!parse_request_keys(req, &r, mqtt_req_fields,
+                          JSON_FIELD_COUNT(mqtt_req_fields), &body, mqtt_keys,
+                          KEY_COUNT(mqtt_keys)))
+    return ESP_OK;
+
+  mqtt_manager_update_config(
+      body.uri, json_reader_has(&r, MQTT_REQ_CMD) ? body.cmd_topic : NULL,
+      json_reader_has(&r, MQTT_REQ_STATUS) ? body.status_topic : NULL);
+  httpd_resp_sendstr(req, "{\"status\":\"ok\"}");
+  return ESP_OK;
+}
 
-  cJSON *json = cJSON_Parse(buf);
-  cJSON *uri = cJSON_GetObjectItem(json, "uri");
-  cJSON *cmd = cJSON_GetObjectItem(json, "cmd_topic");
-  cJSON *status = cJSON_GetObjectItem(json, "status_topic");
+// API: Metrics (Prometheus text format)
+static esp_err_t api_metrics_handler(httpd_req_t *req) {
+  char chunk[512];
+  uint32_t item = 0, line = 0;
+  size_t n;
+  httpd_resp_set_type(req, METRICS_CONTENT_TYPE);
+  while ((n = metrics_render(&item, &line, chunk, sizeof(chunk))) > 0) {
+    if (httpd_resp_send_chunk(req, chunk, n) != ESP_OK)
+      return ESP_FAIL;
+  }
+  return httpd_resp_send_chunk(req, NULL, 0);
+}
 
-  if (uri) {
-    // Simple update logic
-    mqtt_manager_update_config(uri->valuestring, cmd ? cmd->valuestring : NULL,
-                               status ? status->valuestring : NULL);
-    httpd_resp_sendstr(req, "{\"status\":\"ok\"}");
-  } else {
-    httpd_resp_send_500(req);
+// API: Access Statistics
+static esp_err_t api_stats_handler(httpd_req_t *req) {
+  char chunk[512];
+  uint32_t item = 0, line = 0;
+  size_t n;
+  httpd_resp_set_type(req, "application/json");
+  while ((n = access_stats_render(&item, &line, chunk, sizeof(chunk))) > 0) {
+    if (httpd_resp_send_chunk(req, chunk, n) != ESP_OK)
+      return ESP_FAIL;
   }
-  cJSON_Delete(json);
-  return ESP_OK;
+  return httpd_resp_send_chunk(req, NULL, 0);
 }
 
-void start_web_server(void) {
+// API: Stalls and Span Profile
+static esp_err_t api_profile_handler(httpd_req_t *req) {
+  char chunk[512];
+  uint32_t item = 0, line = 0;
+  size_t n;
+  httpd_resp_set_type(req, "application/json");
+  while ((n = profiler_render(&item, &line, chunk, sizeof(chunk))) > 0) {
+    if (httpd_resp_send_chunk(req, chunk, n) != ESP_OK)
+      return ESP_FAIL;
+  }
+  return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+typedef struct {
+  const char *uri;
+  httpd_method_t method;
+  esp_err_t (*handler)(httpd_req_t *req);
+  const char *name; // Profiler span
+  const char *labels;
+  metric_t *latency;
+} api_route_t;
+
+static api_route_t api_routes[] = {
+    API_ROUTE("/api/access/verify", POST, api_verify_pin_handler),
+    API_ROUTE("/api/auth/login", POST, api_login_handler),
+    API_ROUTE("/api/admin/users", GET, api_get_users_handler),
+    API_ROUTE("/api/admin/users", POST, api_add_user_handler),
+    API_ROUTE("/api/admin/users", DELETE, api_delete_user_handler),
+    API_ROUTE("/api/admin/users/*", PATCH, api_update_user_handler),
+    API_ROUTE("/api/admin/users/*", DELETE, api_delete_user_id_handler),
+    API_ROUTE("/api/admin/logs", GET, api_get_logs_handler),
+    API_ROUTE("/api/admin/logs/download", GET, api_download_logs_handler),
+    API_ROUTE("/api/admin/open", POST, api_open_gate_handler),
+    API_ROUTE("/api/admin/gates", GET, api_get_gates_handler),
+    API_ROUTE("/api/admin/gates", POST, api_set_gate_handler),
+    API_ROUTE("/api/admin/mqtt", GET, api_get_mqtt_handler),
+    API_ROUTE("/api/admin/mqtt", POST, api_set_mqtt_handler),
+    API_ROUTE("/api/admin/metrics", GET, api_metrics_handler),
+    API_ROUTE("/api/admin/stats", GET, api_stats_handler),
+    API_ROUTE("/api/admin/profile", GET, api_profile_handler),
+};
+
+static esp_err_t api_timed_handler(httpd_req_t *req) {
+  api_route_t *r = (api_route_t *)req->user_ctx;
+  uint32_t start = metrics_now_us();
+  profiler_enter(r->name);
+  json_pool_begin();
+  esp_err_t ret = r->handler(req);
+  json_pool_end();
+  profiler_exit();
+  metrics_observe_us(r->latency, metrics_now_us() - start);
+  return ret;
+}
+
+esp_err_t start_web_server(void) {
+  json_pool_init();
+  response_cache_init();
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
   config.uri_match_fn = httpd_uri_match_wildcard;
+  config.max_uri_handlers = 24;
+
+  esp_err_t ret = httpd_start(&server, &config);
+  if (ret == ESP_OK) {
+    for (size_t i = 0; i < API_ROUTE_COUNT(api_routes); i++) {
+      api_route_t *r = &api_routes[i];
+      if (!r->latency)
+        r->latency = metrics_histogram("http_handler_duration_seconds",
+                                       "API handler latency", r->labels);
+      httpd_uri_t uri = {.uri = r->uri,
+                         .method = r->method,
+                         .handler = api_timed_handler,
+                         .user_ctx = r};
+      httpd_register_uri_handler(server, &uri);
+    }
+
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    httpd_uri_t uri_ws_keypad = {.uri = KEYPAD_WS_URI,
+                                 .method = HTTP_GET,
+                                 .handler = ws_keypad_handler,
+                                 .is_websocket = true};
+    httpd_register_uri_handler(server, &uri_ws_keypad);
+#endif
 
-  if (httpd_start(&server, &config) == ESP_OK) {
+    // Static files last: handlers match in registration order and the
+    // wildcard would otherwise shadow every GET route above.
     httpd_uri_t uri_root = {.uri = "/*",
                             .method = HTTP_GET,
                             .handler = static_file_handler,
                             .user_ctx = NULL};
     httpd_register_uri_handler(server, &uri_root);
-
-    httpd_uri_t uri_verify = {.uri = "/api/access/verify",
-                              .method = HTTP_POST,
-                              .handler = api_verify_pin_handler};
-    httpd_register_uri_handler(server, &uri_verify);
-
-    httpd_uri_t uri_login = {.uri = "/api/auth/login",
-                             .method = HTTP_POST,
-                             .handler = api_login_handler};
-    httpd_register_uri_handler(server, &uri_login);
-
-    httpd_uri_t uri_users_get = {.uri = "/api/admin/users",
-                                 .method = HTTP_GET,
-                                 .handler = api_get_users_handler};
-    httpd_register_uri_handler(server, &uri_users_get);
-
-    httpd_uri_t uri_users_add = {.uri = "/api/admin/users",
-                                 .method = HTTP_POST,
-                                 .handler = api_add_user_handler};
-    httpd_register_uri_handler(server, &uri_users_add);
-
-    httpd_uri_t uri_users_del = {.uri = "/api/admin/users",
-                                 .method = HTTP_DELETE,
-                                 .handler = api_delete_user_handler};
-    httpd_register_uri_handler(server, &uri_users_del);
-
-    httpd_uri_t uri_logs = {.uri = "/api/admin/logs",
-                            .method = HTTP_GET,
-                            .handler = api_get_logs_handler};
-    httpd_register_uri_handler(server, &uri_logs);
-
-    httpd_uri_t uri_open = {.uri = "/api/admin/open",
-                            .method = HTTP_POST,
-                            .handler = api_open_gate_handler};
-    httpd_register_uri_handler(server, &uri_open);
-
-    httpd_uri_t uri_dl_logs = {.uri = "/api/admin/logs/download",
-                               .method = HTTP_GET,
-                               .handler = api_download_logs_handler};
-    httpd_register_uri_handler(server, &uri_dl_logs);
-
-    httpd_uri_t uri_mqtt_get = {.uri = "/api/admin/mqtt",
-                                .method = HTTP_GET,
-                                .handler = api_get_mqtt_handler};
-    httpd_register_uri_handler(server, &uri_mqtt_get);
-
-    httpd_uri_t uri_mqtt_set = {.uri = "/api/admin/mqtt",
-                                .method = HTTP_POST,
-                                .handler = api_set_mqtt_handler};
-    httpd_register_uri_handler(server, &uri_mqtt_set);
   }
+  return ret;
 }
 
 void stop_web_server(void) {
@@ -11,7 +11,4 @@ esp_err_t start_web_server(void);
 void stop_web_server(void);
 #endif
 
-// Function to control relay (implemented in main)
-void trigger_relay(void);
-
 #endif // WEB_SERVER_H
@@ -0,0 +1,740 @@
+// HTTP load generator for the gate API.
+//
+// Replays a weighted mix of API calls against a base URL (the device, a host
+// build, or mock_server.py) and reports throughput, latency percentiles and
+// error rates per operation.
+//
+//   closed loop: N workers, each sends its next request as soon as the
+//                previous one completes (measures capacity at N clients)
+//   open loop:   requests are scheduled at a fixed rate regardless of how
+//                fast the target answers; latency is measured from the
+//                scheduled send time so queueing shows up (finds saturation)
+//
+// Build: cmake -S tools/loadgen -B build/loadgen && cmake --build build/loadgen
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using steady = std::chrono::steady_clock;
+
+static uint64_t now_us(void) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             steady::now().time_since_epoch())
+      .count();
+}
+
+// ---------------------------------------------------------------------------
+// Latency histogram: log-linear buckets, 64 sub-buckets per power of two
+// (about 1.5% resolution) from 1us to ~1h
+
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_RANGES 32
+#define HIST_BUCKETS (HIST_RANGES * HIST_SUB)
+
+typedef struct {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t total;
+  uint64_t max;
+  uint64_t sum;
+} histogram_t;
+
+static int hist_index(uint64_t v) {
+  if (v < HIST_SUB)
+    return (int)v;
+  int msb = 63 - __builtin_clzll(v);
+  int range = msb - HIST_SUB_BITS + 1;
+  if (range >= HIST_RANGES)
+    return HIST_BUCKETS - 1;
+  int sub = (int)((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+  return range * HIST_SUB + sub;
+}
+
+// Upper bound of a bucket, used when reporting percentiles
+static uint64_t hist_value(int idx) {
+  int range = idx / HIST_SUB, sub = idx % HIST_SUB;
+  if (range == 0)
+    return sub;
+  int shift = range - 1;
+  return ((uint64_t)(HIST_SUB + sub + 1) << shift) - 1;
+}
+
+static void hist_record(histogram_t *h, uint64_t v) {
+  h->counts[hist_index(v)]++;
+  h->total++;
+  h->sum += v;
+  if (v > h->max)
+    h->max = v;
+}
+
+static void hist_merge(histogram_t *dst, const histogram_t *src) {
+  for (int i = 0; i < HIST_BUCKETS; i++)
+    dst->counts[i] += src->counts[i];
+  dst->total += src->total;
+  dst->sum += src->sum;
+  if (src->max > dst->max)
+    dst->max = src->max;
+}
+
+static uint64_t hist_percentile(const histogram_t *h, double p) {
+  if (h->total == 0)
+    return 0;
+  uint64_t rank = (uint64_t)(p / 100.0 * h->total + 0.5);
+  if (rank == 0)
+    rank = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank)
+      return hist_value(i) < h->max ? hist_value(i) : h->max;
+  }
+  return h->max;
+}
+
+// ---------------------------------------------------------------------------
+// Traffic mix
+
+typedef enum {
+  OP_VERIFY_OK = 0,
+  OP_VERIFY_BAD,
+  OP_USERS,
+  OP_LOGS,
+  OP_DOWNLOAD,
+  OP_COUNT
+} op_t;
+
+static const char *op_names[OP_COUNT] = {"verify", "verify_bad", "users",
+                                         "logs", "download"};
+
+typedef struct {
+  histogram_t latency;
+  uint64_t ok;
+  uint64_t http_errors;  // Unexpected status code
+  uint64_t net_errors;   // Connect, timeout or malformed response
+  uint64_t busy;         // 503 from the device's connection limit
+  uint64_t locked;       // 403 while the keypad is locked out
+  uint64_t bytes;
+} op_stats_t;
+
+typedef struct {
+  op_stats_t ops[OP_COUNT];
+} stats_t;
+
+static void stats_merge(stats_t *dst, const stats_t *src) {
+  for (int i = 0; i < OP_COUNT; i++) {
+    op_stats_t *d = &dst->ops[i];
+    const op_stats_t *s = &src->ops[i];
+    hist_merge(&d->latency, &s->latency);
+    d->ok += s->ok;
+    d->http_errors += s->http_errors;
+    d->net_errors += s->net_errors;
+    d->busy += s->busy;
+    d->locked += s->locked;
+    d->bytes += s->bytes;
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Configuration
+
+typedef struct {
+  std::string host;
+  std::string port;
+  std::string base_path;
+  bool open_loop;
+  int concurrency;
+  std::vector<double> rates; // Open loop: one run per rate
+  double duration_s;
+  double warmup_s;
+  int timeout_ms;
+  bool keepalive;
+  std::string auth;          // Value for an Authorization header
+  std::vector<std::string> pins;
+  unsigned weights[OP_COUNT];
+  unsigned seed;
+} config_t;
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [options] http://host[:port][/prefix]\n"
+          "  --mode closed|open     loop model (default closed)\n"
+          "  -c, --concurrency N    workers / max in-flight requests (4)\n"
+          "  -r, --rate R[,R...]    open loop requests per second; several\n"
+          "                         rates run back to back (saturation sweep)\n"
+          "  -d, --duration S       measured seconds per run (10)\n"
+          "  -w, --warmup S         unmeasured seconds before each run (1)\n"
+          "  --mix op=W,...         weights for verify, verify_bad, users,\n"
+          "                         logs, download (default verify=60,\n"
+          "                         verify_bad=10,users=15,logs=10,download=5)\n"
+          "  --pin P[,P...]         valid PINs for the verify op\n"
+          "  --auth VALUE           Authorization header for admin calls\n"
+          "  --timeout MS           per request timeout (5000)\n"
+          "  --no-keepalive         new connection per request\n"
+          "  --seed N               random seed for the mix\n"
+          "\n"
+          "verify_bad sends wrong PINs and will trip the device lockout; a\n"
+          "403 during lockout is counted as 'locked', not as an error.\n",
+          argv0);
+}
+
+static std::vector<std::string> split(const std::string &s, char sep) {
+  std::vector<std::string> out;
+  size_t start = 0;
+  while (start <= s.size()) {
+    size_t end = s.find(sep, start);
+    if (end == std::string::npos)
+      end = s.size();
+    if (end > start)
+      out.push_back(s.substr(start, end - start));
+    start = end + 1;
+  }
+  return out;
+}
+
+static bool parse_url(config_t *cfg, const std::string &url) {
+  const std::string scheme = "http://";
+  if (url.compare(0, scheme.size(), scheme) != 0) {
+    fprintf(stderr, "only http:// URLs are supported\n");
+    return false;
+  }
+  std::string rest = url.substr(scheme.size());
+  size_t slash = rest.find('/');
+  std::string hostport = rest.substr(0, slash);
+  cfg->base_path = slash == std::string::npos ? "" : rest.substr(slash);
+  while (!cfg->base_path.empty() && cfg->base_path.back() == '/')
+    cfg->base_path.pop_back();
+  size_t colon = hostport.rfind(':');
+  if (colon == std::string::npos) {
+    cfg->host = hostport;
+    cfg->port = "80";
+  } else {
+    cfg->host = hostport.substr(0, colon);
+    cfg->port = hostport.substr(colon + 1);
+  }
+  return !cfg->host.empty();
+}
+
+static bool parse_mix(config_t *cfg, const std::string &mix) {
+  memset(cfg->weights, 0, sizeof(cfg->weights));
+  for (const std::string &item : split(mix, ',')) {
+    size_t eq = item.find('=');
+    if (eq == std::string::npos)
+      return false;
+    std::string name = item.substr(0, eq);
+    int op = -1;
+    for (int i = 0; i < OP_COUNT; i++) {
+      if (name == op_names[i])
+        op = i;
+    }
+    if (op < 0) {
+      fprintf(stderr, "unknown op '%s'\n", name.c_str());
+      return false;
+    }
+    cfg->weights[op] = (unsigned)atoi(item.c_str() + eq + 1);
+  }
+  return true;
+}
+
+static bool parse_args(config_t *cfg, int argc, char **argv) {
+  cfg->open_loop = false;
+  cfg->concurrency = 4;
+  cfg->duration_s = 10;
+  cfg->warmup_s = 1;
+  cfg->timeout_ms = 5000;
+  cfg->keepalive = true;
+  cfg->seed = (unsigned)now_us();
+  parse_mix(cfg, "verify=60,verify_bad=10,users=15,logs=10,download=5");
+
+  std::string url;
+  for (int i = 1; i < argc; i++) {
+    std::string a = argv[i];
+    auto value = [&](void) -> std::string {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "%s needs a value\n", a.c_str());
+        exit(2);
+      }
+      return argv[++i];
+    };
+    if (a == "-h" || a == "--help") {
+      usage(argv[0]);
+      exit(0);
+    } else if (a == "--mode") {
+      std::string m = value();
+      if (m != "open" && m != "closed")
+        return false;
+      cfg->open_loop = m == "open";
+    } else if (a == "-c" || a == "--concurrency") {
+      cfg->concurrency = atoi(value().c_str());
+    } else if (a == "-r" || a == "--rate") {
+      for (const std::string &r : split(value(), ','))
+        cfg->rates.push_back(atof(r.c_str()));
+    } else if (a == "-d" || a == "--duration") {
+      cfg->duration_s = atof(value().c_str());
+    } else if (a == "-w" || a == "--warmup") {
+      cfg->warmup_s = atof(value().c_str());
+    } else if (a == "--mix") {
+      if (!parse_mix(cfg, value()))
+        return false;
+    } else if (a == "--pin") {
+      cfg->pins = split(value(), ',');
+    } else if (a == "--auth") {
+      cfg->auth = value();
+    } else if (a == "--timeout") {
+      cfg->timeout_ms = atoi(value().c_str());
+    } else if (a == "--no-keepalive") {
+      cfg->keepalive = false;
+    } else if (a == "--seed") {
+      cfg->seed = (unsigned)strtoul(value().c_str(), NULL, 10);
+    } else if (!a.empty() && a[0] == '-') {
+      fprintf(stderr, "unknown option %s\n", a.c_str());
+      return false;
+    } else {
+      url = a;
+    }
+  }
+
+  if (url.empty() || !parse_url(cfg, url))
+    return false;
+  if (cfg->concurrency < 1)
+    cfg->concurrency = 1;
+  if (cfg->open_loop && cfg->rates.empty()) {
+    fprintf(stderr, "open loop needs --rate\n");
+    return false;
+  }
+  if (cfg->weights[OP_VERIFY_OK] && cfg->pins.empty()) {
+    fprintf(stderr, "no --pin given, verify requests will be denied\n");
+    cfg->weights[OP_VERIFY_BAD] += cfg->weights[OP_VERIFY_OK];
+    cfg->weights[OP_VERIFY_OK] = 0;
+  }
+  unsigned total = 0;
+  for (int i = 0; i < OP_COUNT; i++)
+    total += cfg->weights[i];
+  return total > 0;
+}
+
+// ---------------------------------------------------------------------------
+// Minimal blocking HTTP/1.1 client, one per worker
+
+typedef struct {
+  int fd;
+  const config_t *cfg;
+  struct addrinfo *addr;
+  std::string rx; // Bytes received past the previous response
+} client_t;
+
+static void client_close(client_t *c) {
+  if (c->fd >= 0)
+    close(c->fd);
+  c->fd = -1;
+  c->rx.clear();
+}
+
+static bool client_connect(client_t *c) {
+  c->fd = socket(c->addr->ai_family, c->addr->ai_socktype,
+                 c->addr->ai_protocol);
+  if (c->fd < 0)
+    return false;
+  struct timeval tv;
+  tv.tv_sec = c->cfg->timeout_ms / 1000;
+  tv.tv_usec = (c->cfg->timeout_ms % 1000) * 1000;
+  setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  int one = 1;
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(c->fd, c->addr->ai_addr, c->addr->ai_addrlen) != 0) {
+    client_close(c);
+    return false;
+  }
+  return true;
+}
+
+static bool send_all(int fd, const std::string &data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (n <= 0)
+      return false;
+    sent += n;
+  }
+  return true;
+}
+
+static bool fill(client_t *c) {
+  char buf[4096];
+  ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+  if (n <= 0)
+    return false;
+  c->rx.append(buf, n);
+  return true;
+}
+
+// Returns the next CRLF-terminated line without the terminator
+static bool read_line(client_t *c, std::string *line) {
+  size_t pos;
+  while ((pos = c->rx.find("\r\n")) == std::string::npos) {
+    if (c->rx.size() > 8192 || !fill(c))
+      return false;
+  }
+  *line = c->rx.substr(0, pos);
+  c->rx.erase(0, pos + 2);
+  return true;
+}
+
+static bool read_exact(client_t *c, size_t len) {
+  while (c->rx.size() < len) {
+    if (!fill(c))
+      return false;
+  }
+  c->rx.erase(0, len);
+  return true;
+}
+
+static bool header_is(const std::string &line, const char *name,
+                      std::string *value) {
+  size_t n = strlen(name);
+  if (line.size() <= n || line[n] != ':' ||
+      strncasecmp(line.c_str(), name, n) != 0)
+    return false;
+  size_t start = n + 1;
+  while (start < line.size() && line[start] == ' ')
+    start++;
+  *value = line.substr(start);
+  return true;
+}
+
+// Sends one request and drains the response body. Returns the status code,
+// or -1 on a transport error (the connection is then closed).
+static int client_request(client_t *c, const char *method,
+                          const std::string &path, const std::string &body,
+                          uint64_t *bytes) {
+  for (int attempt = 0; attempt < 2; attempt++) {
+    bool reused = c->fd >= 0;
+    if (!reused && !client_connect(c))
+      return -1;
+
+    std::string req = std::string(method) + " " + c->cfg->base_path + path +
+                      " HTTP/1.1\r\nHost: " + c->cfg->host + "\r\n";
+    if (!c->cfg->auth.empty())
+      req += "Authorization: " + c->cfg->auth + "\r\n";
+    if (!c->cfg->keepalive)
+      req += "Connection: close\r\n";
+    if (!body.empty()) {
+      req += "Content-Type: application/json\r\nContent-Length: " +
+             std::to_string(body.size()) + "\r\n";
+    }
+    req += "\r\n" + body;
+
+    std::string line, value;
+    if (!send_all(c->fd, req) || !read_line(c, &line)) {
+      client_close(c);
+      if (reused)
+        continue; // Server closed an idle keep-alive socket, retry once
+      return -1;
+    }
+
+    int status = 0;
+    if (sscanf(line.c_str(), "HTTP/1.%*d %d", &status) != 1) {
+      client_close(c);
+      return -1;
+    }
+    long content_length = -1;
+    bool chunked = false, close_after = !c->cfg->keepalive;
+    for (;;) {
+      if (!read_line(c, &line)) {
+        client_close(c);
+        return -1;
+      }
+      if (line.empty())
+        break;
+      if (header_is(line, "Content-Length", &value))
+        content_length = atol(value.c_str());
+      else if (header_is(line, "Transfer-Encoding", &value))
+        chunked = strcasestr(value.c_str(), "chunked") != NULL;
+      else if (header_is(line, "Connection", &value))
+        close_after |= strcasecmp(value.c_str(), "close") == 0;
+    }
+
+    bool ok = true;
+    if (chunked) {
+      for (;;) {
+        if (!read_line(c, &line)) {
+          ok = false;
+          break;
+        }
+        size_t size = strtoul(line.c_str(), NULL, 16);
+        if (!read_exact(c, size + 2)) {
+          ok = false;
+          break;
+        }
+        *bytes += size;
+        if (size == 0)
+          break;
+      }
+    } else if (content_length >= 0) {
+      ok = read_exact(c, content_length);
+      *bytes += content_length;
+    } else {
+      // Body runs to connection close
+      while (fill(c)) {
+        *bytes += c->rx.size();
+        c->rx.clear();
+      }
+      close_after = true;
+    }
+    if (!ok) {
+      client_close(c);
+      return -1;
+    }
+    if (close_after)
+      client_close(c);
+    return status;
+  }
+  return -1;
+}
+
+// ---------------------------------------------------------------------------
+// Workers
+
+typedef struct {
+  const config_t *cfg;
+  double rate;                  // Open loop only
+  uint64_t start_us;            // First scheduled request
+  uint64_t measure_us;          // Stats are kept from here on
+  uint64_t end_us;
+  std::atomic<uint64_t> ticket; // Next open-loop slot
+} run_t;
+
+static op_t pick_op(const config_t *cfg, std::mt19937 *rng) {
+  unsigned total = 0;
+  for (int i = 0; i < OP_COUNT; i++)
+    total += cfg->weights[i];
+  unsigned r = (*rng)() % total;
+  for (int i = 0; i < OP_COUNT; i++) {
+    if (r < cfg->weights[i])
+      return (op_t)i;
+    r -= cfg->weights[i];
+  }
+  return OP_USERS;
+}
+
+static bool pin_is_valid(const config_t *cfg, const std::string &pin) {
+  for (const std::string &p : cfg->pins) {
+    if (p == pin)
+      return true;
+  }
+  return false;
+}
+
+static int run_op(client_t *c, op_t op, std::mt19937 *rng, uint64_t *bytes) {
+  const config_t *cfg = c->cfg;
+  switch (op) {
+  case OP_VERIFY_OK: {
+    const std::string &pin = cfg->pins[(*rng)() % cfg->pins.size()];
+    return client_request(c, "POST", "/api/access/verify",
+                          "{\"pin\":\"" + pin + "\"}", bytes);
+  }
+  case OP_VERIFY_BAD: {
+    char pin[16];
+    do {
+      snprintf(pin, sizeof(pin), "%04u", (unsigned)((*rng)() % 10000));
+    } while (pin_is_valid(cfg, pin));
+    return client_request(c, "POST", "/api/access/verify",
+                          std::string("{\"pin\":\"") + pin + "\"}", bytes);
+  }
+  case OP_USERS:
+    return client_request(c, "GET", "/api/admin/users", "", bytes);
+  case OP_LOGS:
+    return client_request(c, "GET", "/api/admin/logs", "", bytes);
+  case OP_DOWNLOAD:
+    return client_request(c, "GET", "/api/admin/logs/download", "", bytes);
+  default:
+    return -1;
+  }
+}
+
+static void account(op_stats_t *s, op_t op, int status, uint64_t latency_us,
+                    uint64_t bytes) {
+  hist_record(&s->latency, latency_us);
+  s->bytes += bytes;
+  if (status < 0) {
+    s->net_errors++;
+  } else if (status == 503) {
+    s->busy++;
+  } else if (op == OP_VERIFY_BAD && (status == 401 || status == 403)) {
+    s->ok++;
+  } else if (op == OP_VERIFY_OK && status == 403) {
+    s->locked++; // Lockout caused by verify_bad traffic
+  } else if (status == 200) {
+    s->ok++;
+  } else {
+    s->http_errors++;
+  }
+}
+
+static void worker(run_t *run, struct addrinfo *addr, unsigned seed,
+                   stats_t *out) {
+  const config_t *cfg = run->cfg;
+  client_t c;
+  c.fd = -1;
+  c.cfg = cfg;
+  c.addr = addr;
+  std::mt19937 rng(seed);
+
+  for (;;) {
+    uint64_t scheduled;
+    if (cfg->open_loop) {
+      uint64_t t = run->ticket.fetch_add(1);
+      scheduled = run->start_us + (uint64_t)(t * 1e6 / run->rate);
+      if (scheduled >= run->end_us)
+        break;
+      uint64_t now = now_us();
+      if (scheduled > now)
+        std::this_thread::sleep_for(std::chrono::microseconds(scheduled - now));
+    } else {
+      scheduled = now_us();
+      if (scheduled >= run->end_us)
+        break;
+    }
+
+    op_t op = pick_op(cfg, &rng);
+    uint64_t bytes = 0;
+    int status = run_op(&c, op, &rng, &bytes);
+    uint64_t done = now_us();
+    if (scheduled >= run->measure_us)
+      account(&out->ops[op], op, status, done - scheduled, bytes);
+  }
+  client_close(&c);
+}
+
+// ---------------------------------------------------------------------------
+// Reporting
+
+static void print_ms(uint64_t us) { printf(" %9.2f", us / 1000.0); }
+
+static void report(const config_t *cfg, const stats_t *st, double rate,
+                   double seconds) {
+  histogram_t all;
+  memset(&all, 0, sizeof(all));
+  uint64_t ok = 0, errors = 0, busy = 0, locked = 0, bytes = 0;
+
+  if (cfg->open_loop)
+    printf("\n== open loop, offered %.1f req/s, %d max in flight ==\n", rate,
+           cfg->concurrency);
+  else
+    printf("\n== closed loop, %d workers ==\n", cfg->concurrency);
+  printf("%-11s %8s %8s %6s %6s %6s %9s %9s %9s %9s\n", "op", "count",
+         "req/s", "err%", "busy", "lock", "p50 ms", "p95 ms", "p99 ms",
+         "max ms");
+
+  for (int i = 0; i < OP_COUNT; i++) {
+    const op_stats_t *s = &st->ops[i];
+    uint64_t n = s->latency.total;
+    if (n == 0)
+      continue;
+    uint64_t err = s->http_errors + s->net_errors;
+    printf("%-11s %8llu %8.1f %6.2f %6llu %6llu", op_names[i],
+           (unsigned long long)n, n / seconds, 100.0 * err / n,
+           (unsigned long long)s->busy, (unsigned long long)s->locked);
+    print_ms(hist_percentile(&s->latency, 50));
+    print_ms(hist_percentile(&s->latency, 95));
+    print_ms(hist_percentile(&s->latency, 99));
+    print_ms(s->latency.max);
+    printf("\n");
+    hist_merge(&all, &s->latency);
+    ok += s->ok;
+    errors += err;
+    busy += s->busy;
+    locked += s->locked;
+    bytes += s->bytes;
+  }
+
+  if (all.total == 0) {
+    printf("no requests completed\n");
+    return;
+  }
+  printf("%-11s %8llu %8.1f %6.2f %6llu %6llu", "all",
+         (unsigned long long)all.total, all.total / seconds,
+         100.0 * errors / all.total, (unsigned long long)busy,
+         (unsigned long long)locked);
+  print_ms(hist_percentile(&all, 50));
+  print_ms(hist_percentile(&all, 95));
+  print_ms(hist_percentile(&all, 99));
+  print_ms(all.max);
+  printf("\n");
+  printf("good throughput %.1f req/s, %.1f KiB/s received\n", ok / seconds,
+         bytes / 1024.0 / seconds);
+  if (cfg->open_loop && all.total / seconds < rate * 0.95)
+    printf("target is saturated: completed %.1f of %.1f offered req/s\n",
+           all.total / seconds, rate);
+}
+
+static void run_once(const config_t *cfg, struct addrinfo *addr, double rate,
+                     unsigned seed) {
+  run_t run;
+  run.cfg = cfg;
+  run.rate = rate;
+  run.start_us = now_us();
+  run.measure_us = run.start_us + (uint64_t)(cfg->warmup_s * 1e6);
+  run.end_us = run.measure_us + (uint64_t)(cfg->duration_s * 1e6);
+  run.ticket = 0;
+
+  std::vector<stats_t> per_worker(cfg->concurrency);
+  std::vector<std::thread> threads;
+  memset(per_worker.data(), 0, per_worker.size() * sizeof(stats_t));
+  for (int i = 0; i < cfg->concurrency; i++)
+    threads.emplace_back(worker, &run, addr, seed + i, &per_worker[i]);
+  for (std::thread &t : threads)
+    t.join();
+
+  stats_t total;
+  memset(&total, 0, sizeof(total));
+  for (const stats_t &s : per_worker)
+    stats_merge(&total, &s);
+  report(cfg, &total, rate, cfg->duration_s);
+}
+
+int main(int argc, char **argv) {
+  config_t cfg;
+  if (!parse_args(&cfg, argc, argv)) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  struct addrinfo hints, *addr = NULL;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int err = getaddrinfo(cfg.host.c_str(), cfg.port.c_str(), &hints, &addr);
+  if (err != 0) {
+    fprintf(stderr, "%s: %s\n", cfg.host.c_str(), gai_strerror(err));
+    return 1;
+  }
+
+  printf("target http://%s:%s%s, %.1fs per run after %.1fs warmup\n",
+         cfg.host.c_str(), cfg.port.c_str(), cfg.base_path.c_str(),
+         cfg.duration_s, cfg.warmup_s);
+  if (cfg.open_loop) {
+    for (double rate : cfg.rates)
+      run_once(&cfg, addr, rate, cfg.seed);
+  } else {
+    run_once(&cfg, addr, 0, cfg.seed);
+  }
+  freeaddrinfo(addr);
+  return 0;
+}
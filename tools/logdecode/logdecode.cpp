@@ -0,0 +1,185 @@
+// Expands the binary log records the firmware writes with LOG_RING_FLASH.
+//
+// Records hold the addresses of their tag and format strings rather than
+// the text (see src/log_ring.h), so they are resolved against the ELF of
+// the exact build that wrote them; a different build decodes to garbage or
+// "?" placeholders. The firmware serves the trace files on its admin API:
+//
+//   curl -O http://gate.local/api/admin/trace.old
+//   curl -O http://gate.local/api/admin/trace.bin
+//   logdecode firmware.elf trace.old trace.bin
+//
+// Files are decoded in the order given, so pass trace.old first. A torn
+// record (power lost mid-append) is skipped a word at a time until the
+// next valid header.
+//
+// Build: cmake -S tools/logdecode -B build/logdecode && cmake --build build/logdecode
+
+#include "log_ring.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+typedef struct {
+  uint32_t addr;
+  uint32_t size;
+  std::vector<uint8_t> data;
+} section_t;
+
+static std::vector<section_t> sections;
+
+static bool read_file(const char *path, std::vector<uint8_t> *out) {
+  FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "%s: cannot open\n", path);
+    return false;
+  }
+  uint8_t buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    out->insert(out->end(), buf, buf + n);
+  if (f != stdin)
+    fclose(f);
+  return true;
+}
+
+static uint32_t le16(const uint8_t *p) { return p[0] | p[1] << 8; }
+
+static uint32_t le32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Keeps the loaded sections with contents; the strings live in those
+static bool load_elf(const char *path) {
+  std::vector<uint8_t> elf;
+  if (!read_file(path, &elf))
+    return false;
+  if (elf.size() < 52 || memcmp(elf.data(), "\177ELF", 4) != 0) {
+    fprintf(stderr, "%s: not an ELF file\n", path);
+    return false;
+  }
+  if (elf[4] != 1 || elf[5] != 1) {
+    fprintf(stderr, "%s: not a 32-bit little-endian ELF\n", path);
+    return false;
+  }
+  uint32_t shoff = le32(&elf[0x20]);
+  uint32_t shentsize = le16(&elf[0x2E]);
+  uint32_t shnum = le16(&elf[0x30]);
+  if (shentsize < 40 || shoff + (uint64_t)shnum * shentsize > elf.size()) {
+    fprintf(stderr, "%s: bad section table\n", path);
+    return false;
+  }
+  for (uint32_t i = 0; i < shnum; i++) {
+    const uint8_t *sh = &elf[shoff + i * shentsize];
+    uint32_t type = le32(sh + 4), flags = le32(sh + 8), addr = le32(sh + 12);
+    uint32_t offset = le32(sh + 16), size = le32(sh + 20);
+    const uint32_t SHF_ALLOC = 2, SHT_NOBITS = 8;
+    if (!(flags & SHF_ALLOC) || type == SHT_NOBITS || !addr || !size ||
+        offset + (uint64_t)size > elf.size())
+      continue;
+    section_t s;
+    s.addr = addr;
+    s.size = size;
+    s.data.assign(&elf[offset], &elf[offset] + size);
+    sections.push_back(s);
+  }
+  if (sections.empty()) {
+    fprintf(stderr, "%s: no loaded sections\n", path);
+    return false;
+  }
+  return true;
+}
+
+// The NUL-terminated string at addr, NULL when no section holds one
+static const char *resolve(uint32_t addr) {
+  for (const section_t &s : sections) {
+    if (addr < s.addr || addr - s.addr >= s.size)
+      continue;
+    const uint8_t *p = s.data.data() + (addr - s.addr);
+    if (!memchr(p, 0, s.size - (addr - s.addr)))
+      return NULL;
+    return (const char *)p;
+  }
+  return NULL;
+}
+
+// Header fields that only a real record can have
+static bool record_valid(const uint8_t *p, size_t left) {
+  uint32_t len = le16(p + 2);
+  if (p[0] != LOG_REC_READY && p[0] != LOG_REC_PAD)
+    return false;
+  if (len < 4 || len % 4 || len > left)
+    return false;
+  return p[0] == LOG_REC_PAD ||
+         (len >= sizeof(log_rec_t) && p[1] >= LOG_RING_ERROR &&
+          p[1] <= LOG_RING_INFO);
+}
+
+static void print_record(const uint8_t *p) {
+  static const char *const prefix[] = {"", "ERROR: ", "WARN: ", ""};
+  uint32_t len = le16(p + 2), ms = le32(p + 4);
+  const char *tag = resolve(le32(p + 8));
+  const char *fmt = resolve(le32(p + 12));
+  char msg[512];
+  if (fmt) {
+    log_ring_format(fmt, p + sizeof(log_rec_t), len - sizeof(log_rec_t), msg,
+                    sizeof(msg));
+  } else {
+    snprintf(msg, sizeof(msg), "? format 0x%08x, %u argument bytes",
+             (unsigned)le32(p + 12), (unsigned)(len - sizeof(log_rec_t)));
+  }
+  printf("[%6u.%03u] [%s] %s%s\n", (unsigned)(ms / 1000),
+         (unsigned)(ms % 1000), tag ? tag : "?", prefix[p[1] & 3], msg);
+}
+
+// Returns the number of bytes skipped as corrupt
+static size_t decode(const std::vector<uint8_t> &trace) {
+  size_t pos = 0, skipped = 0;
+  while (pos + 4 <= trace.size()) {
+    const uint8_t *p = &trace[pos];
+    if (!record_valid(p, trace.size() - pos)) {
+      pos += 4;
+      skipped += 4;
+      continue;
+    }
+    if (p[0] == LOG_REC_READY)
+      print_record(p);
+    pos += le16(p + 2);
+  }
+  return skipped + (trace.size() - pos);
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s firmware.elf trace.bin [trace.bin...]\n"
+          "\n"
+          "Pass trace.old before trace.bin to keep the order; - reads\n"
+          "standard input.\n",
+          argv0);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    usage(argv[0]);
+    return 2;
+  }
+  if (!load_elf(argv[1]))
+    return 1;
+  int status = 0;
+  for (int i = 2; i < argc; i++) {
+    std::vector<uint8_t> trace;
+    if (!read_file(argv[i], &trace)) {
+      status = 1;
+      continue;
+    }
+    size_t skipped = decode(trace);
+    if (skipped)
+      fprintf(stderr, "%s: %u corrupt bytes skipped\n", argv[i],
+              (unsigned)skipped);
+  }
+  return status;
+}
@@ -0,0 +1,95 @@
+// Clock and heap interposition for the replay (Linux, glibc).
+//
+// gettimeofday() and time() return the trace time set by the replay, so the
+// firmware's expiry, lockout and schedule checks run on the trace clock.
+// malloc and friends forward to glibc and keep a running total, which is
+// how the replay sees the firmware's heap high-water.
+
+#define _GNU_SOURCE
+#include "host.h"
+
+#include <errno.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+extern void __libc_free(void *ptr);
+
+static int64_t trace_us = 0;
+
+void host_clock_set(int64_t us) { trace_us = us; }
+
+int gettimeofday(struct timeval *restrict tv, void *restrict tz) {
+  (void)tz;
+  tv->tv_sec = trace_us / 1000000;
+  tv->tv_usec = trace_us % 1000000;
+  return 0;
+}
+
+time_t time(time_t *out) {
+  time_t t = trace_us / 1000000;
+  if (out)
+    *out = t;
+  return t;
+}
+
+// ---------------------------------------------------------------------------
+// Heap accounting, in usable bytes so allocator rounding is included
+
+static int64_t live = 0;
+static int64_t peak = 0;
+static int64_t mark = 0;
+
+static void *counted(void *ptr) {
+  if (ptr) {
+    live += malloc_usable_size(ptr);
+    if (live > peak)
+      peak = live;
+  }
+  return ptr;
+}
+
+void host_heap_mark(void) { mark = peak = live; }
+
+int64_t host_heap_live(void) { return live - mark; }
+
+int64_t host_heap_peak(void) { return peak - mark; }
+
+void *malloc(size_t size) { return counted(__libc_malloc(size)); }
+
+void *calloc(size_t n, size_t size) { return counted(__libc_calloc(n, size)); }
+
+void *realloc(void *ptr, size_t size) {
+  size_t old = ptr ? malloc_usable_size(ptr) : 0;
+  void *p = __libc_realloc(ptr, size);
+  if (p || size == 0)
+    live -= old; // Moved, resized or freed
+  return counted(p);
+}
+
+void free(void *ptr) {
+  if (ptr)
+    live -= malloc_usable_size(ptr);
+  __libc_free(ptr);
+}
+
+void *memalign(size_t align, size_t size) {
+  return counted(__libc_memalign(align, size));
+}
+
+void *aligned_alloc(size_t align, size_t size) {
+  return counted(__libc_memalign(align, size));
+}
+
+int posix_memalign(void **out, size_t align, size_t size) {
+  void *p = counted(__libc_memalign(align, size));
+  if (!p)
+    return ENOMEM;
+  *out = p;
+  return 0;
+}
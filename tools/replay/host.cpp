@@ -0,0 +1,290 @@
+// Host implementations of what the firmware's data layer links against:
+// storage, the replication and profiler hooks and the IDF calls it makes.
+
+#include "host.h"
+#include "data_manager.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "profiler.h"
+#include "replication.h"
+#include "storage.h"
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+bool host_verbose = false;
+uint32_t host_errors = 0;
+
+void host_log(char level, const char *tag, const char *fmt, ...) {
+  if (level == 'E')
+    host_errors++;
+  if (!host_verbose)
+    return;
+  va_list args;
+  va_start(args, fmt);
+  fprintf(stderr, "%c (%s) ", level, tag);
+  vfprintf(stderr, fmt, args);
+  fputc('\n', stderr);
+  va_end(args);
+}
+
+static uint32_t rng_state = 1;
+
+void host_seed(uint32_t seed) { rng_state = seed ? seed : 1; }
+
+uint32_t esp_random(void) {
+  // xorshift32
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+int64_t esp_timer_get_time(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int esp_timer_create(const esp_timer_create_args_t *args,
+                     esp_timer_handle_t *out) {
+  (void)args;
+  *out = NULL;
+  return 0;
+}
+
+int esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us) {
+  (void)timer;
+  (void)period_us;
+  return 0;
+}
+
+// Roughly what an ESP32 has free with WiFi and MQTT up
+#define HOST_HEAP_BYTES (160 * 1024)
+
+size_t heap_caps_get_free_size(uint32_t caps) {
+  (void)caps;
+  return HOST_HEAP_BYTES - host_heap_live();
+}
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps) {
+  (void)caps;
+  return HOST_HEAP_BYTES - host_heap_peak();
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps) {
+  return heap_caps_get_free_size(caps);
+}
+
+struct host_mutex {
+  int depth;
+};
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void) {
+  static host_mutex m;
+  return &m;
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t m, TickType_t wait) {
+  (void)wait;
+  m->depth++;
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t m) {
+  if (m->depth == 0)
+    return pdFALSE;
+  m->depth--;
+  return pdTRUE;
+}
+
+void vTaskDelay(TickType_t ticks) {
+  (void)ticks; // Only waits for other readers, and there are none
+}
+
+BaseType_t xTaskCreate(void (*fn)(void *), const char *name, uint32_t stack,
+                       void *arg, UBaseType_t priority, TaskHandle_t *out) {
+  (void)fn;
+  (void)name;
+  (void)stack;
+  (void)arg;
+  (void)priority;
+  *out = NULL;
+  return pdTRUE;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait) {
+  (void)clear;
+  (void)wait;
+  return 0;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+  (void)task;
+  return pdTRUE;
+}
+
+// replication.cpp stamps records for peers; the replay has none
+static uint32_t stamp = 0;
+
+void repl_user_changed(user_t *u) {
+  u->version = ++stamp;
+  if (!u->created)
+    u->created = u->version;
+}
+
+void repl_tombstone_dropped(const user_t *u) { (void)u; }
+
+uint32_t repl_node_id(void) { return 1; }
+
+// The replay times operations itself; spans would only add noise
+void profiler_enter(const char *name) { (void)name; }
+void profiler_exit(void) {}
+
+// ---------------------------------------------------------------------------
+// Flash: one buffer per key, mapped outside the heap so it does not count
+// towards the firmware's high-water
+
+#define FLASH_FILES 64
+#define FLASH_FILE_MAX (1 << 20)
+#define FLASH_GROUPS 32
+
+typedef struct {
+  char key[STORAGE_MAX_KEY];
+  uint8_t cls;
+  bool used;
+  uint8_t *data;
+  size_t len;
+} flash_file_t;
+
+static flash_file_t files[FLASH_FILES];
+static host_flash_group_t groups[FLASH_GROUPS];
+static int group_count = 0;
+
+static host_flash_group_t *group_of(const char *key) {
+  char name[sizeof(groups[0].group)];
+  snprintf(name, sizeof(name), "%s", key);
+  char *dot = strrchr(name, '.');
+  if (dot && isdigit((unsigned char)dot[1]))
+    strcpy(dot + 1, "*");
+  for (int i = 0; i < group_count; i++) {
+    if (strcmp(groups[i].group, name) == 0)
+      return &groups[i];
+  }
+  if (group_count == FLASH_GROUPS)
+    return &groups[FLASH_GROUPS - 1];
+  host_flash_group_t *g = &groups[group_count++];
+  strcpy(g->group, name);
+  return g;
+}
+
+int host_flash_groups(host_flash_group_t *out, int max) {
+  for (host_flash_group_t *g = groups; g < groups + group_count; g++)
+    g->stored = 0;
+  for (const flash_file_t *f = files; f < files + FLASH_FILES; f++) {
+    if (f->used)
+      group_of(f->key)->stored += f->len;
+  }
+  int n = group_count < max ? group_count : max;
+  memcpy(out, groups, n * sizeof(*out));
+  return n;
+}
+
+static flash_file_t *file_find(storage_class_t cls, const char *key) {
+  for (flash_file_t *f = files; f < files + FLASH_FILES; f++) {
+    if (f->used && f->cls == cls && strcmp(f->key, key) == 0)
+      return f;
+  }
+  return NULL;
+}
+
+static flash_file_t *file_create(storage_class_t cls, const char *key) {
+  flash_file_t *f = file_find(cls, key);
+  if (f)
+    return f;
+  for (f = files; f < files + FLASH_FILES; f++) {
+    if (f->used)
+      continue;
+    if (!f->data) {
+      void *p = mmap(NULL, FLASH_FILE_MAX, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (p == MAP_FAILED)
+        return NULL;
+      f->data = (uint8_t *)p;
+    }
+    snprintf(f->key, sizeof(f->key), "%s", key);
+    f->cls = cls;
+    f->len = 0;
+    f->used = true;
+    return f;
+  }
+  return NULL;
+}
+
+int storage_read(storage_class_t cls, const char *key, size_t offset,
+                 void *buf, size_t cap) {
+  const flash_file_t *f = file_find(cls, key);
+  if (!f)
+    return -1;
+  if (offset >= f->len)
+    return 0;
+  size_t n = f->len - offset < cap ? f->len - offset : cap;
+  memcpy(buf, f->data + offset, n);
+  return (int)n;
+}
+
+static bool put(storage_class_t cls, const char *key, const void *data,
+                size_t len, bool append) {
+  flash_file_t *f = file_create(cls, key);
+  size_t at = append && f ? f->len : 0;
+  if (!f || at + len > FLASH_FILE_MAX)
+    return false;
+  memcpy(f->data + at, data, len);
+  f->len = at + len;
+  host_flash_group_t *g = group_of(key);
+  g->bytes_written += len;
+  g->writes++;
+  return true;
+}
+
+bool storage_write(storage_class_t cls, const char *key, const void *data,
+                   size_t len) {
+  return put(cls, key, data, len, false);
+}
+
+bool storage_append(storage_class_t cls, const char *key, const void *data,
+                    size_t len) {
+  return put(cls, key, data, len, true);
+}
+
+int32_t storage_size(storage_class_t cls, const char *key) {
+  const flash_file_t *f = file_find(cls, key);
+  return f ? (int32_t)f->len : -1;
+}
+
+bool storage_remove(storage_class_t cls, const char *key) {
+  flash_file_t *f = file_find(cls, key);
+  if (f) {
+    f->used = false;
+    group_of(key)->removes++;
+  }
+  return true;
+}
+
+bool storage_rename(storage_class_t cls, const char *from, const char *to) {
+  flash_file_t *f = file_find(cls, from);
+  if (!f)
+    return false;
+  storage_remove(cls, to);
+  snprintf(f->key, sizeof(f->key), "%s", to);
+  group_of(from)->removes++;
+  return true;
+}
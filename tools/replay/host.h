@@ -0,0 +1,41 @@
+#ifndef REPLAY_HOST_H
+#define REPLAY_HOST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Host stand-ins the replay drives: the clock the firmware reads, the heap
+// it allocates from and the flash it writes to.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// host.c
+void host_clock_set(int64_t us); // What gettimeofday() and time() return
+void host_heap_mark(void);       // Heap figures below count from here
+int64_t host_heap_live(void);    // Bytes allocated and not yet freed
+int64_t host_heap_peak(void);    // Most live at once
+
+#ifdef __cplusplus
+}
+#endif
+
+// host.cpp
+extern bool host_verbose;      // Print firmware log lines to stderr
+extern uint32_t host_errors;   // ESP_LOGE lines so far
+void host_seed(uint32_t seed); // For esp_random()
+
+// Flash traffic by key; hist.0, hist.1... are counted together as hist.*
+typedef struct {
+  char group[16];
+  uint64_t bytes_written; // Writes and appends
+  uint32_t writes;
+  uint32_t removes; // Removes and renames
+  uint32_t stored;  // Bytes held now
+} host_flash_group_t;
+
+int host_flash_groups(host_flash_group_t *out, int max);
+
+#endif // REPLAY_HOST_H
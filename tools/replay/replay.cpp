@@ -0,0 +1,665 @@
+// Trace-driven replay of production access histories.
+//
+// Reads one or more access.log files (the CSV log_to_file writes:
+// timestamp,user,granted,details), builds a user table that reproduces
+// them, and feeds the events through the firmware's own data layer built
+// for the host. The firmware clock follows the trace, so expiry, lockout
+// and schedule checks behave as they did on site. Reports decision latency,
+// flash bytes written per event and heap high-water.
+//
+// Users are added just before their first keypad event and deleted after
+// their last, as an admin would. Count and date limits, schedules and gate
+// masks are inferred from the denials in the trace; a user seen exactly
+// once with a grant becomes a one-time PIN. Two scaling knobs show where
+// the design breaks before a site grows into it:
+//
+//   --users N   N clones of every user, each event going to a random clone
+//   --rate N    trace time compressed N times, so N times the event rate
+//
+// Latencies are host time: compare runs with each other, not with the
+// device. Gzipped history downloads must be unpacked first.
+//
+// Build: cmake -S tools/replay -B build/replay && cmake --build build/replay
+
+#include "host.h"
+
+#include "data_manager.h"
+#include "gates.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using steady = std::chrono::steady_clock;
+
+static uint64_t now_ns(void) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             steady::now().time_since_epoch())
+      .count();
+}
+
+// ---------------------------------------------------------------------------
+// Trace
+
+// Keypad outcomes as data_manager.cpp words them; anything else was logged
+// through data_manager_log_access and is replayed that way
+typedef enum {
+  R_GRANTED = 0,
+  R_INVALID,
+  R_LOCKOUT,
+  R_EXPIRED_TIME,
+  R_EXPIRED_COUNT,
+  R_DENIED_DAY,
+  R_DENIED_TIME,
+  R_DENIED_GATE,
+  R_REMOVED,
+  R_REMOTE,
+  R_COUNT
+} reason_t;
+
+static const char *reason_texts[R_REMOTE] = {
+    "Access Granted",        "Invalid PIN",           "Security Lockout",
+    "Expired (Time)",        "Expired (Count)",       "Denied (Schedule Day)",
+    "Denied (Schedule Time)", "Denied (Gate)",         "Removed (Expired)"};
+
+static const char *reason_names[R_COUNT] = {
+    "granted",    "invalid_pin", "lockout",     "expired_time", "expired_count",
+    "denied_day", "denied_time", "denied_gate", "removed",       "remote"};
+
+// Names the firmware logs for events that are not a user's
+static const char *system_names[] = {"Unknown", "System", "MQTT",
+                                     "(deleted)"};
+
+typedef struct {
+  int64_t us;       // Trace time
+  uint32_t name;    // Index into trace_t::names
+  uint32_t details; // Index into trace_t::details, remote events only
+  uint8_t reason;
+  bool granted;
+} event_t;
+
+typedef struct {
+  std::vector<event_t> events;
+  std::vector<std::string> names;
+  std::vector<bool> is_system;
+  std::vector<std::string> details;
+  std::unordered_map<std::string, uint32_t> name_ids;
+  std::unordered_map<std::string, uint32_t> detail_ids;
+  uint64_t skipped; // Lines that did not parse
+} trace_t;
+
+static uint32_t intern(std::unordered_map<std::string, uint32_t> *ids,
+                       std::vector<std::string> *table, const std::string &s) {
+  auto it = ids->find(s);
+  if (it != ids->end())
+    return it->second;
+  uint32_t id = (uint32_t)table->size();
+  table->push_back(s);
+  (*ids)[s] = id;
+  return id;
+}
+
+static uint32_t name_id(trace_t *t, const std::string &name) {
+  size_t before = t->names.size();
+  uint32_t id = intern(&t->name_ids, &t->names, name);
+  if (t->names.size() > before) {
+    bool sys = false;
+    for (const char *s : system_names)
+      sys |= name == s;
+    t->is_system.push_back(sys);
+  }
+  return id;
+}
+
+// prefix keeps users of different sites apart when several files are merged
+static bool load_trace(trace_t *t, const char *path,
+                       const std::string &prefix) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  char line[512];
+  while (fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\r\n")] = 0;
+    // The name may hold commas; timestamp, granted and details cannot
+    char *first = strchr(line, ',');
+    char *last = strrchr(line, ',');
+    char *flag = NULL;
+    if (first && last > first) {
+      *last = 0;
+      flag = strrchr(first + 1, ',');
+    }
+    char *end;
+    long long ts = strtoll(line, &end, 10);
+    if (!flag || flag == first || end != first ||
+        (flag[1] != '0' && flag[1] != '1')) {
+      t->skipped++;
+      continue;
+    }
+    *first = *flag = 0;
+
+    event_t e;
+    e.us = ts * 1000000;
+    e.granted = flag[1] == '1';
+    std::string details = last + 1;
+    e.reason = R_REMOTE;
+    for (int r = 0; r < R_REMOTE; r++) {
+      if (details == reason_texts[r])
+        e.reason = r;
+    }
+    std::string name = first + 1;
+    e.name = name_id(t, name);
+    if (!t->is_system[e.name] && !prefix.empty())
+      e.name = name_id(t, prefix + name);
+    e.details = e.reason == R_REMOTE
+                    ? intern(&t->detail_ids, &t->details, details)
+                    : 0;
+    t->events.push_back(e);
+  }
+  fclose(f);
+  return true;
+}
+
+// Spreads every user's events over n clones of the user
+static void clone_users(trace_t *t, int n, std::mt19937 *rng) {
+  if (n <= 1)
+    return;
+  std::vector<std::vector<uint32_t>> clones(t->names.size());
+  for (event_t &e : t->events) {
+    if (t->is_system[e.name])
+      continue;
+    std::vector<uint32_t> &c = clones[e.name];
+    if (c.empty()) {
+      std::string base = t->names[e.name];
+      for (int i = 0; i < n; i++)
+        c.push_back(name_id(t, base + "#" + std::to_string(i)));
+    }
+    e.name = c[(*rng)() % n];
+  }
+}
+
+static void compress_time(trace_t *t, double rate) {
+  if (t->events.empty() || rate == 1)
+    return;
+  int64_t t0 = t->events.front().us;
+  for (event_t &e : t->events)
+    e.us = t0 + (int64_t)((e.us - t0) / rate);
+}
+
+// ---------------------------------------------------------------------------
+// User table synthesis
+
+typedef struct {
+  bool keypad;        // Has keypad events, so needs a record
+  size_t first, last; // Event indexes of the first and last of them
+  uint32_t grants;
+  uint32_t grants_before_count; // Grants before the first count expiry
+  bool count_expired;
+  int64_t expired_us; // First time expiry, 0 if none
+  uint8_t grant_days, denied_days;
+  int grant_min_lo, grant_min_hi; // Minutes of day of the grants
+  bool time_denied;
+  int denied_min;
+  bool gate_denied;
+  uint32_t events;
+
+  // Replay state
+  bool live;
+  char pin[PIN_LENGTH];
+} user_spec_t;
+
+static void local_time(int64_t us, struct tm *out) {
+  time_t t = us / 1000000;
+  localtime_r(&t, out);
+}
+
+static std::vector<user_spec_t> synthesize(const trace_t *t) {
+  std::vector<user_spec_t> specs(t->names.size());
+  for (user_spec_t &s : specs) {
+    memset(&s, 0, sizeof(s));
+    s.grant_min_lo = 24 * 60;
+    s.grant_min_hi = -1;
+  }
+  for (size_t i = 0; i < t->events.size(); i++) {
+    const event_t &e = t->events[i];
+    if (t->is_system[e.name] || e.reason == R_REMOTE ||
+        e.reason == R_INVALID || e.reason == R_LOCKOUT ||
+        e.reason == R_REMOVED)
+      continue;
+    user_spec_t &s = specs[e.name];
+    if (!s.keypad)
+      s.first = i;
+    s.keypad = true;
+    s.last = i;
+    s.events++;
+
+    struct tm tm;
+    local_time(e.us, &tm);
+    int minute = tm.tm_hour * 60 + tm.tm_min;
+    switch (e.reason) {
+    case R_GRANTED:
+      s.grants++;
+      if (!s.count_expired)
+        s.grants_before_count++;
+      s.grant_days |= 1 << tm.tm_wday;
+      s.grant_min_lo = std::min(s.grant_min_lo, minute);
+      s.grant_min_hi = std::max(s.grant_min_hi, minute);
+      break;
+    case R_EXPIRED_COUNT:
+      s.count_expired = true;
+      break;
+    case R_EXPIRED_TIME:
+      if (!s.expired_us)
+        s.expired_us = e.us;
+      break;
+    case R_DENIED_DAY:
+      s.denied_days |= 1 << tm.tm_wday;
+      break;
+    case R_DENIED_TIME:
+      s.time_denied = true;
+      s.denied_min = minute;
+      break;
+    case R_DENIED_GATE:
+      s.gate_denied = true;
+      break;
+    }
+  }
+  return specs;
+}
+
+static user_type_t spec_type(const user_spec_t *s) {
+  if (s->count_expired)
+    return USER_TYPE_COUNT_LIMIT;
+  if (s->expired_us)
+    return USER_TYPE_DATE_LIMIT;
+  if (s->grants == 1 && s->events == 1)
+    return USER_TYPE_ONE_TIME;
+  return USER_TYPE_UNLIMITED;
+}
+
+// Writes the record the way the admin API does: one create, one save
+static bool add_user(const std::string &name, user_spec_t *s) {
+  user_fields_t f = {};
+  f.name = name.c_str();
+  f.type = spec_type(s);
+  f.limit = f.type == USER_TYPE_COUNT_LIMIT ? (int)s->grants_before_count : 1;
+  if (f.type == USER_TYPE_DATE_LIMIT)
+    f.expiry = s->expired_us / 1000000 - 1;
+  if (s->denied_days)
+    f.allowed_days = s->grant_days ? s->grant_days : 0x7F & ~s->denied_days;
+  if (s->time_denied) {
+    if (s->grant_min_hi >= 0) {
+      f.start_time = s->grant_min_lo;
+      f.end_time = s->grant_min_hi + 1;
+    } else {
+      f.start_time = (s->denied_min + 1) % (24 * 60);
+      f.end_time = f.start_time + 1;
+    }
+  }
+  if (s->gate_denied)
+    f.gate_mask = 1; // Gate 0 only; the denials are replayed on gate 1
+
+  bool ok = data_manager_create_user(&f, NULL, s->pin);
+  s->live = ok;
+  return ok;
+}
+
+// ---------------------------------------------------------------------------
+// Replay
+
+typedef enum { OP_KEYPAD = 0, OP_REMOTE, OP_ADD, OP_DELETE, OP_COUNT } op_t;
+
+static const char *op_names[OP_COUNT] = {"keypad", "remote", "add", "delete"};
+
+typedef struct {
+  std::vector<uint32_t> latency_ns[OP_COUNT];
+  uint64_t logged[R_COUNT]; // Keypad events per reason in the trace
+  uint64_t differ[R_COUNT]; // ...whose replayed outcome differs
+  uint64_t denied_locked;   // Logged grants refused during a lockout
+  uint64_t trace_lockouts;
+  uint64_t lockouts;
+  uint64_t trace_removed;
+  uint64_t added, refused, deleted;
+  uint64_t swept;
+  int most_users;
+  double seconds;
+} result_t;
+
+typedef struct {
+  std::vector<std::string> files;
+  int users;
+  double rate;
+  double speed; // 0: as fast as possible
+  unsigned seed;
+} config_t;
+
+static void timed(result_t *r, op_t op, uint64_t start) {
+  r->latency_ns[op].push_back((uint32_t)std::min<uint64_t>(
+      now_ns() - start, UINT32_MAX));
+}
+
+static void keypad(const trace_t *t, const event_t &e,
+                   std::vector<user_spec_t> &specs, result_t *r) {
+  // Users refused for a full table are left with no PIN, so they fail
+  const char *pin = "0";
+  if (!t->is_system[e.name] && specs[e.name].live)
+    pin = specs[e.name].pin;
+  int gate = e.reason == R_DENIED_GATE ? 1 : GATE_ANY;
+
+  bool locked = data_manager_lockout_remaining() > 0;
+  uint64_t start = now_ns();
+  bool ok = data_manager_validate_pin(pin, gate, NULL, NULL);
+  timed(r, OP_KEYPAD, start);
+  if (!locked && data_manager_lockout_remaining() > 0)
+    r->lockouts++;
+  if (ok != e.granted) {
+    r->differ[e.reason]++;
+    if (e.granted && data_manager_lockout_remaining() > 0)
+      r->denied_locked++;
+  }
+}
+
+static int user_count(void) {
+  const user_snapshot_t *snap = data_manager_snapshot_acquire();
+  int n = data_manager_snapshot_data(snap)->user_count;
+  data_manager_snapshot_release(snap);
+  return n;
+}
+
+static void replay(const config_t *cfg, const trace_t *t,
+                   std::vector<user_spec_t> &specs, result_t *r) {
+  const std::vector<event_t> &ev = t->events;
+  uint64_t real0 = now_ns();
+  int64_t trace0 = ev.empty() ? 0 : ev.front().us;
+
+  for (size_t i = 0; i < ev.size(); i++) {
+    const event_t &e = ev[i];
+    if (cfg->speed > 0) {
+      uint64_t due = real0 + (uint64_t)((e.us - trace0) * 1000 / cfg->speed);
+      uint64_t now = now_ns();
+      if (due > now)
+        std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+    }
+    host_clock_set(e.us);
+
+    user_spec_t *s = t->is_system[e.name] ? NULL : &specs[e.name];
+    if (s && s->keypad && s->first == i) {
+      uint64_t start = now_ns();
+      bool ok = add_user(t->names[e.name], s);
+      timed(r, OP_ADD, start);
+      if (ok) {
+        r->added++;
+      } else {
+        r->refused++;
+      }
+      r->most_users = std::max(r->most_users, user_count());
+    }
+
+    if (e.reason == R_LOCKOUT) {
+      r->trace_lockouts++; // The firmware decides its own lockouts
+    } else if (e.reason == R_REMOVED) {
+      r->trace_removed++; // ...and runs its own sweeper
+    } else if (e.reason == R_REMOTE) {
+      uint64_t start = now_ns();
+      data_manager_log_access(t->names[e.name].c_str(), e.granted,
+                              t->details[e.details].c_str());
+      timed(r, OP_REMOTE, start);
+    } else {
+      r->logged[e.reason]++;
+      keypad(t, e, specs, r);
+    }
+    // The firmware's writer task picks the event up right after
+    data_manager_flush_events();
+
+    if (s && s->keypad && s->last == i && s->live) {
+      uint64_t start = now_ns();
+      if (data_manager_delete_user(s->pin))
+        r->deleted++;
+      timed(r, OP_DELETE, start);
+      s->live = false;
+    }
+    // On the trace clock, so at most once a trace minute
+    int before = user_count();
+    data_manager_sweep();
+    r->swept += before - user_count();
+  }
+  r->seconds = (now_ns() - real0) / 1e9;
+}
+
+// ---------------------------------------------------------------------------
+// Reporting
+
+static uint32_t percentile(std::vector<uint32_t> &v, double p) {
+  if (v.empty())
+    return 0;
+  size_t rank = (size_t)(p / 100.0 * (v.size() - 1) + 0.5);
+  std::nth_element(v.begin(), v.begin() + rank, v.end());
+  return v[rank];
+}
+
+static void print_bytes(double b) {
+  if (b >= 1024.0 * 1024)
+    printf(" %9.1f MiB", b / (1024.0 * 1024));
+  else if (b >= 1024)
+    printf(" %9.1f KiB", b / 1024);
+  else
+    printf(" %9.0f B  ", b);
+}
+
+static void report(const config_t *cfg, const trace_t *t, result_t *r) {
+  printf("\n%-9s %9s %9s %9s %9s %9s\n", "op", "count", "p50 us", "p90 us",
+         "p99 us", "max us");
+  for (int i = 0; i < OP_COUNT; i++) {
+    std::vector<uint32_t> &v = r->latency_ns[i];
+    if (v.empty())
+      continue;
+    printf("%-9s %9zu", op_names[i], v.size());
+    printf(" %9.1f", percentile(v, 50) / 1000.0);
+    printf(" %9.1f", percentile(v, 90) / 1000.0);
+    printf(" %9.1f", percentile(v, 99) / 1000.0);
+    printf(" %9.1f\n", *std::max_element(v.begin(), v.end()) / 1000.0);
+  }
+
+  uint64_t decisions = 0, differ = 0;
+  for (int i = 0; i < R_COUNT; i++) {
+    decisions += r->logged[i];
+    differ += r->differ[i];
+  }
+  if (decisions) {
+    printf("\n%llu keypad decisions, %.2f%% as logged\n",
+           (unsigned long long)decisions,
+           100.0 * (decisions - differ) / decisions);
+    printf("  %-15s %9s %9s\n", "logged as", "events", "differ");
+    for (int i = 0; i < R_COUNT; i++) {
+      if (r->logged[i])
+        printf("  %-15s %9llu %9llu\n", reason_names[i],
+               (unsigned long long)r->logged[i],
+               (unsigned long long)r->differ[i]);
+    }
+    if (r->denied_locked)
+      printf("  %llu logged grants were refused by a replay lockout\n",
+             (unsigned long long)r->denied_locked);
+  }
+  printf("lockouts: %llu in the trace, %llu in the replay\n",
+         (unsigned long long)r->trace_lockouts,
+         (unsigned long long)r->lockouts);
+  printf("users: %llu added, %llu refused, %llu deleted, at most %d of %d "
+         "at once\n",
+         (unsigned long long)r->added, (unsigned long long)r->refused,
+         (unsigned long long)r->deleted, r->most_users, MAX_USERS);
+  printf("expired users freed: %llu in the trace, %llu in the replay\n",
+         (unsigned long long)r->trace_removed,
+         (unsigned long long)r->swept);
+
+  host_flash_group_t groups[32];
+  int n = host_flash_groups(groups, 32);
+  std::sort(groups, groups + n,
+            [](const host_flash_group_t &a, const host_flash_group_t &b) {
+              return a.bytes_written > b.bytes_written;
+            });
+  double events = (double)t->events.size();
+  printf("\n%-12s %13s %13s %9s %9s %13s\n", "flash", "written",
+         "per event", "writes", "removes", "stored");
+  host_flash_group_t total;
+  memset(&total, 0, sizeof(total));
+  for (int i = 0; i < n; i++) {
+    const host_flash_group_t *g = &groups[i];
+    printf("%-12s", g->group);
+    print_bytes((double)g->bytes_written);
+    print_bytes(g->bytes_written / events);
+    printf(" %9u %9u", g->writes, g->removes);
+    print_bytes(g->stored);
+    printf("\n");
+    total.bytes_written += g->bytes_written;
+    total.writes += g->writes;
+    total.removes += g->removes;
+    total.stored += g->stored;
+  }
+  printf("%-12s", "total");
+  print_bytes((double)total.bytes_written);
+  print_bytes(total.bytes_written / events);
+  printf(" %9u %9u", total.writes, total.removes);
+  print_bytes(total.stored);
+  printf("\n");
+
+  printf("\nheap: peak %lld B above the start, %lld B still held at the "
+         "end\n",
+         (long long)host_heap_peak(), (long long)host_heap_live());
+  if (host_errors)
+    printf("firmware logged %u errors (-v shows them)\n", host_errors);
+  if (cfg->speed == 0)
+    printf("replayed in %.2f s, %.0f events/s\n", r->seconds,
+           events / r->seconds);
+}
+
+// ---------------------------------------------------------------------------
+// Configuration
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [options] access.log [access.log...]\n"
+          "  --users N      clone every user N times (1)\n"
+          "  --rate N       compress trace time N times (1)\n"
+          "  --speed X      replay at X times wall-clock; 0 runs as fast as\n"
+          "                 possible (0)\n"
+          "  --seed N       random seed for clones and PINs\n"
+          "  -v             print the firmware's log lines\n"
+          "\n"
+          "Several files are merged by time, each as its own set of users.\n"
+          "Times of day are taken in the TZ of this process; set TZ to the\n"
+          "site's zone for schedules to line up.\n",
+          argv0);
+}
+
+static bool parse_args(config_t *cfg, int argc, char **argv) {
+  cfg->users = 1;
+  cfg->rate = 1;
+  cfg->speed = 0;
+  cfg->seed = 1;
+
+  for (int i = 1; i < argc; i++) {
+    std::string a = argv[i];
+    auto value = [&](void) -> std::string {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "%s needs a value\n", a.c_str());
+        exit(2);
+      }
+      return argv[++i];
+    };
+    if (a == "-h" || a == "--help") {
+      usage(argv[0]);
+      exit(0);
+    } else if (a == "--users") {
+      cfg->users = atoi(value().c_str());
+    } else if (a == "--rate") {
+      cfg->rate = atof(value().c_str());
+    } else if (a == "--speed") {
+      cfg->speed = atof(value().c_str());
+    } else if (a == "--seed") {
+      cfg->seed = (unsigned)strtoul(value().c_str(), NULL, 10);
+    } else if (a == "-v") {
+      host_verbose = true;
+    } else if (!a.empty() && a[0] == '-') {
+      fprintf(stderr, "unknown option %s\n", a.c_str());
+      return false;
+    } else {
+      cfg->files.push_back(a);
+    }
+  }
+  return !cfg->files.empty() && cfg->users >= 1 && cfg->rate > 0 &&
+         cfg->speed >= 0;
+}
+
+int main(int argc, char **argv) {
+  config_t cfg;
+  if (!parse_args(&cfg, argc, argv)) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  trace_t trace;
+  trace.skipped = 0;
+  for (size_t i = 0; i < cfg.files.size(); i++) {
+    std::string prefix =
+        cfg.files.size() > 1 ? "s" + std::to_string(i) + "/" : "";
+    if (!load_trace(&trace, cfg.files[i].c_str(), prefix))
+      return 1;
+  }
+  if (trace.events.empty()) {
+    fprintf(stderr, "no events in the trace\n");
+    return 1;
+  }
+  std::stable_sort(trace.events.begin(), trace.events.end(),
+                   [](const event_t &a, const event_t &b) {
+                     return a.us < b.us;
+                   });
+  double days =
+      (trace.events.back().us - trace.events.front().us) / 86400e6;
+
+  std::mt19937 rng(cfg.seed);
+  clone_users(&trace, cfg.users, &rng);
+  compress_time(&trace, cfg.rate);
+  std::vector<user_spec_t> specs = synthesize(&trace);
+  size_t records = 0;
+  for (const user_spec_t &s : specs)
+    records += s.keypad;
+
+  printf("trace: %zu files, %zu events over %.1f days, %zu users",
+         cfg.files.size(), trace.events.size(), days, records);
+  if (trace.skipped)
+    printf(", %llu lines skipped", (unsigned long long)trace.skipped);
+  printf("\nscale: users x%d, rate x%g", cfg.users, cfg.rate);
+  if (cfg.speed > 0)
+    printf(", replayed at x%g wall-clock", cfg.speed);
+  printf("\n");
+  fflush(stdout);
+
+  // Sized up front: nothing the replay itself does may touch the heap
+  result_t *r = new result_t();
+  size_t remote = 0;
+  for (const event_t &e : trace.events)
+    remote += e.reason == R_REMOTE;
+  r->latency_ns[OP_KEYPAD].reserve(trace.events.size() - remote);
+  r->latency_ns[OP_REMOTE].reserve(remote);
+  r->latency_ns[OP_ADD].reserve(records);
+  r->latency_ns[OP_DELETE].reserve(records);
+
+  host_seed(cfg.seed);
+  host_clock_set(trace.events.front().us);
+  host_heap_mark();
+  data_manager_init();
+  replay(&cfg, &trace, specs, r);
+  report(&cfg, &trace, r);
+  delete r;
+  return 0;
+}
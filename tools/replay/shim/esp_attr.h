@@ -0,0 +1,7 @@
+#ifndef REPLAY_ESP_ATTR_H
+#define REPLAY_ESP_ATTR_H
+
+#define RTC_NOINIT_ATTR
+#define IRAM_ATTR
+
+#endif // REPLAY_ESP_ATTR_H
@@ -0,0 +1,14 @@
+#ifndef REPLAY_ESP_HEAP_CAPS_H
+#define REPLAY_ESP_HEAP_CAPS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+
+// Device heap modelled from the allocations the replay makes
+size_t heap_caps_get_free_size(uint32_t caps);
+size_t heap_caps_get_minimum_free_size(uint32_t caps);
+size_t heap_caps_get_largest_free_block(uint32_t caps);
+
+#endif // REPLAY_ESP_HEAP_CAPS_H
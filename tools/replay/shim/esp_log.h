@@ -0,0 +1,13 @@
+#ifndef REPLAY_ESP_LOG_H
+#define REPLAY_ESP_LOG_H
+
+// Firmware logging goes to stderr with -v; errors are always counted
+void host_log(char level, const char *tag, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#define ESP_LOGE(tag, ...) host_log('E', tag, __VA_ARGS__)
+#define ESP_LOGW(tag, ...) host_log('W', tag, __VA_ARGS__)
+#define ESP_LOGI(tag, ...) host_log('I', tag, __VA_ARGS__)
+#define ESP_LOGD(tag, ...) host_log('D', tag, __VA_ARGS__)
+
+#endif // REPLAY_ESP_LOG_H
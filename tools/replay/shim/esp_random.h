@@ -0,0 +1,8 @@
+#ifndef REPLAY_ESP_RANDOM_H
+#define REPLAY_ESP_RANDOM_H
+
+#include <stdint.h>
+
+uint32_t esp_random(void); // Seeded, so runs repeat
+
+#endif // REPLAY_ESP_RANDOM_H
@@ -0,0 +1,21 @@
+#ifndef REPLAY_ESP_TIMER_H
+#define REPLAY_ESP_TIMER_H
+
+#include <stdint.h>
+
+int64_t esp_timer_get_time(void); // Host monotonic clock, not trace time
+
+// Timers never fire; the replay calls what they would run itself
+typedef struct host_timer *esp_timer_handle_t;
+typedef void (*esp_timer_cb_t)(void *arg);
+typedef struct {
+  esp_timer_cb_t callback;
+  void *arg;
+  const char *name;
+} esp_timer_create_args_t;
+
+int esp_timer_create(const esp_timer_create_args_t *args,
+                     esp_timer_handle_t *out);
+int esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us);
+
+#endif // REPLAY_ESP_TIMER_H
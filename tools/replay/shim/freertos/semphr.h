@@ -0,0 +1,13 @@
+#ifndef REPLAY_SEMPHR_H
+#define REPLAY_SEMPHR_H
+
+#include "freertos/FreeRTOS.h"
+
+// The replay is one task, so locks only count their depth
+typedef struct host_mutex *SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void);
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t m, TickType_t wait);
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t m);
+
+#endif // REPLAY_SEMPHR_H
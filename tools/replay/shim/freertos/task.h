@@ -0,0 +1,17 @@
+#ifndef REPLAY_TASK_H
+#define REPLAY_TASK_H
+
+#include "freertos/FreeRTOS.h"
+
+// Tasks are never started; the replay calls what they would run itself
+typedef struct host_task *TaskHandle_t;
+typedef unsigned UBaseType_t;
+#define tskIDLE_PRIORITY 0
+
+void vTaskDelay(TickType_t ticks);
+BaseType_t xTaskCreate(void (*fn)(void *), const char *name, uint32_t stack,
+                       void *arg, UBaseType_t priority, TaskHandle_t *out);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+
+#endif // REPLAY_TASK_H